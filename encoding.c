@@ -31,6 +31,7 @@ encode_instruction_assembly(
   u8 reg_or_op_code = 0;
   u8 rex_byte = 0;
   bool needs_16_bit_prefix = false;
+  u8 vex_vvvv = 0;
   u8 r_m = 0;
   u8 mod = MOD_Register;
   u8 op_code[4] = {
@@ -47,12 +48,15 @@ encode_instruction_assembly(
     Storage *storage = &instruction->assembly.operands[storage_index];
     const Operand_Encoding *operand_encoding = &encoding->operands[storage_index];
 
-    if (storage->byte_size == 2) {
+    // Operand-size override only depends on the size of the operation itself,
+    // so for example `movsx r64, r/m16` does not need it
+    if (storage_index == 0 && storage->byte_size == 2) {
       needs_16_bit_prefix = true;
     }
 
     if (
       storage->byte_size == 8 &&
+      !encoding->vex &&
       !(
         operand_encoding->type == Operand_Encoding_Type_Xmm ||
         operand_encoding->type == Operand_Encoding_Type_Xmm_Memory
@@ -80,10 +84,21 @@ encode_instruction_assembly(
 
     if (
       storage->tag == Storage_Tag_Xmm &&
-      operand_encoding->type == Operand_Encoding_Type_Xmm &&
-      encoding->extension_type == Instruction_Extension_Type_Register
+      operand_encoding->type == Operand_Encoding_Type_Xmm
     ) {
-      reg_or_op_code = storage->Register.index;
+      if (
+        encoding->vex && storage_index == 1 &&
+        encoding->operands[2].type != Operand_Encoding_Type_None
+      ) {
+        // :VexEncoding Only the three operand (NDS) forms have a register in VEX.vvvv,
+        // for the two operand ones like a `vmovups` store it stays unused
+        vex_vvvv = storage->Register.index & 0b1111;
+      } else if (encoding->extension_type == Instruction_Extension_Type_Register) {
+        reg_or_op_code = storage->Register.index;
+        if (storage->Register.index & 0b1000) {
+          rex_byte |= REX_R;
+        }
+      }
     }
 
     if(
@@ -110,23 +125,16 @@ encode_instruction_assembly(
             break;
           }
           case Memory_Location_Tag_Indirect: {
-            // Right now the compiler does not support SIB scale other than 1.
-            // From what I can tell there are two reasons that only matter in *extremely*
-            // performance-sensitive code which probably would be written by hand anyway:
-            // 1) `add rax, 8` is three bytes longer than `inc rax`. With current instruction
-            //    cache sizes it is very unlikely to be problematic.
-            // 2) Loop uses the same index for arrays of values of different sizes that could
-            //    be represented with SIB scale. In cases of extreme register pressure this
-            //    can cause spilling. To avoid that we could try to use temporary shifts
-            //    to adjust the offset between different indexes, but it is not implemented ATM.
-            enum { Sib_Scale_1 = 0b00, Sib_Scale_2 = 0b01, Sib_Scale_4 = 0b10, Sib_Scale_8 = 0b11,};
             enum { Sib_Index_None = 0b100,};
-            u8 sib_scale_bits = Sib_Scale_1;
+            // Values of the `Index_Scale` enum are the scale bits of the SIB byte
+            u8 sib_scale_bits = (u8)storage->Memory.location.Indirect.index_scale;
             Register base = storage->Memory.location.Indirect.base_register;
             if (storage->Memory.location.Indirect.maybe_index_register.has_value) {
               needs_sib = true;
               r_m = 0b0100; // SIB
               Register sib_index = storage->Memory.location.Indirect.maybe_index_register.index;
+              // 0b100 index in SIB means no index so RSP can only be the base
+              assert(sib_index != Register_SP);
               sib_byte = (
                 ((sib_scale_bits & 0b11) << 6) |
                 ((sib_index & 0b111) << 3) |
@@ -135,16 +143,21 @@ encode_instruction_assembly(
               if (sib_index & 0b1000) {
                 rex_byte |= REX_X;
               }
+              if (base & 0b1000) {
+                rex_byte |= REX_B;
+              }
             } else if (base == Register_SP || base == Register_R12) {
               // [RSP + X] and [R12 + X] always needs to be encoded as SIB because
               // 0b100 register index in MOD R/M is occupied by SIB byte indicator
               needs_sib = true;
               r_m = 0b0100; // SIB
               sib_byte = (
-                ((sib_scale_bits & 0b11) << 6) |
                 ((Sib_Index_None & 0b111) << 3) |
                 ((base & 0b111) << 0)
               );
+              if (base & 0b1000) {
+                rex_byte |= REX_B;
+              }
             } else {
               r_m = base;
             }
@@ -180,22 +193,76 @@ encode_instruction_assembly(
     rex_byte |= REX_B;
   }
 
-  if (rex_byte) {
-    virtual_memory_buffer_append_u8(buffer, rex_byte);
+  // Mandatory prefixes of SSE instructions are stored as the first byte
+  // of the op code, but just like the legacy ones they must come before REX
+  u8 mandatory_prefix = 0;
+  for (u8 index = 0; index < 3; ++index) {
+    if (!op_code[index]) continue;
+    if (op_code[index] == 0x66 || op_code[index] == 0xF2 || op_code[index] == 0xF3) {
+      mandatory_prefix = op_code[index];
+      op_code[index] = 0;
+    }
+    break;
   }
 
+  // Legacy prefixes must come before REX as otherwise REX is ignored
   if (needs_16_bit_prefix) {
     virtual_memory_buffer_append_u8(buffer, 0x66);
   }
 
-  if (op_code[0]) {
-    virtual_memory_buffer_append_u8(buffer, op_code[0]);
-  }
-  if (op_code[1]) {
-    virtual_memory_buffer_append_u8(buffer, op_code[1]);
-  }
-  if (op_code[2]) {
-    virtual_memory_buffer_append_u8(buffer, op_code[2]);
+  if (encoding->vex) {
+    // :VexEncoding
+    u8 vex_pp = 0;
+    switch(mandatory_prefix) {
+      case 0x66: vex_pp = 0b01; break;
+      case 0xF3: vex_pp = 0b10; break;
+      case 0xF2: vex_pp = 0b11; break;
+    }
+    u8 vex_m_mmmm = 0;
+    if (op_code[1] == 0x0F && op_code[2] == 0x38) {
+      vex_m_mmmm = 0b00010;
+    } else if (op_code[1] == 0x0F && op_code[2] == 0x3A) {
+      vex_m_mmmm = 0b00011;
+    } else if (!op_code[1] && op_code[2] == 0x0F) {
+      vex_m_mmmm = 0b00001;
+    } else {
+      panic("Unexpected op code escape for a VEX-encoded instruction");
+    }
+    // R, X, B and vvvv are stored inverted in the VEX prefix
+    u8 vex_r = !(rex_byte & REX_R & 0b111);
+    u8 vex_x = !(rex_byte & REX_X & 0b111);
+    u8 vex_b = !(rex_byte & REX_B & 0b111);
+    u8 vex_l = instruction->assembly.operands[0].byte_size == 32;
+    u8 vex_tail = (u8)((((~vex_vvvv) & 0b1111) << 3) | (vex_l << 2) | vex_pp);
+    // Two-byte form can only be used when X, B and W are not needed and the op code is in 0F map
+    if (vex_x && vex_b && vex_m_mmmm == 0b00001) {
+      virtual_memory_buffer_append_u8(buffer, 0xC5);
+      virtual_memory_buffer_append_u8(buffer, (u8)((vex_r << 7) | vex_tail));
+    } else {
+      virtual_memory_buffer_append_u8(buffer, 0xC4);
+      virtual_memory_buffer_append_u8(buffer, (u8)(
+        (vex_r << 7) | (vex_x << 6) | (vex_b << 5) | vex_m_mmmm
+      ));
+      virtual_memory_buffer_append_u8(buffer, vex_tail);
+    }
+  } else {
+    if (mandatory_prefix) {
+      virtual_memory_buffer_append_u8(buffer, mandatory_prefix);
+    }
+
+    if (rex_byte) {
+      virtual_memory_buffer_append_u8(buffer, rex_byte);
+    }
+
+    if (op_code[0]) {
+      virtual_memory_buffer_append_u8(buffer, op_code[0]);
+    }
+    if (op_code[1]) {
+      virtual_memory_buffer_append_u8(buffer, op_code[1]);
+    }
+    if (op_code[2]) {
+      virtual_memory_buffer_append_u8(buffer, op_code[2]);
+    }
   }
   virtual_memory_buffer_append_u8(buffer, op_code[3]);
 
@@ -295,51 +362,17 @@ encode_instruction_assembly(
   }
 }
 
-void
-encode_instruction(
-  Program *program,
-  Virtual_Memory_Buffer *buffer,
-  Instruction *instruction
+const Instruction_Encoding *
+instruction_find_encoding(
+  const Instruction *instruction
 ) {
-  // TODO turn into a switch statement on type
-  if (instruction->type == Instruction_Type_Label) {
-    Label *label = program_get_label(program, instruction->label);
-    assert(!label->resolved);
-    label->section = &program->memory.sections.code;
-    label->offset_in_section = u64_to_u32(buffer->occupied);
-    label->resolved = true;
-    instruction->encoded_byte_size = 0;
-    return;
-  } else if (instruction->type == Instruction_Type_Bytes) {
-    u32 instruction_start_offset = u64_to_u32(buffer->occupied);
-    Slice slice = {
-      .bytes = (char *)instruction->Bytes.memory,
-      .length = instruction->Bytes.length,
-    };
-    virtual_memory_buffer_append_slice(buffer, slice);
-
-    if (instruction->Bytes.label_offset_in_instruction != INSTRUCTION_BYTES_NO_LABEL) {
-      u64 patch_offset_in_buffer =
-        instruction_start_offset + instruction->Bytes.label_offset_in_instruction;
-      dyn_array_push(program->patch_info_array, (Label_Location_Diff_Patch_Info) {
-        .target_label_index = instruction->Bytes.label_index,
-        .from = {
-          .section = &program->memory.sections.code,
-          .offset_in_section = u64_to_u32(buffer->occupied),
-        },
-        .patch_target = (s32 *)(buffer->memory + patch_offset_in_buffer),
-      });
-    }
-
-    return;
-  }
-
+  assert(instruction->type == Instruction_Type_Assembly);
   u32 storage_count = countof(instruction->assembly.operands);
   for (u32 index = 0; index < instruction->assembly.mnemonic->encoding_count; ++index) {
     const Instruction_Encoding *encoding = &instruction->assembly.mnemonic->encoding_list[index];
     for (u32 storage_index = 0; storage_index < storage_count; ++storage_index) {
       const Operand_Encoding *operand_encoding = &encoding->operands[storage_index];
-      Storage *storage = &instruction->assembly.operands[storage_index];
+      const Storage *storage = &instruction->assembly.operands[storage_index];
       u32 encoding_size = s32_to_u32(operand_encoding->size);
 
       if (operand_encoding->size != Operand_Size_Any) {
@@ -423,10 +456,85 @@ encode_instruction(
       break;
     }
 
-    if (encoding) {
-      encode_instruction_assembly(program, buffer, instruction, encoding, storage_count);
-      return;
+    if (encoding) return encoding;
+  }
+  return 0;
+}
+
+// :CodeAlignment
+// Fills the gap with the recommended multi-byte NOP forms so that
+// padding that does get executed costs as few instructions as possible.
+void
+encode_nop_padding(
+  Virtual_Memory_Buffer *buffer,
+  u64 byte_size
+) {
+  static const u8 nops[9][9] = {
+    {0x90},
+    {0x66, 0x90},
+    {0x0F, 0x1F, 0x00},
+    {0x0F, 0x1F, 0x40, 0x00},
+    {0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},
+    {0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+  };
+  while (byte_size) {
+    u64 size = byte_size < countof(nops) ? byte_size : countof(nops);
+    virtual_memory_buffer_append_slice(buffer, (Slice){
+      .bytes = (char *)nops[size - 1],
+      .length = size,
+    });
+    byte_size -= size;
+  }
+}
+
+void
+encode_instruction(
+  Program *program,
+  Virtual_Memory_Buffer *buffer,
+  Instruction *instruction
+) {
+  // TODO turn into a switch statement on type
+  if (instruction->type == Instruction_Type_Label) {
+    Label *label = program_get_label(program, instruction->label);
+    assert(!label->resolved);
+    label->section = &program->memory.sections.code;
+    label->offset_in_section = u64_to_u32(buffer->occupied);
+    label->resolved = true;
+    instruction->encoded_byte_size = 0;
+    return;
+  } else if (instruction->type == Instruction_Type_Bytes) {
+    u32 instruction_start_offset = u64_to_u32(buffer->occupied);
+    Slice slice = {
+      .bytes = (char *)instruction->Bytes.memory,
+      .length = instruction->Bytes.length,
+    };
+    virtual_memory_buffer_append_slice(buffer, slice);
+    instruction->encoded_byte_size = instruction->Bytes.length;
+
+    if (instruction->Bytes.label_offset_in_instruction != INSTRUCTION_BYTES_NO_LABEL) {
+      u64 patch_offset_in_buffer =
+        instruction_start_offset + instruction->Bytes.label_offset_in_instruction;
+      dyn_array_push(program->patch_info_array, (Label_Location_Diff_Patch_Info) {
+        .target_label_index = instruction->Bytes.label_index,
+        .from = {
+          .section = &program->memory.sections.code,
+          .offset_in_section = u64_to_u32(buffer->occupied),
+        },
+        .patch_target = (s32 *)(buffer->memory + patch_offset_in_buffer),
+      });
     }
+
+    return;
+  }
+
+  u32 storage_count = countof(instruction->assembly.operands);
+  const Instruction_Encoding *encoding = instruction_find_encoding(instruction);
+  if (encoding) {
+    encode_instruction_assembly(program, buffer, instruction, encoding, storage_count);
+    return;
   }
   const Compiler_Source_Location *compiler_location = &instruction->compiler_source_location;
   printf(
@@ -447,3 +555,25 @@ encode_instruction(
   printf("\n");
   assert(!"Did not find acceptable encoding");
 }
+
+// Encodes the instruction into a throw-away buffer to find out its byte size
+// without resolving any labels or leaving any patch info behind.
+u8
+instruction_byte_size(
+  Program *program,
+  Instruction *instruction
+) {
+  assert(instruction->type != Instruction_Type_Label);
+  s8 memory[32];
+  Virtual_Memory_Buffer scratch_buffer = {
+    .capacity = countof(memory),
+    .committed = countof(memory),
+    .memory = memory,
+  };
+  u64 patch_info_count = dyn_array_length(program->patch_info_array);
+  encode_instruction(program, &scratch_buffer, instruction);
+  while (dyn_array_length(program->patch_info_array) > patch_info_count) {
+    dyn_array_pop(program->patch_info_array);
+  }
+  return instruction->encoded_byte_size;
+}
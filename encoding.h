@@ -26,6 +26,8 @@ typedef enum {
   Operand_Size_16 = 2,
   Operand_Size_32 = 4,
   Operand_Size_64 = 8,
+  Operand_Size_128 = 16,
+  Operand_Size_256 = 32,
 } Operand_Size;
 
 typedef struct {
@@ -38,6 +40,11 @@ typedef struct {
   Instruction_Extension_Type extension_type;
   u8 op_code_extension;
   Operand_Encoding operands[3];
+  // :VexEncoding
+  // VEX-encoded instructions take the non-destructive source from the second
+  // operand (VEX.vvvv) and the mandatory prefix and escape bytes of the op code
+  // are folded into the VEX prefix instead of being emitted as is.
+  bool vex;
 } Instruction_Encoding;
 
 typedef struct {
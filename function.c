@@ -1,4 +1,5 @@
 #include "function.h"
+#include "optimization.h"
 
 // :StackDisplacementEncoding
 // There are three types of values that can be present on the stack in the current setup
@@ -62,6 +63,28 @@ register_acquire_temp(
   return -1;
 }
 
+Register
+register_acquire_temp_xmm(
+  Function_Builder *builder
+) {
+  // :PrivateCallingConvention assigns float arguments starting from XMM0
+  // so the higher volatile registers are the least likely to be occupied
+  static const Register temp_registers[] = {
+    Register_Xmm5, Register_Xmm4, Register_Xmm3, Register_Xmm2, Register_Xmm1, Register_Xmm0,
+  };
+  for (u32 i = 0; i < countof(temp_registers); ++i) {
+    Register reg_index = temp_registers[i];
+    if (!register_bitset_get(builder->code_block.register_occupied_bitset, reg_index)) {
+      register_acquire(builder, reg_index);
+      return reg_index;
+    }
+  }
+
+  // FIXME
+  panic("Could not acquire a temp XMM register");
+  return -1;
+}
+
 void
 register_release(
   Function_Builder *builder,
@@ -128,6 +151,174 @@ register_release_maybe_restore(
   }
 }
 
+// :BlockMove
+// Blocks up to these sizes are moved with unrolled 16-byte SSE moves. Larger ones use
+// `rep movsb` / `rep stosb` which are faster on long blocks, but have a startup cost
+// and need RSI, RDI, RCX (and RAX) to be saved and restored around them.
+#define MOVE_VALUE_MAX_UNROLLED_COPY_SIZE 128
+#define MOVE_VALUE_MAX_UNROLLED_ZERO_SIZE 256
+
+static inline bool
+storage_is_indirect_memory(
+  const Storage *storage
+) {
+  return storage->tag == Storage_Tag_Memory &&
+    storage->Memory.location.tag == Memory_Location_Tag_Indirect;
+}
+
+static inline Storage
+storage_indirect_memory_chunk(
+  const Storage *memory,
+  u64 offset,
+  u64 byte_size
+) {
+  assert(storage_is_indirect_memory(memory));
+  Storage result = *memory;
+  result.byte_size = byte_size;
+  result.Memory.location.Indirect.offset += offset;
+  return result;
+}
+
+static bool
+storage_static_is_zero(
+  const Storage *storage
+) {
+  assert(storage->tag == Storage_Tag_Static);
+  const u8 *bytes = storage->Static.memory;
+  for (u64 i = 0; i < storage->byte_size; ++i) {
+    if (bytes[i]) return false;
+  }
+  return true;
+}
+
+// Copies the block from `source` or zeroes the `target` if there is no source
+static void
+move_memory_block_unrolled(
+  Allocator *allocator,
+  Function_Builder *builder,
+  const Source_Range *source_range,
+  const Storage *target,
+  const Storage *maybe_source
+) {
+  Array_Instruction *instructions = &builder->code_block.instructions;
+  u64 byte_size = target->byte_size;
+  u64 offset = 0;
+  if (byte_size >= 16) {
+    Storage temp = {
+      .tag = Storage_Tag_Xmm,
+      .byte_size = 16,
+      .Xmm.index = register_acquire_temp_xmm(builder),
+    };
+    if (!maybe_source) {
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {pxor, {temp, temp}}});
+    }
+    for (;;) {
+      Storage target_chunk = storage_indirect_memory_chunk(target, offset, 16);
+      if (maybe_source) {
+        Storage source_chunk = storage_indirect_memory_chunk(maybe_source, offset, 16);
+        push_instruction(instructions, *source_range, (Instruction) {.assembly = {movups, {temp, source_chunk}}});
+      }
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {movups, {target_chunk, temp}}});
+      if (offset + 16 == byte_size) break;
+      // The tail is covered by a move that overlaps the previous chunk which is
+      // cheaper than a sequence of smaller moves
+      offset = u64_min(offset + 16, byte_size - 16);
+    }
+    register_release(builder, temp.Xmm.index);
+    return;
+  }
+
+  // Smaller blocks are moved in the largest general purpose register sized chunks that fit
+  Storage temp = {0};
+  if (maybe_source) {
+    temp = storage_register_for_descriptor(register_acquire_temp(builder), &descriptor_s64);
+  }
+  while (offset < byte_size) {
+    u64 chunk_size = 8;
+    while (chunk_size > byte_size - offset) chunk_size /= 2;
+    Storage target_chunk = storage_indirect_memory_chunk(target, offset, chunk_size);
+    if (maybe_source) {
+      Storage source_chunk = storage_indirect_memory_chunk(maybe_source, offset, chunk_size);
+      Storage temp_chunk = temp;
+      temp_chunk.byte_size = chunk_size;
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {temp_chunk, source_chunk}}});
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {target_chunk, temp_chunk}}});
+    } else {
+      Storage zero;
+      switch(chunk_size) {
+        case 1: zero = imm8(allocator, 0); break;
+        case 2: zero = imm16(allocator, 0); break;
+        // 64-bit moves sign extend a 32-bit immediate
+        default: zero = imm32(allocator, 0); break;
+      }
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {target_chunk, zero}}});
+    }
+    offset += chunk_size;
+  }
+  if (maybe_source) register_release(builder, temp.Register.index);
+}
+
+// Copies the block from `source` with `rep movsb` or zeroes the `target` with `rep stosb`
+static void
+move_memory_block_rep_string(
+  Allocator *allocator,
+  Function_Builder *builder,
+  const Source_Range *source_range,
+  const Storage *target,
+  const Storage *maybe_source
+) {
+  Array_Instruction *instructions = &builder->code_block.instructions;
+  Register string_registers[3] = {Register_DI, Register_C, maybe_source ? Register_SI : Register_A};
+  // Make sure none of the temporaries end up in one of the registers they are saving
+  bool acquired[countof(string_registers)] = {0};
+  for (u64 i = 0; i < countof(string_registers); ++i) {
+    if (!register_bitset_get(builder->code_block.register_occupied_bitset, string_registers[i])) {
+      register_acquire(builder, string_registers[i]);
+      acquired[i] = true;
+    }
+  }
+  Storage temps[countof(string_registers)];
+  for (u64 i = 0; i < countof(string_registers); ++i) {
+    temps[i] = storage_register_for_descriptor(register_acquire_temp(builder), &descriptor_s64);
+    Storage reg = storage_register_for_descriptor(string_registers[i], &descriptor_s64);
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {temps[i], reg}}});
+  }
+
+  // Either operand might be addressed through one of the string registers so both
+  // addresses are computed before any of them is overwritten
+  Storage target_address = storage_register_for_descriptor(register_acquire_temp(builder), &descriptor_s64);
+  push_instruction(instructions, *source_range, (Instruction) {.assembly = {lea, {target_address, *target}}});
+  Storage source_address = {0};
+  if (maybe_source) {
+    source_address = storage_register_for_descriptor(register_acquire_temp(builder), &descriptor_s64);
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {lea, {source_address, *maybe_source}}});
+  }
+
+  Storage reg_rdi = storage_register_for_descriptor(Register_DI, &descriptor_s64);
+  Storage reg_rcx = storage_register_for_descriptor(Register_C, &descriptor_s64);
+  push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {reg_rdi, target_address}}});
+  register_release(builder, target_address.Register.index);
+  if (maybe_source) {
+    Storage reg_rsi = storage_register_for_descriptor(Register_SI, &descriptor_s64);
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {reg_rsi, source_address}}});
+    register_release(builder, source_address.Register.index);
+  } else {
+    Storage reg_rax = storage_register_for_descriptor(Register_A, &descriptor_s64);
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {xor, {reg_rax, reg_rax}}});
+  }
+  Storage size_operand = imm64(allocator, target->byte_size);
+  push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {reg_rcx, size_operand}}});
+  const X64_Mnemonic *string_mnemonic = maybe_source ? rep_movsb : rep_stosb;
+  push_instruction(instructions, *source_range, (Instruction) {.assembly = {string_mnemonic}});
+
+  for (u64 i = 0; i < countof(string_registers); ++i) {
+    Storage reg = storage_register_for_descriptor(string_registers[i], &descriptor_s64);
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {reg, temps[i]}}});
+    register_release(builder, temps[i].Register.index);
+    if (acquired[i]) register_release(builder, string_registers[i]);
+  }
+}
+
 void
 move_value(
   Allocator *allocator,
@@ -153,6 +344,10 @@ move_value(
       push_instruction(instructions, *source_range, (Instruction) {.assembly = {movss, {*target, *source, 0}}});
     } else if (target_size == 8) {
       push_instruction(instructions, *source_range, (Instruction) {.assembly = {movsd, {*target, *source, 0}}});
+    } else if (target_size == 16) {
+      // Unaligned form is as fast as the aligned one on aligned data
+      // and we do not guarantee 16-byte alignment of the stack values
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {movups, {*target, *source, 0}}});
     } else {
       panic("Internal Error: XMM operand of unexpected size");
     }
@@ -228,6 +423,19 @@ move_value(
   }
 
   if (source->tag == Storage_Tag_Static) {
+    // :BlockMove
+    if (source->byte_size > 8 && storage_static_is_zero(source)) {
+      assert(target->tag == Storage_Tag_Memory);
+      if (
+        target_size <= MOVE_VALUE_MAX_UNROLLED_ZERO_SIZE &&
+        storage_is_indirect_memory(target)
+      ) {
+        move_memory_block_unrolled(allocator, builder, source_range, target, 0);
+      } else {
+        move_memory_block_rep_string(allocator, builder, source_range, target, 0);
+      }
+      return;
+    }
     if (source->byte_size > 8) {
       // TODO use XMM or 64 bit registers where appropriate
       // TODO support packed structs
@@ -346,33 +554,9 @@ move_value(
   }
 
   if (target->tag == Storage_Tag_Memory && source->tag == Storage_Tag_Memory) {
-    if (target_size >= 16) {
-      // TODO probably can use larger chunks for copying but need to check alignment
-      Storage temp_rsi = storage_register_for_descriptor(register_acquire_temp(builder), &descriptor_s64);
-      Storage temp_rdi = storage_register_for_descriptor(register_acquire_temp(builder), &descriptor_s64);
-      Storage temp_rcx = storage_register_for_descriptor(register_acquire_temp(builder), &descriptor_s64);
-      {
-        Storage reg_rsi = storage_register_for_descriptor(Register_SI, &descriptor_s64);
-        Storage reg_rdi = storage_register_for_descriptor(Register_DI, &descriptor_s64);
-        Storage reg_rcx = storage_register_for_descriptor(Register_C, &descriptor_s64);
-        push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {temp_rsi, reg_rsi}}});
-        push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {temp_rdi, reg_rdi}}});
-        push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {temp_rcx, reg_rcx}}});
-
-        push_instruction(instructions, *source_range, (Instruction) {.assembly = {lea, {reg_rsi, *source}}});
-        push_instruction(instructions, *source_range, (Instruction) {.assembly = {lea, {reg_rdi, *target}}});
-        Storage size_operand = imm64(allocator, target_size);
-        push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {reg_rcx, size_operand}}});
-        push_instruction(instructions, *source_range, (Instruction) {.assembly = {rep_movsb}});
-
-        push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {reg_rsi, temp_rsi}}});
-        push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {reg_rdi, temp_rdi}}});
-        push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {reg_rcx, temp_rcx}}});
-      }
-      register_release(builder, temp_rsi.Register.index);
-      register_release(builder, temp_rdi.Register.index);
-      register_release(builder, temp_rcx.Register.index);
-    } else {
+    bool fits_register =
+      target_size == 1 || target_size == 2 || target_size == 4 || target_size == 8;
+    if (fits_register) {
       Storage temp = {
         .tag = Storage_Tag_Register,
         .byte_size = target->byte_size,
@@ -381,6 +565,14 @@ move_value(
       move_value(allocator, builder, source_range, &temp, source);
       move_value(allocator, builder, source_range, target, &temp);
       register_release(builder, temp.Register.index);
+    } else if (
+      // :BlockMove
+      target_size <= MOVE_VALUE_MAX_UNROLLED_COPY_SIZE &&
+      storage_is_indirect_memory(target) && storage_is_indirect_memory(source)
+    ) {
+      move_memory_block_unrolled(allocator, builder, source_range, target, source);
+    } else {
+      move_memory_block_rep_string(allocator, builder, source_range, target, source);
     }
     return;
   }
@@ -434,6 +626,22 @@ win32_set_volatile_registers_for_function(
   register_bitset_set(&builder->code_block.register_volatile_bitset, Register_R11);
 }
 
+// :RegisterPushPop
+static inline s32
+fn_pushed_register_byte_size(
+  const Function_Builder *builder
+) {
+  s32 result = 0;
+  for (Register reg_index = 0; reg_index <= Register_R15; ++reg_index) {
+    if (register_bitset_get(builder->used_register_bitset, reg_index)) {
+      if (!register_bitset_get(builder->code_block.register_volatile_bitset, reg_index)) {
+        result += 8;
+      }
+    }
+  }
+  return result;
+}
+
 // :StackDisplacementEncoding
 s64
 fn_adjust_stack_displacement(
@@ -448,9 +656,10 @@ fn_adjust_stack_displacement(
   // are for arguments to this function on the stack
   if (displacement >= u32_to_s64(builder->max_call_parameters_stack_size)) {
     // Return address will be pushed on the stack by the caller
-    // and we need to account for that
+    // and we need to account for that, as well as for the registers
+    // we push ourselves in the prolog
     s32 return_address_size = 8;
-    displacement += builder->stack_reserve + return_address_size;
+    displacement += builder->stack_reserve + fn_pushed_register_byte_size(builder) + return_address_size;
   }
   return displacement;
 }
@@ -492,6 +701,137 @@ fn_maybe_remove_unnecessary_jump_from_return_statement_at_the_end_of_function(
   dyn_array_pop(builder->code_block.instructions);
 }
 
+// :RegisterPushPop
+// :FrameElision
+// Undoes the prolog. This is shared between the regular exit from the function
+// and the tail calls which need to tear down the frame before jumping.
+#define MAX_EPILOGUE_INSTRUCTION_COUNT (1 + 16)
+static u64
+fn_epilogue_instructions(
+  const Function_Builder *builder,
+  Instruction *out
+) {
+  u64 count = 0;
+  if (builder->stack_reserve) {
+    // @Leak
+    Storage stack_size_operand = imm_auto_8_or_32(allocator_default, builder->stack_reserve);
+    out[count++] = (Instruction) {.assembly = {add, {rsp, stack_size_operand}}};
+  }
+
+  // Pop non-volatile registers (in original order)
+  for (Register reg_index = 0; reg_index <= Register_R15; ++reg_index) {
+    if (register_bitset_get(builder->used_register_bitset, reg_index)) {
+      if (!register_bitset_get(builder->code_block.register_volatile_bitset, reg_index)) {
+        Storage to_restore = storage_register_for_descriptor(reg_index, &descriptor_s64);
+        out[count++] = (Instruction) {.assembly = {pop, {to_restore}}};
+      }
+    }
+  }
+  assert(count <= MAX_EPILOGUE_INSTRUCTION_COUNT);
+  return count;
+}
+
+// Code that runs once control reaches the `end_label`
+#define MAX_EXIT_INSTRUCTION_COUNT (MAX_EPILOGUE_INSTRUCTION_COUNT + 2)
+static u64
+fn_exit_instructions(
+  const Function_Builder *builder,
+  Instruction *out
+) {
+  u64 count = 0;
+  // :ReturnTypeLargerThanRegister
+  if (calling_convention_has_return_pointer(builder->calling_convention, builder->function->returns.descriptor)) {
+    // FIXME :RegisterAllocation
+    //       make sure that return value is always available in RCX at this point
+    out[count++] = (Instruction) {.assembly = {mov, {rax, rcx}}};
+  }
+  count += fn_epilogue_instructions(builder, out + count);
+  out[count++] = (Instruction) {.assembly = {ret, {0}}};
+  assert(count <= MAX_EXIT_INSTRUCTION_COUNT);
+  return count;
+}
+
+// :TailCall
+// Once the frame is gone any pointer into it that the callee might
+// have received becomes dangling so in that case we fall back to a call.
+static bool
+fn_may_leak_stack_address(
+  const Function_Builder *builder
+) {
+  for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+    Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+    if (instruction->type != Instruction_Type_Assembly) continue;
+    if (instruction->assembly.mnemonic != lea) continue;
+    Storage *source = &instruction->assembly.operands[1];
+    if (
+      source->tag == Storage_Tag_Memory &&
+      source->Memory.location.tag == Memory_Location_Tag_Indirect &&
+      source->Memory.location.Indirect.base_register == Register_SP
+    ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void
+fn_expand_tail_calls(
+  Function_Builder *builder
+) {
+  bool can_reuse_frame = !fn_may_leak_stack_address(builder);
+  Storage end_label = code_label32(builder->code_block.end_label);
+  for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+    Instruction *tail_call = dyn_array_get(builder->code_block.instructions, i);
+    if (tail_call->type != Instruction_Type_Tail_Call) continue;
+    Storage target = tail_call->assembly.operands[0];
+    Instruction expansion[MAX_EPILOGUE_INSTRUCTION_COUNT + 2];
+    u64 count = 0;
+    if (can_reuse_frame) {
+      count = fn_epilogue_instructions(builder, expansion);
+      expansion[count++] = (Instruction) {.assembly = {jmp, {target}}};
+    } else {
+      expansion[count++] = (Instruction) {.assembly = {call, {target}}};
+      expansion[count++] = (Instruction) {.assembly = {jmp, {end_label}}};
+    }
+    for (u64 j = 0; j < count; ++j) {
+      expansion[j].compiler_source_location = tail_call->compiler_source_location;
+      expansion[j].source_range = tail_call->source_range;
+    }
+    dyn_array_splice_raw(builder->code_block.instructions, i, 1, expansion, count);
+    i += count - 1;
+  }
+}
+
+#define FN_MAX_LOOP_OPTIMIZATION_ROUNDS 3
+
+static bool
+fn_makes_calls(
+  const Function_Builder *builder
+) {
+  for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+    Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+    if (instruction->type != Instruction_Type_Assembly) continue;
+    if (instruction->assembly.mnemonic == call) return true;
+  }
+  return false;
+}
+
+static void
+fn_optimize_straight_line_code(
+  Function_Builder *builder
+) {
+  // :PromoteStackSlots
+  fn_promote_stack_slots(builder);
+  // Stack slots can only be reasoned about if nothing else can point into them
+  bool track_stack_slots = !fn_may_leak_stack_address(builder);
+  // :CopyPropagation
+  fn_propagate_copies(builder, track_stack_slots);
+  // :ValueNumbering
+  fn_number_values(builder, track_stack_slots);
+  // :DeadCodeElimination
+  fn_eliminate_dead_code(builder, track_stack_slots);
+}
+
 void
 fn_end(
   Program *program,
@@ -499,16 +839,51 @@ fn_end(
 ) {
   assert(!builder->frozen);
 
-  u8 alignment = 0x8;
-  builder->stack_reserve += builder->max_call_parameters_stack_size;
-  builder->stack_reserve = s32_align(builder->stack_reserve, 16) + alignment;
+  builder->move_count_before_optimization = fn_count_moves(builder);
+  fn_optimize_straight_line_code(builder);
+  // :LoopOptimization
+  // Computations moved out of loops leave behind copies and dead code to clean up
+  // which in turn might let more locals into registers and expose more induction variables
+  for (u32 round = 0; round < FN_MAX_LOOP_OPTIMIZATION_ROUNDS && fn_optimize_loops(builder); ++round) {
+    fn_optimize_straight_line_code(builder);
+  }
+  // :LoopRotation
+  fn_rotate_loops(program, builder);
+  builder->move_count_after_optimization = fn_count_moves(builder);
+
+  // :FrameElision
+  // Leaf functions that do not have any locals do not touch the stack,
+  // so there is no need to allocate (and align) a frame for them at all.
+  // :PrivateCallingConvention calls do not reserve any stack for the callee,
+  // but it still expects RSP to be aligned.
+  if (builder->stack_reserve || builder->max_call_parameters_stack_size || fn_makes_calls(builder)) {
+    builder->stack_reserve += builder->max_call_parameters_stack_size;
+    // Return address and the pushed non-volatile registers are on the stack
+    // as well, so they need to be accounted for to keep RSP 16-byte aligned
+    // at the call sites within this function.
+    s32 return_address_size = 8;
+    s32 already_on_stack = return_address_size + fn_pushed_register_byte_size(builder);
+    builder->stack_reserve =
+      s32_align(builder->stack_reserve + already_on_stack, 16) - already_on_stack;
+  }
   assert(builder->function->returns.descriptor->tag != Descriptor_Tag_Any);
 
+  // :ClobberSets
+  // Tail calls are still opaque here so they count as clobbering everything
+  builder->register_clobber_bitset = fn_clobbered_registers(builder);
+
+  // :TailCall
+  // Needs to happen after the frame size is known but before normalization
+  fn_expand_tail_calls(builder);
+
   for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
     Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
     fn_normalize_instruction_operands(program, builder, instruction);
   }
   fn_maybe_remove_unnecessary_jump_from_return_statement_at_the_end_of_function(builder);
+  // :ColdCode
+  // Runs last so that the instruction index of the hot / cold boundary stays valid
+  fn_split_cold_code(program, builder);
 
   builder->frozen = true;
 }
@@ -537,6 +912,203 @@ typedef struct {
   u8 offset_in_prolog;
 } Function_Pushed_Register;
 
+// :BranchRelaxation
+// Jumps to labels within the same function are first assumed to fit into
+// a rel8 displacement and only get promoted to the rel32 form if they do not.
+// Since a promotion can only make the code larger, and so push other jumps
+// out of the rel8 range, we iterate until nothing changes anymore.
+static inline bool
+instruction_is_relaxable_jump(
+  const Instruction *instruction
+) {
+  if (instruction->type != Instruction_Type_Assembly) return false;
+  if (!storage_is_label(&instruction->assembly.operands[0])) return false;
+  const X64_Mnemonic *mnemonic = instruction->assembly.mnemonic;
+  for (u32 index = 0; index < mnemonic->encoding_count; ++index) {
+    const Operand_Encoding *operand_encoding = &mnemonic->encoding_list[index].operands[0];
+    if (
+      operand_encoding->type == Operand_Encoding_Type_Immediate &&
+      operand_encoding->size == Operand_Size_8
+    ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#define SHORT_JUMP_BYTE_SIZE 2
+
+typedef struct {
+  // Offset of each instruction from the start of the function body.
+  // There is one extra item at the end for the `end_label`.
+  // :ColdCode The exit sequence is accounted for at the hot / cold boundary.
+  Array_u32 offsets;
+  // Index of the label instruction that the jump targets or -1 for
+  // all other instructions and jumps outside of the function body.
+  Array_s64 targets;
+} Branch_Relaxation;
+
+Branch_Relaxation
+fn_relax_branches(
+  Program *program,
+  const Function_Builder *builder,
+  u64 body_start_rva
+) {
+  const Array_Instruction instructions = builder->code_block.instructions;
+  u64 instruction_count = dyn_array_length(instructions);
+  Branch_Relaxation relaxation = {
+    .offsets = dyn_array_make(Array_u32, .capacity = instruction_count + 1),
+    .targets = dyn_array_make(Array_s64, .capacity = instruction_count),
+  };
+
+  // Labels belonging to a function are usually allocated close to each other
+  // so a dense lookup table over the range of their indexes is good enough.
+  u64 end_label_index = builder->code_block.end_label.value;
+  u64 min_label_index = end_label_index;
+  u64 max_label_index = end_label_index;
+  for (u64 i = 0; i < instruction_count; ++i) {
+    Instruction *instruction = dyn_array_get(instructions, i);
+    if (instruction->type != Instruction_Type_Label) continue;
+    min_label_index = u64_min(min_label_index, instruction->label.value);
+    max_label_index = u64_max(max_label_index, instruction->label.value);
+  }
+  u64 label_map_length = max_label_index - min_label_index + 1;
+  s64 *label_to_instruction_index = allocator_allocate_array(allocator_default, s64, label_map_length);
+  for (u64 i = 0; i < label_map_length; ++i) label_to_instruction_index[i] = -1;
+  label_to_instruction_index[end_label_index - min_label_index] = u64_to_s64(instruction_count);
+  for (u64 i = 0; i < instruction_count; ++i) {
+    Instruction *instruction = dyn_array_get(instructions, i);
+    if (instruction->type != Instruction_Type_Label) continue;
+    label_to_instruction_index[instruction->label.value - min_label_index] = u64_to_s64(i);
+  }
+
+  for (u64 i = 0; i < instruction_count; ++i) {
+    Instruction *instruction = dyn_array_get(instructions, i);
+    s64 target = -1;
+    if (instruction_is_relaxable_jump(instruction)) {
+      Label_Index label_index =
+        instruction->assembly.operands[0].Memory.location.Instruction_Pointer_Relative.label_index;
+      if (label_index.value >= min_label_index && label_index.value <= max_label_index) {
+        target = label_to_instruction_index[label_index.value - min_label_index];
+      }
+    }
+    dyn_array_push(relaxation.targets, target);
+    if (target != -1) {
+      instruction->encoded_byte_size = SHORT_JUMP_BYTE_SIZE;
+    } else if (instruction->type == Instruction_Type_Label) {
+      instruction->encoded_byte_size = 0;
+    } else {
+      instruction_byte_size(program, instruction);
+    }
+  }
+  allocator_deallocate(allocator_default, label_to_instruction_index, sizeof(s64) * label_map_length);
+
+  // :CodeAlignment
+  // Loop heads are the labels targeted by the jumps back within the hot code
+  u32 loop_alignment = program->loop_alignment;
+  bool *is_loop_head = 0;
+  if (loop_alignment > 1) {
+    is_loop_head = allocator_allocate_array(allocator_default, bool, instruction_count);
+    memset(is_loop_head, 0, sizeof(bool) * instruction_count);
+    for (u64 i = 0; i < builder->hot_instruction_count; ++i) {
+      s64 target = *dyn_array_get(relaxation.targets, i);
+      if (target != -1 && s64_to_u64(target) <= i) is_loop_head[target] = true;
+    }
+  }
+
+  // :ColdCode
+  u32 exit_byte_size = 0;
+  if (builder->hot_instruction_count != instruction_count) {
+    Instruction exit[MAX_EXIT_INSTRUCTION_COUNT];
+    u64 exit_count = fn_exit_instructions(builder, exit);
+    for (u64 i = 0; i < exit_count; ++i) {
+      exit_byte_size += instruction_byte_size(program, &exit[i]);
+    }
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    dyn_array_clear(relaxation.offsets);
+    u32 offset = 0;
+    u32 end_label_offset = 0;
+    for (u64 i = 0; i < instruction_count; ++i) {
+      if (i == builder->hot_instruction_count) {
+        end_label_offset = offset;
+        offset += exit_byte_size;
+      }
+      if (is_loop_head && is_loop_head[i]) {
+        u64 rva = body_start_rva + offset;
+        offset += u64_to_u32(u64_align(rva, loop_alignment) - rva);
+      }
+      dyn_array_push(relaxation.offsets, offset);
+      offset += dyn_array_get(instructions, i)->encoded_byte_size;
+    }
+    if (builder->hot_instruction_count == instruction_count) end_label_offset = offset;
+    dyn_array_push(relaxation.offsets, end_label_offset);
+
+    for (u64 i = 0; i < instruction_count; ++i) {
+      s64 target = *dyn_array_get(relaxation.targets, i);
+      if (target == -1) continue;
+      Instruction *instruction = dyn_array_get(instructions, i);
+      if (instruction->encoded_byte_size != SHORT_JUMP_BYTE_SIZE) continue;
+      s64 displacement =
+        u32_to_s64(*dyn_array_get(relaxation.offsets, target)) -
+        u32_to_s64(*dyn_array_get(relaxation.offsets, i) + SHORT_JUMP_BYTE_SIZE);
+      // A jump to the instruction right after it, e.g. over an empty `else`, is not encoded.
+      // Only labels or the padding of a loop head can end up between the two afterwards.
+      if (displacement == 0 && instruction->assembly.mnemonic == jmp) {
+        instruction->encoded_byte_size = 0;
+        changed = true;
+      } else if (!s64_fits_into_s8(displacement)) {
+        instruction_byte_size(program, instruction);
+        changed = true;
+      }
+    }
+  }
+  if (is_loop_head) {
+    allocator_deallocate(allocator_default, is_loop_head, sizeof(bool) * instruction_count);
+  }
+
+  return relaxation;
+}
+
+// :CodeAlignment Loop heads are the labels targeted by the jumps back within the hot code
+static bool
+fn_has_loop_heads(
+  const Function_Builder *builder
+) {
+  Label_Instruction_Map map = label_instruction_map_make(builder);
+  bool result = false;
+  for (u64 i = 0; !result && i < builder->hot_instruction_count; ++i) {
+    Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+    if (!instruction_is_relaxable_jump(instruction)) continue;
+    Label_Index label_index =
+      instruction->assembly.operands[0].Memory.location.Instruction_Pointer_Relative.label_index;
+    s64 target = label_instruction_map_get(&map, label_index);
+    if (target != -1 && s64_to_u64(target) <= i) result = true;
+  }
+  label_instruction_map_destroy(&map);
+  return result;
+}
+
+static void
+fn_encode_exit(
+  Program *program,
+  Virtual_Memory_Buffer *buffer,
+  const Function_Builder *builder
+) {
+  encode_instruction_with_compiler_location(
+    program, buffer, &(Instruction) {
+      .type = Instruction_Type_Label, .label = builder->code_block.end_label
+    }
+  );
+  Instruction exit[MAX_EXIT_INSTRUCTION_COUNT];
+  u64 exit_count = fn_exit_instructions(builder, exit);
+  for (u64 i = 0; i < exit_count; ++i) {
+    encode_instruction_with_compiler_location(program, buffer, &exit[i]);
+  }
+}
+
 void
 fn_encode(
   Program *program,
@@ -565,6 +1137,17 @@ fn_encode(
   if (label->resolved) return;
 
   s64 code_base_rva = label->section->base_rva;
+  // :CodeAlignment The padding is not a part of the function for the unwind info
+  u32 function_alignment = program->function_alignment;
+  // :IdenticalCodeFolding Padding in front of the loops must only depend on the
+  // code of the function for identical functions to be encoded to the same bytes
+  if (program->loop_alignment > function_alignment && fn_has_loop_heads(builder)) {
+    function_alignment = program->loop_alignment;
+  }
+  if (function_alignment > 1) {
+    u64 rva = code_base_rva + buffer->occupied;
+    encode_nop_padding(buffer, u64_align(rva, function_alignment) - rva);
+  }
   out_layout->begin_rva = u64_to_u32(code_base_rva + buffer->occupied);
   // @Leak
   Storage stack_size_operand = imm_auto_8_or_32(allocator_default, out_layout->stack_reserve);
@@ -592,75 +1175,470 @@ fn_encode(
     }
   }
 
-  encode_instruction_with_compiler_location(
-    program, buffer, &(Instruction) {.assembly = {sub, {rsp, stack_size_operand}}}
-  );
+  // :FrameElision
+  if (out_layout->stack_reserve) {
+    encode_instruction_with_compiler_location(
+      program, buffer, &(Instruction) {.assembly = {sub, {rsp, stack_size_operand}}}
+    );
+  }
   out_layout->stack_allocation_offset_in_prolog =
     u64_to_u8(code_base_rva + buffer->occupied -out_layout->begin_rva);
   out_layout->size_of_prolog =
     u64_to_u8(code_base_rva + buffer->occupied - out_layout->begin_rva);
 
+  // :BranchRelaxation
+  Branch_Relaxation relaxation =
+    fn_relax_branches(program, builder, code_base_rva + buffer->occupied);
+  u64 body_start = buffer->occupied;
   for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+    // :ColdCode
+    if (i == builder->hot_instruction_count) fn_encode_exit(program, buffer, builder);
     Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
-    encode_instruction(program, buffer, instruction);
-  }
-
-  encode_instruction_with_compiler_location(
-    program, buffer, &(Instruction) {
-      .type = Instruction_Type_Label, .label = builder->code_block.end_label
+    u32 offset = *dyn_array_get(relaxation.offsets, i);
+    // :CodeAlignment
+    assert(buffer->occupied - body_start <= offset);
+    encode_nop_padding(buffer, offset - (buffer->occupied - body_start));
+    s64 target = *dyn_array_get(relaxation.targets, i);
+    if (target != -1 && instruction->encoded_byte_size == 0) continue;
+    if (target != -1 && instruction->encoded_byte_size == SHORT_JUMP_BYTE_SIZE) {
+      s8 displacement = s64_to_s8(
+        u32_to_s64(*dyn_array_get(relaxation.offsets, target)) -
+        u32_to_s64(offset + SHORT_JUMP_BYTE_SIZE)
+      );
+      Instruction short_jump = *instruction;
+      short_jump.assembly.operands[0] = storage_immediate(&displacement);
+      encode_instruction(program, buffer, &short_jump);
+      assert(short_jump.encoded_byte_size == SHORT_JUMP_BYTE_SIZE);
+    } else {
+      encode_instruction(program, buffer, instruction);
     }
-  );
-
-  // :ReturnTypeLargerThanRegister
-  if(descriptor_byte_size(builder->function->returns.descriptor) > 8) {
-    // FIXME :RegisterAllocation
-    //       make sure that return value is always available in RCX at this point
-    encode_instruction_with_compiler_location(
-      program, buffer, &(Instruction) {.assembly = {mov, {rax, rcx}}}
-    );
   }
+  dyn_array_destroy(relaxation.offsets);
+  dyn_array_destroy(relaxation.targets);
 
-  encode_instruction_with_compiler_location(
-    program, buffer, &(Instruction) {.assembly = {add, {rsp, stack_size_operand}}}
-  );
-
-  // :RegisterPushPop
-  // Pop non-volatile registers (in original order)
-  for (Register reg_index = 0; reg_index <= Register_R15; ++reg_index) {
-    if (register_bitset_get(builder->used_register_bitset, reg_index)) {
-      if (!register_bitset_get(builder->code_block.register_volatile_bitset, reg_index)) {
-        Storage to_save = storage_register_for_descriptor(reg_index, &descriptor_s64);
-        encode_instruction_with_compiler_location(
-          program, buffer, &(Instruction) {.assembly = {pop, {to_save}}}
-        );
-      }
-    }
+  if (builder->hot_instruction_count == dyn_array_length(builder->code_block.instructions)) {
+    fn_encode_exit(program, buffer, builder);
   }
-
-  encode_instruction_with_compiler_location(program, buffer, &(Instruction) {.assembly = {ret, {0}}});
   out_layout->end_rva = u64_to_u32(code_base_rva + buffer->occupied);
 
   encode_instruction_with_compiler_location(program, buffer, &(Instruction) {.assembly = {int3, {0}}});
 }
 
-Value
-function_return_value_for_descriptor(
-  Descriptor *descriptor,
-  Function_Argument_Mode mode
+// :IdenticalCodeFolding
+static inline u64
+encoded_function_body_offset(
+  const Program *program,
+  const Function_Layout *layout
 ) {
-  if (descriptor->tag == Descriptor_Tag_Void) {
-    return void_value;
+  return layout->begin_rva - program->memory.sections.code.base_rva;
+}
+
+// Labels inside of the body are compared by their offset from the start of the body,
+// so that jumps within two copies of the same code are considered equal
+static bool
+encoded_function_body_patch_targets_equal(
+  Program *program,
+  const Encoded_Function_Body *a_body,
+  const Label_Location_Diff_Patch_Info *a_patch,
+  const Encoded_Function_Body *b_body,
+  const Label_Location_Diff_Patch_Info *b_patch
+) {
+  if (a_patch->target_label_index.value == b_patch->target_label_index.value) return true;
+  const Label *a = program_get_label(program, a_patch->target_label_index);
+  const Label *b = program_get_label(program, b_patch->target_label_index);
+  // Labels that are not encoded yet are only known to be equal if they are the same label
+  if (!a->resolved || !b->resolved) return false;
+  if (a->section != b->section) return false;
+  if (a->section == &program->memory.sections.code) {
+    u64 a_begin = encoded_function_body_offset(program, &a_body->layout);
+    u64 a_end = a_begin + a_body->layout.end_rva - a_body->layout.begin_rva;
+    u64 b_begin = encoded_function_body_offset(program, &b_body->layout);
+    u64 b_end = b_begin + b_body->layout.end_rva - b_body->layout.begin_rva;
+    bool a_is_internal = a->offset_in_section >= a_begin && a->offset_in_section <= a_end;
+    bool b_is_internal = b->offset_in_section >= b_begin && b->offset_in_section <= b_end;
+    if (a_is_internal || b_is_internal) {
+      return a_is_internal && b_is_internal &&
+        a->offset_in_section - a_begin == b->offset_in_section - b_begin;
+    }
   }
-  // TODO handle 16 byte non-float return values in XMM0
-  if (descriptor_is_float(descriptor)) {
-    return (Value) {
-      .descriptor = descriptor,
-      .storage = storage_register_for_descriptor(Register_Xmm0, descriptor),
-    };
+  // Different labels can still point to the same place, e.g. after a previous fold
+  return a->offset_in_section == b->offset_in_section;
+}
+
+static bool
+encoded_function_body_equal(
+  Program *program,
+  const Virtual_Memory_Buffer *buffer,
+  const Encoded_Function_Body *a,
+  const Encoded_Function_Body *b
+) {
+  if (a->hash != b->hash) return false;
+  u64 byte_size = a->layout.end_rva - a->layout.begin_rva;
+  if (byte_size != b->layout.end_rva - b->layout.begin_rva) return false;
+  if (a->patch_count != b->patch_count) return false;
+  u64 a_offset = encoded_function_body_offset(program, &a->layout);
+  u64 b_offset = encoded_function_body_offset(program, &b->layout);
+  if (memcmp(buffer->memory + a_offset, buffer->memory + b_offset, byte_size) != 0) return false;
+  for (u64 i = 0; i < a->patch_count; ++i) {
+    const Label_Location_Diff_Patch_Info *a_patch =
+      dyn_array_get(program->patch_info_array, a->first_patch_index + i);
+    const Label_Location_Diff_Patch_Info *b_patch =
+      dyn_array_get(program->patch_info_array, b->first_patch_index + i);
+    if (a_patch->from.offset_in_section - a_offset != b_patch->from.offset_in_section - b_offset) {
+      return false;
+    }
+    if (!encoded_function_body_patch_targets_equal(program, a, a_patch, b, b_patch)) return false;
   }
-  u64 byte_size = descriptor_byte_size(descriptor);
-  if (byte_size <= 8) {
-    return (Value) {
+  return true;
+}
+
+// Is called right after `fn_encode` of the `builder` that started at `encode_start_offset`
+// in the buffer and added patches starting at `first_patch_index`. If the machine code and
+// the relocations match one of the `bodies` encoded before, the new copy is removed from the
+// buffer, the label of the function is redirected to the existing one and its index is returned.
+// Otherwise the body is added to the list and -1 is returned. Label patching has to happen after.
+s64
+fn_fold_identical_code(
+  Program *program,
+  Virtual_Memory_Buffer *buffer,
+  const Function_Builder *builder,
+  const Function_Layout *layout,
+  u64 encode_start_offset,
+  u64 first_patch_index,
+  Array_Encoded_Function_Body *bodies
+) {
+  // Macro functions are not encoded
+  if (layout->begin_rva == layout->end_rva) return -1;
+
+  Encoded_Function_Body body = {
+    .layout = *layout,
+    .first_patch_index = first_patch_index,
+    .patch_count = dyn_array_length(program->patch_info_array) - first_patch_index,
+  };
+  u64 offset = encoded_function_body_offset(program, layout);
+  u64 byte_size = layout->end_rva - layout->begin_rva;
+  // Patch locations are not written until the labels are patched so they are cleared
+  // to make sure the bytes only depend on the code. Their targets are compared separately.
+  for (u64 i = 0; i < body.patch_count; ++i) {
+    Label_Location_Diff_Patch_Info *patch =
+      dyn_array_get(program->patch_info_array, first_patch_index + i);
+    *patch->patch_target = 0;
+  }
+  body.hash = hash_bytes(buffer->memory + offset, byte_size);
+
+  for (u64 i = 0; i < dyn_array_length(*bodies); ++i) {
+    const Encoded_Function_Body *existing = dyn_array_get(*bodies, i);
+    if (!encoded_function_body_equal(program, buffer, existing, &body)) continue;
+    buffer->occupied = encode_start_offset;
+    while (dyn_array_length(program->patch_info_array) > first_patch_index) {
+      dyn_array_pop(program->patch_info_array);
+    }
+    program_set_label_offset(
+      program, builder->label_index, u64_to_u32(encoded_function_body_offset(program, &existing->layout))
+    );
+    return u64_to_s64(i);
+  }
+  dyn_array_push(*bodies, body);
+  return -1;
+}
+
+// :FunctionOrdering
+typedef struct {
+  u64 caller;
+  u64 callee;
+  u64 weight;
+} Function_Call_Edge;
+typedef dyn_array_type(Function_Call_Edge) Array_Function_Call_Edge;
+
+static void
+function_call_edge_add(
+  Array_Function_Call_Edge *edges,
+  u64 a,
+  u64 b
+) {
+  // The graph is undirected so the pair is stored with the smaller index first
+  if (a > b) { u64 temp = a; a = b; b = temp; }
+  for (u64 i = 0; i < dyn_array_length(*edges); ++i) {
+    Function_Call_Edge *edge = dyn_array_get(*edges, i);
+    if (edge->caller == a && edge->callee == b) {
+      edge->weight++;
+      return;
+    }
+  }
+  dyn_array_push(*edges, (Function_Call_Edge) {.caller = a, .callee = b, .weight = 1});
+}
+
+// Returns the indexes of the builders starting at `first_function_index` in the order
+// they should be encoded. Functions marked as `cold` always go last. If enabled, the rest
+// are ordered Pettis-Hansen style: the pair of chains with the most calls between them
+// is repeatedly merged, oriented so that the caller and the callee end up next to each other.
+// Calls are counted statically and the ones in cold code are ignored. All ties are broken
+// by the builder index so the result only depends on the compiled code.
+Array_u64
+program_function_layout_order(
+  const Program *program,
+  u64 first_function_index
+) {
+  u64 function_count = dyn_array_length(program->functions);
+  assert(first_function_index <= function_count);
+  u64 count = function_count - first_function_index;
+  Array_u64 order = dyn_array_make(Array_u64, .capacity = count + 1);
+  if (!program->order_functions_by_calls || count < 2) {
+    for (u32 pass = 0; pass < 2; ++pass) {
+      for (u64 i = first_function_index; i < function_count; ++i) {
+        const Function_Builder *builder = dyn_array_get(program->functions, i);
+        bool is_cold = !!(builder->function->flags & Descriptor_Function_Flags_Cold);
+        if (is_cold == (pass == 1)) dyn_array_push(order, i);
+      }
+    }
+    return order;
+  }
+
+  Array_Function_Call_Edge edges = dyn_array_make(Array_Function_Call_Edge);
+  for (u64 caller = 0; caller < count; ++caller) {
+    const Function_Builder *builder = dyn_array_get(program->functions, first_function_index + caller);
+    if (builder->function->flags & Descriptor_Function_Flags_Cold) continue;
+    for (u64 i = 0; i < builder->hot_instruction_count; ++i) {
+      Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+      if (instruction->type != Instruction_Type_Assembly) continue;
+      if (instruction->assembly.mnemonic != call) continue;
+      if (!storage_is_label(&instruction->assembly.operands[0])) continue;
+      Label_Index label_index =
+        instruction->assembly.operands[0].Memory.location.Instruction_Pointer_Relative.label_index;
+      for (u64 callee = 0; callee < count; ++callee) {
+        if (callee == caller) continue;
+        const Function_Builder *target = dyn_array_get(program->functions, first_function_index + callee);
+        if (target->label_index.value != label_index.value) continue;
+        if (target->function->flags & Descriptor_Function_Flags_Cold) break;
+        function_call_edge_add(&edges, caller, callee);
+        break;
+      }
+    }
+  }
+
+  // Each function starts out in its own chain
+  Array_u64 *chains = allocator_allocate_array(allocator_default, Array_u64, count);
+  u64 *chain_of = allocator_allocate_array(allocator_default, u64, count);
+  for (u64 i = 0; i < count; ++i) {
+    chains[i] = dyn_array_make(Array_u64);
+    dyn_array_push(chains[i], i);
+    chain_of[i] = i;
+  }
+
+  for (;;) {
+    // Total weight between two chains is the sum of the weights of all the edges between them
+    u64 best_weight = 0;
+    u64 best_a = 0;
+    u64 best_b = 0;
+    for (u64 i = 0; i < dyn_array_length(edges); ++i) {
+      Function_Call_Edge *edge = dyn_array_get(edges, i);
+      u64 a = chain_of[edge->caller];
+      u64 b = chain_of[edge->callee];
+      if (a == b) continue;
+      if (a > b) { u64 temp = a; a = b; b = temp; }
+      u64 weight = 0;
+      for (u64 j = 0; j < dyn_array_length(edges); ++j) {
+        Function_Call_Edge *other = dyn_array_get(edges, j);
+        u64 other_a = chain_of[other->caller];
+        u64 other_b = chain_of[other->callee];
+        if ((other_a == a && other_b == b) || (other_a == b && other_b == a)) weight += other->weight;
+      }
+      bool is_better = weight > best_weight ||
+        (weight == best_weight && (a < best_a || (a == best_a && b < best_b)));
+      if (is_better) {
+        best_weight = weight;
+        best_a = a;
+        best_b = b;
+      }
+    }
+    if (!best_weight) break;
+
+    // Pick the orientation that puts the heaviest edge between the chains at the seam
+    Array_u64 *a = &chains[best_a];
+    Array_u64 *b = &chains[best_b];
+    u64 a_length = dyn_array_length(*a);
+    u64 b_length = dyn_array_length(*b);
+    u64 seam_weight = 0;
+    u64 best_distance = u64_max_value;
+    bool reverse_a = false;
+    bool reverse_b = false;
+    for (u64 i = 0; i < dyn_array_length(edges); ++i) {
+      Function_Call_Edge *edge = dyn_array_get(edges, i);
+      u64 in_a = chain_of[edge->caller] == best_a ? edge->caller : edge->callee;
+      u64 in_b = chain_of[edge->caller] == best_b ? edge->caller : edge->callee;
+      if (chain_of[in_a] != best_a || chain_of[in_b] != best_b) continue;
+      if (edge->weight < seam_weight) continue;
+      u64 position_a = 0;
+      u64 position_b = 0;
+      for (u64 k = 0; k < a_length; ++k) if (*dyn_array_get(*a, k) == in_a) position_a = k;
+      for (u64 k = 0; k < b_length; ++k) if (*dyn_array_get(*b, k) == in_b) position_b = k;
+      for (u32 orientation = 0; orientation < 4; ++orientation) {
+        bool flip_a = orientation & 1;
+        bool flip_b = orientation & 2;
+        u64 from_seam_a = flip_a ? position_a : a_length - 1 - position_a;
+        u64 from_seam_b = flip_b ? b_length - 1 - position_b : position_b;
+        u64 distance = from_seam_a + from_seam_b;
+        if (edge->weight > seam_weight || distance < best_distance) {
+          seam_weight = edge->weight;
+          best_distance = distance;
+          reverse_a = flip_a;
+          reverse_b = flip_b;
+        }
+      }
+    }
+
+    Array_u64 merged = dyn_array_make(Array_u64, .capacity = a_length + b_length);
+    for (u64 k = 0; k < a_length; ++k) {
+      dyn_array_push(merged, *dyn_array_get(*a, reverse_a ? a_length - 1 - k : k));
+    }
+    for (u64 k = 0; k < b_length; ++k) {
+      dyn_array_push(merged, *dyn_array_get(*b, reverse_b ? b_length - 1 - k : k));
+    }
+    dyn_array_destroy(*a);
+    dyn_array_destroy(*b);
+    *a = merged;
+    *b = dyn_array_make(Array_u64);
+    for (u64 k = 0; k < dyn_array_length(merged); ++k) {
+      chain_of[*dyn_array_get(merged, k)] = best_a;
+    }
+  }
+
+  // Chains are emitted in the order of the first compiled function in them
+  // which keeps the original order for functions that do not call each other
+  for (u32 pass = 0; pass < 2; ++pass) {
+    for (u64 i = 0; i < count; ++i) {
+      if (chain_of[i] != i && pass == 0) continue;
+      const Function_Builder *builder = dyn_array_get(program->functions, first_function_index + i);
+      bool is_cold = !!(builder->function->flags & Descriptor_Function_Flags_Cold);
+      if (is_cold != (pass == 1)) continue;
+      if (is_cold) {
+        dyn_array_push(order, first_function_index + i);
+        continue;
+      }
+      for (u64 k = 0; k < dyn_array_length(chains[i]); ++k) {
+        dyn_array_push(order, first_function_index + *dyn_array_get(chains[i], k));
+      }
+    }
+  }
+  assert(dyn_array_length(order) == count);
+
+  for (u64 i = 0; i < count; ++i) dyn_array_destroy(chains[i]);
+  allocator_deallocate(allocator_default, chains, sizeof(Array_u64) * count);
+  allocator_deallocate(allocator_default, chain_of, sizeof(u64) * count);
+  dyn_array_destroy(edges);
+  return order;
+}
+
+// :ReachabilityStripping
+// Marks the functions and labels that can be reached from the entry point of the program
+// by following the label references in the instructions of the reachable functions.
+// Everything else, e.g. functions that were only referenced from compile-time code,
+// does not need to be written out to the executable.
+Program_Reachability
+program_reachability_compute(
+  const Program *program
+) {
+  u64 function_count = dyn_array_length(program->functions);
+  u64 label_count = dyn_array_length(program->labels);
+  Program_Reachability result = {
+    .functions = allocator_allocate_array(allocator_default, bool, function_count),
+    .function_count = function_count,
+    .labels = allocator_allocate_array(allocator_default, bool, label_count),
+    .label_count = label_count,
+  };
+  memset(result.functions, 0, sizeof(bool) * function_count);
+  memset(result.labels, 0, sizeof(bool) * label_count);
+
+  s64 *label_to_function_index = allocator_allocate_array(allocator_default, s64, label_count);
+  for (u64 i = 0; i < label_count; ++i) label_to_function_index[i] = -1;
+  Array_u64 worklist = dyn_array_make(Array_u64);
+  for (u64 i = 0; i < function_count; ++i) {
+    const Function_Builder *builder = dyn_array_get(program->functions, i);
+    label_to_function_index[builder->label_index.value] = u64_to_s64(i);
+    if (builder->function == &program->entry_point->descriptor->Function) {
+      result.functions[i] = true;
+      result.labels[builder->label_index.value] = true;
+      dyn_array_push(worklist, i);
+    }
+  }
+
+  while (dyn_array_length(worklist)) {
+    u64 function_index = *dyn_array_pop(worklist);
+    const Function_Builder *builder = dyn_array_get(program->functions, function_index);
+    for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+      Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+      Label_Index referenced[countof(instruction->assembly.operands)];
+      u64 referenced_count = 0;
+      if (instruction->type == Instruction_Type_Bytes) {
+        if (instruction->Bytes.label_offset_in_instruction != INSTRUCTION_BYTES_NO_LABEL) {
+          referenced[referenced_count++] = instruction->Bytes.label_index;
+        }
+      } else if (instruction->type != Instruction_Type_Label) {
+        for (u64 operand_index = 0; operand_index < countof(instruction->assembly.operands); ++operand_index) {
+          const Storage *operand = &instruction->assembly.operands[operand_index];
+          if (operand->tag != Storage_Tag_Memory) continue;
+          const Memory_Location *location = &operand->Memory.location;
+          if (location->tag != Memory_Location_Tag_Instruction_Pointer_Relative) continue;
+          referenced[referenced_count++] = location->Instruction_Pointer_Relative.label_index;
+        }
+      }
+      for (u64 j = 0; j < referenced_count; ++j) {
+        u64 label_index = referenced[j].value;
+        result.labels[label_index] = true;
+        s64 target = label_to_function_index[label_index];
+        if (target == -1 || result.functions[target]) continue;
+        result.functions[target] = true;
+        dyn_array_push(worklist, s64_to_u64(target));
+      }
+    }
+  }
+
+  dyn_array_destroy(worklist);
+  allocator_deallocate(allocator_default, label_to_function_index, sizeof(s64) * label_count);
+  return result;
+}
+
+void
+program_reachability_destroy(
+  Program_Reachability *reachability
+) {
+  allocator_deallocate(allocator_default, reachability->functions, sizeof(bool) * reachability->function_count);
+  allocator_deallocate(allocator_default, reachability->labels, sizeof(bool) * reachability->label_count);
+}
+
+void
+program_strip_report_add_function(
+  Program *program,
+  const Function_Builder *builder
+) {
+  // Macro functions are never encoded so there is nothing to remove
+  if (builder->function->flags & Descriptor_Function_Flags_Macro) return;
+  program->strip_report.function_count++;
+  for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+    Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+    if (instruction->type == Instruction_Type_Label) continue;
+    program->strip_report.code_byte_size += instruction_byte_size(program, instruction);
+  }
+}
+
+Value
+function_return_value_for_descriptor(
+  Descriptor *descriptor,
+  Function_Argument_Mode mode
+) {
+  if (descriptor->tag == Descriptor_Tag_Void) {
+    return void_value;
+  }
+  // TODO handle 16 byte non-float return values in XMM0
+  if (descriptor_is_float(descriptor)) {
+    return (Value) {
+      .descriptor = descriptor,
+      .storage = storage_register_for_descriptor(Register_Xmm0, descriptor),
+    };
+  }
+  u64 byte_size = descriptor_byte_size(descriptor);
+  if (byte_size <= 8) {
+    return (Value) {
       .descriptor = descriptor,
       .storage = storage_register_for_descriptor(Register_A, descriptor),
     };
@@ -687,6 +1665,66 @@ function_return_value_for_descriptor(
   };
 }
 
+// Sets EFLAGS as if the value was compared with zero. The returned
+// value is the `value == 0` result of that comparison.
+static Value *
+make_compare_to_zero(
+  Execution_Context *context,
+  Array_Instruction *instructions,
+  const Source_Range *source_range,
+  Value *value
+) {
+  u64 byte_size = descriptor_byte_size(value->descriptor);
+  if (byte_size == 2) {
+    push_instruction(
+      instructions, *source_range,
+      (Instruction) {.assembly = {cmp, {value->storage, imm16(context->allocator, 0), 0}}}
+    );
+  } else if (byte_size == 4 || byte_size == 8) {
+    push_instruction(
+      instructions, *source_range,
+      (Instruction) {.assembly = {cmp, {value->storage, imm32(context->allocator, 0), 0}}}
+    );
+  } else if (byte_size == 1) {
+    push_instruction(
+      instructions, *source_range,
+      (Instruction) {.assembly = {cmp, {value->storage, imm8(context->allocator, 0), 0}}}
+    );
+  } else {
+    assert(!"Unsupported value inside `if`");
+  }
+  return value_from_compare(context, Compare_Type_Equal);
+}
+
+// :ColdCode
+// Marks the label as the start of rarely executed code which `fn_end` moves out of the way
+void
+fn_mark_label_cold(
+  Execution_Context *context,
+  Label_Index label
+) {
+  Function_Builder *builder = context->builder;
+  if (!dyn_array_is_initialized(builder->cold_labels)) {
+    builder->cold_labels = dyn_array_make(Array_Label_Index, .allocator = context->allocator);
+  }
+  dyn_array_push(builder->cold_labels, label);
+}
+
+// Starts a new block of rarely executed code at the current position
+void
+fn_push_cold_label(
+  Execution_Context *context,
+  const Source_Range *source_range
+) {
+  Program *program = context->program;
+  Label_Index label = make_label(program, &program->memory.sections.code, slice_literal("cold"));
+  push_instruction(&context->builder->code_block.instructions, *source_range, (Instruction) {
+    .type = Instruction_Type_Label,
+    .label = label,
+  });
+  fn_mark_label_cold(context, label);
+}
+
 Label_Index
 make_if(
   Execution_Context *context,
@@ -753,27 +1791,99 @@ make_if(
         }
       }
     } else {
-      u64 byte_size = descriptor_byte_size(value->descriptor);
-      if (byte_size == 4 || byte_size == 8) {
-        push_instruction(
-          instructions, *source_range,
-          (Instruction) {.assembly = {cmp, {value->storage, imm32(context->allocator, 0), 0}}}
-        );
-      } else if (byte_size == 1) {
-        push_instruction(
-          instructions, *source_range,
-          (Instruction) {.assembly = {cmp, {value->storage, imm8(context->allocator, 0), 0}}}
-        );
-      } else {
-        assert(!"Unsupported value inside `if`");
-      }
-      Value *eflags = value_from_compare(context, Compare_Type_Equal);
+      Value *eflags = make_compare_to_zero(context, instructions, source_range, value);
       push_instruction(instructions, *source_range, (Instruction) {.assembly = {je, {code_label32(label), eflags->storage, 0}}});
     }
+    // :ColdCode The hint is a part of the condition so it does not leak to other branches
+    if (value->branch_hint == Branch_Hint_Unlikely) {
+      fn_push_cold_label(context, source_range);
+    } else if (value->branch_hint == Branch_Hint_Likely) {
+      fn_mark_label_cold(context, label);
+    }
   }
   return label;
 }
 
+static const X64_Mnemonic *
+cmov_mnemonic_for_compare_type(
+  Compare_Type compare_type
+) {
+  switch(compare_type) {
+    case Compare_Type_Equal: return cmove;
+    case Compare_Type_Not_Equal: return cmovne;
+
+    case Compare_Type_Unsigned_Below: return cmovb;
+    case Compare_Type_Unsigned_Below_Equal: return cmovbe;
+    case Compare_Type_Unsigned_Above: return cmova;
+    case Compare_Type_Unsigned_Above_Equal: return cmovae;
+
+    case Compare_Type_Signed_Less: return cmovl;
+    case Compare_Type_Signed_Less_Equal: return cmovle;
+    case Compare_Type_Signed_Greater: return cmovg;
+    case Compare_Type_Signed_Greater_Equal: return cmovge;
+  }
+  panic("Unsupported comparison");
+  return 0;
+}
+
+// :BranchlessSelect
+// Lowers `if condition then a else b` where both arms are already evaluated
+// and have no side effects into a `cmovcc`, avoiding a branch misprediction
+// on data-dependent conditions. Arms are loaded with plain `mov` as it does
+// not affect EFLAGS, unlike the `xor` that `move_value` uses for zeroing.
+void
+make_select(
+  Execution_Context *context,
+  const Source_Range *source_range,
+  Value *result_value,
+  Value *condition,
+  Value *then_value,
+  Value *else_value
+) {
+  Function_Builder *builder = context->builder;
+  Array_Instruction *instructions = &builder->code_block.instructions;
+  Descriptor *descriptor = result_value->descriptor;
+  u64 byte_size = descriptor_byte_size(descriptor);
+  assert(byte_size == 2 || byte_size == 4 || byte_size == 8);
+  assert(then_value->storage.byte_size == byte_size);
+  assert(else_value->storage.byte_size == byte_size);
+
+  if (condition->storage.tag == Storage_Tag_Static) {
+    s64 imm = storage_immediate_value_up_to_s64(&condition->storage);
+    Value *selected = imm ? then_value : else_value;
+    MASS_ON_ERROR(assign(context, source_range, result_value, selected)) return;
+    return;
+  }
+
+  Storage eflags;
+  if (condition->storage.tag == Storage_Tag_Eflags) {
+    eflags = condition->storage;
+  } else {
+    make_compare_to_zero(context, instructions, source_range, condition);
+    eflags = value_from_compare(context, Compare_Type_Not_Equal)->storage;
+  }
+
+  Storage temp = storage_register_for_descriptor(register_acquire_temp(builder), descriptor);
+  push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {temp, else_value->storage}}});
+
+  Storage then_operand = then_value->storage;
+  bool then_needs_temp = then_operand.tag == Storage_Tag_Static;
+  if (then_needs_temp) {
+    // `cmovcc` does not have an immediate form
+    then_operand = storage_register_for_descriptor(register_acquire_temp(builder), descriptor);
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {then_operand, then_value->storage}}});
+  }
+
+  const X64_Mnemonic *cmovcc = cmov_mnemonic_for_compare_type(eflags.Eflags.compare_type);
+  push_instruction(instructions, *source_range, (Instruction) {.assembly = {cmovcc, {temp, then_operand, eflags}}});
+
+  move_value(context->allocator, builder, source_range, &result_value->storage, &temp);
+  if (then_needs_temp) {
+    register_release(builder, then_operand.Register.index);
+  }
+  register_release(builder, temp.Register.index);
+}
+
 typedef enum {
   Arithmetic_Operation_Plus,
   Arithmetic_Operation_Minus,
@@ -933,6 +2043,122 @@ minus(
   plus_or_minus(context, Arithmetic_Operation_Minus, source_range, result_value, a, b);
 }
 
+// :StrengthReduction
+static inline bool
+u64_is_power_of_two(
+  u64 value
+) {
+  return value && !(value & (value - 1));
+}
+
+static inline u8
+u64_log2(
+  u64 value
+) {
+  u8 result = 0;
+  while (value >>= 1) ++result;
+  return result;
+}
+
+// :StrengthReduction
+// Multiplication by a constant that is a power of two or is adjacent to one
+// is done with a shift and an optional add / sub of the original value.
+// Other constants use the three-operand form of `imul` which does not need
+// the multiplier to be spilled to the stack.
+static bool
+multiply_by_constant(
+  Execution_Context *context,
+  const Source_Range *source_range,
+  Value *result_value,
+  Value *x,
+  s64 constant
+) {
+  Allocator *allocator = context->allocator;
+  Function_Builder *builder = context->builder;
+  Array_Instruction *instructions = &builder->code_block.instructions;
+  if (!storage_is_register_or_memory(&x->storage)) return false;
+
+  u64 byte_size = descriptor_byte_size(x->descriptor);
+  u64 multiplier = constant > 0 ? s64_to_u64(constant) : 0;
+  const X64_Mnemonic *combine = 0;
+  u8 shift = 0;
+  if (constant == 0) {
+    Value *temp = value_register_for_descriptor(context, register_acquire_temp(builder), x->descriptor);
+    Storage zero = imm8(allocator, 0);
+    move_value(allocator, builder, source_range, &temp->storage, &zero);
+    move_to_result_from_temp(allocator, builder, source_range, result_value, temp);
+    return true;
+  } else if (constant > 0 && u64_is_power_of_two(multiplier)) {
+    shift = u64_log2(multiplier);
+  } else if (byte_size >= 4 && (multiplier == 3 || multiplier == 5 || multiplier == 9)) {
+    // :IndexScale The shift and the add fit into a single `lea temp, [temp + temp * scale]`.
+    // `lea` only has a 64-bit form, but the low half of the result is the same.
+    Register temp_index = register_acquire_temp(builder);
+    Value *temp = value_register_for_descriptor(context, temp_index, x->descriptor);
+    move_value(allocator, builder, source_range, &temp->storage, &x->storage);
+    Storage scaled = {
+      .tag = Storage_Tag_Memory,
+      .byte_size = 8,
+      .Memory.location = {
+        .tag = Memory_Location_Tag_Indirect,
+        .Indirect = {
+          .base_register = temp_index,
+          .index_scale = (Index_Scale)u64_log2(multiplier - 1),
+          .maybe_index_register = {.index = temp_index, .has_value = true},
+        },
+      },
+    };
+    Storage temp_64 = storage_register_for_descriptor(temp_index, &descriptor_s64);
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {lea, {temp_64, scaled}}});
+    move_to_result_from_temp(allocator, builder, source_range, result_value, temp);
+    return true;
+  } else if (constant > 0 && u64_is_power_of_two(multiplier - 1)) {
+    shift = u64_log2(multiplier - 1);
+    combine = add;
+  } else if (constant > 0 && u64_is_power_of_two(multiplier + 1)) {
+    shift = u64_log2(multiplier + 1);
+    combine = sub;
+  } else if (byte_size == 1) {
+    // There is no 8-bit `imul` with an immediate, but the low byte
+    // of a 32-bit multiplication is exactly the same
+    Register temp_index = register_acquire_temp(builder);
+    Storage temp_32 = storage_register_for_descriptor(temp_index, &descriptor_s32);
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {movsx, {temp_32, x->storage}}});
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {imul, {
+      temp_32, temp_32, imm32(allocator, s64_to_s32(constant))
+    }}});
+    Value *temp = value_register_for_descriptor(context, temp_index, x->descriptor);
+    move_to_result_from_temp(allocator, builder, source_range, result_value, temp);
+    return true;
+  } else if (byte_size == 2 && s64_fits_into_s16(constant)) {
+    Value *temp = value_register_for_descriptor(context, register_acquire_temp(builder), x->descriptor);
+    Storage immediate = imm16(allocator, s64_to_s16(constant));
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {imul, {temp->storage, x->storage, immediate}}});
+    move_to_result_from_temp(allocator, builder, source_range, result_value, temp);
+    return true;
+  } else if (byte_size >= 4 && s64_fits_into_s32(constant)) {
+    Value *temp = value_register_for_descriptor(context, register_acquire_temp(builder), x->descriptor);
+    Storage immediate = imm32(allocator, s64_to_s32(constant));
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {imul, {temp->storage, x->storage, immediate}}});
+    move_to_result_from_temp(allocator, builder, source_range, result_value, temp);
+    return true;
+  } else {
+    return false;
+  }
+  if (shift >= byte_size * 8) return false;
+
+  Value *temp = value_register_for_descriptor(context, register_acquire_temp(builder), x->descriptor);
+  move_value(allocator, builder, source_range, &temp->storage, &x->storage);
+  if (shift) {
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {shl, {temp->storage, imm8(allocator, shift)}}});
+  }
+  if (combine) {
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {combine, {temp->storage, x->storage}}});
+  }
+  move_to_result_from_temp(allocator, builder, source_range, result_value, temp);
+  return true;
+}
+
 void
 multiply(
   Execution_Context *context,
@@ -949,6 +2175,16 @@ multiply(
 
   maybe_constant_fold(context, source_range, result_value, x, y, *);
 
+  // :StrengthReduction
+  // Multiplication is commutative so the constant can always be on the right
+  if (x->storage.tag == Storage_Tag_Static) {
+    value_swap(Value *, x, y);
+  }
+  if (y->storage.tag == Storage_Tag_Static) {
+    s64 constant = storage_immediate_value_up_to_s64(&y->storage);
+    if (multiply_by_constant(context, source_range, result_value, x, constant)) return;
+  }
+
   // TODO deal with signed / unsigned
   // TODO support double the size of the result?
   Value *y_temp = reserve_stack(allocator, builder, y->descriptor);
@@ -974,6 +2210,208 @@ typedef enum {
   Divide_Operation_Remainder,
 } Divide_Operation;
 
+typedef struct {
+  s64 multiplier;
+  u8 shift;
+} Signed_Division_Magic;
+
+// :StrengthReduction
+// Computes the multiplier and the shift that replace a signed division by
+// a constant with a multiplication, as described in Hacker's Delight (10-4).
+Signed_Division_Magic
+signed_division_magic(
+  s64 divisor,
+  u8 bit_size
+) {
+  assert(divisor >= 2);
+  assert(bit_size == 32 || bit_size == 64);
+  u64 mask = bit_size == 64 ? UINT64_MAX : ((1llu << bit_size) - 1);
+  u64 two_to_n_minus_one = 1llu << (bit_size - 1);
+  u64 absolute_divisor = s64_to_u64(divisor);
+  u64 absolute_nc = two_to_n_minus_one - 1 - two_to_n_minus_one % absolute_divisor;
+  u8 p = bit_size - 1;
+  u64 q1 = two_to_n_minus_one / absolute_nc;
+  u64 r1 = two_to_n_minus_one - q1 * absolute_nc;
+  u64 q2 = two_to_n_minus_one / absolute_divisor;
+  u64 r2 = two_to_n_minus_one - q2 * absolute_divisor;
+  u64 delta;
+  do {
+    p += 1;
+    q1 = (2 * q1) & mask;
+    r1 = (2 * r1) & mask;
+    if (r1 >= absolute_nc) {
+      q1 = (q1 + 1) & mask;
+      r1 = (r1 - absolute_nc) & mask;
+    }
+    q2 = (2 * q2) & mask;
+    r2 = (2 * r2) & mask;
+    if (r2 >= absolute_divisor) {
+      q2 = (q2 + 1) & mask;
+      r2 = (r2 - absolute_divisor) & mask;
+    }
+    delta = absolute_divisor - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  u64 multiplier = (q2 + 1) & mask;
+  return (Signed_Division_Magic) {
+    .multiplier = bit_size == 64 ? (s64)multiplier : (s64)(s32)(u32)multiplier,
+    .shift = p - bit_size,
+  };
+}
+
+// :StrengthReduction
+// Signed division by a positive constant is done with shifts for powers of two
+// and with a multiplication by a magic number otherwise. The results exactly match
+// what `idiv` would produce, which means that the quotient is rounded towards zero
+// and the remainder has the sign of the dividend. Zero and negative divisors as well
+// as unsigned operands go through the generic `idiv` path.
+static bool
+divide_or_remainder_by_constant(
+  Execution_Context *context,
+  Divide_Operation operation,
+  const Source_Range *source_range,
+  Value *result_value,
+  Value *a,
+  Descriptor *descriptor,
+  s64 divisor
+) {
+  Allocator *allocator = context->allocator;
+  Function_Builder *builder = context->builder;
+  Array_Instruction *instructions = &builder->code_block.instructions;
+  if (!storage_is_register_or_memory(&a->storage)) return false;
+  if (!descriptor_is_signed_integer(a->descriptor)) return false;
+  if (!descriptor_is_signed_integer(descriptor)) return false;
+  if (divisor <= 0) return false;
+
+  u8 bit_size = u64_to_u8(descriptor_byte_size(descriptor) * 8);
+  if (bit_size < 64 && divisor >= (1ll << (bit_size - 1))) return false;
+
+  if (divisor == 1) {
+    Value *temp = value_register_for_descriptor(context, register_acquire_temp(builder), descriptor);
+    if (operation == Divide_Operation_Divide) {
+      move_value(allocator, builder, source_range, &temp->storage, &a->storage);
+    } else {
+      Storage zero = imm8(allocator, 0);
+      move_value(allocator, builder, source_range, &temp->storage, &zero);
+    }
+    move_to_result_from_temp(allocator, builder, source_range, result_value, temp);
+    return true;
+  }
+
+  if (u64_is_power_of_two(s64_to_u64(divisor))) {
+    u8 shift = u64_log2(s64_to_u64(divisor));
+    Value *temp = value_register_for_descriptor(context, register_acquire_temp(builder), descriptor);
+    Value *bias = value_register_for_descriptor(context, register_acquire_temp(builder), descriptor);
+    move_value(allocator, builder, source_range, &temp->storage, &a->storage);
+    move_value(allocator, builder, source_range, &bias->storage, &temp->storage);
+    // Negative dividends need a bias of (divisor - 1) to round towards zero
+    if (shift != 1) {
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {sar, {bias->storage, imm8(allocator, bit_size - 1)}}});
+    }
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {shr, {bias->storage, imm8(allocator, bit_size - shift)}}});
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {add, {bias->storage, temp->storage}}});
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {sar, {bias->storage, imm8(allocator, shift)}}});
+    if (operation == Divide_Operation_Divide) {
+      register_release(builder, temp->storage.Register.index);
+      move_to_result_from_temp(allocator, builder, source_range, result_value, bias);
+    } else {
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {shl, {bias->storage, imm8(allocator, shift)}}});
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {sub, {temp->storage, bias->storage}}});
+      register_release(builder, bias->storage.Register.index);
+      move_to_result_from_temp(allocator, builder, source_range, result_value, temp);
+    }
+    return true;
+  }
+
+  if (bit_size <= 32) {
+    // The full product of a 32-bit dividend and a 32-bit magic number fits
+    // into a 64-bit register so there is no need for `imul` with D:A result.
+    Signed_Division_Magic magic = signed_division_magic(divisor, 32);
+    Register dividend_index = register_acquire_temp(builder);
+    Register quotient_index = register_acquire_temp(builder);
+    Value *dividend = value_register_for_descriptor(context, dividend_index, &descriptor_s64);
+    Value *quotient = value_register_for_descriptor(context, quotient_index, &descriptor_s64);
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {movsx, {dividend->storage, a->storage}}});
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {imul, {
+      quotient->storage, dividend->storage, imm32(allocator, s64_to_s32(magic.multiplier))
+    }}});
+    if (magic.multiplier < 0) {
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {sar, {quotient->storage, imm8(allocator, 32)}}});
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {add, {quotient->storage, dividend->storage}}});
+      if (magic.shift) {
+        push_instruction(instructions, *source_range, (Instruction) {.assembly = {sar, {quotient->storage, imm8(allocator, magic.shift)}}});
+      }
+    } else {
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {sar, {quotient->storage, imm8(allocator, 32 + magic.shift)}}});
+    }
+    // Add one to negative quotients to round towards zero
+    Register sign_index =
+      operation == Divide_Operation_Divide ? dividend_index : register_acquire_temp(builder);
+    Value *sign = value_register_for_descriptor(context, sign_index, &descriptor_s64);
+    move_value(allocator, builder, source_range, &sign->storage, &quotient->storage);
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {shr, {sign->storage, imm8(allocator, 63)}}});
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {add, {quotient->storage, sign->storage}}});
+    if (operation == Divide_Operation_Divide) {
+      register_release(builder, dividend_index);
+      Value *sized_quotient = value_register_for_descriptor(context, quotient_index, descriptor);
+      move_to_result_from_temp(allocator, builder, source_range, result_value, sized_quotient);
+    } else {
+      register_release(builder, sign_index);
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {imul, {
+        quotient->storage, quotient->storage, imm32(allocator, s64_to_s32(divisor))
+      }}});
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {sub, {dividend->storage, quotient->storage}}});
+      register_release(builder, quotient_index);
+      Value *sized_remainder = value_register_for_descriptor(context, dividend_index, descriptor);
+      move_to_result_from_temp(allocator, builder, source_range, result_value, sized_remainder);
+    }
+    return true;
+  }
+
+  // 64-bit dividends need the high half of a 128-bit product which on X64
+  // is only available through the one operand `imul` that uses D:A registers
+  assert(bit_size == 64);
+  Signed_Division_Magic magic = signed_division_magic(divisor, 64);
+  Maybe_Saved_Register maybe_saved_rdx = register_acquire_maybe_save_if_already_acquired(
+    allocator, builder, source_range, Register_D
+  );
+  Value *dividend = value_register_for_descriptor(context, register_acquire_temp(builder), &descriptor_s64);
+  Value *reg_a = value_register_for_descriptor(context, Register_A, &descriptor_s64);
+  Value *reg_d = value_register_for_descriptor(context, Register_D, &descriptor_s64);
+  move_value(allocator, builder, source_range, &dividend->storage, &a->storage);
+  Storage multiplier = imm64(allocator, magic.multiplier);
+  move_value(allocator, builder, source_range, &reg_a->storage, &multiplier);
+  push_instruction(instructions, *source_range, (Instruction) {.assembly = {imul, {dividend->storage}}});
+  if (magic.multiplier < 0) {
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {add, {reg_d->storage, dividend->storage}}});
+  }
+  if (magic.shift) {
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {sar, {reg_d->storage, imm8(allocator, magic.shift)}}});
+  }
+  // Add one to negative quotients to round towards zero
+  move_value(allocator, builder, source_range, &reg_a->storage, &reg_d->storage);
+  push_instruction(instructions, *source_range, (Instruction) {.assembly = {shr, {reg_a->storage, imm8(allocator, 63)}}});
+  push_instruction(instructions, *source_range, (Instruction) {.assembly = {add, {reg_d->storage, reg_a->storage}}});
+  if (operation == Divide_Operation_Divide) {
+    register_release(builder, dividend->storage.Register.index);
+    move_value(allocator, builder, source_range, &result_value->storage, &reg_d->storage);
+  } else {
+    if (s64_fits_into_s32(divisor)) {
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {imul, {
+        reg_d->storage, reg_d->storage, imm32(allocator, s64_to_s32(divisor))
+      }}});
+    } else {
+      Storage divisor_operand = imm64(allocator, divisor);
+      move_value(allocator, builder, source_range, &reg_a->storage, &divisor_operand);
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {imul, {reg_d->storage, reg_a->storage}}});
+    }
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {sub, {dividend->storage, reg_d->storage}}});
+    move_to_result_from_temp(allocator, builder, source_range, result_value, dividend);
+  }
+  register_release_maybe_restore(builder, &maybe_saved_rdx);
+  return true;
+}
+
 void
 divide_or_remainder(
   Execution_Context *context,
@@ -1000,16 +2438,24 @@ divide_or_remainder(
     }
   }
 
-  // Save RDX as it will be used for the remainder
-  Maybe_Saved_Register maybe_saved_rdx = register_acquire_maybe_save_if_already_acquired(
-    allocator, builder, source_range, Register_D
-  );
-
   Descriptor *larger_descriptor =
     descriptor_byte_size(a->descriptor) > descriptor_byte_size(b->descriptor)
     ? a->descriptor
     : b->descriptor;
 
+  // :StrengthReduction
+  if (b->storage.tag == Storage_Tag_Static) {
+    s64 divisor = storage_immediate_value_up_to_s64(&b->storage);
+    if (divide_or_remainder_by_constant(
+      context, operation, source_range, result_value, a, larger_descriptor, divisor
+    )) return;
+  }
+
+  // Save RDX as it will be used for the remainder
+  Maybe_Saved_Register maybe_saved_rdx = register_acquire_maybe_save_if_already_acquired(
+    allocator, builder, source_range, Register_D
+  );
+
   // TODO deal with signed / unsigned
   Value *divisor = reserve_stack(allocator, builder, larger_descriptor);
   move_value(allocator, builder, source_range, &divisor->storage, &b->storage);
@@ -1082,6 +2528,208 @@ value_remainder(
   divide_or_remainder(context, Divide_Operation_Remainder, source_range, result_value, a, b);
 }
 
+// :VectorTypes
+static u64
+vector_lane_byte_size(
+  Descriptor *descriptor
+) {
+  assert(descriptor_is_vector(descriptor));
+  if (descriptor == &descriptor_s8x16 || descriptor == &descriptor_u8x16) return 1;
+  if (descriptor == &descriptor_s16x8 || descriptor == &descriptor_u16x8) return 2;
+  if (
+    descriptor == &descriptor_s32x4 ||
+    descriptor == &descriptor_u32x4 ||
+    descriptor == &descriptor_f32x4
+  ) {
+    return 4;
+  }
+  return 8;
+}
+
+static const X64_Mnemonic *
+vector_operation_mnemonic(
+  Vector_Operation operation,
+  Descriptor *descriptor
+) {
+  bool is_f32 = descriptor == &descriptor_f32x4;
+  bool is_f64 = descriptor == &descriptor_f64x2;
+  u64 lane_byte_size = vector_lane_byte_size(descriptor);
+  switch(operation) {
+    case Vector_Operation_Add: {
+      if (is_f32) return addps;
+      if (is_f64) return addpd;
+      switch(lane_byte_size) {
+        case 1: return paddb;
+        case 2: return paddw;
+        case 4: return paddd;
+        case 8: return paddq;
+      }
+      break;
+    }
+    case Vector_Operation_Subtract: {
+      if (is_f32) return subps;
+      if (is_f64) return subpd;
+      switch(lane_byte_size) {
+        case 1: return psubb;
+        case 2: return psubw;
+        case 4: return psubd;
+        case 8: return psubq;
+      }
+      break;
+    }
+    case Vector_Operation_Multiply: {
+      if (is_f32) return mulps;
+      if (is_f64) return mulpd;
+      // There are no packed multiplications for 8 and 64 bit lanes before AVX-512
+      switch(lane_byte_size) {
+        case 2: return pmullw;
+        case 4: return pmulld;
+      }
+      break;
+    }
+    case Vector_Operation_Divide: {
+      if (is_f32) return divps;
+      if (is_f64) return divpd;
+      break;
+    }
+    // Bitwise operations do not care about the lane type
+    case Vector_Operation_And: return pand;
+    case Vector_Operation_Or: return por;
+    case Vector_Operation_Xor: return pxor;
+    case Vector_Operation_Equal: {
+      if (is_f32) return cmpps;
+      if (is_f64) return cmppd;
+      switch(lane_byte_size) {
+        case 1: return pcmpeqb;
+        case 2: return pcmpeqw;
+        case 4: return pcmpeqd;
+        case 8: return pcmpeqq;
+      }
+      break;
+    }
+  }
+  return 0;
+}
+
+bool
+vector_operation_is_supported(
+  Vector_Operation operation,
+  Descriptor *descriptor
+) {
+  return descriptor_is_vector(descriptor) && !!vector_operation_mnemonic(operation, descriptor);
+}
+
+Descriptor *
+vector_operation_result_descriptor(
+  Vector_Operation operation,
+  Descriptor *descriptor
+) {
+  // Comparisons produce a mask with all bits of a lane set, which is only
+  // meaningful as an integer even when the operands are floats
+  if (operation == Vector_Operation_Equal) {
+    if (descriptor == &descriptor_f32x4) return &descriptor_s32x4;
+    if (descriptor == &descriptor_f64x2) return &descriptor_s64x2;
+  }
+  return descriptor;
+}
+
+// Operands are always loaded into temporary registers with unaligned moves first
+// because legacy SSE arithmetic faults on memory operands that are not 16-byte aligned.
+void
+vector_operation(
+  Execution_Context *context,
+  Vector_Operation operation,
+  const Source_Range *source_range,
+  Value *result_value,
+  Value *a,
+  Value *b
+) {
+  assert(descriptor_is_vector(a->descriptor));
+  assert(same_type(a->descriptor, b->descriptor));
+  const X64_Mnemonic *mnemonic = vector_operation_mnemonic(operation, a->descriptor);
+  assert(mnemonic);
+
+  Function_Builder *builder = context->builder;
+  Value *temp_a = value_register_for_descriptor(context, register_acquire_temp_xmm(builder), a->descriptor);
+  Value *temp_b = value_register_for_descriptor(context, register_acquire_temp_xmm(builder), b->descriptor);
+  move_value(context->allocator, context->builder, source_range, &temp_a->storage, &a->storage);
+  move_value(context->allocator, context->builder, source_range, &temp_b->storage, &b->storage);
+
+  // `cmpps` and `cmppd` take the predicate as an immediate where 0 is EQ_OQ
+  Storage predicate = {0};
+  if (mnemonic == cmpps || mnemonic == cmppd) {
+    predicate = imm8(context->allocator, 0);
+  }
+  push_instruction(
+    &context->builder->code_block.instructions,
+    *source_range,
+    (Instruction) {.assembly = {mnemonic, {temp_a->storage, temp_b->storage, predicate}}}
+  );
+
+  register_release(builder, temp_b->storage.Register.index);
+
+  Descriptor *result_descriptor = vector_operation_result_descriptor(operation, a->descriptor);
+  Value *temp_result = value_register_for_descriptor(
+    context, temp_a->storage.Register.index, result_descriptor
+  );
+  MASS_ON_ERROR(assign(context, source_range, result_value, temp_result)) return;
+  // The register stays acquired if the result now lives in it
+  if (!storage_equal(&result_value->storage, &temp_result->storage)) {
+    register_release(builder, temp_result->storage.Register.index);
+  }
+}
+
+bool
+vector_shuffle_is_supported(
+  Descriptor *descriptor
+) {
+  return descriptor_is_vector(descriptor) && vector_lane_byte_size(descriptor) >= 4;
+}
+
+// Lane selectors use two bits per each destination lane for 32-bit lanes
+// and a single bit per each destination lane for 64-bit lanes.
+void
+vector_shuffle(
+  Execution_Context *context,
+  const Source_Range *source_range,
+  Value *result_value,
+  Value *a,
+  u8 lane_selectors
+) {
+  assert(vector_shuffle_is_supported(a->descriptor));
+
+  Value *temp = value_register_for_descriptor(
+    context, register_acquire_temp_xmm(context->builder), a->descriptor
+  );
+  move_value(context->allocator, context->builder, source_range, &temp->storage, &a->storage);
+
+  const X64_Mnemonic *mnemonic = pshufd;
+  u8 immediate = lane_selectors;
+  if (a->descriptor == &descriptor_f32x4) {
+    // Using the same register as both sources turns `shufps` into a full permutation
+    mnemonic = shufps;
+  } else if (a->descriptor == &descriptor_f64x2) {
+    mnemonic = shufpd;
+    immediate = lane_selectors & 0b11;
+  } else if (vector_lane_byte_size(a->descriptor) == 8) {
+    // Expand 64-bit lane selectors into pairs of 32-bit ones for `pshufd`
+    immediate = 0;
+    for (u8 lane = 0; lane < 2; ++lane) {
+      u8 source_lane = (lane_selectors >> lane) & 1;
+      immediate |= (u8)(((source_lane * 2) | ((source_lane * 2 + 1) << 2)) << (lane * 4));
+    }
+  }
+  push_instruction(
+    &context->builder->code_block.instructions,
+    *source_range,
+    (Instruction) {.assembly = {mnemonic, {temp->storage, temp->storage, imm8(context->allocator, immediate)}}}
+  );
+  MASS_ON_ERROR(assign(context, source_range, result_value, temp)) return;
+  // The register stays acquired if the result now lives in it
+  if (!storage_equal(&result_value->storage, &temp->storage)) {
+    register_release(context->builder, temp->storage.Register.index);
+  }
+}
 
 void
 compare(
@@ -1203,52 +2851,69 @@ typedef struct {
 } Saved_Register;
 typedef dyn_array_type(Saved_Register) Array_Saved_Register;
 
-void
-ensure_compiled_function_body(
-  Execution_Context *context,
-  Value *fn_value
+static void
+function_body_scope_define_return(
+  Allocator *allocator,
+  Scope *body_scope,
+  Descriptor_Function *function,
+  Value *return_value,
+  Label_Index return_label
 ) {
-  // If the value already has the operand we assume it is compiled
-  if (fn_value->storage.tag != Storage_Tag_None) return;
-
-  assert(fn_value->descriptor->tag == Descriptor_Tag_Function);
-  Descriptor_Function *function = &fn_value->descriptor->Function;
+  scope_define(body_scope, MASS_RETURN_VALUE_NAME, (Scope_Entry) {
+    .tag = Scope_Entry_Tag_Value,
+    .Value.value = return_value,
+  });
 
-  // No need to compile macro body as it will be compiled inline
-  if (function->flags & Descriptor_Function_Flags_Macro) return;
-  assert(function->body);
+  Value *return_label_value = allocator_allocate(allocator, Value);
+  *return_label_value = (Value) {
+    .descriptor = &descriptor_void,
+    .storage = code_label32(return_label),
+  };
+  scope_define(body_scope, MASS_RETURN_LABEL_NAME, (Scope_Entry) {
+    .tag = Scope_Entry_Tag_Value,
+    .Value.value = return_label_value,
+  });
 
-  if (function->flags & Descriptor_Function_Flags_External) {
-    assert(function->body->tag == Token_Tag_Value);
-    Value *body_value = function->body->Value.value;
-    assert(body_value->descriptor == &descriptor_external_symbol);
-    assert(body_value->storage.tag == Storage_Tag_Static);
-    External_Symbol *symbol = body_value->storage.Static.memory;
-    fn_value->storage = import_symbol(context, symbol->library_name, symbol->symbol_name);
-    return;
+  // Return value can be named in which case it should be accessible in the fn body
+  if (function->returns.name.length) {
+    scope_define(body_scope, function->returns.name, (Scope_Entry) {
+      .tag = Scope_Entry_Tag_Value,
+      .Value.value = return_value,
+    });
   }
+}
 
-  Program *program = context->program;
-  // FIXME @Speed switch this to a hash map lookup
-  // If we already built the function for the target program just set the operand
-  for (u64 i = 0; i < dyn_array_length(program->functions); ++i) {
-    Function_Builder *builder = dyn_array_get(program->functions, i);
-    if (builder->function == function) {
-      fn_value->storage = code_label32(builder->label_index);
-      return;
-    }
-  }
+// :PrivateCallingConvention
+// Splits a value returned in RAX:RDX into the parts held by each of the registers
+static void
+register_pair_parts(
+  const Storage *memory,
+  Storage *low,
+  Storage *high
+) {
+  assert(memory->tag == Storage_Tag_Memory);
+  assert(memory->Memory.location.tag == Memory_Location_Tag_Indirect);
+  *low = *memory;
+  low->byte_size = 8;
+  *high = *memory;
+  high->byte_size = memory->byte_size - 8;
+  high->Memory.location.Indirect.offset += 8;
+}
 
-  // TODO better name (coming from the function)
-  Slice fn_name = fn_value->descriptor->name.length
-    ? fn_value->descriptor->name
-    : slice_literal("anonymous_function");
-  Label_Index fn_label = make_label(program, &program->memory.sections.code, fn_name);
-  fn_value->storage = code_label32(fn_label);
+static void
+function_compile_body(
+  Execution_Context *context,
+  Descriptor *fn_descriptor,
+  Label_Index fn_label,
+  Calling_Convention convention
+) {
+  Program *program = context->program;
+  Descriptor_Function *function = &fn_descriptor->Function;
 
   Function_Builder builder = (Function_Builder){
     .function = function,
     .label_index = fn_label,
+    .calling_convention = convention,
     .code_block = {
       // FIXME use fn_value->descriptor->name
       .end_label = make_label(program, &program->memory.sections.code, slice_literal("fn end")),
@@ -1265,14 +2930,15 @@ ensure_compiled_function_body(
     switch(argument->tag) {
       case Function_Argument_Tag_Any_Of_Type: {
         Value *arg_value = function_argument_value_at_index(
-          context, function, index, Function_Argument_Mode_Body
+          context, function, convention, index, Function_Argument_Mode_Body
         );
         Slice name = argument->Any_Of_Type.name;
         scope_define(body_scope, name, (Scope_Entry) {
           .tag = Scope_Entry_Tag_Value,
           .Value.value = arg_value,
         });
-        if (arg_value->storage.tag == Storage_Tag_Register) {
+        // :BlockMove Float arguments need to survive the XMM temporaries of block moves
+        if (arg_value->storage.tag == Storage_Tag_Register || arg_value->storage.tag == Storage_Tag_Xmm) {
           register_bitset_set(
             &builder.code_block.register_occupied_bitset,
             arg_value->storage.Register.index
@@ -1288,29 +2954,29 @@ ensure_compiled_function_body(
   }
 
   Value *return_value = allocator_allocate(context->allocator, Value);
-  *return_value = function_return_value_for_descriptor(
-    function->returns.descriptor, Function_Argument_Mode_Body
-  );
-
-  scope_define(body_scope, MASS_RETURN_VALUE_NAME, (Scope_Entry) {
-    .tag = Scope_Entry_Tag_Value,
-    .Value.value = return_value,
-  });
+  Label_Index return_label = builder.code_block.end_label;
+  bool returns_in_register_pair =
+    calling_convention_returns_in_register_pair(convention, function->returns.descriptor);
+  if (returns_in_register_pair) {
+    // :PrivateCallingConvention
+    // The body writes the result into a local that is loaded into RAX:RDX on the way out
+    *return_value = *reserve_stack(context->allocator, &builder, function->returns.descriptor);
+    return_label = make_label(program, &program->memory.sections.code, slice_literal("fn return"));
+  } else {
+    *return_value = function_return_value_for_descriptor(
+      function->returns.descriptor, Function_Argument_Mode_Body
+    );
+  }
 
-  Value *return_label_value = allocator_allocate(context->allocator, Value);
-  *return_label_value = (Value) {
-    .descriptor = &descriptor_void,
-    .storage = code_label32(builder.code_block.end_label),
-  };
-  scope_define(body_scope, MASS_RETURN_LABEL_NAME, (Scope_Entry) {
-    .tag = Scope_Entry_Tag_Value,
-    .Value.value = return_label_value,
-  });
+  function_body_scope_define_return(
+    context->allocator, body_scope, function, return_value, return_label
+  );
 
   // :ReturnTypeLargerThanRegister
   // Make sure we don't stomp the address of a larger-than-register
   // return value during the execution of the function
   if (
+    !returns_in_register_pair &&
     return_value->storage.tag == Storage_Tag_Memory &&
     return_value->storage.Memory.location.tag == Memory_Location_Tag_Indirect
   ) {
@@ -1320,32 +2986,303 @@ ensure_compiled_function_body(
     );
   }
 
-  // Return value can be named in which case it should be accessible in the fn body
-  if (function->returns.name.length) {
-    scope_define(body_scope, function->returns.name, (Scope_Entry) {
-      .tag = Scope_Entry_Tag_Value,
-      .Value.value = return_value,
-    });
-  }
+  // :TailCall
+  // The last statement of the body is in a tail position when it is just a call
+  body_context.tail_call_args_token =
+    token_view_last_statement_call_args(function->body->Group.children);
 
   // TODO Should this set compilation_mode?
   body_context.scope = body_scope;
   body_context.builder = &builder;
   token_parse_block_no_scope(&body_context, function->body, return_value);
 
+  if (returns_in_register_pair) {
+    Source_Range source_range = function->body->source_range;
+    Storage low, high;
+    register_pair_parts(&return_value->storage, &low, &high);
+    push_instruction(&builder.code_block.instructions, source_range, (Instruction) {
+      .type = Instruction_Type_Label,
+      .label = return_label,
+    });
+    push_instruction(&builder.code_block.instructions, source_range, (Instruction) {
+      .assembly = {mov, {storage_register_for_descriptor(Register_A, &descriptor_s64), low}}
+    });
+    Storage reg_d = {.tag = Storage_Tag_Register, .byte_size = high.byte_size, .Register.index = Register_D};
+    push_instruction(&builder.code_block.instructions, source_range, (Instruction) {
+      .assembly = {mov, {reg_d, high}}
+    });
+  }
+
   fn_end(program, &builder);
 
   // Only push the builder at the end to avoid problems in nested JIT compiles
   dyn_array_push(program->functions, builder);
 }
 
+void
+ensure_compiled_function_body(
+  Execution_Context *context,
+  Value *fn_value
+) {
+  // If the value already has the operand we assume it is compiled
+  if (fn_value->storage.tag != Storage_Tag_None) return;
+
+  assert(fn_value->descriptor->tag == Descriptor_Tag_Function);
+  Descriptor_Function *function = &fn_value->descriptor->Function;
+
+  // No need to compile macro body as it will be compiled inline
+  if (function->flags & Descriptor_Function_Flags_Macro) return;
+  assert(function->body);
+
+  if (function->flags & Descriptor_Function_Flags_External) {
+    assert(function->body->tag == Token_Tag_Value);
+    Value *body_value = function->body->Value.value;
+    assert(body_value->descriptor == &descriptor_external_symbol);
+    assert(body_value->storage.tag == Storage_Tag_Static);
+    External_Symbol *symbol = body_value->storage.Static.memory;
+    fn_value->storage = import_symbol(context, symbol->library_name, symbol->symbol_name);
+    return;
+  }
+
+  Program *program = context->program;
+  // FIXME @Speed switch this to a hash map lookup
+  // If we already built the function for the target program just set the operand
+  for (u64 i = 0; i < dyn_array_length(program->functions); ++i) {
+    Function_Builder *builder = dyn_array_get(program->functions, i);
+    if (builder->function == function && builder->calling_convention == Calling_Convention_Win64) {
+      fn_value->storage = code_label32(builder->label_index);
+      return;
+    }
+  }
+
+  // TODO better name (coming from the function)
+  Slice fn_name = fn_value->descriptor->name.length
+    ? fn_value->descriptor->name
+    : slice_literal("anonymous_function");
+  Label_Index fn_label = make_label(program, &program->memory.sections.code, fn_name);
+  fn_value->storage = code_label32(fn_label);
+
+  function_compile_body(context, fn_value->descriptor, fn_label, Calling_Convention_Win64);
+}
+
+// :PrivateCallingConvention
+// Direct calls get their own copy of the function body that uses the private
+// convention. Anything that can be observed from outside of Mass code, i.e.
+// exports, the entry point or a function whose address is taken, still goes
+// through `ensure_compiled_function_body` and gets the Win64 one.
+static Label_Index
+ensure_compiled_private_function_body(
+  Execution_Context *context,
+  Descriptor *fn_descriptor
+) {
+  Program *program = context->program;
+  Descriptor_Function *function = &fn_descriptor->Function;
+  // FIXME @Speed switch this to a hash map lookup
+  for (u64 i = 0; i < dyn_array_length(program->private_function_labels); ++i) {
+    Private_Function_Label *entry = dyn_array_get(program->private_function_labels, i);
+    if (entry->function == function) return entry->label_index;
+  }
+
+  Slice fn_name = fn_descriptor->name.length
+    ? fn_descriptor->name
+    : slice_literal("anonymous_function");
+  Label_Index fn_label = make_label(program, &program->memory.sections.code, fn_name);
+  dyn_array_push(program->private_function_labels, (Private_Function_Label) {
+    .function = function,
+    .label_index = fn_label,
+  });
+
+  function_compile_body(context, fn_descriptor, fn_label, Calling_Convention_Private);
+  return fn_label;
+}
+
+// :Inlining
+// Functions with small bodies, or the ones explicitly marked as `inline`,
+// are not called but instead have their body parsed directly into the
+// caller's code block. Unlike macros, the arguments are copied so the
+// callee can not observe or modify caller's values.
+#define INLINE_MAX_BODY_TOKEN_COUNT 16
+#define INLINE_MAX_DEPTH 4
+
+static u64
+token_view_count_tokens_up_to(
+  Token_View view,
+  u64 limit
+) {
+  u64 count = 0;
+  for (u64 i = 0; i < view.length && count <= limit; ++i) {
+    const Token *token = view.tokens[i];
+    count += 1;
+    if (token->tag == Token_Tag_Group) {
+      count += token_view_count_tokens_up_to(token->Group.children, limit - count);
+    }
+  }
+  return count;
+}
+
+static bool
+function_should_be_inlined(
+  Execution_Context *context,
+  Descriptor_Function *function
+) {
+  if (function->flags & Descriptor_Function_Flags_External) return false;
+  if (function->flags & Descriptor_Function_Flags_Compile_Time) return false;
+  if (!function->body || function->body->tag != Token_Tag_Group) return false;
+  // Avoid unbounded expansion for recursive and mutually recursive functions
+  if (context->builder->function == function) return false;
+  if (context->inline_depth >= INLINE_MAX_DEPTH) return false;
+  // :ColdCode Keeping rarely called functions out of line is the whole point
+  if (function->flags & Descriptor_Function_Flags_Cold) return false;
+  if (function->flags & Descriptor_Function_Flags_Inline) return true;
+  u64 token_count = token_view_count_tokens_up_to(
+    function->body->Group.children, INLINE_MAX_BODY_TOKEN_COUNT
+  );
+  return token_count <= INLINE_MAX_BODY_TOKEN_COUNT;
+}
+
+static void
+call_function_overload_inline(
+  Execution_Context *context,
+  const Source_Range *source_range,
+  Descriptor_Function *function,
+  Array_Value_Ptr arguments,
+  Value *result_value
+) {
+  Function_Builder *builder = context->builder;
+  Program *program = context->program;
+  Scope *body_scope = scope_make(context->allocator, function->scope);
+
+  for (u64 i = 0; i < dyn_array_length(function->arguments); ++i) {
+    Function_Argument *argument = dyn_array_get(function->arguments, i);
+    switch(argument->tag) {
+      case Function_Argument_Tag_Exact: {
+        // There is no name so nothing to do
+        break;
+      }
+      case Function_Argument_Tag_Any_Of_Type: {
+        Value *arg_value = reserve_stack(
+          context->allocator, builder, argument->Any_Of_Type.descriptor
+        );
+        arg_value->epoch = context->epoch;
+        if (i >= dyn_array_length(arguments)) {
+          Token_View default_expression = argument->Any_Of_Type.maybe_default_expression;
+          assert(default_expression.length);
+          Execution_Context arg_context = *context;
+          arg_context.scope = body_scope;
+          token_parse_expression(
+            &arg_context, default_expression, arg_value, Expression_Parse_Mode_Default
+          );
+        } else {
+          MASS_ON_ERROR(assign(context, source_range, arg_value, *dyn_array_get(arguments, i))) return;
+        }
+        MASS_ON_ERROR(*context->result) return;
+        scope_define(body_scope, argument->Any_Of_Type.name, (Scope_Entry) {
+          .tag = Scope_Entry_Tag_Value,
+          .Value.value = arg_value,
+        });
+        break;
+      }
+    }
+  }
+
+  // Same as for a real call the result goes through a temporary so that
+  // the body can not observe a partially written `result_value`
+  Descriptor *return_descriptor = function->returns.descriptor;
+  Value *return_value;
+  if (descriptor_byte_size(return_descriptor)) {
+    return_value = reserve_stack(context->allocator, builder, return_descriptor);
+    return_value->epoch = context->epoch;
+  } else {
+    return_value = allocator_allocate(context->allocator, Value);
+    *return_value = function_return_value_for_descriptor(
+      return_descriptor, Function_Argument_Mode_Body
+    );
+  }
+
+  Label_Index return_label_index =
+    make_label(program, &program->memory.sections.code, MASS_RETURN_LABEL_NAME);
+  function_body_scope_define_return(
+    context->allocator, body_scope, function, return_value, return_label_index
+  );
+
+  {
+    Execution_Context body_context = *context;
+    body_context.scope = body_scope;
+    body_context.inline_depth++;
+    token_parse_block_no_scope(&body_context, function->body, return_value);
+  }
+  MASS_ON_ERROR(*context->result) return;
+
+  push_instruction(
+    &builder->code_block.instructions, *source_range,
+    (Instruction) {.type = Instruction_Type_Label, .label = return_label_index}
+  );
+
+  MASS_ON_ERROR(assign(context, source_range, result_value, return_value)) return;
+}
+
+// :TailCall
+// When the result of a call is directly returned from the current function
+// the call can be replaced by tearing down the frame and jumping to the callee
+// which then returns straight to our caller. The callee gets the home area
+// our caller has reserved for us so only register arguments are supported.
+static bool
+call_can_be_tail_call(
+  const Function_Builder *builder,
+  const Storage *call_target,
+  const Descriptor_Function *descriptor,
+  Calling_Convention convention
+) {
+  Descriptor *return_descriptor = builder->function->returns.descriptor;
+  if (!same_type(descriptor->returns.descriptor, return_descriptor)) return false;
+  // :ReturnTypeLargerThanRegister
+  if (descriptor_byte_size(return_descriptor) > 8) return false;
+  // :PrivateCallingConvention
+  // There is no home area for a Win64 callee if we were called with the private convention
+  if (convention == Calling_Convention_Win64) {
+    if (builder->calling_convention != Calling_Convention_Win64) return false;
+    if (dyn_array_length(descriptor->arguments) > 4) return false;
+  }
+  for (u64 i = 0; i < dyn_array_length(descriptor->arguments); ++i) {
+    Function_Argument *argument = dyn_array_get(descriptor->arguments, i);
+    Descriptor *arg_descriptor = argument->tag == Function_Argument_Tag_Exact
+      ? argument->Exact.descriptor
+      : argument->Any_Of_Type.descriptor;
+    // Large arguments are passed as a pointer to a copy in our frame
+    if (descriptor_byte_size(arg_descriptor) > 8) return false;
+  }
+  // Registers and stack are restored by the epilogue before the jump
+  return storage_is_label(call_target) || call_target->tag == Storage_Tag_Static;
+}
+
+// :ClobberSets
+// Callees are compiled on demand before the call to them is emitted, so unless
+// there is recursion involved the set of registers they modify is already known.
+static u64
+call_target_clobbered_registers(
+  const Program *program,
+  const Storage *call_target
+) {
+  if (storage_is_label(call_target)) {
+    Label_Index label_index = call_target->Memory.location.Instruction_Pointer_Relative.label_index;
+    for (u64 i = 0; i < dyn_array_length(program->functions); ++i) {
+      const Function_Builder *callee = dyn_array_get(program->functions, i);
+      if (callee->label_index.value != label_index.value) continue;
+      if (callee->frozen) return callee->register_clobber_bitset;
+      break;
+    }
+  }
+  return LIVENESS_VOLATILE_REGISTERS;
+}
+
 void
 call_function_overload(
   Execution_Context *context,
   const Source_Range *source_range,
   Value *to_call,
   Array_Value_Ptr arguments,
-  Value *result_value
+  Value *result_value,
+  bool is_tail_call_position
 ) {
   Function_Builder *builder = context->builder;
   Array_Instruction *instructions = &builder->code_block.instructions;
@@ -1353,11 +3290,61 @@ call_function_overload(
   assert(to_call_descriptor->tag == Descriptor_Tag_Function);
   Descriptor_Function *descriptor = &to_call_descriptor->Function;
 
-  ensure_compiled_function_body(context, to_call);
+  // Calls through a pointer have to stay calls as the target is not known statically
+  if (
+    to_call->descriptor->tag == Descriptor_Tag_Function &&
+    function_should_be_inlined(context, descriptor)
+  ) {
+    call_function_overload_inline(context, source_range, descriptor, arguments, result_value);
+    return;
+  }
+
+  // :PrivateCallingConvention
+  Calling_Convention convention = Calling_Convention_Win64;
+  Storage call_target;
+  if (
+    to_call->descriptor->tag == Descriptor_Tag_Function &&
+    (to_call->storage.tag == Storage_Tag_None || storage_is_label(&to_call->storage)) &&
+    function_can_use_private_calling_convention(descriptor)
+  ) {
+    convention = Calling_Convention_Private;
+    call_target = code_label32(ensure_compiled_private_function_body(context, to_call_descriptor));
+  } else {
+    ensure_compiled_function_body(context, to_call);
+    call_target = to_call->storage;
+  }
+
+  bool is_tail_call = is_tail_call_position &&
+    call_can_be_tail_call(builder, &call_target, descriptor, convention);
+
+  // :ClobberSets
+  // Registers that are set up for the call are overwritten by us even if the callee does not touch them
+  u64 clobbered_registers = call_target_clobbered_registers(context->program, &call_target);
+  u64 overwritten_registers = clobbered_registers;
+  if (calling_convention_has_return_pointer(convention, descriptor->returns.descriptor)) {
+    register_bitset_set(&overwritten_registers, Register_C);
+  }
+  for (u64 i = 0; i < dyn_array_length(descriptor->arguments); ++i) {
+    Value *target_arg = function_argument_value_at_index(
+      context, descriptor, convention, i, Function_Argument_Mode_Call
+    );
+    if (target_arg->storage.tag == Storage_Tag_Register || target_arg->storage.tag == Storage_Tag_Xmm) {
+      register_bitset_set(&overwritten_registers, target_arg->storage.Register.index);
+    }
+  }
+
+  // :ColdCode
+  // Setting up the call to a `cold` function is just as unlikely to run as the call itself
+  bool is_cold_call =
+    (descriptor->flags & Descriptor_Function_Flags_Cold) &&
+    !(builder->function->flags & Descriptor_Function_Flags_Cold);
+  if (is_cold_call) fn_push_cold_label(context, source_range);
 
   Array_Saved_Register saved_array = dyn_array_make(Array_Saved_Register);
 
-  for (Register reg_index = 0; reg_index <= Register_R15; ++reg_index) {
+  // Nothing in the current function runs after a tail call so there is nothing to preserve
+  for (Register reg_index = 0; reg_index <= Register_R15 && !is_tail_call; ++reg_index) {
+    if (!register_bitset_get(overwritten_registers, reg_index)) continue;
     if (register_bitset_get(builder->code_block.register_volatile_bitset, reg_index)) {
       if (register_bitset_get(builder->code_block.register_occupied_bitset, reg_index)) {
         Value to_save = {
@@ -1377,10 +3364,11 @@ call_function_overload(
   }
 
   Scope *default_arguments_scope = scope_make(context->allocator, descriptor->scope);
+  u64 argument_register_bitset = 0;
   for (u64 i = 0; i < dyn_array_length(descriptor->arguments); ++i) {
     Function_Argument *target_arg_definition = dyn_array_get(descriptor->arguments, i);
     Value *target_arg = function_argument_value_at_index(
-      context, descriptor, i, Function_Argument_Mode_Call
+      context, descriptor, convention, i, Function_Argument_Mode_Call
     );
     Value *source_arg;
     if (i >= dyn_array_length(arguments)) {
@@ -1413,6 +3401,16 @@ call_function_overload(
       assign(context, source_range, stack_value, source_arg);
       load_address(context, source_range, target_arg, stack_value);
     }
+    // :BlockMove Arguments that are already in place must not be used as
+    // temporaries while moving the remaining ones
+    Storage *target_storage = &target_arg->storage;
+    if (target_storage->tag == Storage_Tag_Register || target_storage->tag == Storage_Tag_Xmm) {
+      Register reg_index = target_storage->Register.index;
+      if (!register_bitset_get(builder->code_block.register_occupied_bitset, reg_index)) {
+        register_acquire(builder, reg_index);
+        register_bitset_set(&argument_register_bitset, reg_index);
+      }
+    }
     Slice name;
     switch(target_arg_definition->tag) {
       case Function_Argument_Tag_Any_Of_Type: {
@@ -1432,10 +3430,18 @@ call_function_overload(
       });
     }
   }
+  for (Register reg_index = 0; reg_index <= Register_Xmm15; ++reg_index) {
+    if (register_bitset_get(argument_register_bitset, reg_index)) {
+      register_release(builder, reg_index);
+    }
+  }
 
   // If we call a function, then we need to reserve space for the home
   // area of at least 4 arguments?
-  u64 parameters_stack_size = u64_max(4, dyn_array_length(arguments)) * 8;
+  // :PrivateCallingConvention All of the arguments are in registers and there is no home area
+  u64 parameters_stack_size = convention == Calling_Convention_Win64
+    ? u64_max(4, dyn_array_length(arguments)) * 8
+    : 0;
 
   Value fn_return_value = function_return_value_for_descriptor(
     descriptor->returns.descriptor, Function_Argument_Mode_Call
@@ -1443,7 +3449,7 @@ call_function_overload(
 
   // :ReturnTypeLargerThanRegister
   u64 return_size = descriptor_byte_size(descriptor->returns.descriptor);
-  if (return_size > 8) {
+  if (calling_convention_has_return_pointer(convention, descriptor->returns.descriptor)) {
     Storage result_operand;
     // If we want the result at a memory location can just pass that address to the callee
     if (result_value->storage.tag == Storage_Tag_Memory) {
@@ -1464,17 +3470,45 @@ call_function_overload(
     parameters_stack_size
   ));
 
-  if (to_call->storage.tag == Storage_Tag_Static) {
+  if (is_tail_call) {
+    Storage target = call_target;
+    if (target.tag == Storage_Tag_Static) {
+      target = storage_register_for_descriptor(Register_A, to_call_descriptor);
+      push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {target, call_target}}});
+    }
+    push_instruction(instructions, *source_range, (Instruction) {
+      .type = Instruction_Type_Tail_Call,
+      .assembly = {jmp, {target}},
+    });
+    dyn_array_destroy(saved_array);
+    // Any code using the result is unreachable, but the result still needs a type
+    MASS_ON_ERROR(assign(context, source_range, result_value, &fn_return_value));
+    return;
+  }
+
+  if (call_target.tag == Storage_Tag_Static) {
     // TODO it will not be safe to use this register with other calling conventions
     Storage reg = storage_register_for_descriptor(Register_A, to_call_descriptor);
-    push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {reg, to_call->storage}}});
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {reg, call_target}}});
     push_instruction(instructions, *source_range, (Instruction) {.assembly = {call, {reg}}});
   } else {
-    push_instruction(instructions, *source_range, (Instruction) {.assembly = {call, {to_call->storage, 0, 0}}});
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {
+      call, {call_target, 0, 0},
+      .call_preserved_bitset = LIVENESS_VOLATILE_REGISTERS & ~clobbered_registers,
+    }});
   }
 
   Value *saved_result = &fn_return_value;
-  if (return_size <= 8) {
+  if (calling_convention_returns_in_register_pair(convention, descriptor->returns.descriptor)) {
+    saved_result = reserve_stack(context->allocator, builder, descriptor->returns.descriptor);
+    Storage low, high;
+    register_pair_parts(&saved_result->storage, &low, &high);
+    Storage reg_d = {.tag = Storage_Tag_Register, .byte_size = high.byte_size, .Register.index = Register_D};
+    push_instruction(instructions, *source_range, (Instruction) {
+      .assembly = {mov, {low, storage_register_for_descriptor(Register_A, &descriptor_s64)}}
+    });
+    push_instruction(instructions, *source_range, (Instruction) {.assembly = {mov, {high, reg_d}}});
+  } else if (return_size <= 8) {
     if (return_size != 0) {
       // FIXME Should not be necessary with correct register allocation
       saved_result = reserve_stack(context->allocator, builder, descriptor->returns.descriptor);
@@ -1597,6 +3631,12 @@ make_and(
     .type = Instruction_Type_Label,
     .label = label,
   });
+  // :ColdCode Both have to be true so either one being rare is enough
+  if (a->branch_hint == Branch_Hint_Unlikely || b->branch_hint == Branch_Hint_Unlikely) {
+    result->branch_hint = Branch_Hint_Unlikely;
+  } else if (a->branch_hint == Branch_Hint_Likely && b->branch_hint == Branch_Hint_Likely) {
+    result->branch_hint = Branch_Hint_Likely;
+  }
   return result;
 }
 
@@ -1619,7 +3659,11 @@ make_or(
   };
 
   compare(context, Compare_Type_Equal, source_range, result, a, &zero);
+  // :ColdCode `b` is only evaluated when `a` is false
+  if (a->branch_hint == Branch_Hint_Likely) result->branch_hint = Branch_Hint_Unlikely;
+  if (a->branch_hint == Branch_Hint_Unlikely) result->branch_hint = Branch_Hint_Likely;
   Label_Index else_label = make_if(context, instructions, source_range, result);
+  result->branch_hint = Branch_Hint_None;
   {
     compare(context, Compare_Type_Not_Equal, source_range, result, b, &zero);
     push_instruction(instructions, *source_range, (Instruction) {.assembly = {jmp, {code_label32(label)}}});
@@ -1635,6 +3679,12 @@ make_or(
     .type = Instruction_Type_Label,
     .label = label,
   });
+  // :ColdCode Either one being true is enough so both have to be rare
+  if (a->branch_hint == Branch_Hint_Likely || b->branch_hint == Branch_Hint_Likely) {
+    result->branch_hint = Branch_Hint_Likely;
+  } else if (a->branch_hint == Branch_Hint_Unlikely && b->branch_hint == Branch_Hint_Unlikely) {
+    result->branch_hint = Branch_Hint_Unlikely;
+  }
   return result;
 }
 
@@ -73,6 +73,39 @@ fn_encode(
   Function_Layout *out_layout
 );
 
+s64
+fn_fold_identical_code(
+  Program *program,
+  Virtual_Memory_Buffer *buffer,
+  const Function_Builder *builder,
+  const Function_Layout *layout,
+  u64 encode_start_offset,
+  u64 first_patch_index,
+  Array_Encoded_Function_Body *bodies
+);
+
+Array_u64
+program_function_layout_order(
+  const Program *program,
+  u64 first_function_index
+);
+
+Program_Reachability
+program_reachability_compute(
+  const Program *program
+);
+
+void
+program_reachability_destroy(
+  Program_Reachability *reachability
+);
+
+void
+program_strip_report_add_function(
+  Program *program,
+  const Function_Builder *builder
+);
+
 void
 plus(
   Execution_Context *context,
@@ -118,6 +151,53 @@ value_remainder(
   Value *b
 );
 
+typedef enum {
+  Vector_Operation_Add,
+  Vector_Operation_Subtract,
+  Vector_Operation_Multiply,
+  Vector_Operation_Divide,
+  Vector_Operation_And,
+  Vector_Operation_Or,
+  Vector_Operation_Xor,
+  Vector_Operation_Equal,
+} Vector_Operation;
+
+bool
+vector_operation_is_supported(
+  Vector_Operation operation,
+  Descriptor *descriptor
+);
+
+Descriptor *
+vector_operation_result_descriptor(
+  Vector_Operation operation,
+  Descriptor *descriptor
+);
+
+void
+vector_operation(
+  Execution_Context *context,
+  Vector_Operation operation,
+  const Source_Range *source_range,
+  Value *result_value,
+  Value *a,
+  Value *b
+);
+
+bool
+vector_shuffle_is_supported(
+  Descriptor *descriptor
+);
+
+void
+vector_shuffle(
+  Execution_Context *context,
+  const Source_Range *source_range,
+  Value *result_value,
+  Value *a,
+  u8 lane_selectors
+);
+
 void
 compare(
   Execution_Context *context,
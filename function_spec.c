@@ -3,6 +3,7 @@
 #include "value.c"
 #include "instruction.c"
 #include "encoding.c"
+#include "optimization.c"
 #include "function.c"
 #include "source.c"
 
@@ -176,6 +177,113 @@ spec("function") {
         &(Instruction){.assembly = {mov, memory->storage, temp_reg->storage}}
       ));
     }
+    it("should copy medium sized blocks with unrolled 16-byte moves") {
+      Storage target = stack(0, 40);
+      Storage source = stack(64, 40);
+      move_value(temp_allocator, builder, &test_range, &target, &source);
+      check(dyn_array_length(builder->code_block.instructions) == 6);
+      s64 expected_offsets[] = {0, 16, 24};
+      for (u64 i = 0; i < countof(expected_offsets); ++i) {
+        Instruction *load = dyn_array_get(builder->code_block.instructions, i * 2);
+        Instruction *store = dyn_array_get(builder->code_block.instructions, i * 2 + 1);
+        check(load->assembly.mnemonic == movups);
+        check(store->assembly.mnemonic == movups);
+        check(load->assembly.operands[0].tag == Storage_Tag_Xmm);
+        check(load->assembly.operands[1].Memory.location.Indirect.offset == 64 + expected_offsets[i]);
+        check(store->assembly.operands[0].Memory.location.Indirect.offset == expected_offsets[i]);
+      }
+    }
+    it("should copy blocks smaller than 16 bytes in register sized chunks") {
+      Storage target = stack(0, 12);
+      Storage source = stack(16, 12);
+      move_value(temp_allocator, builder, &test_range, &target, &source);
+      check(dyn_array_length(builder->code_block.instructions) == 4);
+      Instruction *last = dyn_array_get(builder->code_block.instructions, 3);
+      check(last->assembly.mnemonic == mov);
+      check(last->assembly.operands[0].byte_size == 4);
+      check(last->assembly.operands[0].Memory.location.Indirect.offset == 8);
+    }
+    it("should use `rep movsb` for copies above the unrolled size") {
+      Storage target = stack(0, 1024);
+      Storage source = stack(1024, 1024);
+      move_value(temp_allocator, builder, &test_range, &target, &source);
+      u64 rep_count = 0;
+      for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+        Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+        check(instruction->assembly.mnemonic != movups);
+        if (instruction->assembly.mnemonic == rep_movsb) rep_count++;
+      }
+      check(rep_count == 1);
+    }
+    it("should zero blocks with `pxor` and 16-byte stores") {
+      Storage target = stack(0, 48);
+      Storage zero = {
+        .tag = Storage_Tag_Static,
+        .byte_size = 48,
+        .Static.memory = allocator_allocate_bytes(temp_allocator, 48, 16),
+      };
+      memset(zero.Static.memory, 0, 48);
+      move_value(temp_allocator, builder, &test_range, &target, &zero);
+      check(dyn_array_length(builder->code_block.instructions) == 4);
+      Instruction *clear = dyn_array_get(builder->code_block.instructions, 0);
+      check(clear->assembly.mnemonic == pxor);
+      check(storage_equal(&clear->assembly.operands[0], &clear->assembly.operands[1]));
+      for (u64 i = 1; i < 4; ++i) {
+        Instruction *store = dyn_array_get(builder->code_block.instructions, i);
+        check(store->assembly.mnemonic == movups);
+        check(storage_equal(&store->assembly.operands[1], &clear->assembly.operands[0]));
+      }
+    }
+    it("should use `rep stosb` for zeroing above the unrolled size") {
+      Storage target = stack(0, 1024);
+      Storage zero = {
+        .tag = Storage_Tag_Static,
+        .byte_size = 1024,
+        .Static.memory = allocator_allocate_bytes(temp_allocator, 1024, 16),
+      };
+      memset(zero.Static.memory, 0, 1024);
+      move_value(temp_allocator, builder, &test_range, &target, &zero);
+      u64 rep_count = 0;
+      for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+        Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+        check(instruction->assembly.mnemonic != pxor);
+        if (instruction->assembly.mnemonic == rep_stosb) rep_count++;
+      }
+      check(rep_count == 1);
+    }
+    it("should read the target address before `rep stosb` overwrites the string registers") {
+      register_acquire(builder, Register_A);
+      Storage target = {
+        .tag = Storage_Tag_Memory,
+        .byte_size = 1024,
+        .Memory.location = {
+          .tag = Memory_Location_Tag_Indirect,
+          .Indirect = {.base_register = Register_A},
+        },
+      };
+      Storage zero = {
+        .tag = Storage_Tag_Static,
+        .byte_size = 1024,
+        .Static.memory = allocator_allocate_bytes(temp_allocator, 1024, 16),
+      };
+      memset(zero.Static.memory, 0, 1024);
+      move_value(temp_allocator, builder, &test_range, &target, &zero);
+      s64 address_index = -1;
+      s64 clear_index = -1;
+      for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+        Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+        if (instruction->assembly.mnemonic == lea) {
+          check(storage_equal(&instruction->assembly.operands[1], &target));
+          check(instruction->assembly.operands[0].Register.index != Register_A);
+          check(instruction->assembly.operands[0].Register.index != Register_DI);
+          address_index = u64_to_s64(i);
+        }
+        if (instruction->assembly.mnemonic == xor) clear_index = u64_to_s64(i);
+      }
+      check(address_index != -1);
+      check(address_index < clear_index);
+      register_release(builder, Register_A);
+    }
     it("should use appropriate setCC instruction when moving from eflags") {
       struct { Compare_Type compare_type; const X64_Mnemonic *mnemonic; } tests[] = {
         { Compare_Type_Equal, sete },
@@ -226,6 +334,1129 @@ spec("function") {
       }
     }
   }
+  describe("fn_encode") {
+    static Program *program = 0;
+    static Function_Layout layout = {0};
+    static Descriptor_Function void_function = {
+      .returns = {.descriptor = &descriptor_void},
+    };
+
+    before_each() {
+      program = allocator_allocate(temp_allocator, Program);
+      program_init(temp_allocator, program);
+      Section *code_section = &program->memory.sections.code;
+      builder->function = &void_function;
+      builder->label_index = make_label(program, code_section, slice_literal("fn"));
+      builder->code_block.end_label = make_label(program, code_section, slice_literal("fn_end"));
+      layout = (Function_Layout){0};
+    }
+
+    after_each() {
+      program_deinit(program);
+    }
+
+    it("should not allocate a stack frame for leaf functions without locals") {
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {eax, ecx}}
+      });
+      fn_end(program, builder);
+      check(builder->stack_reserve == 0);
+      fn_encode(program, &program->memory.sections.code.buffer, builder, &layout);
+      check(layout.size_of_prolog == 0);
+      s8 *code = program->memory.sections.code.buffer.memory;
+      check((u8)code[0] == 0x89);
+      check((u8)code[1] == 0xC8);
+      check((u8)code[2] == 0xC3);
+    }
+
+    it("should keep the stack aligned at call sites when pushing registers") {
+      register_acquire(builder, Register_B);
+      builder->max_call_parameters_stack_size = 32;
+      fn_end(program, builder);
+      // return address (8) + pushed RBX (8) + reserve must be a multiple of 16
+      check(builder->stack_reserve == 32);
+    }
+
+    it("should use rel8 jumps for labels that are close") {
+      Label_Index target = make_label(program, &program->memory.sections.code, slice_literal("target"));
+      Label_Index back = make_label(program, &program->memory.sections.code, slice_literal("back"));
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {jmp, {code_label32(target)}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .type = Instruction_Type_Label, .label = back
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {int3}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .type = Instruction_Type_Label, .label = target
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {jmp, {code_label32(back)}}
+      });
+      fn_end(program, builder);
+      fn_encode(program, &program->memory.sections.code.buffer, builder, &layout);
+
+      s8 *body = program->memory.sections.code.buffer.memory + layout.size_of_prolog;
+      check(dyn_array_get(builder->code_block.instructions, 0)->encoded_byte_size == 2);
+      check((u8)body[0] == 0xEB);
+      check(body[1] == 1);
+      check((u8)body[2] == 0xCC);
+      check((u8)body[3] == 0xEB);
+      check(body[4] == -3);
+    }
+
+    it("should not encode a jump to the instruction right after it") {
+      Label_Index skip = make_label(program, &program->memory.sections.code, slice_literal("skip"));
+      Label_Index after = make_label(program, &program->memory.sections.code, slice_literal("after"));
+      Instruction code[] = {
+        {.assembly = {jne, {code_label32(skip), storage_eflags(Compare_Type_Not_Equal)}}},
+        {.assembly = {int3}},
+        {.assembly = {jmp, {code_label32(after)}}},
+        {.type = Instruction_Type_Label, .label = skip},
+        {.type = Instruction_Type_Label, .label = after},
+        {.assembly = {int3}},
+      };
+      for (u64 i = 0; i < countof(code); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, code[i]);
+      }
+      fn_end(program, builder);
+      fn_encode(program, &program->memory.sections.code.buffer, builder, &layout);
+
+      s8 *body = program->memory.sections.code.buffer.memory + layout.size_of_prolog;
+      check((u8)body[0] == 0x75);
+      check(body[1] == 1);
+      check((u8)body[2] == 0xCC);
+      check((u8)body[3] == 0xCC);
+      check((u8)body[4] == 0xC3);
+    }
+
+    it("should use rel32 jumps for labels that do not fit into rel8") {
+      Label_Index target = make_label(program, &program->memory.sections.code, slice_literal("target"));
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {jne, {code_label32(target), storage_eflags(Compare_Type_Not_Equal)}}
+      });
+      for (u64 i = 0; i < 200; ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+          .assembly = {int3}
+        });
+      }
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .type = Instruction_Type_Label, .label = target
+      });
+      fn_end(program, builder);
+      fn_encode(program, &program->memory.sections.code.buffer, builder, &layout);
+
+      s8 *body = program->memory.sections.code.buffer.memory + layout.size_of_prolog;
+      check(dyn_array_get(builder->code_block.instructions, 0)->encoded_byte_size == 6);
+      check((u8)body[0] == 0x0F);
+      check((u8)body[1] == 0x85);
+      program_patch_labels(program);
+      check(*(s32 *)(body + 2) == 200);
+    }
+
+    it("should pad function entries and loop heads to the requested alignment with NOPs") {
+      program->function_alignment = 16;
+      program->loop_alignment = 16;
+      Label_Index loop = make_label(program, &program->memory.sections.code, slice_literal("loop"));
+      Instruction code[] = {
+        {.assembly = {int3}},
+        {.type = Instruction_Type_Label, .label = loop},
+        {.assembly = {int3}},
+        {.assembly = {jmp, {code_label32(loop)}}},
+      };
+      for (u64 i = 0; i < countof(code); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, code[i]);
+      }
+      fn_end(program, builder);
+      Virtual_Memory_Buffer *buffer = &program->memory.sections.code.buffer;
+      virtual_memory_buffer_append_u8(buffer, 0xCC);
+      fn_encode(program, buffer, builder, &layout);
+
+      check(layout.begin_rva % 16 == 0);
+      u8 *entry = (u8 *)buffer->memory + layout.begin_rva - program->memory.sections.code.base_rva;
+      check(entry - (u8 *)buffer->memory == 16);
+      check(((u8 *)buffer->memory)[1] == 0x66);
+      Label *loop_label = program_get_label(program, loop);
+      check(loop_label->offset_in_section == 32);
+      // 15 bytes of padding after the first `int3` are a 9 and a 6 byte NOP
+      check(entry[0] == 0xCC);
+      check(entry[1] == 0x66 && entry[2] == 0x0F && entry[3] == 0x1F && entry[4] == 0x84);
+      check(entry[10] == 0x66 && entry[11] == 0x0F && entry[12] == 0x1F && entry[13] == 0x44);
+      check(entry[16] == 0xCC);
+      check(entry[17] == 0xEB);
+      check((s8)entry[18] == -3);
+      check(layout.end_rva - layout.begin_rva == 20);
+    }
+
+    it("should fold functions with identical machine code and relocation targets") {
+      Section *code_section = &program->memory.sections.code;
+      Virtual_Memory_Buffer *buffer = &code_section->buffer;
+      Label_Index callees[] = {
+        make_label(program, code_section, slice_literal("a")),
+        make_label(program, code_section, slice_literal("b")),
+      };
+      // The second function has the same bytes as the first one, but calls a different function
+      u64 callee_indexes[] = {0, 1, 0};
+      s64 expected_folded_indexes[] = {-1, -1, 0};
+      Label_Index labels[countof(callee_indexes)];
+      u64 occupied_before_last = 0;
+      Array_Encoded_Function_Body bodies = dyn_array_make(Array_Encoded_Function_Body);
+      for (u64 i = 0; i < countof(callee_indexes); ++i) {
+        dyn_array_clear(builder->code_block.instructions);
+        *builder = (Function_Builder){
+          .code_block.instructions = builder->code_block.instructions,
+          .function = &void_function,
+        };
+        builder->label_index = labels[i] = make_label(program, code_section, slice_literal("fn"));
+        builder->code_block.end_label = make_label(program, code_section, slice_literal("fn_end"));
+        push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+          .assembly = {call, {code_label32(callees[callee_indexes[i]])}}
+        });
+        fn_end(program, builder);
+        occupied_before_last = buffer->occupied;
+        u64 first_patch_index = dyn_array_length(program->patch_info_array);
+        fn_encode(program, buffer, builder, &layout);
+        s64 folded_index = fn_fold_identical_code(
+          program, buffer, builder, &layout, occupied_before_last, first_patch_index, &bodies
+        );
+        check(folded_index == expected_folded_indexes[i]);
+      }
+      check(dyn_array_length(bodies) == 2);
+      check(buffer->occupied == occupied_before_last);
+      check(dyn_array_length(program->patch_info_array) == 2);
+      Label *first = program_get_label(program, labels[0]);
+      Label *last = program_get_label(program, labels[2]);
+      check(last->resolved);
+      check(last->offset_in_section == first->offset_in_section);
+      dyn_array_destroy(bodies);
+    }
+
+    it("should fold identical functions with aligned loops regardless of where they start") {
+      program->loop_alignment = 16;
+      Section *code_section = &program->memory.sections.code;
+      Virtual_Memory_Buffer *buffer = &code_section->buffer;
+      s64 folded_indexes[2];
+      u64 occupied_before_last = 0;
+      Array_Encoded_Function_Body bodies = dyn_array_make(Array_Encoded_Function_Body);
+      for (u64 i = 0; i < countof(folded_indexes); ++i) {
+        dyn_array_clear(builder->code_block.instructions);
+        *builder = (Function_Builder){
+          .code_block.instructions = builder->code_block.instructions,
+          .function = &void_function,
+        };
+        builder->label_index = make_label(program, code_section, slice_literal("fn"));
+        builder->code_block.end_label = make_label(program, code_section, slice_literal("fn_end"));
+        Label_Index loop = make_label(program, code_section, slice_literal("loop"));
+        Instruction code[] = {
+          {.assembly = {int3}},
+          {.type = Instruction_Type_Label, .label = loop},
+          {.assembly = {int3}},
+          {.assembly = {jmp, {code_label32(loop)}}},
+        };
+        for (u64 j = 0; j < countof(code); ++j) {
+          push_instruction(&builder->code_block.instructions, test_range, code[j]);
+        }
+        fn_end(program, builder);
+        // Something unaligned in between would shift the loop padding of the second copy
+        virtual_memory_buffer_append_u8(buffer, 0xCC);
+        occupied_before_last = buffer->occupied;
+        u64 first_patch_index = dyn_array_length(program->patch_info_array);
+        fn_encode(program, buffer, builder, &layout);
+        check(layout.begin_rva % 16 == 0);
+        folded_indexes[i] = fn_fold_identical_code(
+          program, buffer, builder, &layout, occupied_before_last, first_patch_index, &bodies
+        );
+      }
+      check(folded_indexes[0] == -1);
+      check(folded_indexes[1] == 0);
+      check(buffer->occupied == occupied_before_last);
+      dyn_array_destroy(bodies);
+    }
+
+    it("should only consider functions and data referenced from the entry point reachable") {
+      Section *code_section = &program->memory.sections.code;
+      Section *data_section = &program->memory.sections.rw_data;
+      Label_Index global = make_label(program, data_section, slice_literal("global"));
+      Descriptor descriptors[3] = {0};
+      Label_Index labels[countof(descriptors)];
+      for (u64 i = 0; i < countof(descriptors); ++i) {
+        descriptors[i] = (Descriptor){.tag = Descriptor_Tag_Function, .Function = void_function};
+        labels[i] = make_label(program, code_section, slice_literal("fn"));
+      }
+      // fn 0 (entry) -> fn 1 -> global, fn 2 is never called
+      Instruction instructions[] = {
+        {.assembly = {call, {code_label32(labels[1])}}},
+        {.assembly = {lea, {rax, code_label32(global)}}},
+        {.assembly = {call, {code_label32(labels[1])}}},
+      };
+      for (u64 i = 0; i < countof(descriptors); ++i) {
+        Function_Builder other = {
+          .function = &descriptors[i].Function,
+          .label_index = labels[i],
+          .code_block.instructions = dyn_array_make(Array_Instruction),
+        };
+        push_instruction(&other.code_block.instructions, test_range, instructions[i]);
+        dyn_array_push(program->functions, other);
+      }
+      program->entry_point = &(Value){.descriptor = &descriptors[0]};
+      Program_Reachability reachability = program_reachability_compute(program);
+      check(reachability.functions[0]);
+      check(reachability.functions[1]);
+      check(!reachability.functions[2]);
+      check(reachability.labels[global.value]);
+      program_reachability_destroy(&reachability);
+      for (u64 i = 0; i < dyn_array_length(program->functions); ++i) {
+        dyn_array_destroy(dyn_array_get(program->functions, i)->code_block.instructions);
+      }
+    }
+
+    it("should share constant pool memory between identical constants and string suffixes") {
+      Slice foobar = {.bytes = "foobar", .length = sizeof("foobar")};
+      Slice bar = {.bytes = "bar", .length = sizeof("bar")};
+      Label_Index first = program_constant_pool_add(program, foobar, 1);
+      Label_Index suffix = program_constant_pool_add(program, bar, 1);
+      Label_Index second = program_constant_pool_add(program, foobar, 1);
+      check(first.value == second.value);
+      check(first.value != suffix.value);
+      program_constant_pool_flush(program, 0);
+      Label *first_label = program_get_label(program, first);
+      Label *suffix_label = program_get_label(program, suffix);
+      check(first_label->resolved);
+      check(suffix_label->resolved);
+      check(suffix_label->offset_in_section == first_label->offset_in_section + 3);
+      check(program->memory.sections.ro_data.buffer.occupied == foobar.length);
+      check(memcmp(rip_value_pointer_from_label_index(program, suffix), "bar", bar.length) == 0);
+    }
+  }
+  describe("fn_eliminate_dead_code") {
+    static Program *program = 0;
+    static Label_Index target = {0};
+
+    before_each() {
+      program = allocator_allocate(temp_allocator, Program);
+      program_init(temp_allocator, program);
+      Section *code_section = &program->memory.sections.code;
+      builder->code_block.end_label = make_label(program, code_section, slice_literal("fn_end"));
+      target = make_label(program, code_section, slice_literal("target"));
+    }
+
+    after_each() {
+      program_deinit(program);
+    }
+
+    it("should split basic blocks at labels and after branches") {
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {jne, {code_label32(target), storage_eflags(Compare_Type_Not_Equal)}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {eax, ecx}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .type = Instruction_Type_Label, .label = target
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {edx, eax}}
+      });
+      Control_Flow_Graph graph = control_flow_graph_make(builder);
+      check(dyn_array_length(graph.blocks) == 3);
+      Basic_Block *entry = dyn_array_get(graph.blocks, 0);
+      check(entry->jump_target == 2);
+      check(entry->fallthrough == 1);
+      check(entry->exit == Basic_Block_Exit_None);
+      Basic_Block *last = dyn_array_get(graph.blocks, 2);
+      check(last->first_instruction_index == 2);
+      check(last->instruction_count == 2);
+      check(last->exit == Basic_Block_Exit_Return);
+
+      Liveness liveness = liveness_compute(builder, &graph, false);
+      check(register_bitset_get(liveness.register_live_in[1], Register_C));
+      check(!register_bitset_get(liveness.register_live_in[1], Register_A));
+      check(register_bitset_get(liveness.register_live_in[2], Register_A));
+      check(liveness.register_live_in[0] & (1llu << LIVENESS_EFLAGS_BIT));
+      liveness_destroy(&liveness, &graph);
+      control_flow_graph_destroy(&graph);
+    }
+
+    it("should remove instructions that can not be reached") {
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {jmp, {code_label32(target)}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {int3}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .type = Instruction_Type_Label, .label = target
+      });
+      check(fn_eliminate_dead_code(builder, true));
+      check(dyn_array_length(builder->code_block.instructions) == 2);
+      check(dyn_array_get(builder->code_block.instructions, 1)->type == Instruction_Type_Label);
+    }
+
+    it("should remove register writes that are overwritten before being read") {
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {eax, ecx}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {eax, edx}}
+      });
+      check(fn_eliminate_dead_code(builder, true));
+      check(dyn_array_length(builder->code_block.instructions) == 1);
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 0),
+        &(Instruction){.assembly = {mov, {eax, edx}}}
+      ));
+    }
+
+    it("should remove stack stores that are overwritten before being read") {
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {stack(-8, 4), ecx}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {stack(-8, 4), edx}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {eax, stack(-8, 4)}}
+      });
+      check(!fn_eliminate_dead_code(builder, false));
+      check(dyn_array_length(builder->code_block.instructions) == 3);
+      check(fn_eliminate_dead_code(builder, true));
+      check(dyn_array_length(builder->code_block.instructions) == 2);
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 0),
+        &(Instruction){.assembly = {mov, {stack(-8, 4), edx}}}
+      ));
+    }
+
+    it("should keep stack stores that a call might read") {
+      builder->max_call_parameters_stack_size = 8;
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {stack(0, 8), rcx}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {call, {rax}}
+      });
+      check(!fn_eliminate_dead_code(builder, true));
+      check(dyn_array_length(builder->code_block.instructions) == 2);
+    }
+
+    it("should remove stores to locals across a call when no stack address leaks") {
+      // The fifth argument goes after the 32 bytes of the home area
+      builder->max_call_parameters_stack_size = 40;
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {stack(-8, 8), rcx}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {stack(-16, 8), rdx}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {stack(32, 8), rdx}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {call, {rax}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {stack(-8, 8), rax}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {rax, stack(-8, 8)}}
+      });
+      check(fn_eliminate_dead_code(builder, true));
+      // The stores to locals before the call are dead, the stack argument is not
+      check(dyn_array_length(builder->code_block.instructions) == 4);
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 0),
+        &(Instruction){.assembly = {mov, {stack(32, 8), rdx}}}
+      ));
+    }
+  }
+  describe("fn_promote_stack_slots") {
+    static Program *program = 0;
+    static Label_Index loop = {0};
+
+    before_each() {
+      program = allocator_allocate(temp_allocator, Program);
+      program_init(temp_allocator, program);
+      Section *code_section = &program->memory.sections.code;
+      builder->code_block.end_label = make_label(program, code_section, slice_literal("fn_end"));
+      loop = make_label(program, code_section, slice_literal("loop"));
+    }
+
+    after_each() {
+      program_deinit(program);
+    }
+
+    it("should keep a loop counter in a register instead of the stack") {
+      builder->stack_reserve = 8;
+      Instruction counter_loop[] = {
+        {.assembly = {mov, {stack(-8, 8), imm32(temp_allocator, 0)}}},
+        {.type = Instruction_Type_Label, .label = loop},
+        {.assembly = {add, {stack(-8, 8), imm8(temp_allocator, 1)}}},
+        {.assembly = {cmp, {stack(-8, 8), imm32(temp_allocator, 10)}}},
+        {.assembly = {jl, {code_label32(loop), storage_eflags(Compare_Type_Signed_Less)}}},
+        {.assembly = {mov, {rax, stack(-8, 8)}}},
+      };
+      for (u64 i = 0; i < countof(counter_loop); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, counter_loop[i]);
+      }
+      check(fn_promote_stack_slots(builder));
+      check(builder->stack_reserve == 0);
+      Storage counter = dyn_array_get(builder->code_block.instructions, 2)->assembly.operands[0];
+      check(counter.tag == Storage_Tag_Register);
+      // RAX is only written once the loop is done so it can hold the counter before that
+      check(counter.Register.index == Register_A);
+      check(storage_equal(&dyn_array_get(builder->code_block.instructions, 3)->assembly.operands[0], &counter));
+      check(storage_equal(&dyn_array_get(builder->code_block.instructions, 5)->assembly.operands[1], &counter));
+    }
+
+    it("should share registers with temporaries that are dead while a local is live") {
+      builder->stack_reserve = 16;
+      Instruction counter_loop[] = {
+        {.assembly = {mov, {rax, rcx}}},
+        {.assembly = {add, {rax, rdx}}},
+        {.assembly = {mov, {r8, rax}}},
+        {.assembly = {add, {r8, r9}}},
+        {.assembly = {mov, {r10, r8}}},
+        {.assembly = {mov, {r11, r10}}},
+        {.assembly = {mov, {stack(-16, 8), r11}}},
+        {.assembly = {mov, {stack(-8, 8), imm32(temp_allocator, 0)}}},
+        {.type = Instruction_Type_Label, .label = loop},
+        {.assembly = {add, {stack(-8, 8), imm8(temp_allocator, 1)}}},
+        {.assembly = {cmp, {stack(-8, 8), imm32(temp_allocator, 10)}}},
+        {.assembly = {jl, {code_label32(loop), storage_eflags(Compare_Type_Signed_Less)}}},
+        {.assembly = {mov, {rax, stack(-16, 8)}}},
+        {.assembly = {add, {rax, stack(-8, 8)}}},
+      };
+      for (u64 i = 0; i < countof(counter_loop); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, counter_loop[i]);
+      }
+      check(fn_promote_stack_slots(builder));
+      check(builder->stack_reserve == 0);
+      // RCX is kept intact for the epilogue, RDX is free once it has been added
+      Storage counter = dyn_array_get(builder->code_block.instructions, 9)->assembly.operands[0];
+      check(storage_equal(&counter, &rdx));
+      check(storage_equal(&dyn_array_get(builder->code_block.instructions, 13)->assembly.operands[1], &rdx));
+      // The other local is live across the loop but not while RAX holds the temporaries
+      Storage saved = dyn_array_get(builder->code_block.instructions, 6)->assembly.operands[0];
+      check(storage_equal(&saved, &rax));
+      check(storage_equal(&dyn_array_get(builder->code_block.instructions, 12)->assembly.operands[1], &rax));
+      check(!register_bitset_get(builder->used_register_bitset, Register_B));
+      check(!register_bitset_get(builder->used_register_bitset, Register_R12));
+    }
+
+    it("should keep an s8 loop counter in a register without byte encoding ambiguity") {
+      builder->stack_reserve = 8;
+      // All of the registers with a byte encoding below SI are live across the loop
+      Instruction counter_loop[] = {
+        {.assembly = {mov, {rax, rcx}}},
+        {.assembly = {mov, {rdx, rbx}}},
+        {.assembly = {mov, {r8, r9}}},
+        {.assembly = {mov, {r10, r11}}},
+        {.assembly = {mov, {stack(-1, 1), imm8(temp_allocator, 1)}}},
+        {.type = Instruction_Type_Label, .label = loop},
+        {.assembly = {add, {stack(-1, 1), imm8(temp_allocator, 1)}}},
+        {.assembly = {cmp, {stack(-1, 1), imm8(temp_allocator, 100)}}},
+        {.assembly = {jl, {code_label32(loop), storage_eflags(Compare_Type_Signed_Less)}}},
+        {.assembly = {movsx, {rsi, stack(-1, 1)}}},
+        {.assembly = {add, {rax, rdx}}},
+        {.assembly = {add, {rax, rbx}}},
+        {.assembly = {add, {r8, r10}}},
+        {.assembly = {add, {r9, r11}}},
+        {.assembly = {add, {rax, r8}}},
+        {.assembly = {add, {rax, r9}}},
+        {.assembly = {add, {rax, rsi}}},
+      };
+      for (u64 i = 0; i < countof(counter_loop); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, counter_loop[i]);
+      }
+      check(fn_promote_stack_slots(builder));
+      check(builder->stack_reserve == 0);
+      Storage counter = dyn_array_get(builder->code_block.instructions, 6)->assembly.operands[0];
+      check(counter.tag == Storage_Tag_Register);
+      check(counter.byte_size == 1);
+      // SI and DI are free but would be encoded as DH and BH without a REX prefix
+      check(counter.Register.index == Register_R12);
+      check(storage_equal(&dyn_array_get(builder->code_block.instructions, 9)->assembly.operands[1], &counter));
+    }
+
+    it("should not promote a local whose address is taken") {
+      builder->stack_reserve = 16;
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {stack(-16, 8), imm32(temp_allocator, 42)}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {stack(-8, 8), imm32(temp_allocator, 0)}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {lea, {rcx, stack(-8, 8)}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {rax, stack(-16, 8)}}
+      });
+      check(fn_promote_stack_slots(builder));
+      check(builder->stack_reserve == 16);
+      check(dyn_array_get(builder->code_block.instructions, 0)->assembly.operands[0].tag == Storage_Tag_Register);
+      check(dyn_array_get(builder->code_block.instructions, 1)->assembly.operands[0].tag == Storage_Tag_Memory);
+    }
+  }
+  describe("fn_propagate_copies") {
+    static Program *program = 0;
+
+    before_each() {
+      program = allocator_allocate(temp_allocator, Program);
+      program_init(temp_allocator, program);
+      Section *code_section = &program->memory.sections.code;
+      builder->code_block.end_label = make_label(program, code_section, slice_literal("fn_end"));
+    }
+
+    after_each() {
+      program_deinit(program);
+    }
+
+    it("should read the source of a copy instead of the temporary") {
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {stack(0, 8), rcx}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {rdx, stack(0, 8)}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {add, {rax, rdx}}
+      });
+      check(fn_count_moves(builder) == 2);
+      check(fn_propagate_copies(builder, true));
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 2),
+        &(Instruction){.assembly = {add, {rax, rcx}}}
+      ));
+      // Neither the temporary register nor the stack slot are read anymore
+      check(fn_eliminate_dead_code(builder, true));
+      check(dyn_array_length(builder->code_block.instructions) == 1);
+      check(fn_count_moves(builder) == 0);
+    }
+
+    it("should not use a copy after its source has been changed") {
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {rcx, rax}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {add, {rax, imm8(temp_allocator, 1)}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {add, {rdx, rcx}}
+      });
+      check(!fn_propagate_copies(builder, true));
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 2),
+        &(Instruction){.assembly = {add, {rdx, rcx}}}
+      ));
+    }
+  }
+  describe("fn_number_values") {
+    static Program *program = 0;
+
+    before_each() {
+      program = allocator_allocate(temp_allocator, Program);
+      program_init(temp_allocator, program);
+      Section *code_section = &program->memory.sections.code;
+      builder->code_block.end_label = make_label(program, code_section, slice_literal("fn_end"));
+    }
+
+    after_each() {
+      program_deinit(program);
+    }
+
+    it("should copy the result of an identical computation from another register") {
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {imul, {rcx, rax, imm32(temp_allocator, 10)}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {imul, {rdx, rax, imm32(temp_allocator, 10)}}
+      });
+      check(fn_number_values(builder, true));
+      check(dyn_array_length(builder->code_block.instructions) == 2);
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 1),
+        &(Instruction){.assembly = {mov, {rdx, rcx}}}
+      ));
+    }
+
+    it("should remove a repeated address computation when the result is still in place") {
+      Storage field = {
+        .tag = Storage_Tag_Memory,
+        .byte_size = 8,
+        .Memory.location = {
+          .tag = Memory_Location_Tag_Indirect,
+          .Indirect = {.base_register = Register_A, .offset = 8},
+        },
+      };
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {lea, {rcx, field}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {rdx, rcx}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {lea, {rcx, field}}
+      });
+      check(fn_number_values(builder, true));
+      check(dyn_array_length(builder->code_block.instructions) == 2);
+    }
+
+    it("should not reuse a computation when one of the operands has changed") {
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {imul, {rcx, rax, imm32(temp_allocator, 10)}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {add, {rax, imm8(temp_allocator, 1)}}
+      });
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {imul, {rdx, rax, imm32(temp_allocator, 10)}}
+      });
+      check(!fn_number_values(builder, true));
+      check(dyn_array_length(builder->code_block.instructions) == 3);
+    }
+
+    it("should keep a copy that is overwritten after another copy has read it") {
+      Instruction copies[] = {
+        {.assembly = {mov, {rbx, rcx}}},
+        {.assembly = {mov, {rdx, rbx}}},
+        {.assembly = {mov, {rbx, imm32(temp_allocator, 2)}}},
+        {.assembly = {add, {rax, rdx}}},
+      };
+      for (u64 i = 0; i < countof(copies); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, copies[i]);
+      }
+      check(!fn_number_values(builder, true));
+      check(dyn_array_length(builder->code_block.instructions) == 4);
+    }
+
+    it("should use both the quotient and the remainder of a single idiv") {
+      Instruction division[] = {
+        {.assembly = {mov, {rax, rcx}}},
+        {.assembly = {cqo}},
+        {.assembly = {idiv, {r8}}},
+      };
+      for (u64 i = 0; i < countof(division); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, division[i]);
+      }
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {r9, rax}}
+      });
+      for (u64 i = 0; i < countof(division); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, division[i]);
+      }
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {mov, {r10, rdx}}
+      });
+      check(fn_number_values(builder, true));
+      check(dyn_array_length(builder->code_block.instructions) == 5);
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 4),
+        &(Instruction){.assembly = {mov, {r10, rdx}}}
+      ));
+    }
+  }
+  describe("fn_optimize_loops") {
+    static Program *program = 0;
+    static Label_Index loop = {0};
+    static Label_Index loop_exit = {0};
+
+    before_each() {
+      program = allocator_allocate(temp_allocator, Program);
+      program_init(temp_allocator, program);
+      Section *code_section = &program->memory.sections.code;
+      builder->code_block.end_label = make_label(program, code_section, slice_literal("fn_end"));
+      loop = make_label(program, code_section, slice_literal("loop"));
+      loop_exit = make_label(program, code_section, slice_literal("exit"));
+    }
+
+    after_each() {
+      program_deinit(program);
+    }
+
+    it("should move a computation that does not change between iterations in front of the loop") {
+      Instruction counter_loop[] = {
+        {.assembly = {mov, {rax, imm32(temp_allocator, 0)}}},
+        {.type = Instruction_Type_Label, .label = loop},
+        {.assembly = {cmp, {rax, imm32(temp_allocator, 10)}}},
+        {.assembly = {jge, {code_label32(loop_exit), storage_eflags(Compare_Type_Signed_Less)}}},
+        {.assembly = {mov, {r9, imm32(temp_allocator, 100)}}},
+        {.assembly = {add, {r8, r9}}},
+        {.assembly = {add, {rax, imm8(temp_allocator, 1)}}},
+        {.assembly = {jmp, {code_label32(loop)}}},
+        {.type = Instruction_Type_Label, .label = loop_exit},
+      };
+      for (u64 i = 0; i < countof(counter_loop); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, counter_loop[i]);
+      }
+      check(fn_optimize_loops(builder));
+      check(dyn_array_length(builder->code_block.instructions) == countof(counter_loop));
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 1),
+        &(Instruction){.assembly = {mov, {r9, imm32(temp_allocator, 100)}}}
+      ));
+      check(dyn_array_get(builder->code_block.instructions, 2)->label.value == loop.value);
+    }
+
+    it("should replace a scaled array index with a pointer advanced with the induction variable") {
+      Storage element = {
+        .tag = Storage_Tag_Memory,
+        .byte_size = 8,
+        .Memory.location = {
+          .tag = Memory_Location_Tag_Indirect,
+          .Indirect = {
+            .base_register = Register_R9,
+            .maybe_index_register = {.index = Register_C, .has_value = true},
+          },
+        },
+      };
+      Instruction array_loop[] = {
+        {.assembly = {mov, {rax, imm32(temp_allocator, 0)}}},
+        {.type = Instruction_Type_Label, .label = loop},
+        {.assembly = {cmp, {rax, imm32(temp_allocator, 10)}}},
+        {.assembly = {jge, {code_label32(loop_exit), storage_eflags(Compare_Type_Signed_Less)}}},
+        {.assembly = {imul, {rcx, rax, imm32(temp_allocator, 8)}}},
+        {.assembly = {add, {r8, element}}},
+        {.assembly = {add, {rax, imm8(temp_allocator, 1)}}},
+        {.assembly = {jmp, {code_label32(loop)}}},
+        {.type = Instruction_Type_Label, .label = loop_exit},
+      };
+      for (u64 i = 0; i < countof(array_loop); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, array_loop[i]);
+      }
+      check(fn_optimize_loops(builder));
+      // Two instructions to compute the initial pointer and one to advance it
+      check(dyn_array_length(builder->code_block.instructions) == countof(array_loop) + 3);
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 1),
+        &(Instruction){.assembly = {imul, {rdx, rax, imm32(temp_allocator, 8)}}}
+      ));
+      Storage pointer_element = element;
+      pointer_element.Memory.location.Indirect.base_register = Register_D;
+      pointer_element.Memory.location.Indirect.maybe_index_register = (Maybe_Register){0};
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 7),
+        &(Instruction){.assembly = {add, {r8, pointer_element}}}
+      ));
+      Storage next_element = pointer_element;
+      next_element.Memory.location.Indirect.offset = 8;
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 9),
+        &(Instruction){.assembly = {lea, {rdx, next_element}}}
+      ));
+    }
+  }
+  describe("fn_rotate_loops") {
+    static Program *program = 0;
+    static Label_Index loop = {0};
+    static Label_Index loop_exit = {0};
+
+    before_each() {
+      program = allocator_allocate(temp_allocator, Program);
+      program_init(temp_allocator, program);
+      Section *code_section = &program->memory.sections.code;
+      builder->code_block.end_label = make_label(program, code_section, slice_literal("fn_end"));
+      loop = make_label(program, code_section, slice_literal("loop"));
+      loop_exit = make_label(program, code_section, slice_literal("exit"));
+    }
+
+    after_each() {
+      program_deinit(program);
+    }
+
+    it("should move the condition of a loop to the bottom leaving a guard at the top") {
+      Storage less = storage_eflags(Compare_Type_Signed_Less);
+      Instruction counter_loop[] = {
+        {.type = Instruction_Type_Label, .label = loop},
+        {.assembly = {cmp, {rax, imm32(temp_allocator, 10)}}},
+        {.assembly = {jge, {code_label32(loop_exit), less}}},
+        {.assembly = {add, {rax, imm8(temp_allocator, 1)}}},
+        {.assembly = {jmp, {code_label32(loop)}}},
+        {.type = Instruction_Type_Label, .label = loop_exit},
+      };
+      for (u64 i = 0; i < countof(counter_loop); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, counter_loop[i]);
+      }
+      check(fn_rotate_loops(program, builder));
+      check(dyn_array_length(builder->code_block.instructions) == 8);
+      Instruction *body = dyn_array_get(builder->code_block.instructions, 3);
+      check(body->type == Instruction_Type_Label);
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 5),
+        &(Instruction){.assembly = {cmp, {rax, imm32(temp_allocator, 10)}}}
+      ));
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 6),
+        &(Instruction){.assembly = {jl, {code_label32(body->label), less}}}
+      ));
+      check(dyn_array_get(builder->code_block.instructions, 7)->label.value == loop_exit.value);
+    }
+
+    it("should not rotate a loop that exits before the jump back") {
+      Instruction counter_loop[] = {
+        {.type = Instruction_Type_Label, .label = loop_exit},
+        {.assembly = {ret}},
+        {.type = Instruction_Type_Label, .label = loop},
+        {.assembly = {cmp, {rax, imm32(temp_allocator, 10)}}},
+        {.assembly = {jge, {code_label32(loop_exit), storage_eflags(Compare_Type_Signed_Less)}}},
+        {.assembly = {jmp, {code_label32(loop)}}},
+      };
+      for (u64 i = 0; i < countof(counter_loop); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, counter_loop[i]);
+      }
+      check(!fn_rotate_loops(program, builder));
+      check(dyn_array_length(builder->code_block.instructions) == 6);
+    }
+  }
+  describe("fn_split_cold_code") {
+    static Program *program = 0;
+    static Label_Index cold = {0};
+    static Label_Index skip = {0};
+
+    before_each() {
+      program = allocator_allocate(temp_allocator, Program);
+      program_init(temp_allocator, program);
+      Section *code_section = &program->memory.sections.code;
+      builder->code_block.end_label = make_label(program, code_section, slice_literal("fn_end"));
+      cold = make_label(program, code_section, slice_literal("cold"));
+      skip = make_label(program, code_section, slice_literal("skip"));
+    }
+
+    after_each() {
+      program_deinit(program);
+    }
+
+    it("should move a cold block after the rest of the code and invert the branch to it") {
+      Storage greater = storage_eflags(Compare_Type_Signed_Greater);
+      Instruction code[] = {
+        {.assembly = {cmp, {rax, imm32(temp_allocator, 10)}}},
+        {.assembly = {jle, {code_label32(skip), greater}}},
+        {.type = Instruction_Type_Label, .label = cold},
+        {.assembly = {add, {rax, imm32(temp_allocator, 100)}}},
+        {.type = Instruction_Type_Label, .label = skip},
+        {.assembly = {add, {rax, imm8(temp_allocator, 1)}}},
+      };
+      for (u64 i = 0; i < countof(code); ++i) {
+        push_instruction(&builder->code_block.instructions, test_range, code[i]);
+      }
+      builder->cold_labels = dyn_array_make(Array_Label_Index, .allocator = temp_allocator);
+      dyn_array_push(builder->cold_labels, cold);
+
+      check(fn_split_cold_code(program, builder));
+      check(dyn_array_length(builder->code_block.instructions) == 7);
+      check(builder->hot_instruction_count == 4);
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 1),
+        &(Instruction){.assembly = {jg, {code_label32(cold), greater}}}
+      ));
+      check(dyn_array_get(builder->code_block.instructions, 2)->label.value == skip.value);
+      check(dyn_array_get(builder->code_block.instructions, 4)->label.value == cold.value);
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 6),
+        &(Instruction){.assembly = {jmp, {code_label32(skip)}}}
+      ));
+    }
+
+    it("should not change the code without cold labels") {
+      push_instruction(&builder->code_block.instructions, test_range, (Instruction) {
+        .assembly = {add, {rax, imm8(temp_allocator, 1)}}
+      });
+      check(!fn_split_cold_code(program, builder));
+      check(builder->hot_instruction_count == 1);
+    }
+  }
+  describe("make_and") {
+    static Program *program = 0;
+
+    before_each() {
+      program = allocator_allocate(temp_allocator, Program);
+      program_init(temp_allocator, program);
+      temp_context->program = program;
+    }
+
+    after_each() {
+      program_deinit(program);
+    }
+
+    it("should keep an `unlikely` hint with its operand instead of the next branch") {
+      Value *a = value_register_for_descriptor(temp_context, Register_A, &descriptor_s64);
+      a->branch_hint = Branch_Hint_Unlikely;
+      Value *b = value_register_for_descriptor(temp_context, Register_C, &descriptor_s64);
+      Value *result = make_and(temp_context, builder, &test_range, a, b);
+      // Evaluating `b` is rare and so is the whole condition
+      check(dyn_array_length(builder->cold_labels) == 1);
+      check(result->branch_hint == Branch_Hint_Unlikely);
+      make_if(temp_context, &builder->code_block.instructions, &test_range, result);
+      check(dyn_array_length(builder->cold_labels) == 2);
+
+      Value *unrelated = value_register_for_descriptor(temp_context, Register_D, &descriptor_s64);
+      make_if(temp_context, &builder->code_block.instructions, &test_range, unrelated);
+      check(dyn_array_length(builder->cold_labels) == 2);
+    }
+  }
+  describe("encode_instruction") {
+    static Program *program = 0;
+
+    before_each() {
+      program = allocator_allocate(temp_allocator, Program);
+      program_init(temp_allocator, program);
+    }
+
+    after_each() {
+      program_deinit(program);
+    }
+
+    it("should use REX.R for XMM8-15 and put the mandatory prefix before REX") {
+      Instruction instruction = {.assembly = {movsd, {xmm8_64, xmm1_64}}};
+      encode_instruction(program, &program->memory.sections.code.buffer, &instruction);
+      s8 *code = program->memory.sections.code.buffer.memory;
+      check(instruction.encoded_byte_size == 5);
+      check((u8)code[0] == 0xF2);
+      check((u8)code[1] == 0x44);
+      check((u8)code[2] == 0x0F);
+      check((u8)code[3] == 0x10);
+      check((u8)code[4] == 0xC1);
+    }
+
+    it("should encode the scale of the index register in the SIB byte") {
+      Storage element = {
+        .tag = Storage_Tag_Memory,
+        .byte_size = 8,
+        .Memory.location = {
+          .tag = Memory_Location_Tag_Indirect,
+          .Indirect = {
+            .base_register = Register_C,
+            .index_scale = Index_Scale_8,
+            .maybe_index_register = {.index = Register_D, .has_value = true},
+            .offset = 16,
+          },
+        },
+      };
+      Instruction instruction = {.assembly = {mov, {rax, element}}};
+      encode_instruction(program, &program->memory.sections.code.buffer, &instruction);
+      s8 *code = program->memory.sections.code.buffer.memory;
+      check(instruction.encoded_byte_size == 5);
+      check((u8)code[0] == 0x48);
+      check((u8)code[1] == 0x8B);
+      check((u8)code[2] == 0x44);
+      check((u8)code[3] == 0xD1);
+      check((u8)code[4] == 0x10);
+    }
+
+    it("should use REX.B for an extended base register in the SIB byte") {
+      Storage element = {
+        .tag = Storage_Tag_Memory,
+        .byte_size = 8,
+        .Memory.location = {
+          .tag = Memory_Location_Tag_Indirect,
+          .Indirect = {
+            .base_register = Register_R8,
+            .index_scale = Index_Scale_8,
+            .maybe_index_register = {.index = Register_R9, .has_value = true},
+          },
+        },
+      };
+      Instruction instruction = {.assembly = {mov, {rax, element}}};
+      encode_instruction(program, &program->memory.sections.code.buffer, &instruction);
+      s8 *code = program->memory.sections.code.buffer.memory;
+      check(instruction.encoded_byte_size == 4);
+      check((u8)code[0] == 0x4B);
+      check((u8)code[1] == 0x8B);
+      check((u8)code[2] == 0x04);
+      check((u8)code[3] == 0xC8);
+    }
+
+    it("should encode packed instructions with 128-bit operands") {
+      Instruction instruction = {.assembly = {paddd, {xmm0_128, xmm9_128}}};
+      encode_instruction(program, &program->memory.sections.code.buffer, &instruction);
+      s8 *code = program->memory.sections.code.buffer.memory;
+      check(instruction.encoded_byte_size == 5);
+      check((u8)code[0] == 0x66);
+      check((u8)code[1] == 0x41);
+      check((u8)code[2] == 0x0F);
+      check((u8)code[3] == 0xFE);
+      check((u8)code[4] == 0xC1);
+    }
+
+    it("should use a two-byte VEX prefix when REX.X and REX.B are not needed") {
+      Instruction instruction = {.assembly = {vpaddd, {xmm1_128, xmm2_128, xmm3_128}}};
+      encode_instruction(program, &program->memory.sections.code.buffer, &instruction);
+      s8 *code = program->memory.sections.code.buffer.memory;
+      check(instruction.encoded_byte_size == 4);
+      check((u8)code[0] == 0xC5);
+      check((u8)code[1] == 0xE9);
+      check((u8)code[2] == 0xFE);
+      check((u8)code[3] == 0xCB);
+    }
+
+    it("should encode VEX loads and stores with the register operand in ModRM.reg") {
+      Storage xmm_memory = {
+        .tag = Storage_Tag_Memory,
+        .byte_size = 16,
+        .Memory.location = {
+          .tag = Memory_Location_Tag_Indirect,
+          .Indirect = {.base_register = Register_A},
+        },
+      };
+      Storage ymm_memory = xmm_memory;
+      ymm_memory.byte_size = 32;
+      Storage ymm3 = xmm3_128;
+      ymm3.byte_size = 32;
+      struct { Instruction instruction; u8 expected[4]; } tests[] = {
+        {{.assembly = {vmovups, {xmm3_128, xmm_memory}}}, {0xC5, 0xF8, 0x10, 0x18}},
+        {{.assembly = {vmovups, {xmm_memory, xmm3_128}}}, {0xC5, 0xF8, 0x11, 0x18}},
+        {{.assembly = {vmovups, {ymm3, ymm_memory}}}, {0xC5, 0xFC, 0x10, 0x18}},
+        {{.assembly = {vmovups, {ymm_memory, ymm3}}}, {0xC5, 0xFC, 0x11, 0x18}},
+      };
+      Virtual_Memory_Buffer *buffer = &program->memory.sections.code.buffer;
+      for (u64 i = 0; i < countof(tests); ++i) {
+        buffer->occupied = 0;
+        encode_instruction(program, buffer, &tests[i].instruction);
+        check(tests[i].instruction.encoded_byte_size == 4);
+        check(memcmp(buffer->memory, tests[i].expected, 4) == 0);
+      }
+    }
+
+    it("should use a three-byte VEX prefix for an extended r/m register") {
+      Instruction instruction = {.assembly = {vpaddd, {xmm1_128, xmm2_128, xmm9_128}}};
+      encode_instruction(program, &program->memory.sections.code.buffer, &instruction);
+      s8 *code = program->memory.sections.code.buffer.memory;
+      check(instruction.encoded_byte_size == 5);
+      check((u8)code[0] == 0xC4);
+      check((u8)code[1] == 0xC1);
+      check((u8)code[2] == 0x69);
+      check((u8)code[3] == 0xFE);
+      check((u8)code[4] == 0xC9);
+    }
+  }
+
+  describe("vector_operation") {
+    it("should not clobber XMM registers that hold arguments") {
+      // :PrivateCallingConvention passes the 5th and 6th float arguments in XMM4 and XMM5
+      register_acquire(builder, Register_Xmm4);
+      register_acquire(builder, Register_Xmm5);
+      Value *a = &(Value){&descriptor_f32x4, stack(0, 16)};
+      Value *b = &(Value){&descriptor_f32x4, stack(16, 16)};
+      Value *result = &(Value){&descriptor_f32x4, stack(32, 16)};
+      vector_operation(temp_context, Vector_Operation_Add, &test_range, result, a, b);
+      check(dyn_array_length(builder->code_block.instructions) == 4);
+      for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+        Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+        for (u64 j = 0; j < countof(instruction->assembly.operands); ++j) {
+          Storage *operand = &instruction->assembly.operands[j];
+          if (operand->tag != Storage_Tag_Xmm) continue;
+          check(operand->Register.index != Register_Xmm4);
+          check(operand->Register.index != Register_Xmm5);
+        }
+      }
+      // Temporaries are released once the result is stored
+      u64 occupied = builder->code_block.register_occupied_bitset;
+      check(occupied == ((1llu << Register_Xmm4) | (1llu << Register_Xmm5)));
+    }
+  }
+
   describe("plus") {
     it("should fold s8 immediates and move them to the result value") {
       Value *reg_a = value_register_for_descriptor(temp_context, Register_A, &descriptor_s8);
@@ -375,4 +1606,65 @@ spec("function") {
       ));
     }
   }
+  describe("multiply") {
+    it("should use a shift for multiplication by a power of two") {
+      Value *reg_a = value_register_for_descriptor(temp_context, Register_A, &descriptor_s64);
+      Value *reg_b = value_register_for_descriptor(temp_context, Register_B, &descriptor_s64);
+      register_acquire(builder, Register_B);
+      multiply(temp_context, &test_range, reg_a, reg_b, value_from_s64(temp_context, 8));
+      Value *temp = value_register_for_descriptor(temp_context, Register_C, &descriptor_s64);
+      check(dyn_array_length(builder->code_block.instructions) == 3);
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 0),
+        &(Instruction){.assembly = {mov, temp->storage, reg_b->storage}}
+      ));
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 1),
+        &(Instruction){.assembly = {shl, temp->storage, imm8(temp_allocator, 3)}}
+      ));
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 2),
+        &(Instruction){.assembly = {mov, reg_a->storage, temp->storage}}
+      ));
+    }
+    it("should use three-operand imul with an immediate for other constants") {
+      Value *reg_a = value_register_for_descriptor(temp_context, Register_A, &descriptor_s32);
+      Value *m32 = &(Value){&descriptor_s32, stack(0, 4)};
+      multiply(temp_context, &test_range, reg_a, value_from_s32(temp_context, 10), m32);
+      Value *temp = value_register_for_descriptor(temp_context, Register_C, &descriptor_s32);
+      check(dyn_array_length(builder->code_block.instructions) == 2);
+      check(instruction_equal(
+        dyn_array_get(builder->code_block.instructions, 0),
+        &(Instruction){.assembly = {imul, temp->storage, m32->storage, imm32(temp_allocator, 10)}}
+      ));
+    }
+  }
+  describe("divide") {
+    it("should not use idiv when dividing by a constant") {
+      Value *reg_a = value_register_for_descriptor(temp_context, Register_A, &descriptor_s64);
+      Value *m64 = &(Value){&descriptor_s64, stack(0, 8)};
+      Value *divisors[] = {
+        value_from_s64(temp_context, 1),
+        value_from_s64(temp_context, 4),
+        value_from_s64(temp_context, 10),
+      };
+      for (u64 i = 0; i < countof(divisors); ++i) {
+        dyn_array_clear(builder->code_block.instructions);
+        divide(temp_context, &test_range, reg_a, m64, divisors[i]);
+        value_remainder(temp_context, &test_range, reg_a, m64, divisors[i]);
+        for (u64 j = 0; j < dyn_array_length(builder->code_block.instructions); ++j) {
+          Instruction *instruction = dyn_array_get(builder->code_block.instructions, j);
+          check(instruction->assembly.mnemonic != idiv);
+        }
+      }
+    }
+    it("should compute the magic number for a signed division") {
+      Signed_Division_Magic magic = signed_division_magic(7, 32);
+      check(magic.multiplier == (s32)0x92492493);
+      check(magic.shift == 2);
+      magic = signed_division_magic(10, 64);
+      check(magic.multiplier == 0x6666666666666667);
+      check(magic.shift == 2);
+    }
+  }
 }
@@ -575,13 +575,21 @@ main(void) {
     { "u32", "has_value" },
   }));
 
+  // Values match the scale bits of the SIB byte
+  push_type(type_enum("Index_Scale", (Enum_Item[]){
+    { "1", 0 },
+    { "2", 1 },
+    { "4", 2 },
+    { "8", 3 },
+  }));
+
   push_type(type_union("Memory_Location", (Struct[]){
     struct_fields("Instruction_Pointer_Relative", (Struct_Item[]){
       { "Label_Index", "label_index" },
     }),
     struct_fields("Indirect", (Struct_Item[]){
       { "Register", "base_register" },
-      { "u32", "_base_register_padding" },
+      { "Index_Scale", "index_scale" },
       { "Maybe_Register", "maybe_index_register" },
       { "s64", "offset" },
     }),
@@ -644,12 +652,19 @@ main(void) {
     { "Scope_Entry *", "next_overload" },
   }));
 
+  push_type(type_enum("Branch_Hint", (Enum_Item[]){
+    { "None", 0 },
+    { "Likely", 1 },
+    { "Unlikely", 2 },
+  }));
+
   push_type(type_struct("Value", (Struct_Item[]){
     { "Descriptor *", "descriptor" },
     { "Storage", "storage" },
     { "Value *", "next_overload" },
     { "u64", "epoch" },
     { "Compiler_Source_Location", "compiler_source_location" },
+    { "Branch_Hint", "branch_hint" },
   }));
 
   push_type(type_enum("Descriptor_Function_Flags", (Enum_Item[]){
@@ -659,6 +674,8 @@ main(void) {
     { "No_Own_Return", 1 << 2 },
     { "External", 1 << 3 },
     { "Compile_Time", 1 << 4 },
+    { "Inline", 1 << 5 },
+    { "Cold", 1 << 6 },
   }));
 
   push_type(type_struct("Descriptor_Struct_Field", (Struct_Item[]){
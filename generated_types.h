@@ -91,6 +91,8 @@ typedef struct Maybe_Register Maybe_Register;
 typedef dyn_array_type(Maybe_Register *) Array_Maybe_Register_Ptr;
 typedef dyn_array_type(const Maybe_Register *) Array_Const_Maybe_Register_Ptr;
 
+typedef enum Index_Scale Index_Scale;
+
 typedef struct Memory_Location Memory_Location;
 typedef dyn_array_type(Memory_Location *) Array_Memory_Location_Ptr;
 typedef dyn_array_type(const Memory_Location *) Array_Const_Memory_Location_Ptr;
@@ -109,6 +111,8 @@ typedef struct Scope_Entry Scope_Entry;
 typedef dyn_array_type(Scope_Entry *) Array_Scope_Entry_Ptr;
 typedef dyn_array_type(const Scope_Entry *) Array_Const_Scope_Entry_Ptr;
 
+typedef enum Branch_Hint Branch_Hint;
+
 typedef struct Value Value;
 typedef dyn_array_type(Value *) Array_Value_Ptr;
 typedef dyn_array_type(const Value *) Array_Const_Value_Ptr;
@@ -350,6 +354,13 @@ typedef struct Maybe_Register {
 } Maybe_Register;
 typedef dyn_array_type(Maybe_Register) Array_Maybe_Register;
 
+typedef enum Index_Scale {
+  Index_Scale_1 = 0,
+  Index_Scale_2 = 1,
+  Index_Scale_4 = 2,
+  Index_Scale_8 = 3,
+} Index_Scale;
+
 typedef enum {
   Memory_Location_Tag_Instruction_Pointer_Relative = 0,
   Memory_Location_Tag_Indirect = 1,
@@ -360,7 +371,7 @@ typedef struct {
 } Memory_Location_Instruction_Pointer_Relative;
 typedef struct {
   Register base_register;
-  u32 _base_register_padding;
+  Index_Scale index_scale;
   Maybe_Register maybe_index_register;
   s64 offset;
 } Memory_Location_Indirect;
@@ -458,12 +469,19 @@ typedef struct Scope_Entry {
   };
 } Scope_Entry;
 typedef dyn_array_type(Scope_Entry) Array_Scope_Entry;
+typedef enum Branch_Hint {
+  Branch_Hint_None = 0,
+  Branch_Hint_Likely = 1,
+  Branch_Hint_Unlikely = 2,
+} Branch_Hint;
+
 typedef struct Value {
   Descriptor * descriptor;
   Storage storage;
   Value * next_overload;
   u64 epoch;
   Compiler_Source_Location compiler_source_location;
+  Branch_Hint branch_hint;
 } Value;
 typedef dyn_array_type(Value) Array_Value;
 
@@ -474,6 +492,8 @@ typedef enum Descriptor_Function_Flags {
   Descriptor_Function_Flags_No_Own_Return = 4,
   Descriptor_Function_Flags_External = 8,
   Descriptor_Function_Flags_Compile_Time = 16,
+  Descriptor_Function_Flags_Inline = 32,
+  Descriptor_Function_Flags_Cold = 64,
 } Descriptor_Function_Flags;
 
 typedef struct Descriptor_Struct_Field {
@@ -660,6 +680,9 @@ static Descriptor descriptor_compare_type_pointer_pointer;
 static Descriptor descriptor_maybe_register;
 static Descriptor descriptor_maybe_register_pointer;
 static Descriptor descriptor_maybe_register_pointer_pointer;
+static Descriptor descriptor_index_scale;
+static Descriptor descriptor_index_scale_pointer;
+static Descriptor descriptor_index_scale_pointer_pointer;
 static Descriptor descriptor_memory_location;
 static Descriptor descriptor_memory_location_pointer;
 static Descriptor descriptor_memory_location_pointer_pointer;
@@ -678,6 +701,9 @@ static Descriptor descriptor_scope_entry;
 static Descriptor descriptor_scope_entry_pointer;
 static Descriptor descriptor_scope_entry_pointer_pointer;
 MASS_DEFINE_OPAQUE_C_TYPE(scope_entry_tag, Scope_Entry_Tag)
+static Descriptor descriptor_branch_hint;
+static Descriptor descriptor_branch_hint_pointer;
+static Descriptor descriptor_branch_hint_pointer_pointer;
 static Descriptor descriptor_value;
 static Descriptor descriptor_value_pointer;
 static Descriptor descriptor_value_pointer_pointer;
@@ -981,6 +1007,7 @@ MASS_DEFINE_STRUCT_DESCRIPTOR(maybe_register,
   },
 );
 MASS_DEFINE_TYPE_VALUE(maybe_register);
+MASS_DEFINE_OPAQUE_C_TYPE(index_scale, Index_Scale)
 MASS_DEFINE_STRUCT_DESCRIPTOR(compiler_source_location,
   {
     .name = slice_literal_fields("filename"),
@@ -1000,6 +1027,7 @@ MASS_DEFINE_STRUCT_DESCRIPTOR(compiler_source_location,
 );
 MASS_DEFINE_TYPE_VALUE(compiler_source_location);
 MASS_DEFINE_OPAQUE_C_TYPE(operator_fixity, Operator_Fixity)
+MASS_DEFINE_OPAQUE_C_TYPE(branch_hint, Branch_Hint)
 MASS_DEFINE_STRUCT_DESCRIPTOR(value,
   {
     .name = slice_literal_fields("descriptor"),
@@ -1026,6 +1054,11 @@ MASS_DEFINE_STRUCT_DESCRIPTOR(value,
     .descriptor = &descriptor_compiler_source_location,
     .offset = offsetof(Value, compiler_source_location),
   },
+  {
+    .name = slice_literal_fields("branch_hint"),
+    .descriptor = &descriptor_branch_hint,
+    .offset = offsetof(Value, branch_hint),
+  },
 );
 MASS_DEFINE_TYPE_VALUE(value);
 MASS_DEFINE_OPAQUE_C_TYPE(descriptor_function_flags, Descriptor_Function_Flags)
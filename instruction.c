@@ -40,6 +40,10 @@
 #define xmm_m32 { Operand_Encoding_Type_Xmm_Memory, Operand_Size_32 }
 #define xmm64 { Operand_Encoding_Type_Xmm, Operand_Size_64 }
 #define xmm_m64 { Operand_Encoding_Type_Xmm_Memory, Operand_Size_64 }
+#define xmm128 { Operand_Encoding_Type_Xmm, Operand_Size_128 }
+#define xmm_m128 { Operand_Encoding_Type_Xmm_Memory, Operand_Size_128 }
+#define ymm256 { Operand_Encoding_Type_Xmm, Operand_Size_256 }
+#define ymm_m256 { Operand_Encoding_Type_Xmm_Memory, Operand_Size_256 }
 
 #define encoding_operands(...) __VA_ARGS__
 
@@ -55,6 +59,20 @@
     .operands = { encoding_operands(__VA_ARGS__) },\
   }
 
+// :VexEncoding
+#define vex_encoding(_op_code_u16_, _extension_type_, ...)\
+  {\
+    .op_code = {\
+      ((_op_code_u16_) >> 24) & 0xFFu,\
+      ((_op_code_u16_) >> 16) & 0xFFu,\
+      ((_op_code_u16_) >> 8) & 0xFFu,\
+      (_op_code_u16_) & 0xFFu\
+    },\
+    _extension_type_\
+    .operands = { encoding_operands(__VA_ARGS__) },\
+    .vex = true,\
+  }
+
 #define mnemonic(_name_, ...)\
   const X64_Mnemonic *_name_ = &(const X64_Mnemonic){\
     .name = #_name_,\
@@ -90,6 +108,13 @@ mnemonic(movsx,
   encoding(0x0FBE, _r, r64, r_m8),
   encoding(0x0FBF, _r, r32, r_m16),
   encoding(0x0FBF, _r, r64, r_m16),
+  encoding(0x63, _r, r64, r_m32),
+);
+
+mnemonic(movzx,
+  encoding(0x0FB6, _r, r16, r_m8),
+  encoding(0x0FB6, _r, r32, r_m8),
+  encoding(0x0FB7, _r, r32, r_m16),
 );
 
 mnemonic(movss,
@@ -102,11 +127,25 @@ mnemonic(movsd,
   encoding(0xF20F11, _r, xmm_m64, xmm64),
 );
 
+mnemonic(movups,
+  encoding(0x0F10, _r, xmm128, xmm_m128),
+  encoding(0x0F11, _r, xmm_m128, xmm128),
+);
+
+mnemonic(movdqu,
+  encoding(0xF30F6F, _r, xmm128, xmm_m128),
+  encoding(0xF30F7F, _r, xmm_m128, xmm128),
+);
+
 // TODO figure out how to better deal with implicit parameters here
 mnemonic(rep_movsb,
   encoding(0xF3A4, none, 0),
 );
 
+mnemonic(rep_stosb,
+  encoding(0xF3AA, none, 0),
+);
+
 mnemonic(lea,
   encoding(0x8d, _r, r64, m),
 );
@@ -221,6 +260,33 @@ mnemonic(imul,
   encoding(0x69, _r, r16, r_m16, imm16),
   encoding(0x69, _r, r32, r_m32, imm32),
   encoding(0x69, _r, r64, r_m64, imm32),
+
+  // Implicit A register is multiplied by the operand with the result in D:A
+  encoding(0xF6, _op_code(5), r_m8),
+  encoding(0xF7, _op_code(5), r_m16),
+  encoding(0xF7, _op_code(5), r_m32),
+  encoding(0xF7, _op_code(5), r_m64),
+);
+
+mnemonic(shl,
+  encoding(0xC0, _op_code(4), r_m8, imm8),
+  encoding(0xC1, _op_code(4), r_m16, imm8),
+  encoding(0xC1, _op_code(4), r_m32, imm8),
+  encoding(0xC1, _op_code(4), r_m64, imm8),
+);
+
+mnemonic(shr,
+  encoding(0xC0, _op_code(5), r_m8, imm8),
+  encoding(0xC1, _op_code(5), r_m16, imm8),
+  encoding(0xC1, _op_code(5), r_m32, imm8),
+  encoding(0xC1, _op_code(5), r_m64, imm8),
+);
+
+mnemonic(sar,
+  encoding(0xC0, _op_code(7), r_m8, imm8),
+  encoding(0xC1, _op_code(7), r_m16, imm8),
+  encoding(0xC1, _op_code(7), r_m32, imm8),
+  encoding(0xC1, _op_code(7), r_m64, imm8),
 );
 
 mnemonic(idiv,
@@ -283,6 +349,278 @@ mnemonic(jmp,
   encoding(0xFF, _op_code(4), r_m64),
 );
 
+// Packed SSE instructions. Memory operands of the arithmetic ones must be 16-byte aligned
+
+mnemonic(addps,
+  encoding(0x0F58, _r, xmm128, xmm_m128),
+);
+
+mnemonic(addpd,
+  encoding(0x660F58, _r, xmm128, xmm_m128),
+);
+
+mnemonic(subps,
+  encoding(0x0F5C, _r, xmm128, xmm_m128),
+);
+
+mnemonic(subpd,
+  encoding(0x660F5C, _r, xmm128, xmm_m128),
+);
+
+mnemonic(mulps,
+  encoding(0x0F59, _r, xmm128, xmm_m128),
+);
+
+mnemonic(mulpd,
+  encoding(0x660F59, _r, xmm128, xmm_m128),
+);
+
+mnemonic(divps,
+  encoding(0x0F5E, _r, xmm128, xmm_m128),
+);
+
+mnemonic(divpd,
+  encoding(0x660F5E, _r, xmm128, xmm_m128),
+);
+
+mnemonic(minps,
+  encoding(0x0F5D, _r, xmm128, xmm_m128),
+);
+
+mnemonic(minpd,
+  encoding(0x660F5D, _r, xmm128, xmm_m128),
+);
+
+mnemonic(maxps,
+  encoding(0x0F5F, _r, xmm128, xmm_m128),
+);
+
+mnemonic(maxpd,
+  encoding(0x660F5F, _r, xmm128, xmm_m128),
+);
+
+mnemonic(paddb,
+  encoding(0x660FFC, _r, xmm128, xmm_m128),
+);
+
+mnemonic(paddw,
+  encoding(0x660FFD, _r, xmm128, xmm_m128),
+);
+
+mnemonic(paddd,
+  encoding(0x660FFE, _r, xmm128, xmm_m128),
+);
+
+mnemonic(paddq,
+  encoding(0x660FD4, _r, xmm128, xmm_m128),
+);
+
+mnemonic(psubb,
+  encoding(0x660FF8, _r, xmm128, xmm_m128),
+);
+
+mnemonic(psubw,
+  encoding(0x660FF9, _r, xmm128, xmm_m128),
+);
+
+mnemonic(psubd,
+  encoding(0x660FFA, _r, xmm128, xmm_m128),
+);
+
+mnemonic(psubq,
+  encoding(0x660FFB, _r, xmm128, xmm_m128),
+);
+
+mnemonic(pmullw,
+  encoding(0x660FD5, _r, xmm128, xmm_m128),
+);
+
+mnemonic(pmulld,
+  encoding(0x660F3840, _r, xmm128, xmm_m128),
+);
+
+mnemonic(pand,
+  encoding(0x660FDB, _r, xmm128, xmm_m128),
+);
+
+mnemonic(por,
+  encoding(0x660FEB, _r, xmm128, xmm_m128),
+);
+
+mnemonic(pxor,
+  encoding(0x660FEF, _r, xmm128, xmm_m128),
+);
+
+mnemonic(pcmpeqb,
+  encoding(0x660F74, _r, xmm128, xmm_m128),
+);
+
+mnemonic(pcmpeqw,
+  encoding(0x660F75, _r, xmm128, xmm_m128),
+);
+
+mnemonic(pcmpeqd,
+  encoding(0x660F76, _r, xmm128, xmm_m128),
+);
+
+mnemonic(pcmpeqq,
+  encoding(0x660F3829, _r, xmm128, xmm_m128),
+);
+
+mnemonic(cmpps,
+  encoding(0x0FC2, _r, xmm128, xmm_m128, imm8),
+);
+
+mnemonic(cmppd,
+  encoding(0x660FC2, _r, xmm128, xmm_m128, imm8),
+);
+
+mnemonic(shufps,
+  encoding(0x0FC6, _r, xmm128, xmm_m128, imm8),
+);
+
+mnemonic(shufpd,
+  encoding(0x660FC6, _r, xmm128, xmm_m128, imm8),
+);
+
+mnemonic(pshufd,
+  encoding(0x660F70, _r, xmm128, xmm_m128, imm8),
+);
+
+// VEX-encoded AVX / AVX2 forms. 256-bit integer ones require AVX2
+
+mnemonic(vmovups,
+  vex_encoding(0x0F10, _r, xmm128, xmm_m128),
+  vex_encoding(0x0F11, _r, xmm_m128, xmm128),
+  vex_encoding(0x0F10, _r, ymm256, ymm_m256),
+  vex_encoding(0x0F11, _r, ymm_m256, ymm256),
+);
+
+mnemonic(vaddps,
+  vex_encoding(0x0F58, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x0F58, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vaddpd,
+  vex_encoding(0x660F58, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660F58, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vsubps,
+  vex_encoding(0x0F5C, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x0F5C, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vsubpd,
+  vex_encoding(0x660F5C, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660F5C, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vmulps,
+  vex_encoding(0x0F59, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x0F59, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vmulpd,
+  vex_encoding(0x660F59, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660F59, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vdivps,
+  vex_encoding(0x0F5E, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x0F5E, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vdivpd,
+  vex_encoding(0x660F5E, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660F5E, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpaddb,
+  vex_encoding(0x660FFC, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FFC, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpaddw,
+  vex_encoding(0x660FFD, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FFD, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpaddd,
+  vex_encoding(0x660FFE, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FFE, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpaddq,
+  vex_encoding(0x660FD4, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FD4, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpsubb,
+  vex_encoding(0x660FF8, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FF8, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpsubw,
+  vex_encoding(0x660FF9, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FF9, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpsubd,
+  vex_encoding(0x660FFA, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FFA, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpsubq,
+  vex_encoding(0x660FFB, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FFB, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpmullw,
+  vex_encoding(0x660FD5, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FD5, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpmulld,
+  vex_encoding(0x660F3840, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660F3840, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpand,
+  vex_encoding(0x660FDB, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FDB, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpor,
+  vex_encoding(0x660FEB, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FEB, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpxor,
+  vex_encoding(0x660FEF, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660FEF, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpcmpeqb,
+  vex_encoding(0x660F74, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660F74, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpcmpeqw,
+  vex_encoding(0x660F75, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660F75, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpcmpeqd,
+  vex_encoding(0x660F76, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660F76, _r, ymm256, ymm256, ymm_m256),
+);
+
+mnemonic(vpcmpeqq,
+  vex_encoding(0x660F3829, _r, xmm128, xmm128, xmm_m128),
+  vex_encoding(0x660F3829, _r, ymm256, ymm256, ymm_m256),
+);
+
 #define ENUMERATE_CC(process)\
  process(0x0, o)\
  process(0x1, no)\
@@ -330,6 +668,15 @@ ENUMERATE_CC(jcc)
 ENUMERATE_CC(setcc)
 #undef setcc
 
+#define cmovcc(_value_, _suffix_)\
+  mnemonic(cmov##_suffix_,\
+    encoding(0x0F40 + (_value_), _r, r16, r_m16, eflags),\
+    encoding(0x0F40 + (_value_), _r, r32, r_m32, eflags),\
+    encoding(0x0F40 + (_value_), _r, r64, r_m64, eflags),\
+  );
+ENUMERATE_CC(cmovcc)
+#undef cmovcc
+
 #undef ENUMERATE_CC
 
 #undef none
@@ -367,8 +714,13 @@ ENUMERATE_CC(setcc)
 #undef xmm_m32
 #undef xmm64
 #undef xmm_m64
+#undef xmm128
+#undef xmm_m128
+#undef ymm256
+#undef ymm_m256
 
 #undef encoding_operands
 
 #undef mnemonic
 #undef encoding
+#undef vex_encoding
@@ -4,6 +4,7 @@ scc .\source.c .\source.h ^
     .\function.c .\function.h ^
     .\function_spec.c ^
     .\encoding.c .\encoding.h ^
+    .\optimization.c .\optimization.h ^
     .\win32_platform.h ^
     .\win32_runtime.h ^
     .\instruction.c ^
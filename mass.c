@@ -4,6 +4,7 @@
 #include "value.c"
 #include "instruction.c"
 #include "encoding.c"
+#include "optimization.c"
 #include "function.c"
 #include "source.c"
 
@@ -20,6 +21,16 @@ mass_cli_print_usage() {
     "  mass [flags] source_code.mass\n\n"
     "Flags:\n"
     "  --run              Run code in JIT mode\n"
+    "  --optimization-report\n"
+    "                     Print the number of moves in each function before and after optimization\n"
+    "  --strip-report     Print the unreachable code and data left out of the executable\n"
+    "  --order-functions  Place functions that call each other next to each other\n"
+    "  --fold-identical-functions\n"
+    "                     Share a single copy of the machine code between identical functions\n"
+    "  --align-functions  [1, 2, 4, ..., 64]\n"
+    "                     Align function entries to the given number of bytes\n"
+    "  --align-loops      [1, 2, 4, ..., 64]\n"
+    "                     Align the first instruction of loops to the given number of bytes\n"
     "  --binary-format    [pe32:cli, pe32:gui]\n"
     "    Set output binary executable format;"
     #ifdef _WIN32
@@ -29,6 +40,34 @@ mass_cli_print_usage() {
   return -1;
 }
 
+void
+mass_cli_print_optimization_report(
+  Program *program
+) {
+  u64 total_before = 0;
+  u64 total_after = 0;
+  for (u64 i = 0; i < dyn_array_length(program->functions); ++i) {
+    Function_Builder *builder = dyn_array_get(program->functions, i);
+    Label *label = program_get_label(program, builder->label_index);
+    slice_print(label->name);
+    printf(": mov %" PRIu64 " -> %" PRIu64 "\n",
+      builder->move_count_before_optimization, builder->move_count_after_optimization);
+    total_before += builder->move_count_before_optimization;
+    total_after += builder->move_count_after_optimization;
+  }
+  printf("total: mov %" PRIu64 " -> %" PRIu64 "\n", total_before, total_after);
+}
+
+void
+mass_cli_print_strip_report(
+  const Strip_Report *report
+) {
+  printf("functions: %" PRIu64 " (~%" PRIu64 " bytes)\n", report->function_count, report->code_byte_size);
+  printf("imports: %" PRIu64 " symbols, %" PRIu64 " libraries\n",
+    report->import_symbol_count, report->import_library_count);
+  printf("data: %" PRIu64 " bytes\n", report->data_byte_size);
+}
+
 s32
 mass_cli_print_error(
   Parse_Error *error
@@ -47,11 +86,38 @@ int main(s32 argc, char **argv) {
   Executable_Type win32_executable_type = Executable_Type_Cli;
 
   Mass_Cli_Mode mode = Mass_Cli_Mode_Compile;
+  bool print_optimization_report = false;
+  bool print_strip_report = false;
+  bool order_functions = false;
+  bool fold_identical_functions = false;
+  u32 function_alignment = 0;
+  u32 loop_alignment = 0;
   char *raw_file_path = 0;
   for (s32 i = 1; i < argc; ++i) {
     char *arg = argv[i];
     if (strcmp(arg, "--run") == 0) {
       mode = Mass_Cli_Mode_Run;
+    } else if (strcmp(arg, "--optimization-report") == 0) {
+      print_optimization_report = true;
+    } else if (strcmp(arg, "--strip-report") == 0) {
+      print_strip_report = true;
+    } else if (strcmp(arg, "--order-functions") == 0) {
+      order_functions = true;
+    } else if (strcmp(arg, "--fold-identical-functions") == 0) {
+      fold_identical_functions = true;
+    } else if (strcmp(arg, "--align-functions") == 0 || strcmp(arg, "--align-loops") == 0) {
+      if (++i >= argc) {
+        return mass_cli_print_usage();
+      }
+      u32 alignment = (u32)strtoul(argv[i], 0, 10);
+      if (!alignment || alignment > 64 || (alignment & (alignment - 1))) {
+        return mass_cli_print_usage();
+      }
+      if (strcmp(arg, "--align-functions") == 0) {
+        function_alignment = alignment;
+      } else {
+        loop_alignment = alignment;
+      }
     } else if (strcmp(arg, "--binary-format") == 0) {
       if (++i >= argc) {
         return mass_cli_print_usage();
@@ -82,6 +148,10 @@ int main(s32 argc, char **argv) {
   Compilation compilation;
   compilation_init(&compilation);
   Execution_Context context = execution_context_from_compilation(&compilation);
+  context.program->order_functions_by_calls = order_functions;
+  context.program->fold_identical_functions = fold_identical_functions;
+  context.program->function_alignment = function_alignment;
+  context.program->loop_alignment = loop_alignment;
 
   Scope *module_scope = scope_make(context.allocator, context.scope);
   Module *prelude_module = program_module_from_file(
@@ -129,12 +199,15 @@ int main(s32 argc, char **argv) {
         bucket_buffer_to_fixed_buffer(allocator_default, path_builder); // @Leak
       write_executable((char *)path_buffer->memory, &context, win32_executable_type);
       bucket_buffer_destroy(path_builder);
+      if (print_optimization_report) mass_cli_print_optimization_report(context.program);
+      if (print_strip_report) mass_cli_print_strip_report(&context.program->strip_report);
       break;
     }
     case Mass_Cli_Mode_Run: {
       Jit jit;
       jit_init(&jit, context.program);
       program_jit(&jit);
+      if (print_optimization_report) mass_cli_print_optimization_report(context.program);
       fn_type_opaque main = value_as_function(&jit, jit.program->entry_point);
       main();
       return 0;
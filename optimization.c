@@ -0,0 +1,3114 @@
+#include "optimization.h"
+
+// :ControlFlowGraph
+// Labels belonging to a function are usually allocated close to each other
+// so, same as for :BranchRelaxation, a dense lookup table over the range
+// of their indexes is good enough to find the instruction for a label.
+typedef struct {
+  u64 min_label_index;
+  u64 max_label_index;
+  // Index of the label instruction or -1 for labels outside of the function body.
+  // The `end_label` maps to the instruction count.
+  s64 *instruction_indexes;
+} Label_Instruction_Map;
+
+static Label_Instruction_Map
+label_instruction_map_make(
+  const Function_Builder *builder
+) {
+  const Array_Instruction instructions = builder->code_block.instructions;
+  u64 instruction_count = dyn_array_length(instructions);
+  u64 end_label_index = builder->code_block.end_label.value;
+  Label_Instruction_Map map = {
+    .min_label_index = end_label_index,
+    .max_label_index = end_label_index,
+  };
+  for (u64 i = 0; i < instruction_count; ++i) {
+    Instruction *instruction = dyn_array_get(instructions, i);
+    if (instruction->type != Instruction_Type_Label) continue;
+    map.min_label_index = u64_min(map.min_label_index, instruction->label.value);
+    map.max_label_index = u64_max(map.max_label_index, instruction->label.value);
+  }
+  u64 length = map.max_label_index - map.min_label_index + 1;
+  map.instruction_indexes = allocator_allocate_array(allocator_default, s64, length);
+  for (u64 i = 0; i < length; ++i) map.instruction_indexes[i] = -1;
+  map.instruction_indexes[end_label_index - map.min_label_index] = u64_to_s64(instruction_count);
+  for (u64 i = 0; i < instruction_count; ++i) {
+    Instruction *instruction = dyn_array_get(instructions, i);
+    if (instruction->type != Instruction_Type_Label) continue;
+    map.instruction_indexes[instruction->label.value - map.min_label_index] = u64_to_s64(i);
+  }
+  return map;
+}
+
+static inline s64
+label_instruction_map_get(
+  const Label_Instruction_Map *map,
+  Label_Index label_index
+) {
+  if (label_index.value < map->min_label_index) return -1;
+  if (label_index.value > map->max_label_index) return -1;
+  return map->instruction_indexes[label_index.value - map->min_label_index];
+}
+
+static void
+label_instruction_map_destroy(
+  Label_Instruction_Map *map
+) {
+  u64 length = map->max_label_index - map->min_label_index + 1;
+  allocator_deallocate(allocator_default, map->instruction_indexes, sizeof(s64) * length);
+}
+
+static inline bool
+instruction_is_conditional_jump(
+  const Instruction *instruction
+) {
+  if (instruction->type != Instruction_Type_Assembly) return false;
+  const Storage *operands = instruction->assembly.operands;
+  return storage_is_label(&operands[0]) && operands[1].tag == Storage_Tag_Eflags;
+}
+
+static inline bool
+instruction_ends_basic_block(
+  const Instruction *instruction
+) {
+  switch(instruction->type) {
+    case Instruction_Type_Label: return false;
+    case Instruction_Type_Tail_Call: return true;
+    case Instruction_Type_Bytes: {
+      return instruction->Bytes.label_offset_in_instruction != INSTRUCTION_BYTES_NO_LABEL;
+    }
+    case Instruction_Type_Assembly: {
+      const X64_Mnemonic *mnemonic = instruction->assembly.mnemonic;
+      return mnemonic == jmp || mnemonic == ret || instruction_is_conditional_jump(instruction);
+    }
+  }
+  panic("Unexpected instruction type");
+  return false;
+}
+
+// Returns the block index for the label or -1 if the label is outside of the function
+static s64
+control_flow_graph_label_block(
+  const Control_Flow_Graph *graph,
+  const Label_Instruction_Map *map,
+  Label_Index label_index,
+  Basic_Block_Exit *exit
+) {
+  s64 instruction_index = label_instruction_map_get(map, label_index);
+  if (instruction_index == -1) {
+    *exit = Basic_Block_Exit_Unknown;
+    return -1;
+  }
+  if (s64_to_u64(instruction_index) == dyn_array_length(graph->instruction_block_indexes)) {
+    if (*exit != Basic_Block_Exit_Unknown) *exit = Basic_Block_Exit_Return;
+    return -1;
+  }
+  return u64_to_s64(*dyn_array_get(graph->instruction_block_indexes, instruction_index));
+}
+
+static void
+control_flow_graph_mark_reachable(
+  Control_Flow_Graph *graph,
+  Array_u64 *stack,
+  s64 block_index
+) {
+  if (block_index == -1) return;
+  Basic_Block *block = dyn_array_get(graph->blocks, block_index);
+  if (block->reachable) return;
+  block->reachable = true;
+  dyn_array_push(*stack, s64_to_u64(block_index));
+}
+
+Control_Flow_Graph
+control_flow_graph_make(
+  const Function_Builder *builder
+) {
+  const Array_Instruction instructions = builder->code_block.instructions;
+  u64 instruction_count = dyn_array_length(instructions);
+  Control_Flow_Graph graph = {
+    .blocks = dyn_array_make(Array_Basic_Block),
+    .instruction_block_indexes = dyn_array_make(Array_u64, .capacity = instruction_count),
+  };
+
+  // A new block starts with each label and after each branch
+  for (u64 i = 0; i < instruction_count; ++i) {
+    Instruction *instruction = dyn_array_get(instructions, i);
+    Basic_Block *last_block = dyn_array_last(graph.blocks);
+    bool starts_block = !last_block || instruction->type == Instruction_Type_Label;
+    if (!starts_block) {
+      Instruction *previous = dyn_array_get(instructions, i - 1);
+      starts_block = instruction_ends_basic_block(previous);
+    }
+    if (starts_block) {
+      dyn_array_push(graph.blocks, (Basic_Block) {
+        .first_instruction_index = i,
+        .jump_target = -1,
+        .fallthrough = -1,
+      });
+      last_block = dyn_array_last(graph.blocks);
+    }
+    last_block->instruction_count++;
+    dyn_array_push(graph.instruction_block_indexes, dyn_array_length(graph.blocks) - 1);
+  }
+
+  Label_Instruction_Map map = label_instruction_map_make(builder);
+  u64 block_count = dyn_array_length(graph.blocks);
+  for (u64 block_index = 0; block_index < block_count; ++block_index) {
+    Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+    u64 last_index = block->first_instruction_index + block->instruction_count - 1;
+    Instruction *last = dyn_array_get(instructions, last_index);
+    bool falls_through = true;
+    if (last->type == Instruction_Type_Tail_Call) {
+      block->exit = Basic_Block_Exit_Unknown;
+      falls_through = false;
+    } else if (last->type == Instruction_Type_Bytes) {
+      if (last->Bytes.label_offset_in_instruction != INSTRUCTION_BYTES_NO_LABEL) {
+        block->jump_target =
+          control_flow_graph_label_block(&graph, &map, last->Bytes.label_index, &block->exit);
+      }
+    } else if (last->type == Instruction_Type_Assembly) {
+      const Storage *target = &last->assembly.operands[0];
+      if (last->assembly.mnemonic == ret) {
+        block->exit = Basic_Block_Exit_Return;
+        falls_through = false;
+      } else if (last->assembly.mnemonic == jmp || instruction_is_conditional_jump(last)) {
+        falls_through = last->assembly.mnemonic != jmp;
+        if (storage_is_label(target)) {
+          Label_Index label_index = target->Memory.location.Instruction_Pointer_Relative.label_index;
+          block->jump_target = control_flow_graph_label_block(&graph, &map, label_index, &block->exit);
+        } else {
+          block->exit = Basic_Block_Exit_Unknown;
+        }
+      }
+    }
+    if (falls_through) {
+      if (block_index + 1 < block_count) {
+        block->fallthrough = u64_to_s64(block_index + 1);
+      } else if (block->exit != Basic_Block_Exit_Unknown) {
+        block->exit = Basic_Block_Exit_Return;
+      }
+    }
+  }
+
+  // Besides the entry, blocks can be reached through labels used as values
+  // (e.g. an address loaded with `lea`) or referenced from inline machine code.
+  Array_u64 stack = dyn_array_make(Array_u64);
+  if (block_count) control_flow_graph_mark_reachable(&graph, &stack, 0);
+  for (u64 i = 0; i < instruction_count; ++i) {
+    Instruction *instruction = dyn_array_get(instructions, i);
+    Basic_Block_Exit ignored = Basic_Block_Exit_None;
+    if (instruction->type == Instruction_Type_Bytes) {
+      if (instruction->Bytes.label_offset_in_instruction == INSTRUCTION_BYTES_NO_LABEL) continue;
+      control_flow_graph_mark_reachable(&graph, &stack, control_flow_graph_label_block(
+        &graph, &map, instruction->Bytes.label_index, &ignored
+      ));
+    } else if (instruction->type == Instruction_Type_Assembly) {
+      bool is_jump = instruction->assembly.mnemonic == jmp || instruction_is_conditional_jump(instruction);
+      for (u64 operand_index = is_jump ? 1 : 0; operand_index < 3; ++operand_index) {
+        const Storage *operand = &instruction->assembly.operands[operand_index];
+        if (!storage_is_label(operand)) continue;
+        Label_Index label_index = operand->Memory.location.Instruction_Pointer_Relative.label_index;
+        control_flow_graph_mark_reachable(&graph, &stack, control_flow_graph_label_block(
+          &graph, &map, label_index, &ignored
+        ));
+      }
+    }
+  }
+  while (dyn_array_length(stack)) {
+    u64 block_index = *dyn_array_pop(stack);
+    Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+    control_flow_graph_mark_reachable(&graph, &stack, block->jump_target);
+    control_flow_graph_mark_reachable(&graph, &stack, block->fallthrough);
+  }
+  dyn_array_destroy(stack);
+  label_instruction_map_destroy(&map);
+
+  return graph;
+}
+
+void
+control_flow_graph_destroy(
+  Control_Flow_Graph *graph
+) {
+  dyn_array_destroy(graph->blocks);
+  dyn_array_destroy(graph->instruction_block_indexes);
+}
+
+// :Liveness
+static inline u64
+liveness_register_bit(
+  Register reg
+) {
+  return 1llu << reg;
+}
+
+static inline u64
+liveness_operand_register_bits(
+  const Storage *operand
+) {
+  switch(operand->tag) {
+    case Storage_Tag_Register: {
+      u64 bits = liveness_register_bit(operand->Register.index);
+      // Without a REX prefix byte registers 4 to 7 are AH, CH, DH and BH
+      if (operand->byte_size == 1 && operand->Register.index >= Register_SP && operand->Register.index <= Register_DI) {
+        bits |= liveness_register_bit(operand->Register.index - Register_SP);
+      }
+      return bits;
+    }
+    case Storage_Tag_Xmm: {
+      return liveness_register_bit(Register_Xmm0 | (operand->Xmm.index & 0xF));
+    }
+    case Storage_Tag_Eflags: {
+      return 1llu << LIVENESS_EFLAGS_BIT;
+    }
+    case Storage_Tag_None:
+    case Storage_Tag_Any:
+    case Storage_Tag_Static:
+    case Storage_Tag_Memory: {
+      return 0;
+    }
+  }
+  panic("Unexpected storage tag");
+  return 0;
+}
+
+static inline u64
+liveness_address_register_bits(
+  const Storage *operand
+) {
+  if (operand->tag != Storage_Tag_Memory) return 0;
+  if (operand->Memory.location.tag != Memory_Location_Tag_Indirect) return 0;
+  const Memory_Location_Indirect *indirect = &operand->Memory.location.Indirect;
+  u64 bits = liveness_register_bit(indirect->base_register);
+  if (indirect->maybe_index_register.has_value) {
+    bits |= liveness_register_bit(indirect->maybe_index_register.index);
+  }
+  return bits;
+}
+
+static inline bool
+liveness_operand_stack_slot(
+  const Storage *operand,
+  Stack_Slot *slot
+) {
+  if (operand->tag != Storage_Tag_Memory) return false;
+  if (operand->Memory.location.tag != Memory_Location_Tag_Indirect) return false;
+  const Memory_Location_Indirect *indirect = &operand->Memory.location.Indirect;
+  if (indirect->base_register != Register_SP) return false;
+  if (indirect->maybe_index_register.has_value) return false;
+  *slot = (Stack_Slot){.offset = indirect->offset, .byte_size = operand->byte_size};
+  return true;
+}
+
+static inline bool
+operand_is_memory(
+  const Storage *operand
+) {
+  return operand->tag == Storage_Tag_Memory && !storage_is_label(operand);
+}
+
+static void
+instruction_effects_read_memory(
+  const Storage *operand,
+  Instruction_Effects *effects
+) {
+  if (!operand_is_memory(operand)) return;
+  Stack_Slot slot;
+  if (liveness_operand_stack_slot(operand, &slot)) {
+    assert(effects->stack_read_count < countof(effects->stack_reads));
+    effects->stack_reads[effects->stack_read_count++] = slot;
+  } else if (
+    operand->Memory.location.tag == Memory_Location_Tag_Indirect &&
+    operand->Memory.location.Indirect.base_register == Register_SP
+  ) {
+    s64 offset = operand->Memory.location.Indirect.offset;
+    if (operand->Memory.location.Indirect.maybe_index_register.has_value && offset < 0) {
+      // :IndexScale An index, e.g. of an array element, only reaches further up within
+      // the local, which for locals laid out by `reserve_stack` ends before offset 0
+      assert(effects->stack_read_count < countof(effects->stack_reads));
+      effects->stack_reads[effects->stack_read_count++] = (Stack_Slot){offset, s64_to_u64(-offset)};
+    } else {
+      effects->reads_all_stack = true;
+    }
+  }
+}
+
+static void
+instruction_effects_write_memory(
+  const Storage *operand,
+  Instruction_Effects *effects
+) {
+  if (!operand_is_memory(operand)) return;
+  Stack_Slot slot;
+  if (liveness_operand_stack_slot(operand, &slot)) {
+    effects->stack_write = slot;
+    effects->has_stack_write = true;
+  } else {
+    effects->writes_memory = true;
+  }
+}
+
+typedef enum {
+  Operand_Access_Read,
+  Operand_Access_Write,
+  Operand_Access_Read_Write,
+} Operand_Access;
+
+#define LIVENESS_VOLATILE_REGISTERS (\
+  (1llu << Register_A) | (1llu << Register_C) | (1llu << Register_D) |\
+  (1llu << Register_R8) | (1llu << Register_R9) | (1llu << Register_R10) | (1llu << Register_R11) |\
+  (1llu << Register_Xmm0) | (1llu << Register_Xmm1) | (1llu << Register_Xmm2) |\
+  (1llu << Register_Xmm3) | (1llu << Register_Xmm4) | (1llu << Register_Xmm5) |\
+  (1llu << LIVENESS_EFLAGS_BIT)\
+)
+
+// :PrivateCallingConvention passes arguments in R10, R11, XMM4 and XMM5 as well
+#define LIVENESS_ARGUMENT_REGISTERS (\
+  (1llu << Register_C) | (1llu << Register_D) | (1llu << Register_R8) | (1llu << Register_R9) |\
+  (1llu << Register_R10) | (1llu << Register_R11) |\
+  (1llu << Register_Xmm0) | (1llu << Register_Xmm1) | (1llu << Register_Xmm2) | (1llu << Register_Xmm3) |\
+  (1llu << Register_Xmm4) | (1llu << Register_Xmm5)\
+)
+
+void
+instruction_effects(
+  const Instruction *instruction,
+  Instruction_Effects *effects
+) {
+  *effects = (Instruction_Effects){0};
+  switch(instruction->type) {
+    case Instruction_Type_Label: {
+      return;
+    }
+    case Instruction_Type_Bytes:
+    case Instruction_Type_Tail_Call: {
+      // We do not know what the machine code or the callee does so assume everything
+      effects->register_uses = LIVENESS_ALL_REGISTERS | (1llu << LIVENESS_EFLAGS_BIT);
+      effects->register_writes = effects->register_uses;
+      effects->reads_all_stack = true;
+      effects->writes_memory = true;
+      effects->has_side_effects = true;
+      return;
+    }
+    case Instruction_Type_Assembly: {
+      break;
+    }
+  }
+
+  const X64_Mnemonic *mnemonic = instruction->assembly.mnemonic;
+  const Storage *operands = instruction->assembly.operands;
+  u64 operand_count = 0;
+  while (operand_count < countof(instruction->assembly.operands)) {
+    if (operands[operand_count].tag == Storage_Tag_None) break;
+    operand_count++;
+  }
+
+  const u64 rax = liveness_register_bit(Register_A);
+  const u64 rdx = liveness_register_bit(Register_D);
+  const u64 rsp = liveness_register_bit(Register_SP);
+  const u64 eflags = 1llu << LIVENESS_EFLAGS_BIT;
+
+  Operand_Access destination_access = Operand_Access_Read_Write;
+  u64 first_source_index = 1;
+  bool writes_eflags = false;
+  if (mnemonic == jmp || instruction_is_conditional_jump(instruction)) {
+    destination_access = Operand_Access_Read;
+    effects->has_side_effects = true;
+  } else if (mnemonic == ret) {
+    destination_access = Operand_Access_Read;
+    effects->register_uses |= rsp;
+    effects->has_side_effects = true;
+  } else if (mnemonic == int3) {
+    effects->has_side_effects = true;
+  } else if (mnemonic == cmp) {
+    destination_access = Operand_Access_Read;
+    writes_eflags = true;
+  } else if (mnemonic == call) {
+    destination_access = Operand_Access_Read;
+    // :ClobberSets
+    u64 clobbered = LIVENESS_VOLATILE_REGISTERS & ~instruction->assembly.call_preserved_bitset;
+    effects->register_uses |= LIVENESS_ARGUMENT_REGISTERS | rsp;
+    effects->register_writes |= clobbered;
+    effects->register_kills |= clobbered;
+    effects->reads_call_arguments = true;
+    effects->writes_memory = true;
+    effects->has_side_effects = true;
+  } else if (mnemonic == push || mnemonic == pop) {
+    destination_access = mnemonic == push ? Operand_Access_Read : Operand_Access_Write;
+    effects->register_uses |= rsp;
+    effects->register_writes |= rsp;
+    effects->writes_memory = true;
+    effects->has_side_effects = true;
+  } else if (mnemonic == rep_movsb) {
+    u64 bits =
+      liveness_register_bit(Register_SI) | liveness_register_bit(Register_DI) |
+      liveness_register_bit(Register_C);
+    effects->register_uses |= bits;
+    effects->register_writes |= bits;
+    effects->reads_all_stack = true;
+    effects->writes_memory = true;
+    effects->has_side_effects = true;
+  } else if (mnemonic == rep_stosb) {
+    u64 bits = liveness_register_bit(Register_DI) | liveness_register_bit(Register_C);
+    effects->register_uses |= bits | rax;
+    effects->register_writes |= bits;
+    effects->writes_memory = true;
+    effects->has_side_effects = true;
+  } else if (mnemonic == cbw || mnemonic == cwd || mnemonic == cdq || mnemonic == cqo) {
+    effects->register_uses |= rax;
+    if (mnemonic == cbw) {
+      effects->register_writes |= rax;
+    } else {
+      effects->register_writes |= rdx;
+      // 32-bit and 64-bit writes clear the whole register
+      if (mnemonic != cwd) effects->register_kills |= rdx;
+    }
+  } else if ((mnemonic == imul || mnemonic == idiv) && operand_count == 1) {
+    // Implicit A register is the other operand with the result in D:A
+    destination_access = Operand_Access_Read;
+    effects->register_uses |= rax;
+    effects->register_writes |= rax;
+    if (operands[0].byte_size != 1) effects->register_writes |= rdx;
+    if (mnemonic == idiv) {
+      effects->register_uses |= rdx;
+      // Division by zero raises an exception
+      effects->has_side_effects = true;
+    }
+    if (operands[0].byte_size >= 4) effects->register_kills |= rax | rdx;
+    writes_eflags = true;
+  } else if (operand_count == 2 && operands[1].tag == Storage_Tag_Eflags) {
+    // setcc
+    destination_access = Operand_Access_Write;
+  } else if (
+    mnemonic == mov || mnemonic == movsx || mnemonic == movzx || mnemonic == lea ||
+    mnemonic == movups || mnemonic == movdqu || mnemonic == pshufd ||
+    mnemonic->encoding_list[0].vex
+  ) {
+    destination_access = Operand_Access_Write;
+  } else if (mnemonic == movss || mnemonic == movsd) {
+    // Register to register moves only replace the low part of the destination
+    if (operand_is_memory(&operands[0])) destination_access = Operand_Access_Write;
+  } else if (mnemonic == imul && operand_count == 3) {
+    destination_access = Operand_Access_Write;
+    writes_eflags = true;
+  } else if (mnemonic == xor && storage_equal(&operands[0], &operands[1]) && !operand_is_memory(&operands[0])) {
+    // Zeroing idiom does not depend on the previous value of the register
+    destination_access = Operand_Access_Write;
+    first_source_index = 2;
+    writes_eflags = true;
+  } else if (mnemonic == pxor && storage_equal(&operands[0], &operands[1])) {
+    destination_access = Operand_Access_Write;
+    first_source_index = 2;
+  } else if (
+    mnemonic == add || mnemonic == sub || mnemonic == xor || mnemonic == imul || mnemonic == inc ||
+    mnemonic == shl || mnemonic == shr || mnemonic == sar
+  ) {
+    writes_eflags = true;
+  }
+  if (writes_eflags) {
+    effects->register_writes |= eflags;
+    effects->register_kills |= eflags;
+  }
+
+  if (operand_count) {
+    const Storage *destination = &operands[0];
+    u64 destination_bits = liveness_operand_register_bits(destination);
+    effects->register_uses |= liveness_address_register_bits(destination);
+    if (destination_access == Operand_Access_Write) {
+      // Writing a partial register keeps the rest of it
+      bool is_partial_write =
+        (destination->tag == Storage_Tag_Register && destination->byte_size < 4) ||
+        (destination->tag == Storage_Tag_Xmm && destination->byte_size < 16);
+      if (is_partial_write) destination_access = Operand_Access_Read_Write;
+      else effects->register_kills |= destination_bits;
+    }
+    if (destination_access != Operand_Access_Read) {
+      effects->register_writes |= destination_bits;
+      instruction_effects_write_memory(destination, effects);
+    }
+    if (destination_access != Operand_Access_Write) {
+      effects->register_uses |= destination_bits;
+      instruction_effects_read_memory(destination, effects);
+    }
+  }
+  for (u64 i = first_source_index; i < operand_count; ++i) {
+    const Storage *source = &operands[i];
+    effects->register_uses |= liveness_address_register_bits(source);
+    if (mnemonic == lea) continue;
+    effects->register_uses |= liveness_operand_register_bits(source);
+    instruction_effects_read_memory(source, effects);
+  }
+}
+
+static inline bool
+stack_slot_overlaps(
+  const Stack_Slot *a,
+  const Stack_Slot *b
+) {
+  return a->offset < b->offset + u64_to_s64(b->byte_size)
+    && b->offset < a->offset + u64_to_s64(a->byte_size);
+}
+
+static inline bool
+stack_slot_contains(
+  const Stack_Slot *outer,
+  const Stack_Slot *inner
+) {
+  return outer->offset <= inner->offset
+    && inner->offset + u64_to_s64(inner->byte_size) <= outer->offset + u64_to_s64(outer->byte_size);
+}
+
+static void
+liveness_add_stack_slot(
+  Liveness *liveness,
+  const Stack_Slot *slot
+) {
+  for (u64 i = 0; i < dyn_array_length(liveness->stack_slots); ++i) {
+    Stack_Slot *existing = dyn_array_get(liveness->stack_slots, i);
+    if (existing->offset == slot->offset && existing->byte_size == slot->byte_size) return;
+  }
+  dyn_array_push(liveness->stack_slots, *slot);
+}
+
+static void
+liveness_stack_kill(
+  const Liveness *liveness,
+  u64 *live,
+  const Stack_Slot *write
+) {
+  for (u64 i = 0; i < dyn_array_length(liveness->stack_slots); ++i) {
+    if (stack_slot_contains(write, dyn_array_get(liveness->stack_slots, i))) {
+      live[i / 64] &= ~(1llu << (i % 64));
+    }
+  }
+}
+
+static void
+liveness_stack_gen(
+  const Liveness *liveness,
+  u64 *live,
+  const Stack_Slot *read
+) {
+  for (u64 i = 0; i < dyn_array_length(liveness->stack_slots); ++i) {
+    if (stack_slot_overlaps(read, dyn_array_get(liveness->stack_slots, i))) {
+      live[i / 64] |= 1llu << (i % 64);
+    }
+  }
+}
+
+static void
+liveness_stack_gen_all(
+  const Liveness *liveness,
+  u64 *live
+) {
+  for (u64 i = 0; i < dyn_array_length(liveness->stack_slots); ++i) {
+    live[i / 64] |= 1llu << (i % 64);
+  }
+}
+
+bool
+liveness_stack_slot_is_live(
+  const Liveness *liveness,
+  const u64 *live_stack,
+  const Stack_Slot *slot
+) {
+  for (u64 i = 0; i < dyn_array_length(liveness->stack_slots); ++i) {
+    if (!(live_stack[i / 64] & (1llu << (i % 64)))) continue;
+    if (stack_slot_overlaps(slot, dyn_array_get(liveness->stack_slots, i))) return true;
+  }
+  return false;
+}
+
+// Updates `live_registers` and `live_stack` from the state after the instruction to the state before it
+void
+liveness_step_backward(
+  const Liveness *liveness,
+  const Instruction_Effects *effects,
+  u64 *live_registers,
+  u64 *live_stack
+) {
+  *live_registers = (*live_registers & ~effects->register_kills) | effects->register_uses;
+  if (!liveness->stack_word_count) return;
+  if (effects->has_stack_write) liveness_stack_kill(liveness, live_stack, &effects->stack_write);
+  for (u8 i = 0; i < effects->stack_read_count; ++i) {
+    liveness_stack_gen(liveness, live_stack, &effects->stack_reads[i]);
+  }
+  if (effects->reads_all_stack) liveness_stack_gen_all(liveness, live_stack);
+  if (effects->reads_call_arguments && liveness->call_arguments_byte_size) {
+    Stack_Slot arguments = {.offset = 0, .byte_size = liveness->call_arguments_byte_size};
+    liveness_stack_gen(liveness, live_stack, &arguments);
+  }
+}
+
+// Live state at the end of the block based on the successors and how the block exits
+static void
+liveness_block_out(
+  const Liveness *liveness,
+  const Control_Flow_Graph *graph,
+  u64 block_index,
+  u64 *live_registers,
+  u64 *live_stack
+) {
+  const Basic_Block *block = dyn_array_get(graph->blocks, block_index);
+  u64 words = liveness->stack_word_count;
+  *live_registers = 0;
+  memset(live_stack, 0, sizeof(u64) * words);
+  s64 successors[] = {block->jump_target, block->fallthrough};
+  for (u64 i = 0; i < countof(successors); ++i) {
+    if (successors[i] == -1) continue;
+    *live_registers |= liveness->register_live_in[successors[i]];
+    const u64 *successor_stack = liveness->stack_live_in + successors[i] * words;
+    for (u64 word = 0; word < words; ++word) live_stack[word] |= successor_stack[word];
+  }
+  // Locals of the function are gone once it returns
+  if (block->exit == Basic_Block_Exit_Return) *live_registers |= liveness->return_registers;
+  if (block->exit == Basic_Block_Exit_Unknown) {
+    *live_registers |= LIVENESS_ALL_REGISTERS;
+    liveness_stack_gen_all(liveness, live_stack);
+  }
+}
+
+Liveness
+liveness_compute(
+  const Function_Builder *builder,
+  const Control_Flow_Graph *graph,
+  bool track_stack_slots
+) {
+  const Array_Instruction instructions = builder->code_block.instructions;
+  u64 instruction_count = dyn_array_length(instructions);
+  u64 block_count = dyn_array_length(graph->blocks);
+  Liveness liveness = {
+    .stack_slots = dyn_array_make(Array_Stack_Slot),
+    .call_arguments_byte_size = builder->max_call_parameters_stack_size,
+    .return_registers = LIVENESS_ALL_REGISTERS,
+  };
+  // The caller only looks at the return value in RAX or XMM0 and the epilogue
+  // reads the pointer to a larger return value from RCX. Non-volatile registers
+  // are restored by the epilogue if the function uses them, so otherwise they
+  // need to be kept intact.
+  u64 saved_registers = 0;
+  for (Register reg_index = 0; reg_index <= Register_R15; ++reg_index) {
+    if (!register_bitset_get(builder->used_register_bitset, reg_index)) continue;
+    if (register_bitset_get(builder->code_block.register_volatile_bitset, reg_index)) continue;
+    saved_registers |= liveness_register_bit(reg_index);
+  }
+  liveness.return_registers &= ~(LIVENESS_VOLATILE_REGISTERS | saved_registers);
+  liveness.return_registers |=
+    liveness_register_bit(Register_A) | liveness_register_bit(Register_C) |
+    liveness_register_bit(Register_Xmm0) | liveness_register_bit(Register_SP);
+  // :PrivateCallingConvention
+  if (builder->function && calling_convention_returns_in_register_pair(
+    builder->calling_convention, builder->function->returns.descriptor
+  )) {
+    liveness.return_registers |= liveness_register_bit(Register_D);
+  }
+
+  if (track_stack_slots) {
+    for (u64 i = 0; i < instruction_count; ++i) {
+      Instruction_Effects effects;
+      instruction_effects(dyn_array_get(instructions, i), &effects);
+      // Offsets are only comparable as long as RSP does not move within the body
+      if (effects.register_writes & liveness_register_bit(Register_SP)) {
+        dyn_array_clear(liveness.stack_slots);
+        break;
+      }
+      if (effects.has_stack_write) liveness_add_stack_slot(&liveness, &effects.stack_write);
+      for (u8 read_index = 0; read_index < effects.stack_read_count; ++read_index) {
+        liveness_add_stack_slot(&liveness, &effects.stack_reads[read_index]);
+      }
+    }
+    liveness.stack_word_count = (dyn_array_length(liveness.stack_slots) + 63) / 64;
+  }
+
+  u64 words = liveness.stack_word_count;
+  // Allocating at least one item keeps the allocator happy for empty functions
+  u64 block_allocation_count = block_count ? block_count : 1;
+  liveness.register_live_in = allocator_allocate_array(allocator_default, u64, block_allocation_count);
+  liveness.register_live_out = allocator_allocate_array(allocator_default, u64, block_allocation_count);
+  memset(liveness.register_live_in, 0, sizeof(u64) * block_allocation_count);
+  memset(liveness.register_live_out, 0, sizeof(u64) * block_allocation_count);
+  u64 stack_allocation_count = block_allocation_count * (words ? words : 1);
+  liveness.stack_live_in = allocator_allocate_array(allocator_default, u64, stack_allocation_count);
+  liveness.stack_live_out = allocator_allocate_array(allocator_default, u64, stack_allocation_count);
+  memset(liveness.stack_live_in, 0, sizeof(u64) * stack_allocation_count);
+  memset(liveness.stack_live_out, 0, sizeof(u64) * stack_allocation_count);
+
+  // Going backwards over the blocks converges quickly as most edges go forward
+  u64 *stack_scratch = allocator_allocate_array(allocator_default, u64, words ? words : 1);
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (u64 block_index = block_count; block_index-- > 0;) {
+      const Basic_Block *block = dyn_array_get(graph->blocks, block_index);
+      u64 *stack_out = liveness.stack_live_out + block_index * words;
+      u64 *stack_in = liveness.stack_live_in + block_index * words;
+      u64 live_registers;
+      liveness_block_out(&liveness, graph, block_index, &live_registers, stack_out);
+      liveness.register_live_out[block_index] = live_registers;
+      if (words) memcpy(stack_scratch, stack_out, sizeof(u64) * words);
+      for (u64 i = block->instruction_count; i-- > 0;) {
+        Instruction_Effects effects;
+        instruction_effects(dyn_array_get(instructions, block->first_instruction_index + i), &effects);
+        liveness_step_backward(&liveness, &effects, &live_registers, stack_scratch);
+      }
+      if (live_registers != liveness.register_live_in[block_index]) changed = true;
+      liveness.register_live_in[block_index] = live_registers;
+      if (words && memcmp(stack_scratch, stack_in, sizeof(u64) * words) != 0) {
+        memcpy(stack_in, stack_scratch, sizeof(u64) * words);
+        changed = true;
+      }
+    }
+  }
+  allocator_deallocate(allocator_default, stack_scratch, sizeof(u64) * (words ? words : 1));
+
+  return liveness;
+}
+
+void
+liveness_destroy(
+  Liveness *liveness,
+  const Control_Flow_Graph *graph
+) {
+  u64 block_count = dyn_array_length(graph->blocks);
+  u64 block_allocation_count = block_count ? block_count : 1;
+  u64 words = liveness->stack_word_count;
+  u64 stack_allocation_count = block_allocation_count * (words ? words : 1);
+  allocator_deallocate(allocator_default, liveness->register_live_in, sizeof(u64) * block_allocation_count);
+  allocator_deallocate(allocator_default, liveness->register_live_out, sizeof(u64) * block_allocation_count);
+  allocator_deallocate(allocator_default, liveness->stack_live_in, sizeof(u64) * stack_allocation_count);
+  allocator_deallocate(allocator_default, liveness->stack_live_out, sizeof(u64) * stack_allocation_count);
+  dyn_array_destroy(liveness->stack_slots);
+}
+
+// :PromoteStackSlots
+// Locals created by `reserve_stack` live in RSP-relative memory, so e.g. a loop counter
+// is loaded and stored on every iteration. A local that can not be pointed to is moved
+// into a register that is not live anywhere the local is, so registers that only hold
+// temporaries before or after the local is used can be shared with it.
+//
+// Addresses of locals only leak through `lea` with an RSP base and only an indexed operand
+// can reach a local other than the one at its offset. `reserve_stack` lays out locals
+// downwards, and both a pointer and an index can only reach memory above the offset within
+// that local, so every local below the lowest such offset can not be referenced indirectly.
+typedef struct {
+  Stack_Slot slot;
+  u64 access_count;
+  bool is_promotable;
+} Stack_Slot_Promotion;
+typedef dyn_array_type(Stack_Slot_Promotion) Array_Stack_Slot_Promotion;
+
+static Stack_Slot_Promotion *
+stack_slot_promotion_find(
+  Array_Stack_Slot_Promotion promotions,
+  const Stack_Slot *slot
+) {
+  for (u64 i = 0; i < dyn_array_length(promotions); ++i) {
+    Stack_Slot_Promotion *promotion = dyn_array_get(promotions, i);
+    if (promotion->slot.offset != slot->offset) continue;
+    if (promotion->slot.byte_size != slot->byte_size) continue;
+    return promotion;
+  }
+  return 0;
+}
+
+static inline Storage
+stack_slot_promotion_register(
+  Register reg,
+  u64 byte_size
+) {
+  return (Storage){
+    .tag = Storage_Tag_Register,
+    .byte_size = byte_size,
+    .Register.index = reg,
+  };
+}
+
+// Collects the registers that interfere with the slot. As the slot can not be pointed to,
+// only the instructions that have it as an operand read or write it.
+static u64
+stack_slot_promotion_conflicts(
+  const Function_Builder *builder,
+  const Control_Flow_Graph *graph,
+  const Liveness *liveness,
+  const Stack_Slot *slot
+) {
+  const Array_Instruction instructions = builder->code_block.instructions;
+  u64 block_count = dyn_array_length(graph->blocks);
+  u64 block_allocation_count = block_count ? block_count : 1;
+  bool *slot_live_in = allocator_allocate_array(allocator_default, bool, block_allocation_count);
+  memset(slot_live_in, 0, sizeof(bool) * block_allocation_count);
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (u64 block_index = block_count; block_index-- > 0;) {
+      const Basic_Block *block = dyn_array_get(graph->blocks, block_index);
+      bool live = (block->jump_target != -1 && slot_live_in[block->jump_target])
+        || (block->fallthrough != -1 && slot_live_in[block->fallthrough]);
+      for (u64 i = block->instruction_count; i-- > 0;) {
+        Instruction_Effects effects;
+        instruction_effects(dyn_array_get(instructions, block->first_instruction_index + i), &effects);
+        if (effects.has_stack_write && stack_slot_contains(&effects.stack_write, slot)) live = false;
+        for (u8 read_index = 0; read_index < effects.stack_read_count; ++read_index) {
+          if (stack_slot_overlaps(&effects.stack_reads[read_index], slot)) live = true;
+        }
+      }
+      if (live != slot_live_in[block_index]) changed = true;
+      slot_live_in[block_index] = live;
+    }
+  }
+
+  u64 conflicts = 0;
+  for (u64 block_index = 0; block_index < block_count; ++block_index) {
+    const Basic_Block *block = dyn_array_get(graph->blocks, block_index);
+    if (!block->reachable) continue;
+    u64 live_registers = liveness->register_live_out[block_index];
+    bool live = (block->jump_target != -1 && slot_live_in[block->jump_target])
+      || (block->fallthrough != -1 && slot_live_in[block->fallthrough]);
+    for (u64 i = block->instruction_count; i-- > 0;) {
+      Instruction_Effects effects;
+      instruction_effects(dyn_array_get(instructions, block->first_instruction_index + i), &effects);
+      bool writes_slot = effects.has_stack_write && stack_slot_overlaps(&effects.stack_write, slot);
+      // A write to the slot becomes a write to the register, even if the value is never read
+      if (live || writes_slot) conflicts |= live_registers | effects.register_writes;
+      liveness_step_backward(liveness, &effects, &live_registers, 0);
+      if (writes_slot) live = false;
+      for (u8 read_index = 0; read_index < effects.stack_read_count; ++read_index) {
+        if (stack_slot_overlaps(&effects.stack_reads[read_index], slot)) live = true;
+      }
+      if (live) conflicts |= live_registers;
+    }
+  }
+
+  allocator_deallocate(allocator_default, slot_live_in, sizeof(bool) * block_allocation_count);
+  return conflicts;
+}
+
+bool
+fn_promote_stack_slots(
+  Function_Builder *builder
+) {
+  Array_Instruction instructions = builder->code_block.instructions;
+  const u64 rsp = liveness_register_bit(Register_SP);
+  s64 lowest_leaked_offset = 0;
+  Array_Stack_Slot_Promotion promotions = dyn_array_make(Array_Stack_Slot_Promotion);
+
+  bool can_promote = true;
+  for (u64 i = 0; can_promote && i < dyn_array_length(instructions); ++i) {
+    Instruction *instruction = dyn_array_get(instructions, i);
+    if (instruction->type == Instruction_Type_Label) continue;
+    // Machine code provided by the user might use any register
+    if (instruction->type == Instruction_Type_Bytes) {
+      can_promote = false;
+      break;
+    }
+    // :TailCall The frame is gone by the time the callee runs
+    if (instruction->type == Instruction_Type_Tail_Call) continue;
+    Instruction_Effects effects;
+    instruction_effects(instruction, &effects);
+    if (effects.register_writes & rsp) {
+      can_promote = false;
+      break;
+    }
+    for (u64 operand_index = 0; operand_index < countof(instruction->assembly.operands); ++operand_index) {
+      const Storage *operand = &instruction->assembly.operands[operand_index];
+      if (operand->tag == Storage_Tag_None) break;
+      if (!operand_is_memory(operand)) continue;
+      if (operand->Memory.location.tag != Memory_Location_Tag_Indirect) continue;
+      if (operand->Memory.location.Indirect.base_register != Register_SP) continue;
+      bool is_indexed = operand->Memory.location.Indirect.maybe_index_register.has_value;
+      if (instruction->assembly.mnemonic == lea || is_indexed) {
+        // An index, e.g. of an array element, can only move the address further up
+        s64 offset = operand->Memory.location.Indirect.offset;
+        if (offset < lowest_leaked_offset) lowest_leaked_offset = offset;
+        continue;
+      }
+      Stack_Slot slot;
+      if (!liveness_operand_stack_slot(operand, &slot)) {
+        can_promote = false;
+        break;
+      }
+      Stack_Slot_Promotion *promotion = stack_slot_promotion_find(promotions, &slot);
+      if (!promotion) {
+        promotion = dyn_array_push(promotions, (Stack_Slot_Promotion){
+          .slot = slot,
+          .is_promotable = slot.offset < 0 && slot.byte_size <= 8,
+        });
+      }
+      promotion->access_count++;
+      // The replacement register must be usable in place of the memory operand
+      Storage original = *operand;
+      Storage *mutable_operand = &instruction->assembly.operands[operand_index];
+      *mutable_operand = stack_slot_promotion_register(Register_A, slot.byte_size);
+      if (!instruction_find_encoding(instruction)) promotion->is_promotable = false;
+      *mutable_operand = original;
+    }
+  }
+
+  bool changed = false;
+  if (!can_promote) goto cleanup;
+
+  for (u64 i = 0; i < dyn_array_length(promotions); ++i) {
+    Stack_Slot_Promotion *promotion = dyn_array_get(promotions, i);
+    if (promotion->slot.offset + u64_to_s64(promotion->slot.byte_size) > lowest_leaked_offset) {
+      promotion->is_promotable = false;
+    }
+    // Partially overlapping accesses would need to be split or merged
+    for (u64 j = 0; j < dyn_array_length(promotions); ++j) {
+      if (i == j) continue;
+      Stack_Slot_Promotion *other = dyn_array_get(promotions, j);
+      if (stack_slot_overlaps(&promotion->slot, &other->slot)) promotion->is_promotable = false;
+    }
+  }
+
+  Register candidates[] = {
+    Register_A, Register_C, Register_D, Register_R8, Register_R9, Register_R10, Register_R11,
+    Register_B, Register_SI, Register_DI, Register_R12, Register_R13, Register_R14, Register_R15,
+  };
+  Control_Flow_Graph graph = control_flow_graph_make(builder);
+  for (;;) {
+    // The most frequently accessed locals, such as loop counters, benefit the most
+    Stack_Slot_Promotion *best = 0;
+    for (u64 i = 0; i < dyn_array_length(promotions); ++i) {
+      Stack_Slot_Promotion *promotion = dyn_array_get(promotions, i);
+      if (!promotion->is_promotable) continue;
+      if (!best || promotion->access_count > best->access_count) best = promotion;
+    }
+    if (!best) break;
+    best->is_promotable = false;
+
+    // Non-volatile registers the function does not use yet are not live at the return
+    // as far as the promoted local is concerned, since the prolog would save them
+    u64 used_register_bitset = builder->used_register_bitset;
+    for (u64 i = 0; i < countof(candidates); ++i) {
+      register_bitset_set(&builder->used_register_bitset, candidates[i]);
+    }
+    Liveness liveness = liveness_compute(builder, &graph, false);
+    builder->used_register_bitset = used_register_bitset;
+    u64 conflicts = stack_slot_promotion_conflicts(builder, &graph, &liveness, &best->slot);
+    liveness_destroy(&liveness, &graph);
+
+    // Volatile registers and the already saved ones come first as any other
+    // non-volatile register would need to be saved in the prolog
+    Register reg = Register_SP;
+    for (u64 pass = 0; pass < 2 && reg == Register_SP; ++pass) {
+      for (u64 i = 0; i < countof(candidates); ++i) {
+        if (conflicts & liveness_register_bit(candidates[i])) continue;
+        // Byte access to SI and DI needs a REX prefix, without it the encoding means DH or BH
+        bool is_byte_ambiguous = candidates[i] == Register_SI || candidates[i] == Register_DI;
+        if (best->slot.byte_size == 1 && is_byte_ambiguous) continue;
+        bool is_free_to_use =
+          register_bitset_get(builder->code_block.register_volatile_bitset, candidates[i]) ||
+          register_bitset_get(builder->used_register_bitset, candidates[i]);
+        if (pass == 0 && !is_free_to_use) continue;
+        reg = candidates[i];
+        break;
+      }
+    }
+    if (reg == Register_SP) continue;
+    register_bitset_set(&builder->used_register_bitset, reg);
+
+    Storage replacement = stack_slot_promotion_register(reg, best->slot.byte_size);
+    for (u64 i = 0; i < dyn_array_length(instructions); ++i) {
+      Instruction *instruction = dyn_array_get(instructions, i);
+      if (instruction->type != Instruction_Type_Assembly) continue;
+      for (u64 operand_index = 0; operand_index < countof(instruction->assembly.operands); ++operand_index) {
+        Storage *operand = &instruction->assembly.operands[operand_index];
+        if (operand->tag == Storage_Tag_None) break;
+        if (instruction->assembly.mnemonic == lea) continue;
+        Stack_Slot slot;
+        if (!liveness_operand_stack_slot(operand, &slot)) continue;
+        if (slot.offset != best->slot.offset || slot.byte_size != best->slot.byte_size) continue;
+        *operand = replacement;
+      }
+    }
+    changed = true;
+  }
+  control_flow_graph_destroy(&graph);
+
+  // Once no local is left in memory there is no need for the space in the frame
+  if (changed && lowest_leaked_offset == 0) {
+    bool has_locals_in_memory = false;
+    for (u64 i = 0; i < dyn_array_length(instructions); ++i) {
+      Instruction *instruction = dyn_array_get(instructions, i);
+      if (instruction->type != Instruction_Type_Assembly) continue;
+      for (u64 operand_index = 0; operand_index < countof(instruction->assembly.operands); ++operand_index) {
+        Stack_Slot slot;
+        if (!liveness_operand_stack_slot(&instruction->assembly.operands[operand_index], &slot)) continue;
+        if (slot.offset < 0) has_locals_in_memory = true;
+      }
+    }
+    if (!has_locals_in_memory) builder->stack_reserve = 0;
+  }
+
+  cleanup:
+  dyn_array_destroy(promotions);
+  return changed;
+}
+
+// :CopyPropagation
+// Values are often chained through temporary registers and stack slots, e.g. by
+// `assign` and `move_to_result_from_temp`. Within a basic block reads of a location
+// that was just copied from another one are redirected to the original, which
+// usually leaves the copy itself dead for `fn_eliminate_dead_code` to remove.
+typedef struct {
+  Storage destination;
+  Storage source;
+} Available_Copy;
+typedef dyn_array_type(Available_Copy) Array_Available_Copy;
+
+static inline bool
+copy_propagation_is_location(
+  const Storage *storage,
+  bool track_stack_slots
+) {
+  Stack_Slot slot;
+  if (storage->tag == Storage_Tag_Register) {
+    // Byte registers are excluded as the meaning of some of them depends on the REX prefix
+    return storage->byte_size >= 2 && storage->Register.index != Register_SP;
+  }
+  return track_stack_slots && liveness_operand_stack_slot(storage, &slot);
+}
+
+static u64
+copy_propagation_register_bits(
+  const Storage *storage
+) {
+  return liveness_operand_register_bits(storage) | liveness_address_register_bits(storage);
+}
+
+static void
+copy_propagation_invalidate(
+  Array_Available_Copy copies,
+  const Instruction_Effects *effects
+) {
+  for (u64 i = 0; i < dyn_array_length(copies);) {
+    Available_Copy *copy = dyn_array_get(copies, i);
+    bool is_valid = true;
+    u64 bits = copy_propagation_register_bits(&copy->destination) | copy_propagation_register_bits(&copy->source);
+    if (bits & effects->register_writes) is_valid = false;
+    const Storage *locations[] = {&copy->destination, &copy->source};
+    for (u64 location_index = 0; location_index < countof(locations); ++location_index) {
+      Stack_Slot slot;
+      if (!liveness_operand_stack_slot(locations[location_index], &slot)) continue;
+      if (effects->writes_memory) is_valid = false;
+      if (effects->has_stack_write && stack_slot_overlaps(&slot, &effects->stack_write)) is_valid = false;
+    }
+    if (is_valid) {
+      ++i;
+    } else {
+      dyn_array_delete(copies, i);
+    }
+  }
+}
+
+static const Available_Copy *
+copy_propagation_find(
+  Array_Available_Copy copies,
+  const Storage *destination
+) {
+  for (u64 i = 0; i < dyn_array_length(copies); ++i) {
+    Available_Copy *copy = dyn_array_get(copies, i);
+    if (storage_equal(&copy->destination, destination)) return copy;
+  }
+  return 0;
+}
+
+static Register
+copy_propagation_address_register(
+  Array_Available_Copy copies,
+  Register reg
+) {
+  for (u64 i = 0; i < dyn_array_length(copies); ++i) {
+    Available_Copy *copy = dyn_array_get(copies, i);
+    if (copy->destination.tag != Storage_Tag_Register) continue;
+    if (copy->destination.byte_size != 8) continue;
+    if (copy->destination.Register.index != reg) continue;
+    if (copy->source.tag != Storage_Tag_Register) return reg;
+    return copy->source.Register.index;
+  }
+  return reg;
+}
+
+// Returns true if any of the operands was replaced
+static bool
+copy_propagation_rewrite(
+  Array_Available_Copy copies,
+  Instruction *instruction
+) {
+  if (instruction->type != Instruction_Type_Assembly) return false;
+  const X64_Mnemonic *mnemonic = instruction->assembly.mnemonic;
+  // Immediate operands mean relative targets for the control flow instructions
+  if (mnemonic == call || mnemonic == jmp || instruction_is_conditional_jump(instruction)) return false;
+  Instruction_Effects effects;
+  instruction_effects(instruction, &effects);
+  Storage *operands = instruction->assembly.operands;
+  bool rewritten = false;
+  for (u64 i = 0; i < countof(instruction->assembly.operands); ++i) {
+    Storage *operand = &operands[i];
+    if (operand->tag == Storage_Tag_None) break;
+
+    if (operand->tag == Storage_Tag_Memory && operand->Memory.location.tag == Memory_Location_Tag_Indirect) {
+      Memory_Location_Indirect *indirect = &operand->Memory.location.Indirect;
+      Memory_Location_Indirect original = *indirect;
+      indirect->base_register = copy_propagation_address_register(copies, indirect->base_register);
+      if (indirect->maybe_index_register.has_value) {
+        indirect->maybe_index_register.index =
+          copy_propagation_address_register(copies, indirect->maybe_index_register.index);
+      }
+      if (memcmp(&original, indirect, sizeof(original)) != 0) {
+        if (instruction_find_encoding(instruction)) {
+          rewritten = true;
+        } else {
+          *indirect = original;
+        }
+      }
+    }
+
+    bool is_read_only;
+    if (i == 0) {
+      if (operand->tag == Storage_Tag_Memory) {
+        is_read_only = !effects.has_stack_write && !effects.writes_memory;
+      } else {
+        is_read_only = !(liveness_operand_register_bits(operand) & effects.register_writes);
+      }
+    } else {
+      is_read_only = mnemonic != lea;
+      // Zeroing idiom relies on both operands being the same register
+      if (mnemonic == xor && storage_equal(&operands[0], operand)) is_read_only = false;
+    }
+    if (!is_read_only) continue;
+    const Available_Copy *copy = copy_propagation_find(copies, operand);
+    if (!copy) continue;
+    Storage original = *operand;
+    *operand = copy->source;
+    if (instruction_find_encoding(instruction)) {
+      rewritten = true;
+    } else {
+      *operand = original;
+    }
+  }
+  return rewritten;
+}
+
+bool
+fn_propagate_copies(
+  Function_Builder *builder,
+  bool track_stack_slots
+) {
+  Array_Instruction instructions = builder->code_block.instructions;
+  if (!dyn_array_length(instructions)) return false;
+  Control_Flow_Graph graph = control_flow_graph_make(builder);
+  Array_Available_Copy copies = dyn_array_make(Array_Available_Copy);
+  bool changed = false;
+  for (u64 block_index = 0; block_index < dyn_array_length(graph.blocks); ++block_index) {
+    const Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+    if (!block->reachable) continue;
+    dyn_array_clear(copies);
+    for (u64 i = 0; i < block->instruction_count; ++i) {
+      Instruction *instruction = dyn_array_get(instructions, block->first_instruction_index + i);
+      if (copy_propagation_rewrite(copies, instruction)) changed = true;
+      Instruction_Effects effects;
+      instruction_effects(instruction, &effects);
+      copy_propagation_invalidate(copies, &effects);
+      if (instruction->type != Instruction_Type_Assembly) continue;
+      if (instruction->assembly.mnemonic != mov) continue;
+      const Storage *destination = &instruction->assembly.operands[0];
+      const Storage *source = &instruction->assembly.operands[1];
+      // Immediates of 64-bit instructions are sign-extended the same way as in `mov r/m64, imm32`
+      bool is_sign_extended_immediate =
+        source->tag == Storage_Tag_Static && source->byte_size == 4 && destination->byte_size == 8;
+      if (destination->byte_size != source->byte_size && !is_sign_extended_immediate) continue;
+      if (storage_equal(destination, source)) continue;
+      if (!copy_propagation_is_location(destination, track_stack_slots)) continue;
+      if (source->tag != Storage_Tag_Static && !copy_propagation_is_location(source, track_stack_slots)) continue;
+      dyn_array_push(copies, (Available_Copy){*destination, *source});
+    }
+  }
+  dyn_array_destroy(copies);
+  control_flow_graph_destroy(&graph);
+  return changed;
+}
+
+u64
+fn_count_moves(
+  const Function_Builder *builder
+) {
+  u64 count = 0;
+  for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+    Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+    if (instruction->type != Instruction_Type_Assembly) continue;
+    if (instruction->assembly.mnemonic == mov) count++;
+  }
+  return count;
+}
+
+// :ClobberSets
+// Volatile registers that can be modified by calling the function. Callers
+// that know which function they call only need to save registers from this
+// set and the optimizer can keep values in the other ones across the call.
+u64
+fn_clobbered_registers(
+  const Function_Builder *builder
+) {
+  // :ReturnTypeLargerThanRegister The pointer is copied to RAX on the way out
+  u64 clobbered = liveness_register_bit(Register_A);
+  for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+    Instruction_Effects effects;
+    instruction_effects(dyn_array_get(builder->code_block.instructions, i), &effects);
+    clobbered |= effects.register_writes;
+  }
+  return clobbered & LIVENESS_VOLATILE_REGISTERS;
+}
+
+// :ValueNumbering
+// Local value numbering over each basic block. Every register and stack slot
+// gets a number for the value it holds and a pure instruction is identified by
+// its mnemonic and the numbers of the values it reads. When the same computation
+// is seen again the instruction is dropped if its results are still in place or
+// turned into a `mov` from a register that still holds the result.
+//
+// Results that are not in place are often recomputed by a chain of instructions
+// that all match earlier ones (e.g. `mov rax, a; cqo; idiv b` for a quotient and
+// a remainder) so such instructions are removed only tentatively. They are put
+// back if something reads their results before a later instruction of the chain
+// is found to be redundant or before the results are overwritten.
+#define VALUE_NUMBERING_REGISTER_COUNT (LIVENESS_EFLAGS_BIT + 1)
+#define VALUE_NUMBERING_MAX_USED_REGISTERS 8
+#define VALUE_NUMBERING_MAX_IMPLICIT_OUTPUTS 4
+
+typedef struct {
+  u64 tag_and_byte_size;
+  u64 values[3];
+} Value_Numbering_Operand_Key;
+
+typedef struct {
+  const X64_Mnemonic *mnemonic;
+  Value_Numbering_Operand_Key operands[3];
+  u64 used_registers;
+  u64 used_values[VALUE_NUMBERING_MAX_USED_REGISTERS];
+  u64 memory_epoch;
+  u64 stack_epoch;
+} Value_Numbering_Key;
+
+typedef struct {
+  Value_Numbering_Key key;
+  u64 destination_value;
+  u64 implicit_values[VALUE_NUMBERING_MAX_IMPLICIT_OUTPUTS];
+} Value_Numbering_Entry;
+typedef dyn_array_type(Value_Numbering_Entry) Array_Value_Numbering_Entry;
+
+typedef struct {
+  Stack_Slot slot;
+  u64 value;
+} Value_Numbering_Slot;
+typedef dyn_array_type(Value_Numbering_Slot) Array_Value_Numbering_Slot;
+
+typedef struct {
+  u64 instruction_index;
+  // Registers written by the instruction that were neither read nor overwritten yet
+  u64 output_registers;
+  s64 dependencies[VALUE_NUMBERING_MAX_USED_REGISTERS];
+  u8 dependency_count;
+  // Register that held the result when the instruction was seen or -1
+  s64 replacement_source;
+  bool resolved;
+} Value_Numbering_Pending;
+typedef dyn_array_type(Value_Numbering_Pending) Array_Value_Numbering_Pending;
+
+typedef enum {
+  Value_Numbering_Decision_Keep,
+  Value_Numbering_Decision_Remove,
+  Value_Numbering_Decision_Replace,
+} Value_Numbering_Decision;
+
+typedef struct {
+  bool track_stack_slots;
+  u64 next_value;
+  u64 memory_epoch;
+  // Changes with every write to the stack for reads through an index
+  u64 stack_epoch;
+  // Values as they would be if all of the instructions were executed
+  u64 virtual_values[VALUE_NUMBERING_REGISTER_COUNT];
+  // Values actually in the registers with the removed instructions skipped
+  u64 actual_values[VALUE_NUMBERING_REGISTER_COUNT];
+  // Tentatively removed instruction that produced the virtual value or -1
+  s64 pending_writers[VALUE_NUMBERING_REGISTER_COUNT];
+  Array_Value_Numbering_Slot slots;
+  Array_Value_Numbering_Entry entries;
+  Array_Value_Numbering_Pending pendings;
+  Value_Numbering_Decision *decisions;
+  Register *replacement_sources;
+} Value_Numbering;
+
+static inline u64
+value_numbering_next(
+  Value_Numbering *numbering
+) {
+  return ++numbering->next_value;
+}
+
+static void
+value_numbering_reset(
+  Value_Numbering *numbering
+) {
+  for (u64 i = 0; i < VALUE_NUMBERING_REGISTER_COUNT; ++i) {
+    numbering->virtual_values[i] = numbering->actual_values[i] = value_numbering_next(numbering);
+    numbering->pending_writers[i] = -1;
+  }
+  numbering->memory_epoch = value_numbering_next(numbering);
+  numbering->stack_epoch = value_numbering_next(numbering);
+  dyn_array_clear(numbering->slots);
+  dyn_array_clear(numbering->entries);
+  dyn_array_clear(numbering->pendings);
+}
+
+static u64
+value_numbering_slot_value(
+  Value_Numbering *numbering,
+  const Stack_Slot *slot
+) {
+  for (u64 i = 0; i < dyn_array_length(numbering->slots); ++i) {
+    Value_Numbering_Slot *known = dyn_array_get(numbering->slots, i);
+    if (known->slot.offset == slot->offset && known->slot.byte_size == slot->byte_size) {
+      return known->value;
+    }
+  }
+  // Contents of a slot do not change until it is written so a fresh number is stable
+  u64 value = value_numbering_next(numbering);
+  dyn_array_push(numbering->slots, (Value_Numbering_Slot){*slot, value});
+  return value;
+}
+
+static void
+value_numbering_set_slot_value(
+  Value_Numbering *numbering,
+  const Stack_Slot *slot,
+  u64 value
+) {
+  for (u64 i = 0; i < dyn_array_length(numbering->slots);) {
+    Value_Numbering_Slot *known = dyn_array_get(numbering->slots, i);
+    if (stack_slot_overlaps(&known->slot, slot)) {
+      dyn_array_delete(numbering->slots, i);
+    } else {
+      ++i;
+    }
+  }
+  dyn_array_push(numbering->slots, (Value_Numbering_Slot){*slot, value});
+}
+
+static void
+value_numbering_materialize(
+  Value_Numbering *numbering,
+  s64 pending_index
+) {
+  Value_Numbering_Pending *pending = dyn_array_get(numbering->pendings, pending_index);
+  if (pending->resolved) return;
+  pending->resolved = true;
+  if (pending->replacement_source != -1) {
+    // The register with the result was not touched at that point so a copy is enough
+    numbering->decisions[pending->instruction_index] = Value_Numbering_Decision_Replace;
+    numbering->replacement_sources[pending->instruction_index] = (Register)pending->replacement_source;
+  } else {
+    numbering->decisions[pending->instruction_index] = Value_Numbering_Decision_Keep;
+    // Inputs of the instruction must be there for it to be executed
+    for (u8 i = 0; i < pending->dependency_count; ++i) {
+      value_numbering_materialize(numbering, pending->dependencies[i]);
+    }
+  }
+  for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+    if (numbering->pending_writers[reg] != pending_index) continue;
+    numbering->actual_values[reg] = numbering->virtual_values[reg];
+    numbering->pending_writers[reg] = -1;
+  }
+}
+
+static void
+value_numbering_read_registers(
+  Value_Numbering *numbering,
+  u64 registers
+) {
+  for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+    if (!(registers & (1llu << reg))) continue;
+    s64 pending_index = numbering->pending_writers[reg];
+    if (pending_index != -1) value_numbering_materialize(numbering, pending_index);
+  }
+}
+
+static void
+value_numbering_overwrite_registers(
+  Value_Numbering *numbering,
+  u64 registers
+) {
+  for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+    if (!(registers & (1llu << reg))) continue;
+    s64 pending_index = numbering->pending_writers[reg];
+    if (pending_index == -1) continue;
+    numbering->pending_writers[reg] = -1;
+    Value_Numbering_Pending *pending = dyn_array_get(numbering->pendings, pending_index);
+    pending->output_registers &= ~(1llu << reg);
+    if (pending->output_registers) continue;
+    // Nothing has read any of the results so the instruction is dead, unless another
+    // tentatively removed instruction read them in which case it is decided with that one
+    bool has_dependents = false;
+    for (u64 i = 0; i < dyn_array_length(numbering->pendings); ++i) {
+      Value_Numbering_Pending *other = dyn_array_get(numbering->pendings, i);
+      if (other->resolved) continue;
+      for (u8 dependency_index = 0; dependency_index < other->dependency_count; ++dependency_index) {
+        if (other->dependencies[dependency_index] == pending_index) has_dependents = true;
+      }
+    }
+    if (!has_dependents) pending->resolved = true;
+  }
+}
+
+// Registers that are written by the instruction in a way that depends on the operand only
+static inline u64
+value_numbering_destination_register_bits(
+  const Instruction *instruction,
+  const Instruction_Effects *effects
+) {
+  const Storage *destination = &instruction->assembly.operands[0];
+  if (destination->tag != Storage_Tag_Register && destination->tag != Storage_Tag_Xmm) return 0;
+  return liveness_operand_register_bits(destination) & effects->register_writes;
+}
+
+static void
+value_numbering_operand_key(
+  Value_Numbering *numbering,
+  const Storage *operand,
+  bool is_read,
+  bool is_address_only,
+  Value_Numbering_Operand_Key *key,
+  bool *reads_memory,
+  bool *reads_stack
+) {
+  key->tag_and_byte_size = ((u64)operand->tag << 48) | ((u64)is_read << 47) | operand->byte_size;
+  switch(operand->tag) {
+    case Storage_Tag_None:
+    case Storage_Tag_Any: {
+      break;
+    }
+    case Storage_Tag_Register:
+    case Storage_Tag_Xmm: {
+      if (!is_read) break;
+      u64 bits = liveness_operand_register_bits(operand);
+      for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+        if (bits & (1llu << reg)) key->values[0] = numbering->virtual_values[reg];
+      }
+      break;
+    }
+    case Storage_Tag_Eflags: {
+      key->values[0] = operand->Eflags.compare_type;
+      break;
+    }
+    case Storage_Tag_Static: {
+      if (operand->byte_size <= sizeof(key->values[0])) {
+        memcpy(&key->values[0], operand->Static.memory, operand->byte_size);
+      } else {
+        key->values[0] = (u64)operand->Static.memory;
+      }
+      break;
+    }
+    case Storage_Tag_Memory: {
+      Stack_Slot slot;
+      const Memory_Location *location = &operand->Memory.location;
+      if (numbering->track_stack_slots && !is_address_only && liveness_operand_stack_slot(operand, &slot)) {
+        // The location of a written slot is an output and not part of the computation
+        if (is_read) key->values[0] = value_numbering_slot_value(numbering, &slot);
+      } else if (location->tag == Memory_Location_Tag_Instruction_Pointer_Relative) {
+        key->values[0] = location->Instruction_Pointer_Relative.label_index.value;
+        if (!is_address_only) *reads_memory = true;
+      } else {
+        const Memory_Location_Indirect *indirect = &location->Indirect;
+        key->values[0] = numbering->virtual_values[indirect->base_register];
+        // Value numbers are small enough to leave room for the scale in the low bits
+        key->values[1] = indirect->maybe_index_register.has_value
+          ? (numbering->virtual_values[indirect->maybe_index_register.index] << 2) | indirect->index_scale
+          : 0;
+        key->values[2] = (u64)indirect->offset;
+        if (!is_address_only) *reads_memory = true;
+        if (!is_address_only && indirect->base_register == Register_SP) *reads_stack = true;
+      }
+      break;
+    }
+  }
+}
+
+static inline bool
+value_numbering_is_copy(
+  const Value_Numbering *numbering,
+  const Instruction *instruction
+) {
+  const X64_Mnemonic *mnemonic = instruction->assembly.mnemonic;
+  const Storage *operands = instruction->assembly.operands;
+  u64 byte_size = 0;
+  Storage_Tag register_tag = Storage_Tag_None;
+  if (mnemonic == mov) {
+    byte_size = 8;
+    register_tag = Storage_Tag_Register;
+  } else if (mnemonic == movups || mnemonic == movdqu) {
+    byte_size = 16;
+    register_tag = Storage_Tag_Xmm;
+  } else {
+    return false;
+  }
+  u64 memory_count = 0;
+  for (u64 i = 0; i < 2; ++i) {
+    Stack_Slot slot;
+    if (operands[i].byte_size != byte_size) return false;
+    if (operands[i].tag == register_tag) continue;
+    if (!numbering->track_stack_slots || !liveness_operand_stack_slot(&operands[i], &slot)) return false;
+    memory_count++;
+  }
+  return memory_count < 2;
+}
+
+static u64
+value_numbering_operand_value(
+  Value_Numbering *numbering,
+  const Storage *operand
+) {
+  Stack_Slot slot;
+  if (liveness_operand_stack_slot(operand, &slot)) {
+    return value_numbering_slot_value(numbering, &slot);
+  }
+  u64 bits = liveness_operand_register_bits(operand);
+  for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+    if (bits & (1llu << reg)) return numbering->virtual_values[reg];
+  }
+  panic("Unexpected operand for a copy");
+  return 0;
+}
+
+static void
+value_numbering_instruction(
+  Value_Numbering *numbering,
+  const Array_Instruction instructions,
+  u64 instruction_index,
+  u64 live_after
+) {
+  const Instruction *instruction = dyn_array_get(instructions, instruction_index);
+  Instruction_Effects effects;
+  instruction_effects(instruction, &effects);
+  const u64 eflags_bit = 1llu << LIVENESS_EFLAGS_BIT;
+  const u64 stack_pointer_bits = (1llu << Register_SP) | (1llu << Register_BP);
+
+  u64 used_register_count = 0;
+  for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+    if (effects.register_uses & (1llu << reg)) used_register_count++;
+  }
+  u64 destination_bits = 0;
+  u64 implicit_outputs = 0;
+  u64 implicit_output_count = 0;
+  bool is_candidate =
+    instruction->type == Instruction_Type_Assembly &&
+    // Repeating a division that did not fault before can not fault either
+    (!effects.has_side_effects || instruction->assembly.mnemonic == idiv) &&
+    !effects.writes_memory &&
+    !effects.reads_all_stack &&
+    !(effects.has_stack_write && !numbering->track_stack_slots) &&
+    !(effects.register_writes & stack_pointer_bits) &&
+    (effects.register_writes || effects.has_stack_write) &&
+    used_register_count <= VALUE_NUMBERING_MAX_USED_REGISTERS;
+  if (is_candidate) {
+    destination_bits = value_numbering_destination_register_bits(instruction, &effects);
+    implicit_outputs = effects.register_writes & ~destination_bits;
+    u64 destination_bit_count = 0;
+    for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+      if (destination_bits & (1llu << reg)) destination_bit_count++;
+      if (implicit_outputs & (1llu << reg)) implicit_output_count++;
+    }
+    // Byte registers that might be either AH..BH or SPL..DIL are not worth the trouble
+    if (destination_bit_count > 1) is_candidate = false;
+    if (implicit_output_count > VALUE_NUMBERING_MAX_IMPLICIT_OUTPUTS) is_candidate = false;
+  }
+
+  bool matched = false;
+  bool is_copy = is_candidate && value_numbering_is_copy(numbering, instruction);
+  Value_Numbering_Entry entry = {0};
+  if (is_copy) {
+    matched = true;
+    entry.destination_value = value_numbering_operand_value(numbering, &instruction->assembly.operands[1]);
+  } else if (is_candidate) {
+    bool reads_memory = false;
+    bool reads_stack = false;
+    entry.key.mnemonic = instruction->assembly.mnemonic;
+    for (u64 i = 0; i < countof(instruction->assembly.operands); ++i) {
+      const Storage *operand = &instruction->assembly.operands[i];
+      bool is_read;
+      if (operand->tag == Storage_Tag_Memory) {
+        is_read = i != 0 || !effects.has_stack_write;
+        if (i == 0 && effects.has_stack_write) {
+          for (u8 read_index = 0; read_index < effects.stack_read_count; ++read_index) {
+            Stack_Slot *read = &effects.stack_reads[read_index];
+            if (read->offset == effects.stack_write.offset && read->byte_size == effects.stack_write.byte_size) {
+              is_read = true;
+            }
+          }
+        }
+      } else {
+        is_read = !!(liveness_operand_register_bits(operand) & effects.register_uses);
+      }
+      bool is_address_only = instruction->assembly.mnemonic == lea && i == 1;
+      value_numbering_operand_key(
+        numbering, operand, is_read, is_address_only, &entry.key.operands[i], &reads_memory, &reads_stack
+      );
+    }
+    entry.key.used_registers = effects.register_uses;
+    u64 used_index = 0;
+    for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+      if (!(effects.register_uses & (1llu << reg))) continue;
+      entry.key.used_values[used_index++] = numbering->virtual_values[reg];
+    }
+    if (reads_memory) entry.key.memory_epoch = numbering->memory_epoch;
+    if (reads_stack) entry.key.stack_epoch = numbering->stack_epoch;
+    for (u64 i = 0; i < dyn_array_length(numbering->entries); ++i) {
+      Value_Numbering_Entry *existing = dyn_array_get(numbering->entries, i);
+      if (memcmp(&existing->key, &entry.key, sizeof(entry.key)) == 0) {
+        entry = *existing;
+        matched = true;
+        break;
+      }
+    }
+    if (!matched) {
+      entry.destination_value = value_numbering_next(numbering);
+      for (u64 i = 0; i < implicit_output_count; ++i) {
+        entry.implicit_values[i] = value_numbering_next(numbering);
+      }
+      dyn_array_push(numbering->entries, entry);
+    }
+  }
+
+  if (matched) {
+    // Check whether all of the results are already where they should be
+    bool is_in_place = true;
+    if (destination_bits) {
+      for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+        if (!(destination_bits & (1llu << reg))) continue;
+        if (numbering->actual_values[reg] != entry.destination_value) is_in_place = false;
+      }
+    }
+    if (effects.has_stack_write) {
+      if (value_numbering_slot_value(numbering, &effects.stack_write) != entry.destination_value) {
+        is_in_place = false;
+      }
+    }
+    u64 output_index = 0;
+    bool eflags_in_place = true;
+    for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+      if (!(implicit_outputs & (1llu << reg))) continue;
+      if (numbering->actual_values[reg] == entry.implicit_values[output_index++]) continue;
+      if (reg == LIVENESS_EFLAGS_BIT) eflags_in_place = false;
+      else is_in_place = false;
+    }
+    // Flags that are not read afterwards do not need to be produced
+    bool eflags_ok = eflags_in_place || !(live_after & eflags_bit);
+
+    // Tentatively removed instructions writing the same registers must be fully overwritten
+    u64 outputs = effects.register_writes;
+    bool can_resolve_pending = true;
+    for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+      if (!(outputs & (1llu << reg))) continue;
+      s64 pending_index = numbering->pending_writers[reg];
+      if (pending_index == -1) continue;
+      Value_Numbering_Pending *pending = dyn_array_get(numbering->pendings, pending_index);
+      if (pending->output_registers & ~effects.register_kills) can_resolve_pending = false;
+    }
+
+    if (is_in_place && eflags_ok && can_resolve_pending) {
+      numbering->decisions[instruction_index] = Value_Numbering_Decision_Remove;
+      value_numbering_overwrite_registers(numbering, outputs);
+      output_index = 0;
+      for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+        if (destination_bits & (1llu << reg)) {
+          numbering->virtual_values[reg] = entry.destination_value;
+        } else if (implicit_outputs & (1llu << reg)) {
+          numbering->virtual_values[reg] = entry.implicit_values[output_index++];
+        }
+      }
+      return;
+    }
+
+    // Same value in another general purpose register can be just copied over
+    s64 replacement_source = -1;
+    bool is_replaceable =
+      !is_copy &&
+      instruction->assembly.operands[0].tag == Storage_Tag_Register &&
+      destination_bits && (destination_bits & effects.register_kills) == destination_bits &&
+      (implicit_outputs & ~eflags_bit) == 0 && eflags_ok;
+    for (Register reg = Register_A; is_replaceable && reg <= Register_R15; ++reg) {
+      u64 bit = 1llu << reg;
+      if (bit & (destination_bits | stack_pointer_bits)) continue;
+      if (numbering->pending_writers[reg] != -1) continue;
+      if (numbering->actual_values[reg] != entry.destination_value) continue;
+      if (numbering->virtual_values[reg] != entry.destination_value) continue;
+      replacement_source = reg;
+      break;
+    }
+
+    // Recomputation might turn out to be unnecessary if it is a part of a longer chain
+    bool can_be_pending = !effects.has_stack_write;
+    for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+      if (!(outputs & (1llu << reg))) continue;
+      if (numbering->pending_writers[reg] != -1) can_be_pending = false;
+    }
+    if (can_be_pending) {
+      Value_Numbering_Pending pending = {
+        .instruction_index = instruction_index,
+        .output_registers = outputs,
+        .replacement_source = replacement_source,
+      };
+      for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+        if (!(effects.register_uses & (1llu << reg))) continue;
+        s64 dependency = numbering->pending_writers[reg];
+        if (dependency == -1) continue;
+        pending.dependencies[pending.dependency_count++] = dependency;
+      }
+      s64 pending_index = u64_to_s64(dyn_array_length(numbering->pendings));
+      dyn_array_push(numbering->pendings, pending);
+      numbering->decisions[instruction_index] = Value_Numbering_Decision_Remove;
+      output_index = 0;
+      for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+        if (destination_bits & (1llu << reg)) {
+          numbering->virtual_values[reg] = entry.destination_value;
+        } else if (implicit_outputs & (1llu << reg)) {
+          numbering->virtual_values[reg] = entry.implicit_values[output_index++];
+        } else {
+          continue;
+        }
+        numbering->pending_writers[reg] = pending_index;
+      }
+      return;
+    }
+
+    if (replacement_source != -1) {
+      numbering->decisions[instruction_index] = Value_Numbering_Decision_Replace;
+      numbering->replacement_sources[instruction_index] = (Register)replacement_source;
+      value_numbering_overwrite_registers(numbering, outputs);
+      for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+        if (!(destination_bits & (1llu << reg))) continue;
+        numbering->virtual_values[reg] = numbering->actual_values[reg] = entry.destination_value;
+      }
+      if (implicit_outputs) numbering->virtual_values[LIVENESS_EFLAGS_BIT] = entry.implicit_values[0];
+      return;
+    }
+  }
+
+  // The instruction stays so everything it reads must be there
+  value_numbering_read_registers(numbering, effects.register_uses);
+  value_numbering_overwrite_registers(numbering, effects.register_writes);
+  u64 output_index = 0;
+  for (u64 reg = 0; reg < VALUE_NUMBERING_REGISTER_COUNT; ++reg) {
+    u64 bit = 1llu << reg;
+    if (!(effects.register_writes & bit)) continue;
+    u64 value;
+    if (!is_candidate) {
+      value = value_numbering_next(numbering);
+    } else if (destination_bits & bit) {
+      value = entry.destination_value;
+    } else {
+      value = entry.implicit_values[output_index++];
+    }
+    numbering->virtual_values[reg] = numbering->actual_values[reg] = value;
+  }
+  if (effects.has_stack_write || effects.writes_memory) {
+    numbering->stack_epoch = value_numbering_next(numbering);
+  }
+  if (effects.has_stack_write) {
+    if (numbering->track_stack_slots) {
+      u64 value = is_candidate ? entry.destination_value : value_numbering_next(numbering);
+      value_numbering_set_slot_value(numbering, &effects.stack_write, value);
+    } else {
+      numbering->memory_epoch = value_numbering_next(numbering);
+    }
+  }
+  if (effects.writes_memory) {
+    numbering->memory_epoch = value_numbering_next(numbering);
+    dyn_array_clear(numbering->slots);
+  }
+}
+
+bool
+fn_number_values(
+  Function_Builder *builder,
+  bool track_stack_slots
+) {
+  Array_Instruction instructions = builder->code_block.instructions;
+  u64 instruction_count = dyn_array_length(instructions);
+  if (!instruction_count) return false;
+  Control_Flow_Graph graph = control_flow_graph_make(builder);
+  Liveness liveness = liveness_compute(builder, &graph, false);
+  Value_Numbering numbering = {
+    .track_stack_slots = track_stack_slots,
+    .slots = dyn_array_make(Array_Value_Numbering_Slot),
+    .entries = dyn_array_make(Array_Value_Numbering_Entry),
+    .pendings = dyn_array_make(Array_Value_Numbering_Pending),
+    .decisions = allocator_allocate_array(allocator_default, Value_Numbering_Decision, instruction_count),
+    .replacement_sources = allocator_allocate_array(allocator_default, Register, instruction_count),
+  };
+  u64 *live_after = allocator_allocate_array(allocator_default, u64, instruction_count);
+  for (u64 i = 0; i < instruction_count; ++i) {
+    numbering.decisions[i] = Value_Numbering_Decision_Keep;
+  }
+
+  for (u64 block_index = 0; block_index < dyn_array_length(graph.blocks); ++block_index) {
+    const Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+    if (!block->reachable) continue;
+    u64 live_registers = liveness.register_live_out[block_index];
+    for (u64 i = block->instruction_count; i-- > 0;) {
+      u64 instruction_index = block->first_instruction_index + i;
+      live_after[instruction_index] = live_registers;
+      Instruction_Effects effects;
+      instruction_effects(dyn_array_get(instructions, instruction_index), &effects);
+      liveness_step_backward(&liveness, &effects, &live_registers, 0);
+    }
+
+    value_numbering_reset(&numbering);
+    for (u64 i = 0; i < block->instruction_count; ++i) {
+      u64 instruction_index = block->first_instruction_index + i;
+      value_numbering_instruction(&numbering, instructions, instruction_index, live_after[instruction_index]);
+    }
+    // Successors expect to see all of the values, and overwritten ones are only
+    // needed if they are the inputs of an instruction that is put back
+    for (u64 i = 0; i < dyn_array_length(numbering.pendings); ++i) {
+      Value_Numbering_Pending *pending = dyn_array_get(numbering.pendings, i);
+      if (pending->resolved || !pending->output_registers) continue;
+      value_numbering_materialize(&numbering, i);
+    }
+  }
+
+  bool changed = false;
+  u64 write_index = 0;
+  for (u64 i = 0; i < instruction_count; ++i) {
+    Instruction instruction = *dyn_array_get(instructions, i);
+    switch(numbering.decisions[i]) {
+      case Value_Numbering_Decision_Remove: {
+        changed = true;
+        continue;
+      }
+      case Value_Numbering_Decision_Replace: {
+        changed = true;
+        Register destination = instruction.assembly.operands[0].Register.index;
+        instruction.assembly = (Instruction_Assembly){mov, {
+          storage_register_for_descriptor(destination, &descriptor_s64),
+          storage_register_for_descriptor(numbering.replacement_sources[i], &descriptor_s64),
+        }};
+        break;
+      }
+      case Value_Numbering_Decision_Keep: {
+        break;
+      }
+    }
+    *dyn_array_get_unsafe(instructions, write_index++) = instruction;
+  }
+  dyn_array_length(instructions) = write_index;
+
+  allocator_deallocate(allocator_default, live_after, sizeof(u64) * instruction_count);
+  allocator_deallocate(allocator_default, numbering.replacement_sources, sizeof(Register) * instruction_count);
+  allocator_deallocate(allocator_default, numbering.decisions, sizeof(Value_Numbering_Decision) * instruction_count);
+  dyn_array_destroy(numbering.pendings);
+  dyn_array_destroy(numbering.entries);
+  dyn_array_destroy(numbering.slots);
+  liveness_destroy(&liveness, &graph);
+  control_flow_graph_destroy(&graph);
+  return changed;
+}
+
+// :DeadCodeElimination
+// Removes instructions in blocks that can not be reached and the ones whose only
+// effect is writing a register or a stack slot that is not read afterwards.
+// Removing an instruction might make the instructions computing its operands
+// dead as well so we repeat until there is nothing left to remove.
+bool
+fn_eliminate_dead_code(
+  Function_Builder *builder,
+  bool track_stack_slots
+) {
+  bool removed_any = false;
+  for (;;) {
+    Array_Instruction instructions = builder->code_block.instructions;
+    u64 instruction_count = dyn_array_length(instructions);
+    if (!instruction_count) break;
+    Control_Flow_Graph graph = control_flow_graph_make(builder);
+    Liveness liveness = liveness_compute(builder, &graph, track_stack_slots);
+    u64 words = liveness.stack_word_count;
+    bool *remove = allocator_allocate_array(allocator_default, bool, instruction_count);
+    memset(remove, 0, sizeof(bool) * instruction_count);
+    u64 *live_stack = allocator_allocate_array(allocator_default, u64, words ? words : 1);
+    const u64 stack_pointer_bits = (1llu << Register_SP) | (1llu << Register_BP);
+
+    bool removed = false;
+    for (u64 block_index = 0; block_index < dyn_array_length(graph.blocks); ++block_index) {
+      const Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+      if (!block->reachable) {
+        for (u64 i = 0; i < block->instruction_count; ++i) {
+          u64 instruction_index = block->first_instruction_index + i;
+          // Labels are kept as they might still be referenced from other unreachable code
+          if (dyn_array_get(instructions, instruction_index)->type == Instruction_Type_Label) continue;
+          remove[instruction_index] = true;
+          removed = true;
+        }
+        continue;
+      }
+      u64 live_registers = liveness.register_live_out[block_index];
+      if (words) memcpy(live_stack, liveness.stack_live_out + block_index * words, sizeof(u64) * words);
+      for (u64 i = block->instruction_count; i-- > 0;) {
+        u64 instruction_index = block->first_instruction_index + i;
+        Instruction_Effects effects;
+        instruction_effects(dyn_array_get(instructions, instruction_index), &effects);
+        bool is_dead =
+          !effects.has_side_effects &&
+          !effects.writes_memory &&
+          (effects.register_writes || effects.has_stack_write) &&
+          !(effects.register_writes & live_registers) &&
+          !(effects.register_writes & stack_pointer_bits);
+        if (is_dead && effects.has_stack_write) {
+          is_dead = words && !liveness_stack_slot_is_live(&liveness, live_stack, &effects.stack_write);
+        }
+        if (is_dead) {
+          // Uses of a removed instruction do not keep anything alive
+          remove[instruction_index] = true;
+          removed = true;
+          continue;
+        }
+        liveness_step_backward(&liveness, &effects, &live_registers, live_stack);
+      }
+    }
+
+    if (removed) {
+      u64 write_index = 0;
+      for (u64 i = 0; i < instruction_count; ++i) {
+        if (remove[i]) continue;
+        *dyn_array_get_unsafe(instructions, write_index++) = *dyn_array_get(instructions, i);
+      }
+      dyn_array_length(instructions) = write_index;
+      removed_any = true;
+    }
+
+    allocator_deallocate(allocator_default, live_stack, sizeof(u64) * (words ? words : 1));
+    allocator_deallocate(allocator_default, remove, sizeof(bool) * instruction_count);
+    liveness_destroy(&liveness, &graph);
+    control_flow_graph_destroy(&graph);
+    if (!removed) break;
+  }
+  return removed_any;
+}
+
+// :LoopOptimization
+// Loops are found from the jumps back to a label, such as `goto _loop_start` in the
+// prelude's `while` and `for`. Only loops that are entered by falling through into
+// their header label are optimized, so the code inserted right before that label runs
+// once before the loop starts, i.e. it acts as the preheader of the loop.
+#define LOOP_INDUCTION_MAX_GROUPS 4
+
+typedef struct {
+  u64 header_index;
+  u64 back_jump_index;
+} Loop;
+
+static inline bool
+instruction_label_operand(
+  const Instruction *instruction,
+  u64 operand_index,
+  Label_Index *label_index
+) {
+  const Storage *operand = &instruction->assembly.operands[operand_index];
+  if (!storage_is_label(operand)) return false;
+  *label_index = operand->Memory.location.Instruction_Pointer_Relative.label_index;
+  return true;
+}
+
+static bool
+loop_find(
+  const Function_Builder *builder,
+  const Label_Instruction_Map *map,
+  u64 header_index,
+  Loop *loop
+) {
+  const Array_Instruction instructions = builder->code_block.instructions;
+  u64 instruction_count = dyn_array_length(instructions);
+  const Instruction *header = dyn_array_get(instructions, header_index);
+  if (header->type != Instruction_Type_Label) return false;
+  // The header has to be reached by falling through from the preheader
+  if (header_index == 0) return false;
+  const Instruction *before_header = dyn_array_get(instructions, header_index - 1);
+  if (before_header->type == Instruction_Type_Tail_Call) return false;
+  if (before_header->type == Instruction_Type_Assembly) {
+    const X64_Mnemonic *mnemonic = before_header->assembly.mnemonic;
+    if (mnemonic == jmp || mnemonic == ret) return false;
+  }
+
+  s64 back_jump_index = -1;
+  for (u64 i = header_index + 1; i < instruction_count; ++i) {
+    const Instruction *instruction = dyn_array_get(instructions, i);
+    if (instruction->type != Instruction_Type_Assembly) continue;
+    if (instruction->assembly.mnemonic != jmp) continue;
+    Label_Index target;
+    if (!instruction_label_operand(instruction, 0, &target)) continue;
+    if (target.value == header->label.value) back_jump_index = u64_to_s64(i);
+  }
+  if (back_jump_index < 0) return false;
+  *loop = (Loop){header_index, s64_to_u64(back_jump_index)};
+
+  // Labels inside of the loop, including the header, can only be jumped to from the loop
+  for (u64 i = 0; i < instruction_count; ++i) {
+    const Instruction *instruction = dyn_array_get(instructions, i);
+    bool is_inside = i >= loop->header_index && i <= loop->back_jump_index;
+    if (instruction->type == Instruction_Type_Bytes) {
+      if (is_inside) return false;
+      if (instruction->Bytes.label_offset_in_instruction == INSTRUCTION_BYTES_NO_LABEL) continue;
+      s64 target_index = label_instruction_map_get(map, instruction->Bytes.label_index);
+      if (target_index >= u64_to_s64(loop->header_index) && target_index <= back_jump_index) return false;
+      continue;
+    }
+    if (instruction->type == Instruction_Type_Tail_Call) {
+      if (is_inside) return false;
+      continue;
+    }
+    if (instruction->type != Instruction_Type_Assembly) continue;
+    bool is_jump = instruction->assembly.mnemonic == jmp || instruction_is_conditional_jump(instruction);
+    for (u64 operand_index = 0; operand_index < countof(instruction->assembly.operands); ++operand_index) {
+      Label_Index label_index;
+      if (!instruction_label_operand(instruction, operand_index, &label_index)) continue;
+      s64 target_index = label_instruction_map_get(map, label_index);
+      if (target_index < u64_to_s64(loop->header_index) || target_index > back_jump_index) continue;
+      if (!is_inside || !is_jump || operand_index != 0) return false;
+    }
+  }
+  return true;
+}
+
+static inline u64
+loop_header_block(
+  const Control_Flow_Graph *graph,
+  const Loop *loop
+) {
+  return *dyn_array_get(graph->instruction_block_indexes, loop->header_index);
+}
+
+static bool
+loop_hoist_invariants(
+  Function_Builder *builder,
+  const Loop *loop
+) {
+  const u64 eflags = 1llu << LIVENESS_EFLAGS_BIT;
+  const u64 frame_registers = liveness_register_bit(Register_SP) | liveness_register_bit(Register_BP);
+  u64 loop_length = loop->back_jump_index - loop->header_index;
+  u64 first_index = loop->header_index + 1;
+
+  Control_Flow_Graph graph = control_flow_graph_make(builder);
+  Liveness liveness = liveness_compute(builder, &graph, false);
+  u64 header_live_in = liveness.register_live_in[loop_header_block(&graph, loop)];
+
+  Instruction_Effects *effects = allocator_allocate_array(allocator_default, Instruction_Effects, loop_length);
+  // Flags that are live right after each of the instructions
+  bool *flags_live_after = allocator_allocate_array(allocator_default, bool, loop_length);
+  bool *hoisted = allocator_allocate_array(allocator_default, bool, loop_length);
+  u8 write_counts[LIVENESS_EFLAGS_BIT + 1] = {0};
+  bool writes_memory = false;
+  for (u64 i = 0; i < loop_length; ++i) {
+    Instruction *instruction = dyn_array_get(builder->code_block.instructions, first_index + i);
+    instruction_effects(instruction, &effects[i]);
+    hoisted[i] = false;
+    if (effects[i].writes_memory || effects[i].has_stack_write) writes_memory = true;
+    for (u64 bit = 0; bit <= LIVENESS_EFLAGS_BIT; ++bit) {
+      if ((effects[i].register_writes >> bit) & 1) {
+        if (write_counts[bit] < 0xFF) write_counts[bit]++;
+      }
+    }
+  }
+  for (u64 block_index = 0; block_index < dyn_array_length(graph.blocks); ++block_index) {
+    const Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+    u64 end = block->first_instruction_index + block->instruction_count;
+    if (end <= first_index || block->first_instruction_index > loop->back_jump_index) continue;
+    u64 live_registers = liveness.register_live_out[block_index];
+    for (u64 i = end; i-- > block->first_instruction_index;) {
+      if (i >= first_index && i < first_index + loop_length) {
+        flags_live_after[i - first_index] = !!(live_registers & eflags);
+        liveness_step_backward(&liveness, &effects[i - first_index], &live_registers, 0);
+      } else {
+        Instruction_Effects outside;
+        instruction_effects(dyn_array_get(builder->code_block.instructions, i), &outside);
+        liveness_step_backward(&liveness, &outside, &live_registers, 0);
+      }
+    }
+  }
+
+  bool changed = false;
+  for (u64 i = 0; i < loop_length; ++i) {
+    Instruction *instruction = dyn_array_get(builder->code_block.instructions, first_index + i);
+    const Instruction_Effects *candidate = &effects[i];
+    if (instruction->type != Instruction_Type_Assembly) continue;
+    const X64_Mnemonic *mnemonic = instruction->assembly.mnemonic;
+    // Division can fault so it can not run before the loop checks its condition
+    if (mnemonic == idiv) continue;
+    if (candidate->has_side_effects || candidate->reads_all_stack) continue;
+    if (candidate->writes_memory || candidate->has_stack_write) continue;
+    if (candidate->stack_read_count && writes_memory) continue;
+    bool reads_other_memory = false;
+    for (u64 operand_index = 0; operand_index < countof(instruction->assembly.operands); ++operand_index) {
+      const Storage *operand = &instruction->assembly.operands[operand_index];
+      if (!operand_is_memory(operand) || mnemonic == lea) continue;
+      Stack_Slot slot;
+      // Memory that is not on the stack might not be valid before the loop condition is checked
+      if (!liveness_operand_stack_slot(operand, &slot)) reads_other_memory = true;
+    }
+    if (reads_other_memory) continue;
+
+    u64 written_in_loop = 0;
+    for (u64 bit = 0; bit <= LIVENESS_EFLAGS_BIT; ++bit) {
+      if (write_counts[bit]) written_in_loop |= 1llu << bit;
+    }
+    if (candidate->register_uses & written_in_loop) continue;
+    u64 writes = candidate->register_writes;
+    if (writes & frame_registers) continue;
+    u64 register_writes = writes & ~eflags;
+    if (!register_writes) continue;
+    if ((candidate->register_kills & register_writes) != register_writes) continue;
+    // The value before the loop must not be needed anymore, neither inside nor after the loop
+    if (writes & header_live_in) continue;
+    if ((writes & eflags) && flags_live_after[i]) continue;
+    bool is_only_writer = true;
+    for (u64 bit = 0; bit < LIVENESS_EFLAGS_BIT; ++bit) {
+      if (((register_writes >> bit) & 1) && write_counts[bit] != 1) is_only_writer = false;
+    }
+    if (!is_only_writer) continue;
+
+    hoisted[i] = true;
+    changed = true;
+    for (u64 bit = 0; bit <= LIVENESS_EFLAGS_BIT; ++bit) {
+      if ((writes >> bit) & 1) write_counts[bit]--;
+    }
+  }
+
+  if (changed) {
+    // Hoisted instructions keep their relative order in front of the header label
+    Array_Instruction instructions = builder->code_block.instructions;
+    Instruction *body = allocator_allocate_array(allocator_default, Instruction, loop_length + 1);
+    u64 hoisted_count = 0;
+    for (u64 i = 0; i < loop_length; ++i) {
+      if (hoisted[i]) body[hoisted_count++] = *dyn_array_get(instructions, first_index + i);
+    }
+    u64 body_count = hoisted_count;
+    body[body_count++] = *dyn_array_get(instructions, loop->header_index);
+    for (u64 i = 0; i < loop_length; ++i) {
+      if (!hoisted[i]) body[body_count++] = *dyn_array_get(instructions, first_index + i);
+    }
+    for (u64 i = 0; i < body_count; ++i) {
+      *dyn_array_get(instructions, loop->header_index + i) = body[i];
+    }
+    allocator_deallocate(allocator_default, body, sizeof(Instruction) * (loop_length + 1));
+  }
+
+  allocator_deallocate(allocator_default, hoisted, sizeof(bool) * loop_length);
+  allocator_deallocate(allocator_default, flags_live_after, sizeof(bool) * loop_length);
+  allocator_deallocate(allocator_default, effects, sizeof(Instruction_Effects) * loop_length);
+  liveness_destroy(&liveness, &graph);
+  control_flow_graph_destroy(&graph);
+  return changed;
+}
+
+// :InductionVariables
+// Values in the loop are described as `induction * scale + base + constant` where
+// the induction is a register that is only ever incremented by a constant in the loop
+// and the base is either the stack pointer or a register not modified in the loop.
+// An address derived from an induction variable with a scale, as produced by array
+// access, is replaced with a new pointer register that is advanced together with the
+// induction variable, which removes the multiplication from the loop body.
+typedef enum {
+  Affine_Base_None,
+  Affine_Base_Stack,
+  Affine_Base_Register,
+} Affine_Base;
+
+typedef struct {
+  bool known;
+  bool has_induction;
+  Register induction;
+  Affine_Base base;
+  Register base_register;
+  s64 scale;
+  s64 constant;
+} Affine_Value;
+
+typedef struct {
+  u64 instruction_index;
+  u64 operand_index;
+  Affine_Value address;
+} Induction_Memory_Use;
+typedef dyn_array_type(Induction_Memory_Use) Array_Induction_Memory_Use;
+
+typedef struct {
+  u64 instruction_index;
+  Register induction;
+  s64 increment;
+} Induction_Update;
+typedef dyn_array_type(Induction_Update) Array_Induction_Update;
+
+typedef struct {
+  Affine_Value address;
+  Register pointer;
+} Induction_Pointer;
+
+static inline bool
+affine_fits(
+  s64 value
+) {
+  return s64_fits_into_s32(value);
+}
+
+static Affine_Value
+affine_add(
+  Affine_Value a,
+  Affine_Value b
+) {
+  if (!a.known || !b.known) return (Affine_Value){0};
+  if (a.base != Affine_Base_None && b.base != Affine_Base_None) return (Affine_Value){0};
+  Affine_Value result = a;
+  if (b.base != Affine_Base_None) {
+    result.base = b.base;
+    result.base_register = b.base_register;
+  }
+  if (b.has_induction) {
+    if (a.has_induction && a.induction != b.induction) return (Affine_Value){0};
+    result.has_induction = true;
+    result.induction = b.induction;
+    result.scale = (a.has_induction ? a.scale : 0) + b.scale;
+  }
+  result.constant = a.constant + b.constant;
+  if (!affine_fits(result.scale) || !affine_fits(result.constant)) return (Affine_Value){0};
+  return result;
+}
+
+static Affine_Value
+affine_multiply(
+  Affine_Value a,
+  s64 factor
+) {
+  if (!a.known || a.base != Affine_Base_None) return (Affine_Value){0};
+  if (!affine_fits(factor)) return (Affine_Value){0};
+  a.scale *= factor;
+  a.constant *= factor;
+  if (!affine_fits(a.scale) || !affine_fits(a.constant)) return (Affine_Value){0};
+  return a;
+}
+
+static inline bool
+affine_is_constant(
+  const Affine_Value *value
+) {
+  return value->known && !value->has_induction && value->base == Affine_Base_None;
+}
+
+static Affine_Value
+affine_operand(
+  const Affine_Value *values,
+  const Storage *operand
+) {
+  if (operand->tag == Storage_Tag_Static && operand->byte_size <= 8) {
+    return (Affine_Value){.known = true, .constant = storage_immediate_value_up_to_s64(operand)};
+  }
+  if (operand->tag == Storage_Tag_Register && operand->byte_size == 8) {
+    return values[operand->Register.index];
+  }
+  return (Affine_Value){0};
+}
+
+static Affine_Value
+affine_address(
+  const Affine_Value *values,
+  const Storage *operand
+) {
+  if (operand->tag != Storage_Tag_Memory) return (Affine_Value){0};
+  if (operand->Memory.location.tag != Memory_Location_Tag_Indirect) return (Affine_Value){0};
+  const Memory_Location_Indirect *indirect = &operand->Memory.location.Indirect;
+  Affine_Value result = {.known = true, .constant = indirect->offset};
+  if (indirect->base_register == Register_SP) {
+    result.base = Affine_Base_Stack;
+  } else {
+    result = affine_add(result, values[indirect->base_register]);
+  }
+  if (indirect->maybe_index_register.has_value) {
+    Affine_Value index = values[indirect->maybe_index_register.index];
+    result = affine_add(result, affine_multiply(index, 1ll << indirect->index_scale));
+  }
+  return result;
+}
+
+static void
+induction_reset_values(
+  Affine_Value *values,
+  u64 inductions,
+  u64 written_in_loop
+) {
+  for (Register reg = 0; reg <= Register_R15; ++reg) {
+    u64 bit = liveness_register_bit(reg);
+    if (reg == Register_SP) {
+      values[reg] = (Affine_Value){0};
+    } else if (inductions & bit) {
+      values[reg] = (Affine_Value){.known = true, .has_induction = true, .induction = reg, .scale = 1};
+    } else if (!(written_in_loop & bit)) {
+      values[reg] = (Affine_Value){.known = true, .base = Affine_Base_Register, .base_register = reg};
+    } else {
+      values[reg] = (Affine_Value){0};
+    }
+  }
+}
+
+// Returns the value written to the destination register or an unknown one
+static Affine_Value
+induction_instruction_value(
+  const Affine_Value *values,
+  const Instruction *instruction
+) {
+  const X64_Mnemonic *mnemonic = instruction->assembly.mnemonic;
+  const Storage *operands = instruction->assembly.operands;
+  const Storage *destination = &operands[0];
+  if (destination->tag != Storage_Tag_Register || destination->byte_size != 8) return (Affine_Value){0};
+  Affine_Value current = values[destination->Register.index];
+  if (mnemonic == mov) return affine_operand(values, &operands[1]);
+  if (mnemonic == lea) return affine_address(values, &operands[1]);
+  if (mnemonic == add) return affine_add(current, affine_operand(values, &operands[1]));
+  if (mnemonic == sub) {
+    Affine_Value subtrahend = affine_operand(values, &operands[1]);
+    if (subtrahend.base != Affine_Base_None) return (Affine_Value){0};
+    return affine_add(current, affine_multiply(subtrahend, -1));
+  }
+  if (mnemonic == inc) return affine_add(current, (Affine_Value){.known = true, .constant = 1});
+  if (mnemonic == shl && operands[1].tag == Storage_Tag_Static) {
+    s64 shift = storage_immediate_value_up_to_s64(&operands[1]);
+    if (shift < 0 || shift > 30) return (Affine_Value){0};
+    return affine_multiply(current, 1ll << shift);
+  }
+  if (mnemonic == imul) {
+    if (operands[2].tag == Storage_Tag_Static) {
+      return affine_multiply(
+        affine_operand(values, &operands[1]), storage_immediate_value_up_to_s64(&operands[2])
+      );
+    }
+    if (operands[1].tag != Storage_Tag_None && operands[2].tag == Storage_Tag_None) {
+      Affine_Value other = affine_operand(values, &operands[1]);
+      if (affine_is_constant(&other)) return affine_multiply(current, other.constant);
+      if (affine_is_constant(&current)) return affine_multiply(other, current.constant);
+    }
+  }
+  return (Affine_Value){0};
+}
+
+// Walks the loop and collects increments of the induction variables and the memory
+// accesses derived from them. Returns false if one of the `inductions` turned out
+// to be modified in some other way, in which case it is removed from the set.
+static bool
+induction_analyze(
+  const Function_Builder *builder,
+  const Loop *loop,
+  u64 *inductions,
+  u64 written_in_loop,
+  Array_Induction_Update *updates,
+  Array_Induction_Memory_Use *uses
+) {
+  Affine_Value values[Register_R15 + 1];
+  induction_reset_values(values, *inductions, written_in_loop);
+  dyn_array_clear(*updates);
+  dyn_array_clear(*uses);
+  for (u64 i = loop->header_index + 1; i <= loop->back_jump_index; ++i) {
+    const Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+    if (instruction->type == Instruction_Type_Label) {
+      induction_reset_values(values, *inductions, written_in_loop);
+      continue;
+    }
+    if (instruction->type != Instruction_Type_Assembly) continue;
+    for (u64 operand_index = 0; operand_index < countof(instruction->assembly.operands); ++operand_index) {
+      const Storage *operand = &instruction->assembly.operands[operand_index];
+      if (!operand_is_memory(operand)) continue;
+      if (operand->Memory.location.tag != Memory_Location_Tag_Indirect) continue;
+      if (operand->Memory.location.Indirect.base_register == Register_SP) continue;
+      const Memory_Location_Indirect *indirect = &operand->Memory.location.Indirect;
+      if (indirect->maybe_index_register.has_value) {
+        // Scaled index addressing by the induction itself needs no extra instructions
+        Register index_register = indirect->maybe_index_register.index;
+        const Affine_Value *index = &values[index_register];
+        if (
+          index->known && index->has_induction && index->induction == index_register &&
+          index->scale == 1 && index->base == Affine_Base_None && index->constant == 0
+        ) continue;
+      }
+      Affine_Value address = affine_address(values, operand);
+      if (!address.known || !address.has_induction || !address.scale) continue;
+      // Addressing by the induction variable itself is already as cheap as it gets
+      if (address.scale == 1 && address.base == Affine_Base_None) continue;
+      dyn_array_push(*uses, (Induction_Memory_Use){i, operand_index, address});
+    }
+
+    Instruction_Effects effects;
+    instruction_effects(instruction, &effects);
+    Affine_Value result = induction_instruction_value(values, instruction);
+    Register destination = instruction->assembly.operands[0].Register.index;
+    bool has_destination =
+      result.known && instruction->assembly.operands[0].tag == Storage_Tag_Register;
+    for (Register reg = 0; reg <= Register_R15; ++reg) {
+      u64 bit = liveness_register_bit(reg);
+      if (!(effects.register_writes & bit)) continue;
+      if (has_destination && reg == destination) continue;
+      if (*inductions & bit) {
+        *inductions &= ~bit;
+        return false;
+      }
+      values[reg] = (Affine_Value){0};
+    }
+    if (has_destination) {
+      u64 bit = liveness_register_bit(destination);
+      if (*inductions & bit) {
+        bool is_increment =
+          result.has_induction && result.induction == destination && result.scale == 1 &&
+          result.base == Affine_Base_None;
+        if (!is_increment) {
+          *inductions &= ~bit;
+          return false;
+        }
+        dyn_array_push(*updates, (Induction_Update){i, destination, result.constant});
+        // Everything derived from the induction is now relative to its new value
+        for (Register reg = 0; reg <= Register_R15; ++reg) {
+          if (!values[reg].known || !values[reg].has_induction) continue;
+          if (values[reg].induction != destination) continue;
+          values[reg].constant -= values[reg].scale * result.constant;
+          if (!affine_fits(values[reg].constant)) values[reg] = (Affine_Value){0};
+        }
+        values[destination] = (Affine_Value){
+          .known = true, .has_induction = true, .induction = destination, .scale = 1
+        };
+      } else {
+        values[destination] = result;
+      }
+    }
+    if (instruction_ends_basic_block(instruction)) {
+      induction_reset_values(values, *inductions, written_in_loop);
+    }
+  }
+  return true;
+}
+
+static bool
+loop_reduce_induction_strength(
+  Function_Builder *builder,
+  const Loop *loop,
+  u64 *used_registers
+) {
+  const u64 eflags = 1llu << LIVENESS_EFLAGS_BIT;
+  Control_Flow_Graph graph = control_flow_graph_make(builder);
+  Liveness liveness = liveness_compute(builder, &graph, false);
+  u64 header_live_in = liveness.register_live_in[loop_header_block(&graph, loop)];
+  liveness_destroy(&liveness, &graph);
+  control_flow_graph_destroy(&graph);
+  // The computation of the initial pointer in the preheader overwrites the flags
+  if (header_live_in & eflags) return false;
+
+  u64 written_in_loop = 0;
+  for (u64 i = loop->header_index + 1; i <= loop->back_jump_index; ++i) {
+    Instruction_Effects effects;
+    instruction_effects(dyn_array_get(builder->code_block.instructions, i), &effects);
+    written_in_loop |= effects.register_writes;
+  }
+  u64 inductions = written_in_loop & LIVENESS_ALL_REGISTERS & 0xFFFF;
+  inductions &= ~(liveness_register_bit(Register_SP) | liveness_register_bit(Register_BP));
+
+  Array_Induction_Update updates = dyn_array_make(Array_Induction_Update);
+  Array_Induction_Memory_Use uses = dyn_array_make(Array_Induction_Memory_Use);
+  while (!induction_analyze(builder, loop, &inductions, written_in_loop, &updates, &uses));
+
+  Induction_Pointer pointers[LOOP_INDUCTION_MAX_GROUPS];
+  u64 pointer_count = 0;
+  Register free_registers[] = {
+    Register_A, Register_C, Register_D, Register_R8, Register_R9, Register_R10, Register_R11,
+    Register_B, Register_SI, Register_DI, Register_R12, Register_R13, Register_R14, Register_R15,
+  };
+
+  bool changed = false;
+  for (u64 use_index = 0; use_index < dyn_array_length(uses); ++use_index) {
+    Induction_Memory_Use *use = dyn_array_get(uses, use_index);
+    if (!(inductions & liveness_register_bit(use->address.induction))) continue;
+    Induction_Pointer *pointer = 0;
+    for (u64 i = 0; i < pointer_count; ++i) {
+      Affine_Value *address = &pointers[i].address;
+      if (address->induction != use->address.induction) continue;
+      if (address->scale != use->address.scale) continue;
+      if (address->base != use->address.base) continue;
+      if (address->base == Affine_Base_Register && address->base_register != use->address.base_register) continue;
+      pointer = &pointers[i];
+      break;
+    }
+    if (!pointer) {
+      if (pointer_count == LOOP_INDUCTION_MAX_GROUPS) continue;
+      // Every increment of the induction needs to be representable as a displacement
+      bool fits = true;
+      for (u64 i = 0; i < dyn_array_length(updates); ++i) {
+        Induction_Update *update = dyn_array_get(updates, i);
+        if (update->induction != use->address.induction) continue;
+        if (!affine_fits(update->increment * use->address.scale)) fits = false;
+      }
+      if (!fits) continue;
+      Register reg = Register_SP;
+      for (u64 i = 0; i < countof(free_registers); ++i) {
+        if (*used_registers & liveness_register_bit(free_registers[i])) continue;
+        reg = free_registers[i];
+        break;
+      }
+      if (reg == Register_SP) break;
+      *used_registers |= liveness_register_bit(reg);
+      register_bitset_set(&builder->used_register_bitset, reg);
+      pointer = &pointers[pointer_count++];
+      *pointer = (Induction_Pointer){.address = use->address, .pointer = reg};
+    }
+    // The constant of the address already includes the original displacement
+    Storage *operand = &dyn_array_get(builder->code_block.instructions, use->instruction_index)
+      ->assembly.operands[use->operand_index];
+    Memory_Location_Indirect *indirect = &operand->Memory.location.Indirect;
+    indirect->base_register = pointer->pointer;
+    indirect->maybe_index_register = (Maybe_Register){0};
+    indirect->index_scale = Index_Scale_1;
+    indirect->offset = use->address.constant - pointer->address.constant;
+    changed = true;
+  }
+
+  if (changed) {
+    // Advancing the pointers right after the increments of the induction variables
+    // with `lea` keeps the flags intact for a comparison that might follow
+    for (u64 update_index = dyn_array_length(updates); update_index-- > 0;) {
+      Induction_Update *update = dyn_array_get(updates, update_index);
+      for (u64 i = pointer_count; i-- > 0;) {
+        Induction_Pointer *pointer = &pointers[i];
+        if (pointer->address.induction != update->induction) continue;
+        Storage pointer_storage = storage_register_for_descriptor(pointer->pointer, &descriptor_s64);
+        Storage advanced = {
+          .tag = Storage_Tag_Memory,
+          .byte_size = 8,
+          .Memory.location = {
+            .tag = Memory_Location_Tag_Indirect,
+            .Indirect = {
+              .base_register = pointer->pointer,
+              .offset = update->increment * pointer->address.scale,
+            },
+          },
+        };
+        Instruction *updating = dyn_array_get(builder->code_block.instructions, update->instruction_index);
+        Instruction advance = {
+          .assembly = {lea, {pointer_storage, advanced}},
+          .compiler_source_location = updating->compiler_source_location,
+          .source_range = updating->source_range,
+        };
+        dyn_array_splice_raw(builder->code_block.instructions, update->instruction_index + 1, 0, &advance, 1);
+      }
+    }
+
+    Instruction *header = dyn_array_get(builder->code_block.instructions, loop->header_index);
+    Instruction preheader[LOOP_INDUCTION_MAX_GROUPS * 2];
+    u64 preheader_count = 0;
+    for (u64 i = 0; i < pointer_count; ++i) {
+      const Affine_Value *address = &pointers[i].address;
+      Storage pointer_storage = storage_register_for_descriptor(pointers[i].pointer, &descriptor_s64);
+      Storage induction_storage = storage_register_for_descriptor(address->induction, &descriptor_s64);
+      Storage start = {
+        .tag = Storage_Tag_Memory,
+        .byte_size = 8,
+        .Memory.location = {
+          .tag = Memory_Location_Tag_Indirect,
+          .Indirect = {
+            .base_register = pointers[i].pointer,
+            .offset = address->constant,
+          },
+        },
+      };
+      if (address->base == Affine_Base_Stack) {
+        // Stack displacement is adjusted for the frame only if RSP is the base
+        start.Memory.location.Indirect.base_register = Register_SP;
+        start.Memory.location.Indirect.maybe_index_register =
+          (Maybe_Register){.index = pointers[i].pointer, .has_value = true};
+      } else if (address->base == Affine_Base_Register) {
+        start.Memory.location.Indirect.base_register = address->base_register;
+        start.Memory.location.Indirect.maybe_index_register =
+          (Maybe_Register){.index = pointers[i].pointer, .has_value = true};
+      }
+      preheader[preheader_count++] = (Instruction){
+        .assembly = {imul, {pointer_storage, induction_storage, imm32(allocator_default, s64_to_s32(address->scale))}},
+      };
+      if (address->base != Affine_Base_None || address->constant) {
+        preheader[preheader_count++] = (Instruction){.assembly = {lea, {pointer_storage, start}}};
+      }
+    }
+    for (u64 i = 0; i < preheader_count; ++i) {
+      preheader[i].compiler_source_location = header->compiler_source_location;
+      preheader[i].source_range = header->source_range;
+    }
+    dyn_array_splice_raw(builder->code_block.instructions, loop->header_index, 0, preheader, preheader_count);
+  }
+
+  dyn_array_destroy(updates);
+  dyn_array_destroy(uses);
+  return changed;
+}
+
+bool
+fn_optimize_loops(
+  Function_Builder *builder
+) {
+  u64 used_registers = liveness_register_bit(Register_SP) | liveness_register_bit(Register_BP);
+  for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+    Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+    // Machine code provided by the user might use any register
+    if (instruction->type == Instruction_Type_Bytes) return false;
+    Instruction_Effects effects;
+    instruction_effects(instruction, &effects);
+    used_registers |= effects.register_uses | effects.register_writes;
+  }
+  // `used_register_bitset` still has the temporaries that earlier passes removed
+  // so only the instructions tell which registers are actually free
+
+  bool changed = false;
+  // Going backwards visits inner loops before the outer ones and keeps
+  // the indexes of the loops that are not processed yet intact
+  for (u64 header_index = dyn_array_length(builder->code_block.instructions); header_index-- > 0;) {
+    Label_Instruction_Map map = label_instruction_map_make(builder);
+    Loop loop;
+    bool found = loop_find(builder, &map, header_index, &loop);
+    label_instruction_map_destroy(&map);
+    if (!found) continue;
+    if (loop_hoist_invariants(builder, &loop)) {
+      changed = true;
+      map = label_instruction_map_make(builder);
+      // Hoisted instructions moved the header label further down
+      u64 hoisted_header_index = header_index;
+      while (dyn_array_get(builder->code_block.instructions, hoisted_header_index)->type != Instruction_Type_Label) {
+        hoisted_header_index++;
+      }
+      found = loop_find(builder, &map, hoisted_header_index, &loop);
+      label_instruction_map_destroy(&map);
+      if (!found) continue;
+    }
+    if (loop_reduce_induction_strength(builder, &loop, &used_registers)) changed = true;
+  }
+  return changed;
+}
+
+// :LoopRotation
+// `while` and `for` from the prelude check the condition at the top of the loop
+// and jump back to it at the bottom, so every iteration runs both a conditional
+// and an unconditional jump. The jump back is replaced with a copy of the condition
+// branching to the start of the body which leaves the original check as the entry guard:
+//
+//   loop:                      loop:
+//     cmp ...                    cmp ...
+//     jge exit                   jge exit
+//     <body>          =>       body:
+//     jmp loop                   <body>
+//   exit:                        cmp ...
+//                                jl body
+//                              exit:
+//
+// `continue` still jumps to the guard at the top and `break` to the exit.
+#define LOOP_ROTATION_MAX_CONDITION_INSTRUCTIONS 16
+
+typedef struct {
+  u64 position;
+  // Either the jump back is replaced or the label for the body is inserted
+  bool is_back_jump;
+  u64 header_index;
+  u64 condition_index;
+  Label_Index body_label;
+  bool needs_exit_jump;
+} Loop_Rotation_Edit;
+typedef dyn_array_type(Loop_Rotation_Edit) Array_Loop_Rotation_Edit;
+
+static const X64_Mnemonic *
+conditional_jump_invert(
+  const X64_Mnemonic *mnemonic
+) {
+  const X64_Mnemonic *pairs[][2] = {
+    {jo, jno}, {jb, jae}, {je, jne}, {jbe, ja}, {js, jns}, {jp, jnp}, {jl, jge}, {jle, jg},
+  };
+  for (u64 i = 0; i < countof(pairs); ++i) {
+    if (pairs[i][0] == mnemonic) return pairs[i][1];
+    if (pairs[i][1] == mnemonic) return pairs[i][0];
+  }
+  return 0;
+}
+
+bool
+fn_rotate_loops(
+  Program *program,
+  Function_Builder *builder
+) {
+  u64 instruction_count = dyn_array_length(builder->code_block.instructions);
+  if (!instruction_count) return false;
+  Label_Instruction_Map map = label_instruction_map_make(builder);
+  Array_Loop_Rotation_Edit edits = dyn_array_make(Array_Loop_Rotation_Edit);
+  bool *is_rotated_condition = allocator_allocate_array(allocator_default, bool, instruction_count);
+  memset(is_rotated_condition, 0, sizeof(bool) * instruction_count);
+
+  // Going backwards makes sure that the last jump to the loop header is rotated
+  // while the ones before it, e.g. `continue`, keep going through the guard.
+  for (u64 back_jump_index = instruction_count; back_jump_index-- > 0;) {
+    Instruction *back_jump = dyn_array_get(builder->code_block.instructions, back_jump_index);
+    if (back_jump->type != Instruction_Type_Assembly) continue;
+    if (back_jump->assembly.mnemonic != jmp) continue;
+    if (!storage_is_label(&back_jump->assembly.operands[0])) continue;
+    Label_Index header_label =
+      back_jump->assembly.operands[0].Memory.location.Instruction_Pointer_Relative.label_index;
+    s64 header_index = label_instruction_map_get(&map, header_label);
+    if (header_index < 0 || u64_to_s64(back_jump_index) <= header_index) continue;
+
+    s64 condition_index = -1;
+    u64 condition_length = 0;
+    for (u64 i = s64_to_u64(header_index) + 1; i < back_jump_index; ++i) {
+      Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+      if (instruction->type == Instruction_Type_Label) continue;
+      if (instruction_is_conditional_jump(instruction)) {
+        condition_index = u64_to_s64(i);
+        break;
+      }
+      if (instruction->type != Instruction_Type_Assembly) break;
+      if (instruction_ends_basic_block(instruction)) break;
+      if (++condition_length > LOOP_ROTATION_MAX_CONDITION_INSTRUCTIONS) break;
+    }
+    if (condition_index < 0) continue;
+    if (is_rotated_condition[condition_index]) continue;
+    Instruction *condition = dyn_array_get(builder->code_block.instructions, condition_index);
+    if (!conditional_jump_invert(condition->assembly.mnemonic)) continue;
+
+    // Only loops where the condition exits to the code after the jump back are rotated
+    Label_Index exit_label =
+      condition->assembly.operands[0].Memory.location.Instruction_Pointer_Relative.label_index;
+    s64 exit_index = label_instruction_map_get(&map, exit_label);
+    if (exit_index <= u64_to_s64(back_jump_index)) continue;
+    bool needs_exit_jump = false;
+    for (u64 i = back_jump_index + 1; i < s64_to_u64(exit_index); ++i) {
+      Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+      if (instruction->type != Instruction_Type_Label) needs_exit_jump = true;
+    }
+
+    is_rotated_condition[condition_index] = true;
+    Label_Index body_label =
+      make_label(program, &program->memory.sections.code, slice_literal("loop_body"));
+    dyn_array_push(edits, (Loop_Rotation_Edit) {
+      .position = back_jump_index,
+      .is_back_jump = true,
+      .header_index = s64_to_u64(header_index),
+      .condition_index = s64_to_u64(condition_index),
+      .body_label = body_label,
+      .needs_exit_jump = needs_exit_jump,
+    });
+    dyn_array_push(edits, (Loop_Rotation_Edit) {
+      .position = s64_to_u64(condition_index) + 1,
+      .condition_index = s64_to_u64(condition_index),
+      .body_label = body_label,
+    });
+  }
+
+  // Applying the edits from the end keeps the positions of the remaining ones valid.
+  // A jump back right after the condition is replaced before the body label is inserted.
+  for (u64 i = 1; i < dyn_array_length(edits); ++i) {
+    for (u64 k = i; k > 0; --k) {
+      Loop_Rotation_Edit *a = dyn_array_get(edits, k - 1);
+      Loop_Rotation_Edit *b = dyn_array_get(edits, k);
+      bool is_ordered = a->position > b->position ||
+        (a->position == b->position && (a->is_back_jump || !b->is_back_jump));
+      if (is_ordered) break;
+      Loop_Rotation_Edit temp = *a;
+      *a = *b;
+      *b = temp;
+    }
+  }
+
+  for (u64 edit_index = 0; edit_index < dyn_array_length(edits); ++edit_index) {
+    Loop_Rotation_Edit *edit = dyn_array_get(edits, edit_index);
+    Instruction *condition = dyn_array_get(builder->code_block.instructions, edit->condition_index);
+    if (!edit->is_back_jump) {
+      Instruction label = {
+        .type = Instruction_Type_Label,
+        .label = edit->body_label,
+        .compiler_source_location = condition->compiler_source_location,
+        .source_range = condition->source_range,
+      };
+      dyn_array_splice_raw(builder->code_block.instructions, edit->position, 0, &label, 1);
+      continue;
+    }
+    Instruction replacement[LOOP_ROTATION_MAX_CONDITION_INSTRUCTIONS + 2];
+    u64 count = 0;
+    for (u64 i = edit->header_index + 1; i < edit->condition_index; ++i) {
+      Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+      if (instruction->type == Instruction_Type_Label) continue;
+      replacement[count++] = *instruction;
+    }
+    Instruction *back_jump = dyn_array_get(builder->code_block.instructions, edit->position);
+    Instruction rotated_condition = *condition;
+    rotated_condition.assembly.mnemonic = conditional_jump_invert(condition->assembly.mnemonic);
+    rotated_condition.assembly.operands[0] = code_label32(edit->body_label);
+    replacement[count++] = rotated_condition;
+    if (edit->needs_exit_jump) {
+      Instruction exit_jump = *back_jump;
+      exit_jump.assembly.operands[0] = condition->assembly.operands[0];
+      replacement[count++] = exit_jump;
+    }
+    dyn_array_splice_raw(builder->code_block.instructions, edit->position, 1, replacement, count);
+  }
+
+  bool changed = dyn_array_length(edits) != 0;
+  allocator_deallocate(allocator_default, is_rotated_condition, sizeof(bool) * instruction_count);
+  dyn_array_destroy(edits);
+  label_instruction_map_destroy(&map);
+  return changed;
+}
+
+// :ColdCode
+// Blocks starting with a label that is marked as cold, e.g. by `unlikely` or a
+// call to a `cold` function, as well as the ones that can only be reached
+// through them or only lead into them, are moved after the rest of the code.
+// `fn_encode` puts them past the epilogue so the hot path stays contiguous.
+// Conditional jumps are inverted where that lets the hot path fall through.
+static Label_Index
+cold_code_block_label(
+  Program *program,
+  const Array_Instruction instructions,
+  const Basic_Block *block,
+  Label_Index *inserted_labels,
+  u64 block_index
+) {
+  Instruction *first = dyn_array_get(instructions, block->first_instruction_index);
+  if (first->type == Instruction_Type_Label) return first->label;
+  if (!inserted_labels[block_index].value) {
+    inserted_labels[block_index] =
+      make_label(program, &program->memory.sections.code, slice_literal("cold_split"));
+  }
+  return inserted_labels[block_index];
+}
+
+// Hot code falls through into the epilogue, the last cold block into nothing
+static inline s64
+cold_code_next_block(
+  const Array_u64 order,
+  u64 position,
+  u64 hot_block_count,
+  u64 end_block
+) {
+  if (position + 1 == hot_block_count) return u64_to_s64(end_block);
+  if (position + 1 < dyn_array_length(order)) return u64_to_s64(*dyn_array_get(order, position + 1));
+  return -1;
+}
+
+bool
+fn_split_cold_code(
+  Program *program,
+  Function_Builder *builder
+) {
+  Array_Instruction instructions = builder->code_block.instructions;
+  u64 instruction_count = dyn_array_length(instructions);
+  builder->hot_instruction_count = instruction_count;
+  if (!instruction_count) return false;
+  if (!dyn_array_is_initialized(builder->cold_labels)) return false;
+  if (!dyn_array_length(builder->cold_labels)) return false;
+  // The whole function is placed with the other cold code
+  if (builder->function && (builder->function->flags & Descriptor_Function_Flags_Cold)) return false;
+
+  Control_Flow_Graph graph = control_flow_graph_make(builder);
+  Label_Instruction_Map map = label_instruction_map_make(builder);
+  u64 block_count = dyn_array_length(graph.blocks);
+  // The end of the function is treated as an extra block
+  u64 end_block = block_count;
+  bool *is_marked_cold = allocator_allocate_array(allocator_default, bool, block_count);
+  bool *is_root = allocator_allocate_array(allocator_default, bool, block_count);
+  bool *is_hot = allocator_allocate_array(allocator_default, bool, block_count);
+  Label_Index *inserted_labels = allocator_allocate_array(allocator_default, Label_Index, block_count);
+  memset(is_marked_cold, 0, sizeof(bool) * block_count);
+  memset(is_root, 0, sizeof(bool) * block_count);
+  memset(is_hot, 0, sizeof(bool) * block_count);
+  memset(inserted_labels, 0, sizeof(Label_Index) * block_count);
+
+  for (u64 i = 0; i < dyn_array_length(builder->cold_labels); ++i) {
+    Label_Index label = *dyn_array_get(builder->cold_labels, i);
+    s64 instruction_index = label_instruction_map_get(&map, label);
+    if (instruction_index < 0 || s64_to_u64(instruction_index) == instruction_count) continue;
+    u64 block_index = *dyn_array_get(graph.instruction_block_indexes, instruction_index);
+    Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+    if (block->first_instruction_index == s64_to_u64(instruction_index)) {
+      is_marked_cold[block_index] = true;
+    }
+  }
+
+  // Besides the entry, code can be entered through labels used as values
+  is_root[0] = true;
+  for (u64 i = 0; i < instruction_count; ++i) {
+    Instruction *instruction = dyn_array_get(instructions, i);
+    Basic_Block_Exit ignored = Basic_Block_Exit_None;
+    s64 block_index = -1;
+    if (instruction->type == Instruction_Type_Bytes) {
+      if (instruction->Bytes.label_offset_in_instruction == INSTRUCTION_BYTES_NO_LABEL) continue;
+      block_index = control_flow_graph_label_block(&graph, &map, instruction->Bytes.label_index, &ignored);
+      if (block_index != -1) is_root[block_index] = true;
+    } else if (instruction->type == Instruction_Type_Assembly) {
+      bool is_jump = instruction->assembly.mnemonic == jmp || instruction_is_conditional_jump(instruction);
+      for (u64 operand_index = is_jump ? 1 : 0; operand_index < 3; ++operand_index) {
+        const Storage *operand = &instruction->assembly.operands[operand_index];
+        if (!storage_is_label(operand)) continue;
+        Label_Index label_index = operand->Memory.location.Instruction_Pointer_Relative.label_index;
+        block_index = control_flow_graph_label_block(&graph, &map, label_index, &ignored);
+        if (block_index != -1) is_root[block_index] = true;
+      }
+    }
+  }
+
+  // Hot code is whatever is reachable without going through a cold label
+  Array_u64 stack = dyn_array_make(Array_u64);
+  for (u64 block_index = 0; block_index < block_count; ++block_index) {
+    if (!is_root[block_index]) continue;
+    is_hot[block_index] = true;
+    dyn_array_push(stack, block_index);
+  }
+  while (dyn_array_length(stack)) {
+    u64 block_index = *dyn_array_pop(stack);
+    Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+    s64 successors[] = {block->jump_target, block->fallthrough};
+    for (u64 i = 0; i < countof(successors); ++i) {
+      s64 successor = successors[i];
+      if (successor == -1 || is_hot[successor] || is_marked_cold[successor]) continue;
+      is_hot[successor] = true;
+      dyn_array_push(stack, s64_to_u64(successor));
+    }
+  }
+  dyn_array_destroy(stack);
+
+  // Code that always continues into cold code is cold as well,
+  // e.g. setting up arguments for a call to a `cold` function
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (u64 block_index = 0; block_index < block_count; ++block_index) {
+      if (!is_hot[block_index] || is_root[block_index]) continue;
+      Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+      if (block->exit != Basic_Block_Exit_None) continue;
+      s64 successors[] = {block->jump_target, block->fallthrough};
+      bool has_hot_successor = false;
+      bool has_successor = false;
+      for (u64 i = 0; i < countof(successors); ++i) {
+        if (successors[i] == -1) continue;
+        has_successor = true;
+        if (is_hot[successors[i]]) has_hot_successor = true;
+      }
+      if (has_successor && !has_hot_successor) {
+        is_hot[block_index] = false;
+        changed = true;
+      }
+    }
+  }
+
+  // Unreachable blocks are left where they are
+  Array_u64 order = dyn_array_make(Array_u64, .capacity = block_count);
+  for (u64 block_index = 0; block_index < block_count; ++block_index) {
+    Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+    if (is_hot[block_index] || !block->reachable) dyn_array_push(order, block_index);
+  }
+  u64 hot_block_count = dyn_array_length(order);
+  for (u64 block_index = 0; block_index < block_count; ++block_index) {
+    Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+    if (!is_hot[block_index] && block->reachable) dyn_array_push(order, block_index);
+  }
+
+  bool changed = hot_block_count != block_count;
+  if (changed) {
+    // Labels have to be known before any of the blocks are copied
+    s64 *fallthrough_targets = allocator_allocate_array(allocator_default, s64, block_count);
+    for (u64 position = 0; position < block_count; ++position) {
+      u64 block_index = *dyn_array_get(order, position);
+      Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+      Instruction *last =
+        dyn_array_get(instructions, block->first_instruction_index + block->instruction_count - 1);
+      bool falls_through = last->type != Instruction_Type_Tail_Call;
+      if (last->type == Instruction_Type_Assembly) {
+        falls_through = last->assembly.mnemonic != jmp && last->assembly.mnemonic != ret;
+      }
+      fallthrough_targets[position] = -1;
+      if (!falls_through) continue;
+      fallthrough_targets[position] = block->fallthrough == -1 ? u64_to_s64(end_block) : block->fallthrough;
+      s64 next = cold_code_next_block(order, position, hot_block_count, end_block);
+      if (fallthrough_targets[position] == next) {
+        fallthrough_targets[position] = -1;
+      } else if (fallthrough_targets[position] != u64_to_s64(end_block)) {
+        u64 target = s64_to_u64(fallthrough_targets[position]);
+        cold_code_block_label(program, instructions, dyn_array_get(graph.blocks, target), inserted_labels, target);
+      }
+    }
+
+    Array_Instruction result =
+      dyn_array_make(Array_Instruction, .capacity = instruction_count + block_count * 2);
+    for (u64 position = 0; position < block_count; ++position) {
+      u64 block_index = *dyn_array_get(order, position);
+      Basic_Block *block = dyn_array_get(graph.blocks, block_index);
+      Instruction *first = dyn_array_get(instructions, block->first_instruction_index);
+      if (inserted_labels[block_index].value) {
+        dyn_array_push(result, (Instruction) {
+          .type = Instruction_Type_Label,
+          .label = inserted_labels[block_index],
+          .compiler_source_location = first->compiler_source_location,
+          .source_range = first->source_range,
+        });
+      }
+      for (u64 i = 0; i < block->instruction_count; ++i) {
+        Instruction *instruction = dyn_array_get(instructions, block->first_instruction_index + i);
+        // The epilogue now directly follows the last hot block
+        bool is_jump_to_epilogue =
+          position + 1 == hot_block_count &&
+          instruction->type == Instruction_Type_Assembly &&
+          instruction->assembly.mnemonic == jmp &&
+          storage_is_label(&instruction->assembly.operands[0]) &&
+          instruction->assembly.operands[0].Memory.location.Instruction_Pointer_Relative.label_index.value ==
+            builder->code_block.end_label.value;
+        if (is_jump_to_epilogue) continue;
+        dyn_array_push(result, *instruction);
+      }
+      s64 fallthrough = fallthrough_targets[position];
+      if (fallthrough != -1) {
+        Label_Index fallthrough_label = builder->code_block.end_label;
+        if (fallthrough != u64_to_s64(end_block)) {
+          u64 target = s64_to_u64(fallthrough);
+          fallthrough_label = cold_code_block_label(
+            program, instructions, dyn_array_get(graph.blocks, target), inserted_labels, target
+          );
+        }
+        Instruction *last = dyn_array_last(result);
+        s64 next = cold_code_next_block(order, position, hot_block_count, end_block);
+        bool jumps_to_next = false;
+        if (instruction_is_conditional_jump(last) && conditional_jump_invert(last->assembly.mnemonic)) {
+          Label_Index target_label =
+            last->assembly.operands[0].Memory.location.Instruction_Pointer_Relative.label_index;
+          jumps_to_next = next == u64_to_s64(end_block)
+            ? target_label.value == builder->code_block.end_label.value
+            : next != -1 && block->jump_target == next;
+        }
+        if (jumps_to_next) {
+          last->assembly.mnemonic = conditional_jump_invert(last->assembly.mnemonic);
+          last->assembly.operands[0] = code_label32(fallthrough_label);
+        } else {
+          dyn_array_push(result, (Instruction) {
+            .assembly = {jmp, {code_label32(fallthrough_label), 0, 0}},
+            .compiler_source_location = last->compiler_source_location,
+            .source_range = last->source_range,
+          });
+        }
+      }
+      if (position + 1 == hot_block_count) builder->hot_instruction_count = dyn_array_length(result);
+    }
+
+    dyn_array_clear(builder->code_block.instructions);
+    for (u64 i = 0; i < dyn_array_length(result); ++i) {
+      dyn_array_push(builder->code_block.instructions, *dyn_array_get(result, i));
+    }
+    dyn_array_destroy(result);
+    allocator_deallocate(allocator_default, fallthrough_targets, sizeof(s64) * block_count);
+  }
+
+  dyn_array_destroy(order);
+  allocator_deallocate(allocator_default, is_marked_cold, sizeof(bool) * block_count);
+  allocator_deallocate(allocator_default, is_root, sizeof(bool) * block_count);
+  allocator_deallocate(allocator_default, is_hot, sizeof(bool) * block_count);
+  allocator_deallocate(allocator_default, inserted_labels, sizeof(Label_Index) * block_count);
+  label_instruction_map_destroy(&map);
+  control_flow_graph_destroy(&graph);
+  return changed;
+}
@@ -0,0 +1,180 @@
+#ifndef OPTIMIZATION_H
+#define OPTIMIZATION_H
+
+#include "prelude.h"
+#include "value.h"
+
+// :ControlFlowGraph
+typedef enum {
+  // Control always continues to the `jump_target` or the `fallthrough` block
+  Basic_Block_Exit_None,
+  // Control may reach the `end_label` of the function, i.e. the epilogue
+  Basic_Block_Exit_Return,
+  // Control may be transferred somewhere we can not see, e.g. a tail call,
+  // an indirect jump or a jump to a label outside of the function
+  Basic_Block_Exit_Unknown,
+} Basic_Block_Exit;
+
+typedef struct {
+  u64 first_instruction_index;
+  u64 instruction_count;
+  // Index of the block targeted by the branch at the end of the block or -1
+  s64 jump_target;
+  // Index of the block that follows if the branch is not taken or -1
+  s64 fallthrough;
+  Basic_Block_Exit exit;
+  bool reachable;
+} Basic_Block;
+typedef dyn_array_type(Basic_Block) Array_Basic_Block;
+
+typedef struct {
+  Array_Basic_Block blocks;
+  // Index of the block each of the instructions of the code block belongs to
+  Array_u64 instruction_block_indexes;
+} Control_Flow_Graph;
+
+// :Liveness
+// Registers use their `Register` value as the bit index with
+// one additional bit for the EFLAGS that are read by jcc / setcc / cmovcc.
+#define LIVENESS_EFLAGS_BIT 32
+#define LIVENESS_ALL_REGISTERS ((1llu << 32) - 1)
+
+typedef struct {
+  s64 offset;
+  u64 byte_size;
+} Stack_Slot;
+typedef dyn_array_type(Stack_Slot) Array_Stack_Slot;
+
+typedef struct {
+  u64 register_uses;
+  // Registers that are modified in any way by the instruction
+  u64 register_writes;
+  // Registers that are *fully* overwritten by the instruction
+  u64 register_kills;
+  // RSP-relative memory read and written by the instruction
+  Stack_Slot stack_reads[3];
+  u8 stack_read_count;
+  Stack_Slot stack_write;
+  bool has_stack_write;
+  // Inline machine code and jumps to unknown code can read any stack memory
+  bool reads_all_stack;
+  // A call reads the outgoing argument area, but can only reach other stack memory
+  // if its address has leaked, in which case stack slots are not tracked at all
+  bool reads_call_arguments;
+  // Memory that is not a known stack slot is written, e.g. through a pointer
+  bool writes_memory;
+  // Instruction has effects besides writing its destination operand
+  bool has_side_effects;
+} Instruction_Effects;
+
+typedef struct {
+  // Distinct RSP-relative memory ranges accessed in the function.
+  // Stack slot liveness is only tracked if the address of the stack can not leak.
+  Array_Stack_Slot stack_slots;
+  u64 stack_word_count;
+  // Size of the `[0, size)` area with the stack arguments of the calls in the function
+  u64 call_arguments_byte_size;
+  // Registers that can be observed once control reaches the epilogue
+  u64 return_registers;
+  u64 *register_live_in;
+  u64 *register_live_out;
+  // `stack_word_count` words of bitset for each block
+  u64 *stack_live_in;
+  u64 *stack_live_out;
+} Liveness;
+
+Control_Flow_Graph
+control_flow_graph_make(
+  const Function_Builder *builder
+);
+
+void
+control_flow_graph_destroy(
+  Control_Flow_Graph *graph
+);
+
+void
+instruction_effects(
+  const Instruction *instruction,
+  Instruction_Effects *effects
+);
+
+Liveness
+liveness_compute(
+  const Function_Builder *builder,
+  const Control_Flow_Graph *graph,
+  bool track_stack_slots
+);
+
+bool
+liveness_stack_slot_is_live(
+  const Liveness *liveness,
+  const u64 *live_stack,
+  const Stack_Slot *slot
+);
+
+void
+liveness_step_backward(
+  const Liveness *liveness,
+  const Instruction_Effects *effects,
+  u64 *live_registers,
+  u64 *live_stack
+);
+
+void
+liveness_destroy(
+  Liveness *liveness,
+  const Control_Flow_Graph *graph
+);
+
+bool
+fn_promote_stack_slots(
+  Function_Builder *builder
+);
+
+bool
+fn_propagate_copies(
+  Function_Builder *builder,
+  bool track_stack_slots
+);
+
+u64
+fn_count_moves(
+  const Function_Builder *builder
+);
+
+u64
+fn_clobbered_registers(
+  const Function_Builder *builder
+);
+
+bool
+fn_number_values(
+  Function_Builder *builder,
+  bool track_stack_slots
+);
+
+bool
+fn_eliminate_dead_code(
+  Function_Builder *builder,
+  bool track_stack_slots
+);
+
+bool
+fn_optimize_loops(
+  Function_Builder *builder
+);
+
+bool
+fn_rotate_loops(
+  Program *program,
+  Function_Builder *builder
+);
+
+bool
+fn_split_cold_code(
+  Program *program,
+  Function_Builder *builder
+);
+
+#endif
@@ -45,11 +45,34 @@ typedef struct {
   s32 exception_directory_size;
 } Encoded_Read_Only_Data_Section;
 
+// :ReachabilityStripping
+static inline bool
+pe32_import_symbol_is_used(
+  const Program_Reachability *reachability,
+  const Import_Symbol *symbol
+) {
+  return reachability->labels[symbol->label32.value];
+}
+
+static bool
+pe32_import_library_is_used(
+  const Program_Reachability *reachability,
+  const Import_Library *lib
+) {
+  for (u64 symbol_index = 0; symbol_index < dyn_array_length(lib->symbols); ++symbol_index) {
+    Import_Symbol *symbol = dyn_array_get(lib->symbols, symbol_index);
+    if (pe32_import_symbol_is_used(reachability, symbol)) return true;
+  }
+  return false;
+}
+
 Encoded_Read_Only_Data_Section
 encode_ro_data_section(
   Program * program,
   IMAGE_SECTION_HEADER *header,
-  Array_Function_Layout layouts
+  Array_Function_Layout layouts,
+  Array_u64 order,
+  const Program_Reachability *reachability
 ) {
   #define get_rva() s64_to_s32(s32_to_s64(header->VirtualAddress) + u64_to_s64(buffer->occupied))
 
@@ -59,6 +82,8 @@ encode_ro_data_section(
 
   Encoded_Read_Only_Data_Section result = {0};
 
+  program_constant_pool_flush(program, reachability);
+
   Bucket_Buffer *temp_buffer = bucket_buffer_make();
   Allocator *temp_allocator = bucket_buffer_allocator_make(temp_buffer);
   Array_Import_Library_Pe32 pe32_libraries =
@@ -79,6 +104,12 @@ encode_ro_data_section(
     Import_Library_Pe32 *pe32_lib = dyn_array_get(pe32_libraries, i);
     for (u64 symbol_index = 0; symbol_index < dyn_array_length(lib->symbols); ++symbol_index) {
       Import_Symbol *symbol = dyn_array_get(lib->symbols, symbol_index);
+      // :ReachabilityStripping Keep the indexes matching the symbols
+      if (!pe32_import_symbol_is_used(reachability, symbol)) {
+        dyn_array_push(pe32_lib->symbol_rvas, 0);
+        program->strip_report.import_symbol_count++;
+        continue;
+      }
       dyn_array_push(pe32_lib->symbol_rvas, get_rva());
       virtual_memory_buffer_append_s16(buffer, 0); // Ordinal Hint, value not required
       u64 name_size = symbol->name.length;
@@ -95,10 +126,12 @@ encode_ro_data_section(
   // IAT list
   for (u64 i = 0; i < dyn_array_length(program->import_libraries); ++i) {
     Import_Library *lib = dyn_array_get(program->import_libraries, i);
+    if (!pe32_import_library_is_used(reachability, lib)) continue;
     Import_Library_Pe32 *pe32_lib = dyn_array_get(pe32_libraries, i);
     pe32_lib->rva = get_rva();
     for (u64 symbol_index = 0; symbol_index < dyn_array_length(lib->symbols); ++symbol_index) {
       Import_Symbol *fn = dyn_array_get(lib->symbols, symbol_index);
+      if (!pe32_import_symbol_is_used(reachability, fn)) continue;
       u32 offset = get_rva() - header->VirtualAddress;
       program_set_label_offset(program, fn->label32, offset);
       u32 symbol_rva = *dyn_array_get(pe32_lib->symbol_rvas, symbol_index);
@@ -112,10 +145,13 @@ encode_ro_data_section(
   // Image thunks
   for (u64 i = 0; i < dyn_array_length(program->import_libraries); ++i) {
     Import_Library *lib = dyn_array_get(program->import_libraries, i);
+    if (!pe32_import_library_is_used(reachability, lib)) continue;
     Import_Library_Pe32 *pe32_lib = dyn_array_get(pe32_libraries, i);
     pe32_lib->image_thunk_rva = get_rva();
 
     for (u64 symbol_index = 0; symbol_index < dyn_array_length(lib->symbols); ++symbol_index) {
+      Import_Symbol *symbol = dyn_array_get(lib->symbols, symbol_index);
+      if (!pe32_import_symbol_is_used(reachability, symbol)) continue;
       u32 symbol_rva = *dyn_array_get(pe32_lib->symbol_rvas, symbol_index);
       virtual_memory_buffer_append_u64(buffer, symbol_rva);
     }
@@ -126,6 +162,10 @@ encode_ro_data_section(
   // Library Names
   for (u64 i = 0; i < dyn_array_length(program->import_libraries); ++i) {
     Import_Library *lib = dyn_array_get(program->import_libraries, i);
+    if (!pe32_import_library_is_used(reachability, lib)) {
+      program->strip_report.import_library_count++;
+      continue;
+    }
     Import_Library_Pe32 *pe32_lib = dyn_array_get(pe32_libraries, i);
     pe32_lib->name_rva = get_rva();
     u64 name_size = lib->name.length;
@@ -141,6 +181,8 @@ encode_ro_data_section(
   result.import_directory_rva = get_rva();
 
   for (u64 i = 0; i < dyn_array_length(program->import_libraries); ++i) {
+    Import_Library *lib = dyn_array_get(program->import_libraries, i);
+    if (!pe32_import_library_is_used(reachability, lib)) continue;
     Import_Library_Pe32 *pe32_lib = dyn_array_get(pe32_libraries, i);
 
     IMAGE_IMPORT_DESCRIPTOR *image_import_descriptor =
@@ -161,18 +203,22 @@ encode_ro_data_section(
 
   // Exception Directory
   {
-    u64 size = sizeof(RUNTIME_FUNCTION) * dyn_array_length(program->functions);
+    // :IdenticalCodeFolding Folded functions are not in the order and share the entry
+    u64 size = sizeof(RUNTIME_FUNCTION) * dyn_array_length(order);
     result.exception_directory_rva = get_rva();
     result.exception_directory_size = u64_to_s32(size);
     RUNTIME_FUNCTION *functions =
       virtual_memory_buffer_allocate_bytes(&section->buffer, size, _Alignof(RUNTIME_FUNCTION));
-    for (u64 i = 0; i < dyn_array_length(program->functions); ++i) {
+    // :FunctionOrdering The table must be sorted by address, i.e. in the order of encoding
+    for (u64 order_index = 0; order_index < dyn_array_length(order); ++order_index) {
+      u64 i = *dyn_array_get(order, order_index);
       Function_Builder *builder = dyn_array_get(program->functions, i);
-      RUNTIME_FUNCTION *function = &functions[i];
+      RUNTIME_FUNCTION *function = &functions[order_index];
       Function_Layout *layout = dyn_array_get(layouts, i);
       win32_init_runtime_info_for_function(builder, layout, function, section);
     }
     dyn_array_destroy(layouts);
+    dyn_array_destroy(order);
   }
 
   header->Misc.VirtualSize = u64_to_s32(buffer->occupied);
@@ -185,13 +231,17 @@ encode_ro_data_section(
 
 typedef struct {
   s32 entry_point_rva;
+  // Indexed by the builder index in `program->functions`
   Array_Function_Layout layouts;
+  // Builder indexes in the order they were encoded
+  Array_u64 order;
 } Encoded_Text_Section;
 
 Encoded_Text_Section
 encode_text_section(
   Execution_Context *context,
-  IMAGE_SECTION_HEADER *header
+  IMAGE_SECTION_HEADER *header,
+  const Program_Reachability *reachability
 ) {
   Program *program = context->program;
 
@@ -207,14 +257,46 @@ encode_text_section(
   assert(program->entry_point->descriptor->tag == Descriptor_Tag_Function);
 
   for (u64 i = 0; i < dyn_array_length(program->functions); ++i) {
+    dyn_array_push(result.layouts, (Function_Layout){0});
+  }
+
+  // :FunctionOrdering
+  Array_u64 order = program_function_layout_order(program, 0);
+  result.order = dyn_array_make(Array_u64, .capacity = dyn_array_length(order));
+  // :IdenticalCodeFolding
+  Array_Encoded_Function_Body bodies = dyn_array_make(Array_Encoded_Function_Body);
+  for (u64 order_index = 0; order_index < dyn_array_length(order); ++order_index) {
+    u64 i = *dyn_array_get(order, order_index);
     Function_Builder *builder = dyn_array_get(program->functions, i);
+    // :ReachabilityStripping
+    if (!reachability->functions[i]) {
+      program_strip_report_add_function(program, builder);
+      continue;
+    }
+    Function_Layout *layout = dyn_array_get(result.layouts, i);
+    u64 encode_start_offset = buffer->occupied;
+    u64 first_patch_index = dyn_array_length(program->patch_info_array);
+    fn_encode(program, buffer, builder, layout);
+    s64 folded_index = -1;
+    if (program->fold_identical_functions) {
+      folded_index = fn_fold_identical_code(
+        program, buffer, builder, layout, encode_start_offset, first_patch_index, &bodies
+      );
+    }
+    if (folded_index == -1) {
+      dyn_array_push(result.order, i);
+    } else {
+      // The folded function shares the body and the unwind info of the existing one,
+      // so it must not get an entry of its own in the exception directory
+      *layout = dyn_array_get(bodies, folded_index)->layout;
+    }
     if (builder->function == &program->entry_point->descriptor->Function) {
-      result.entry_point_rva = get_rva();
+      result.entry_point_rva = layout->begin_rva;
       found_entry_point = true;
     }
-    Function_Layout *layout = dyn_array_push_uninitialized(result.layouts);
-    fn_encode(program, buffer, builder, layout);
   }
+  dyn_array_destroy(order);
+  dyn_array_destroy(bodies);
 
   if (!found_entry_point) {
     panic("Internal error: Could not find entry point in the list of program functions");
@@ -228,6 +310,92 @@ encode_text_section(
   return result;
 }
 
+typedef struct {
+  u32 offset_in_section;
+  Label_Index label_index;
+} Pe32_Data_Label;
+typedef dyn_array_type(Pe32_Data_Label) Array_Pe32_Data_Label;
+
+static int
+pe32_data_label_compare(
+  const void *raw_a,
+  const void *raw_b
+) {
+  const Pe32_Data_Label *a = raw_a;
+  const Pe32_Data_Label *b = raw_b;
+  if (a->offset_in_section != b->offset_in_section) {
+    return a->offset_in_section < b->offset_in_section ? -1 : 1;
+  }
+  return a->label_index.value < b->label_index.value ? -1 : 1;
+}
+
+// :ReachabilityStripping
+// Every global gets its own label so the data of each extends from the label to the next
+// label in the section. Globals that are not referenced from the reachable code are removed
+// by moving the remaining ones down in the buffer, keeping at least their original alignment.
+static void
+pe32_strip_unreferenced_data(
+  Program *program,
+  Section *section,
+  const Program_Reachability *reachability
+) {
+  Virtual_Memory_Buffer *buffer = &section->buffer;
+  Array_Pe32_Data_Label data_labels = dyn_array_make(Array_Pe32_Data_Label);
+  for (u64 i = 0; i < dyn_array_length(program->labels); ++i) {
+    Label *label = dyn_array_get(program->labels, i);
+    if (label->section != section || !label->resolved) continue;
+    dyn_array_push(data_labels, (Pe32_Data_Label) {
+      .offset_in_section = label->offset_in_section,
+      .label_index = {.value = i},
+    });
+  }
+  if (!dyn_array_length(data_labels)) {
+    dyn_array_destroy(data_labels);
+    return;
+  }
+  qsort(
+    dyn_array_raw(data_labels), dyn_array_length(data_labels),
+    sizeof(Pe32_Data_Label), pe32_data_label_compare
+  );
+
+  u64 new_occupied = 0;
+  for (u64 i = 0; i < dyn_array_length(data_labels);) {
+    // Labels at the same offset refer to the same data
+    u64 offset = dyn_array_get(data_labels, i)->offset_in_section;
+    u64 group_end = i;
+    bool is_referenced = false;
+    while (
+      group_end < dyn_array_length(data_labels) &&
+      dyn_array_get(data_labels, group_end)->offset_in_section == offset
+    ) {
+      Label_Index label_index = dyn_array_get(data_labels, group_end)->label_index;
+      is_referenced = is_referenced || reachability->labels[label_index.value];
+      group_end++;
+    }
+    u64 next_offset = group_end < dyn_array_length(data_labels)
+      ? dyn_array_get(data_labels, group_end)->offset_in_section
+      : buffer->occupied;
+    u64 byte_size = next_offset - offset;
+    if (is_referenced) {
+      // Lowest set bit of the original offset is at least the alignment it was allocated with
+      u64 alignment = offset ? u64_min(offset & (~offset + 1), 16) : 16;
+      u64 new_offset = u64_align(new_occupied, alignment);
+      memset(buffer->memory + new_occupied, 0, new_offset - new_occupied);
+      memmove(buffer->memory + new_offset, buffer->memory + offset, byte_size);
+      for (u64 j = i; j < group_end; ++j) {
+        Label_Index label_index = dyn_array_get(data_labels, j)->label_index;
+        program_get_label(program, label_index)->offset_in_section = u64_to_u32(new_offset);
+      }
+      new_occupied = new_offset + byte_size;
+    }
+    i = group_end;
+  }
+  dyn_array_destroy(data_labels);
+
+  program->strip_report.data_byte_size += buffer->occupied - new_occupied;
+  buffer->occupied = new_occupied;
+}
+
 static u32
 win32_section_permissions_to_pe32_section_characteristics(
   Section_Permissions permissions
@@ -269,36 +437,73 @@ pe32_offset_after_size(
   };
 }
 
-void
-pe32_checksum(
-  Fixed_Buffer *buffer,
-  IMAGE_OPTIONAL_HEADER64 *header
+// :StreamingWriter The image is written straight from the section buffers
+// and the checksum is accumulated as the bytes go out
+typedef struct {
+  FILE *file;
+  u64 checksum;
+  u64 offset;
+} Pe32_Writer;
+
+static void
+pe32_writer_write(
+  Pe32_Writer *writer,
+  const void *bytes,
+  u64 byte_size
 ) {
   // Unaligned checksum would require some modification
-  // however since PE32+ executables are always section-aligned
+  // however since all the chunks start at a file-aligned offset
   // we can just assert for sanity.
-  assert(buffer->occupied % sizeof(u32) == 0);
-
-  u32 *chunk = (u32 *)buffer->memory;
-  u32 *chunk_end = (u32 *)(buffer->memory + buffer->occupied);
+  assert(writer->offset % sizeof(u32) == 0);
+  if (byte_size) {
+    size_t written = fwrite(bytes, 1, byte_size, writer->file);
+    assert(written == byte_size);
+  }
 
-  u64 checksum = 0;
-  for (; chunk != chunk_end; ++chunk) {
-    // Checksum does not include itself so need to skip over 4 bytes
-    // where it will be written to in the output file
-    if (chunk == &header->CheckSum) continue;
-    checksum = (checksum & 0xffffffff) + (*chunk) + (checksum >> 32);
+  const u8 *chunk = bytes;
+  u64 checksum = writer->checksum;
+  for (u64 i = 0; i < byte_size; i += sizeof(u32)) {
+    // A partial last word is followed by the zero padding of the section
+    u32 word = 0;
+    u64 word_size = byte_size - i < sizeof(u32) ? byte_size - i : sizeof(u32);
+    memcpy(&word, chunk + i, word_size);
+    checksum = (checksum & 0xffffffff) + word + (checksum >> 32);
     if (checksum > (1llu << 32)) {
       checksum = (checksum & 0xffffffff) + (checksum >> 32);
     }
   }
+  writer->checksum = checksum;
+  writer->offset += byte_size;
+}
+
+static void
+pe32_writer_pad_to(
+  Pe32_Writer *writer,
+  u64 offset
+) {
+  static const s8 zeros[PE32_FILE_ALIGNMENT] = {0};
+  assert(offset >= writer->offset);
+  while (writer->offset != offset) {
+    u64 size = offset - writer->offset;
+    if (size > countof(zeros)) size = countof(zeros);
+    size_t written = fwrite(zeros, 1, size, writer->file);
+    assert(written == size);
+    // Zeroes do not change the checksum
+    writer->offset += size;
+  }
+}
+
+static u32
+pe32_writer_checksum(
+  const Pe32_Writer *writer
+) {
+  u64 checksum = writer->checksum;
   checksum = (checksum & 0xffff) + (checksum >> 16);
   checksum = (checksum) + (checksum >> 16);
   checksum = checksum & 0xffff;
 
-  checksum += buffer->occupied;
-
-  header->CheckSum = u64_to_u32(checksum);
+  checksum += writer->offset;
+  return u64_to_u32(checksum);
 }
 
 void
@@ -355,12 +560,17 @@ write_executable(
 
   offsets = pe32_offset_after_size(&offsets, file_size_of_headers);
 
+  // :ReachabilityStripping
+  program->strip_report = (Strip_Report){0};
+  Program_Reachability reachability = program_reachability_compute(program);
+
   // Prepare .text section
   IMAGE_SECTION_HEADER *text_section_header = &sections[0];
   Virtual_Memory_Buffer *text_section_buffer = &program->memory.sections.code.buffer;
   text_section_header->PointerToRawData = offsets.file;
   text_section_header->VirtualAddress = offsets.virtual;
-  Encoded_Text_Section encoded_text_section = encode_text_section(context, text_section_header);
+  Encoded_Text_Section encoded_text_section =
+    encode_text_section(context, text_section_header, &reachability);
   offsets = pe32_offset_after_size(&offsets, text_section_header->SizeOfRawData);
 
   // Prepare .rdata section
@@ -369,7 +579,8 @@ write_executable(
   ro_data_section_header->PointerToRawData = offsets.file;
   ro_data_section_header->VirtualAddress = offsets.virtual;
   Encoded_Read_Only_Data_Section encoded_ro_data_section = encode_ro_data_section(
-    program, ro_data_section_header, encoded_text_section.layouts
+    program, ro_data_section_header, encoded_text_section.layouts, encoded_text_section.order,
+    &reachability
   );
   offsets = pe32_offset_after_size(&offsets, ro_data_section_header->SizeOfRawData);
 
@@ -377,6 +588,8 @@ write_executable(
   Section *rw_data_section = &program->memory.sections.rw_data;
   Virtual_Memory_Buffer *rw_data_section_buffer = &rw_data_section->buffer;
   IMAGE_SECTION_HEADER *rw_data_section_header = &sections[2];
+  pe32_strip_unreferenced_data(program, rw_data_section, &reachability);
+  program_reachability_destroy(&reachability);
   // FIXME @Hack currently encoder does not like empty data section so adding a zero there
   if (!rw_data_section_buffer->occupied) {
     virtual_memory_buffer_append_s8(rw_data_section_buffer, 0);
@@ -398,21 +611,21 @@ write_executable(
   // Calculate total size of image in memory once loaded
   s32 virtual_size_of_image = offsets.virtual;
 
-  u64 max_exe_buffer = offsets.file;
-  Fixed_Buffer *exe_buffer = fixed_buffer_make(
+  // :StreamingWriter Only the headers are assembled in memory
+  Fixed_Buffer *header_buffer = fixed_buffer_make(
     .allocator = allocator_system,
-    .capacity = max_exe_buffer
+    .capacity = file_size_of_headers
   );
-  IMAGE_DOS_HEADER *dos_header = fixed_buffer_allocate_unaligned(exe_buffer, IMAGE_DOS_HEADER);
+  IMAGE_DOS_HEADER *dos_header = fixed_buffer_allocate_unaligned(header_buffer, IMAGE_DOS_HEADER);
 
   *dos_header = (IMAGE_DOS_HEADER) {
     .e_magic = IMAGE_DOS_SIGNATURE,
     .e_lfanew = sizeof(IMAGE_DOS_HEADER),
   };
-  fixed_buffer_append_s32(exe_buffer, IMAGE_NT_SIGNATURE);
+  fixed_buffer_append_s32(header_buffer, IMAGE_NT_SIGNATURE);
 
   IMAGE_FILE_HEADER *file_header =
-    fixed_buffer_allocate_unaligned(exe_buffer, IMAGE_FILE_HEADER);
+    fixed_buffer_allocate_unaligned(header_buffer, IMAGE_FILE_HEADER);
 
   *file_header = (IMAGE_FILE_HEADER) {
     .Machine = IMAGE_FILE_MACHINE_AMD64,
@@ -423,7 +636,7 @@ write_executable(
   };
 
   IMAGE_OPTIONAL_HEADER64 *optional_header =
-    fixed_buffer_allocate_unaligned(exe_buffer, IMAGE_OPTIONAL_HEADER64);
+    fixed_buffer_allocate_unaligned(header_buffer, IMAGE_OPTIONAL_HEADER64);
 
   *optional_header = (IMAGE_OPTIONAL_HEADER64) {
     .Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC,
@@ -483,49 +696,36 @@ write_executable(
 
   // Write out sections
   for (u32 i = 0; i < countof(sections); ++i) {
-    *fixed_buffer_allocate_unaligned(exe_buffer, IMAGE_SECTION_HEADER) = sections[i];
+    *fixed_buffer_allocate_unaligned(header_buffer, IMAGE_SECTION_HEADER) = sections[i];
   }
 
-  // .text segment
-  {
-    exe_buffer->occupied = text_section_header->PointerToRawData;
-    s8 *code_memory = fixed_buffer_allocate_bytes(
-      exe_buffer, text_section_buffer->occupied, sizeof(s8)
-    );
-    memcpy(code_memory, text_section_buffer->memory, text_section_buffer->occupied);
-  }
+  FILE *file = fopen(file_path, "wb");
+  assert(file);
+  // Section contents are written in large chunks directly from the program memory
+  // so there is nothing to gain from copying them to the stdio buffer first
+  setvbuf(file, 0, _IONBF, 0);
 
-  // .rodata segment
-  {
-    exe_buffer->occupied = ro_data_section_header->PointerToRawData;
-    s8 *data_memory = fixed_buffer_allocate_bytes(
-      exe_buffer, ro_data_section_buffer->occupied, sizeof(s8)
-    );
-    memcpy(data_memory, ro_data_section_buffer->memory, ro_data_section_buffer->occupied);
-  }
+  // Checksum does not include itself, which is the same as summing it up while it is still zero
+  Pe32_Writer writer = {.file = file};
+  pe32_writer_write(&writer, header_buffer->memory, header_buffer->occupied);
 
-  // .rwdata segment
-  {
-    exe_buffer->occupied = rw_data_section_header->PointerToRawData;
-    s8 *data_memory = fixed_buffer_allocate_bytes(
-      exe_buffer, rw_data_section_buffer->occupied, sizeof(s8)
-    );
-    memcpy(data_memory, rw_data_section_buffer->memory, rw_data_section_buffer->occupied);
+  Virtual_Memory_Buffer *section_buffers[] = {
+    text_section_buffer, ro_data_section_buffer, rw_data_section_buffer,
+  };
+  for (u32 i = 0; i < countof(section_buffers); ++i) {
+    pe32_writer_pad_to(&writer, sections[i].PointerToRawData);
+    pe32_writer_write(&writer, section_buffers[i]->memory, section_buffers[i]->occupied);
   }
 
-  // Set the occupied to the expected end of file to ensure
-  // correct alignment of the file size
-  exe_buffer->occupied = offsets.file;
-  assert(exe_buffer->occupied % PE32_FILE_ALIGNMENT == 0);
+  // Pad to the expected end of file to ensure correct alignment of the file size
+  pe32_writer_pad_to(&writer, s32_to_u64(offsets.file));
+  assert(writer.offset % PE32_FILE_ALIGNMENT == 0);
 
-  pe32_checksum(exe_buffer, optional_header);
-
-  /////////
-
-  FILE *file = fopen(file_path, "wb");
-  assert(file);
-  fwrite(exe_buffer->memory, 1, exe_buffer->occupied, file);
+  optional_header->CheckSum = pe32_writer_checksum(&writer);
+  s64 checksum_offset = (s8 *)&optional_header->CheckSum - header_buffer->memory;
+  fseek(file, (long)checksum_offset, SEEK_SET);
+  fwrite(&optional_header->CheckSum, sizeof(optional_header->CheckSum), 1, file);
   fclose(file);
 
-  fixed_buffer_destroy(exe_buffer);
+  fixed_buffer_destroy(header_buffer);
 }
@@ -320,6 +320,7 @@ assign(
     target->descriptor = source->descriptor;
     target->storage = source->storage;
     target->next_overload = source->next_overload;
+    target->branch_hint = source->branch_hint;
     return *context->result;
   }
 
@@ -1083,6 +1084,31 @@ token_view_match_till_end_of_statement(
   return token_view_slice(&view, start_index, *peek_index);
 }
 
+// :TailCall
+static inline bool
+token_view_is_single_call(
+  Token_View view
+) {
+  return (
+    view.length == 2 &&
+    token_view_get(view, 0)->tag == Token_Tag_Id &&
+    token_match(token_view_get(view, 1), &(Token_Pattern){.group_tag = Token_Group_Tag_Paren})
+  );
+}
+
+const Token *
+token_view_last_statement_call_args(
+  Token_View view
+) {
+  if (view.length < 2) return 0;
+  Token_View last_statement = token_view_slice(&view, view.length - 2, view.length);
+  if (!token_view_is_single_call(last_statement)) return 0;
+  if (view.length > 2 && !token_match(token_view_get(view, view.length - 3), &token_pattern_semicolon)) {
+    return 0;
+  }
+  return token_view_get(last_statement, 1);
+}
+
 #define Token_Maybe_Match(_id_, ...)\
   const Token *(_id_) = token_peek_match(view, peek_index, &(Token_Pattern) { __VA_ARGS__ });\
   if (_id_) (++peek_index)
@@ -2734,6 +2760,96 @@ token_handle_storage_variant_of(
   MASS_ON_ERROR(assign(context, source_range, result_value, storage_value));
 }
 
+// :VectorTypes
+static bool
+token_vector_operation_from_builtin_name(
+  Slice name,
+  Vector_Operation *operation
+) {
+  if (slice_equal(name, slice_literal("vector_and"))) {
+    *operation = Vector_Operation_And;
+  } else if (slice_equal(name, slice_literal("vector_or"))) {
+    *operation = Vector_Operation_Or;
+  } else if (slice_equal(name, slice_literal("vector_xor"))) {
+    *operation = Vector_Operation_Xor;
+  } else if (slice_equal(name, slice_literal("vector_equal"))) {
+    *operation = Vector_Operation_Equal;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void
+token_handle_vector_operation(
+  Execution_Context *context,
+  const Source_Range *source_range,
+  Vector_Operation operation,
+  Value *a,
+  Value *b,
+  Value *result_value
+) {
+  if (context->result->tag != Mass_Result_Tag_Success) return;
+
+  if (!descriptor_is_vector(a->descriptor) || !same_type(a->descriptor, b->descriptor)) {
+    context_error_snprintf(
+      context, *source_range,
+      "Vector operations expect both operands to have the same vector type"
+    );
+    return;
+  }
+  if (!vector_operation_is_supported(operation, a->descriptor)) {
+    context_error_snprintf(
+      context, *source_range,
+      "Operation is not supported for %"PRIslice,
+      SLICE_EXPAND_PRINTF(a->descriptor->name)
+    );
+    return;
+  }
+
+  Descriptor *result_descriptor = vector_operation_result_descriptor(operation, a->descriptor);
+  Value *stack_result = reserve_stack(context->allocator, context->builder, result_descriptor);
+  vector_operation(context, operation, source_range, stack_result, a, b);
+  MASS_ON_ERROR(assign(context, source_range, result_value, stack_result));
+}
+
+void
+token_handle_vector_shuffle(
+  Execution_Context *context,
+  const Source_Range *source_range,
+  Array_Value_Ptr args,
+  Value *result_value
+) {
+  if (context->result->tag != Mass_Result_Tag_Success) return;
+
+  if (dyn_array_length(args) != 2) {
+    context_error_snprintf(
+      context, *source_range,
+      "vector_shuffle expects a vector and compile-time known lane selectors"
+    );
+    return;
+  }
+  Value *vector = *dyn_array_get(args, 0);
+  if (!vector_shuffle_is_supported(vector->descriptor)) {
+    context_error_snprintf(
+      context, *source_range,
+      "vector_shuffle only supports vectors with 32 or 64 bit lanes"
+    );
+    return;
+  }
+  Value *lane_selectors = token_value_force_immediate_integer(
+    context, source_range, *dyn_array_get(args, 1), &descriptor_u8
+  );
+  MASS_ON_ERROR(*context->result) return;
+
+  Value *stack_result = reserve_stack(context->allocator, context->builder, vector->descriptor);
+  vector_shuffle(
+    context, source_range, stack_result, vector,
+    u64_to_u8(storage_immediate_value_up_to_u64(&lane_selectors->storage))
+  );
+  MASS_ON_ERROR(assign(context, source_range, result_value, stack_result));
+}
+
 void
 token_handle_c_string(
   Execution_Context *context,
@@ -2971,6 +3087,9 @@ token_handle_function_call(
 ) {
   if (context->result->tag != Mass_Result_Tag_Success) return;
 
+  // :TailCall
+  bool is_tail_call_position = context->tail_call_args_token == args_token;
+
   Value *target = value_any(context);
   MASS_ON_ERROR(token_force_value(context, target_token, target)) return;
   assert(token_match(args_token, &(Token_Pattern){.group_tag = Token_Group_Tag_Paren}));
@@ -3004,7 +3123,10 @@ token_handle_function_call(
   //       correct target register for each argument and use it during mathcing.
   //       We will need type-only eval anyway for things like `typeof(some expression)`.
   {
-    Register arg_registers[] = {Register_C, Register_D, Register_R8, Register_R9};
+    // :PrivateCallingConvention uses R10 and R11 for arguments as well
+    Register arg_registers[] = {
+      Register_C, Register_D, Register_R8, Register_R9, Register_R10, Register_R11
+    };
     bool acquired_registers[countof(arg_registers)] = {0};
     for (uint64_t i = 0; i < countof(arg_registers); ++i) {
       Register reg_index = arg_registers[i];
@@ -3179,7 +3301,9 @@ token_handle_function_call(
         }
       }
     } else {
-      call_function_overload(context, source_range, overload, args, result_value);
+      call_function_overload(
+        context, source_range, overload, args, result_value, is_tail_call_position
+      );
     }
 
 
@@ -3241,6 +3365,60 @@ extend_signed_integer_value_to_next_size(
   return extend_integer_value(context, source_range, value, one_size_larger);
 }
 
+// :WidthPromotion
+// Arithmetic on 8 and 16-bit registers only writes a part of the register, which makes
+// the instruction depend on the previous value of the whole register, and the 16-bit
+// forms also need an operand size prefix. Like the integer promotion in C narrow operands
+// are extended into 32-bit registers with `movsx` / `movzx` and the result is truncated
+// only when it is stored. Both signed and unsigned narrow values fit into `s32` and
+// the low bits of a sum, difference or product do not depend on the upper ones.
+static inline bool
+integer_values_can_be_promoted(
+  const Value *a,
+  const Value *b
+) {
+  if (descriptor_byte_size(a->descriptor) >= 4) return false;
+  if (a->storage.tag == Storage_Tag_Static && b->storage.tag == Storage_Tag_Static) return false;
+  const Value *values[] = {a, b};
+  for (u64 i = 0; i < countof(values); ++i) {
+    const Storage *storage = &values[i]->storage;
+    if (storage->tag != Storage_Tag_Static && !storage_is_register_or_memory(storage)) return false;
+  }
+  return true;
+}
+
+static Value *
+promote_narrow_integer_value(
+  Execution_Context *context,
+  const Source_Range *source_range,
+  Value *value
+) {
+  bool is_signed = descriptor_is_signed_integer(value->descriptor);
+  if (value->storage.tag == Storage_Tag_Static) {
+    s64 immediate = is_signed
+      ? storage_immediate_value_up_to_s64(&value->storage)
+      : u64_to_s64(storage_immediate_value_up_to_u64(&value->storage));
+    return value_from_s32(context, s64_to_s32(immediate));
+  }
+  Register reg = register_acquire_temp(context->builder);
+  Value *result = value_register_for_descriptor(context, reg, &descriptor_s32);
+  push_instruction(
+    &context->builder->code_block.instructions,
+    *source_range,
+    (Instruction) {.assembly = {is_signed ? movsx : movzx, {result->storage, value->storage}}}
+  );
+  return result;
+}
+
+static inline void
+release_promoted_integer_value(
+  Execution_Context *context,
+  Value *value
+) {
+  if (value->storage.tag != Storage_Tag_Register) return;
+  register_release(context->builder, value->storage.Register.index);
+}
+
 void
 maybe_resize_values_for_integer_math_operation(
   Execution_Context *context,
@@ -3354,7 +3532,6 @@ token_handle_array_access(
   assert(array_value->descriptor->tag == Descriptor_Tag_Fixed_Size_Array);
   assert(array_value->storage.tag == Storage_Tag_Memory);
   assert(array_value->storage.Memory.location.tag == Memory_Location_Tag_Indirect);
-  assert(!array_value->storage.Memory.location.Indirect.maybe_index_register.has_value);
 
   Descriptor *item_descriptor = array_value->descriptor->Fixed_Size_Array.item;
   u64 item_byte_size = descriptor_byte_size(item_descriptor);
@@ -3364,57 +3541,47 @@ token_handle_array_access(
     context, source_range, index_value, &descriptor_u64
   );
   array_element_value->storage.byte_size = item_byte_size;
+  Memory_Location_Indirect *indirect = &array_element_value->storage.Memory.location.Indirect;
   if (index_value->storage.tag == Storage_Tag_Static) {
     s32 index = s64_to_s32(storage_immediate_value_up_to_s64(&index_value->storage));
-    array_element_value->storage.Memory.location.Indirect.offset = index * item_byte_size;
+    indirect->offset += index * item_byte_size;
   } else {
-    // @InstructionQuality
-    // This code is very general in terms of the operands where the base
-    // or the index are stored, but it is
-
-    Register reg = register_acquire_temp(context->builder);
-    Value *new_base_register = value_register_for_descriptor(context, reg, &descriptor_s64);
+    if (indirect->maybe_index_register.has_value) {
+      // An operand can only have one index so for nested arrays, e.g. `matrix.(i).(j)`,
+      // the address of the inner array is loaded into a register to become the base
+      Register base_register = register_acquire_temp(context->builder);
+      Value *base_value = value_register_for_descriptor(context, base_register, &descriptor_s64);
+      load_address(context, source_range, base_value, array_value);
+      *indirect = (Memory_Location_Indirect){.base_register = base_register};
+    }
 
-    // Move the index into the register
+    Register index_register = register_acquire_temp(context->builder);
+    Value *index_register_value = value_register_for_descriptor(context, index_register, &descriptor_s64);
     move_value(
       context->allocator,
       context->builder,
       source_range,
-      &new_base_register->storage,
+      &index_register_value->storage,
       &index_value->storage
     );
 
-    Value *byte_size_value = value_from_s64(context, item_byte_size);
-    // Multiply index by the item byte size
-    multiply(context, source_range, new_base_register, new_base_register, byte_size_value);
-
-    {
-      // @InstructionQuality
-      // TODO If the source does not have index, on X64 it should be possible to avoid
-      //      using an extra register and put the index into SIB
-
-      // Load previous address into a temp register
-      Register temp_register = register_acquire_temp(context->builder);
-      Value temp_value = {
-        .descriptor = &descriptor_s64,
-        .storage = storage_register_for_descriptor(temp_register, &descriptor_s64)
-      };
-
-      load_address(context, source_range, &temp_value, array_value);
-      plus(context, source_range, new_base_register, new_base_register, &temp_value);
-      register_release(context->builder, temp_register);
-    }
-
-    array_element_value->storage = (Storage) {
-      .tag = Storage_Tag_Memory,
-      .byte_size = item_byte_size,
-      .Memory.location = {
-        .tag = Memory_Location_Tag_Indirect,
-        .Indirect = {
-          .base_register = new_base_register->storage.Register.index,
-        }
+    // :IndexScale
+    // Items of the common sizes are addressed by the index directly with the SIB scale,
+    // so the access itself is the only instruction. Other sizes need a multiplication.
+    Index_Scale scale = Index_Scale_1;
+    switch(item_byte_size) {
+      case 1: scale = Index_Scale_1; break;
+      case 2: scale = Index_Scale_2; break;
+      case 4: scale = Index_Scale_4; break;
+      case 8: scale = Index_Scale_8; break;
+      default: {
+        Value *byte_size_value = value_from_s64(context, item_byte_size);
+        multiply(context, source_range, index_register_value, index_register_value, byte_size_value);
+        break;
       }
-    };
+    }
+    indirect->maybe_index_register = (Maybe_Register){.index = index_register, .has_value = true};
+    indirect->index_scale = scale;
   }
   // FIXME this might actually cause problems in assigning to an array element
   MASS_ON_ERROR(assign(context, source_range, result_value, array_element_value)) return;
@@ -3438,6 +3605,7 @@ token_eval_operator(
   } else if (slice_equal(operator, slice_literal("()"))) {
     const Token *target = token_view_get(args_view, 0);
     const Token *args_token = token_view_get(args_view, 1);
+    Vector_Operation builtin_vector_operation;
     // TODO turn `cast` into a compile-time function call / macro
     if (
       target->tag == Token_Tag_Id &&
@@ -3464,6 +3632,30 @@ token_eval_operator(
       Array_Value_Ptr args = token_match_call_arguments(context, args_token);
       token_handle_storage_variant_of(context, &args_token->source_range, args, result_value);
       dyn_array_destroy(args);
+    } else if (
+      target->tag == Token_Tag_Id &&
+      slice_equal(target->source, slice_literal("vector_shuffle"))
+    ) {
+      Array_Value_Ptr args = token_match_call_arguments(context, args_token);
+      token_handle_vector_shuffle(context, &args_token->source_range, args, result_value);
+      dyn_array_destroy(args);
+    } else if (
+      target->tag == Token_Tag_Id &&
+      token_vector_operation_from_builtin_name(target->source, &builtin_vector_operation)
+    ) {
+      Array_Value_Ptr args = token_match_call_arguments(context, args_token);
+      if (dyn_array_length(args) != 2) {
+        context_error_snprintf(
+          context, args_token->source_range,
+          "%"PRIslice" expects two arguments", SLICE_EXPAND_PRINTF(target->source)
+        );
+      } else {
+        token_handle_vector_operation(
+          context, &args_token->source_range, builtin_vector_operation,
+          *dyn_array_get(args, 0), *dyn_array_get(args, 1), result_value
+        );
+      }
+      dyn_array_destroy(args);
     } else if (
       target->tag == Token_Tag_Id &&
       slice_equal(target->source, slice_literal("address_of"))
@@ -3564,6 +3756,23 @@ token_eval_operator(
     Value *rhs_value = value_any(context);
     MASS_ON_ERROR(token_force_value(context, rhs, rhs_value)) return;
 
+    if (descriptor_is_vector(lhs_value->descriptor)) {
+      Vector_Operation operation = Vector_Operation_Add;
+      if (slice_equal(operator, slice_literal("-"))) operation = Vector_Operation_Subtract;
+      else if (slice_equal(operator, slice_literal("*"))) operation = Vector_Operation_Multiply;
+      else if (slice_equal(operator, slice_literal("/"))) operation = Vector_Operation_Divide;
+      else if (slice_equal(operator, slice_literal("%"))) {
+        context_error_snprintf(
+          context, args_view.source_range, "Remainder is not supported for vector types"
+        );
+        return;
+      }
+      token_handle_vector_operation(
+        context, &args_view.source_range, operation, lhs_value, rhs_value, result_value
+      );
+      return;
+    }
+
     bool lhs_is_literal = lhs_value->descriptor == &descriptor_number_literal;
     bool rhs_is_literal = rhs_value->descriptor == &descriptor_number_literal;
     if (lhs_is_literal && rhs_is_literal) {
@@ -3600,19 +3809,38 @@ token_eval_operator(
     Function_Builder *builder = context->builder;
 
     Value *stack_result = reserve_stack(context->allocator, builder, lhs_value->descriptor);
+    Value *operation_result = stack_result;
+    // :WidthPromotion
+    bool is_promoted = integer_values_can_be_promoted(lhs_value, rhs_value);
+    if (is_promoted) {
+      lhs_value = promote_narrow_integer_value(context, &lhs->source_range, lhs_value);
+      rhs_value = promote_narrow_integer_value(context, &rhs->source_range, rhs_value);
+      operation_result = value_register_for_descriptor(
+        context, register_acquire_temp(builder), &descriptor_s32
+      );
+    }
     if (slice_equal(operator, slice_literal("+"))) {
-      plus(context, &lhs->source_range, stack_result, lhs_value, rhs_value);
+      plus(context, &lhs->source_range, operation_result, lhs_value, rhs_value);
     } else if (slice_equal(operator, slice_literal("-"))) {
-      minus(context, &lhs->source_range, stack_result, lhs_value, rhs_value);
+      minus(context, &lhs->source_range, operation_result, lhs_value, rhs_value);
     } else if (slice_equal(operator, slice_literal("*"))) {
-      multiply(context, &lhs->source_range, stack_result, lhs_value, rhs_value);
+      multiply(context, &lhs->source_range, operation_result, lhs_value, rhs_value);
     } else if (slice_equal(operator, slice_literal("/"))) {
-      divide(context, &lhs->source_range, stack_result, lhs_value, rhs_value);
+      divide(context, &lhs->source_range, operation_result, lhs_value, rhs_value);
     } else if (slice_equal(operator, slice_literal("%"))) {
-      value_remainder(context, &lhs->source_range, stack_result, lhs_value, rhs_value);
+      value_remainder(context, &lhs->source_range, operation_result, lhs_value, rhs_value);
     } else {
       panic("Internal error: Unexpected operator");
     }
+    if (is_promoted) {
+      // Storing the low part of the register is all the truncation that is needed
+      Storage truncated = operation_result->storage;
+      truncated.byte_size = stack_result->storage.byte_size;
+      move_value(context->allocator, builder, &lhs->source_range, &stack_result->storage, &truncated);
+      release_promoted_integer_value(context, operation_result);
+      release_promoted_integer_value(context, lhs_value);
+      release_promoted_integer_value(context, rhs_value);
+    }
     MASS_ON_ERROR(assign(context, &args_view.source_range, result_value, stack_result)) return;
   } else if (
     slice_equal(operator, slice_literal(">")) ||
@@ -3708,7 +3936,19 @@ token_eval_operator(
       }
     }
 
+    // :WidthPromotion
+    // The kind of the comparison is already picked so it does not matter that
+    // the promoted values are always signed
+    bool is_promoted = integer_values_can_be_promoted(lhs_value, rhs_value);
+    if (is_promoted) {
+      lhs_value = promote_narrow_integer_value(context, &lhs->source_range, lhs_value);
+      rhs_value = promote_narrow_integer_value(context, &rhs->source_range, rhs_value);
+    }
     compare(context, compare_type, &lhs->source_range, result_value, lhs_value, rhs_value);
+    if (is_promoted) {
+      release_promoted_integer_value(context, lhs_value);
+      release_promoted_integer_value(context, rhs_value);
+    }
   } else if (slice_equal(operator, slice_literal("->"))) {
     const Token *arguments = token_view_get(args_view, 0);
     const Token *return_types = token_view_get(args_view, 1);
@@ -3734,6 +3974,61 @@ token_eval_operator(
       }
     }
     MASS_ON_ERROR(assign(context, &args_view.source_range, result_value, function_value)) return;
+  } else if (slice_equal(operator, slice_literal("inline"))) {
+    const Token *function = token_view_get(args_view, 0);
+    Value *function_value = value_any(context);
+    MASS_ON_ERROR(token_force_value(context, function, function_value)) return;
+    if (function_value) {
+      if (
+        function_value->descriptor->tag == Descriptor_Tag_Function &&
+        !(function_value->descriptor->Function.flags & Descriptor_Function_Flags_External)
+      ) {
+        Descriptor_Function *descriptor = &function_value->descriptor->Function;
+        descriptor->flags |= Descriptor_Function_Flags_Inline;
+      } else {
+        context_error_snprintf(
+          context, function->source_range,
+          "Only literal functions (with a body) can be marked as inline"
+        );
+      }
+    }
+    MASS_ON_ERROR(assign(context, &args_view.source_range, result_value, function_value)) return;
+  } else if (
+    slice_equal(operator, slice_literal("likely")) ||
+    slice_equal(operator, slice_literal("unlikely"))
+  ) {
+    // :ColdCode
+    const Token *condition = token_view_get(args_view, 0);
+    Value *condition_value = value_any(context);
+    MASS_ON_ERROR(token_force_value(context, condition, condition_value)) return;
+    // Storing the condition into an existing variable does not make the variable rare
+    bool is_expression_result = result_value->descriptor->tag == Descriptor_Tag_Any;
+    MASS_ON_ERROR(assign(context, &args_view.source_range, result_value, condition_value)) return;
+    if (is_expression_result) {
+      result_value->branch_hint = slice_equal(operator, slice_literal("likely"))
+        ? Branch_Hint_Likely
+        : Branch_Hint_Unlikely;
+    }
+  } else if (slice_equal(operator, slice_literal("cold"))) {
+    // :ColdCode
+    const Token *function = token_view_get(args_view, 0);
+    Value *function_value = value_any(context);
+    MASS_ON_ERROR(token_force_value(context, function, function_value)) return;
+    if (function_value) {
+      if (
+        function_value->descriptor->tag == Descriptor_Tag_Function &&
+        !(function_value->descriptor->Function.flags & Descriptor_Function_Flags_External)
+      ) {
+        Descriptor_Function *descriptor = &function_value->descriptor->Function;
+        descriptor->flags |= Descriptor_Function_Flags_Cold;
+      } else {
+        context_error_snprintf(
+          context, function->source_range,
+          "Only literal functions (with a body) can be marked as cold"
+        );
+      }
+    }
+    MASS_ON_ERROR(assign(context, &args_view.source_range, result_value, function_value)) return;
   } else {
     panic("TODO: Unknown operator");
   }
@@ -3785,6 +4080,66 @@ token_dispatch_operator(
   dyn_array_splice_raw(*token_stack, start_index, argument_count, &result_token, 1);
 }
 
+// :BranchlessSelect
+// An arm of an `if` expression can be evaluated eagerly when it is a single
+// number literal or an already defined runtime variable as neither of those
+// can have side effects.
+static Value *
+token_if_arm_as_select_operand(
+  Execution_Context *context,
+  Token_View arm
+) {
+  if (arm.length != 1) return 0;
+  const Token *token = token_view_get(arm, 0);
+  if (token->tag == Token_Tag_Value) {
+    Value *value = token->Value.value;
+    return value->descriptor == &descriptor_number_literal ? value : 0;
+  }
+  if (token->tag != Token_Tag_Id) return 0;
+  Scope_Entry *scope_entry = scope_lookup(context->scope, token->source);
+  if (!scope_entry || scope_entry->tag != Scope_Entry_Tag_Value) return 0;
+  Value *value = scope_entry->Value.value;
+  if (value->epoch != context->epoch) return 0;
+  if (
+    value->storage.tag != Storage_Tag_Register &&
+    value->storage.tag != Storage_Tag_Memory
+  ) {
+    return 0;
+  }
+  return value;
+}
+
+// :BranchlessSelect
+// Returns the type of the select result if both arms fit into a register
+// that `cmovcc` can work with, or 0 otherwise.
+static Descriptor *
+token_select_descriptor(
+  Value *then_value,
+  Value *else_value
+) {
+  bool then_is_literal = then_value->descriptor == &descriptor_number_literal;
+  bool else_is_literal = else_value->descriptor == &descriptor_number_literal;
+  Descriptor *descriptor = 0;
+  if (then_is_literal && else_is_literal) {
+    descriptor = &descriptor_s64;
+  } else if (then_is_literal) {
+    descriptor = else_value->descriptor;
+  } else if (else_is_literal) {
+    descriptor = then_value->descriptor;
+  } else if (same_type(then_value->descriptor, else_value->descriptor)) {
+    descriptor = then_value->descriptor;
+  } else {
+    return 0;
+  }
+  bool is_pointer = descriptor->tag == Descriptor_Tag_Pointer;
+  if (!descriptor_is_integer(descriptor) && !(is_pointer && !then_is_literal && !else_is_literal)) {
+    return 0;
+  }
+  u64 byte_size = descriptor_byte_size(descriptor);
+  if (byte_size != 2 && byte_size != 4 && byte_size != 8) return 0;
+  return descriptor;
+}
+
 const Token *
 token_parse_if_expression(
   Execution_Context *context,
@@ -3860,6 +4215,36 @@ token_parse_if_expression(
     goto err;
   }
 
+  // :BranchlessSelect
+  Value *then_operand = token_if_arm_as_select_operand(context, then_branch);
+  Value *else_operand = token_if_arm_as_select_operand(context, else_branch);
+  Descriptor *select_descriptor =
+    then_operand && else_operand ? token_select_descriptor(then_operand, else_operand) : 0;
+  if (select_descriptor) {
+    Value *condition_value = value_any(context);
+    token_parse_expression(context, condition, condition_value, Expression_Parse_Mode_Default);
+    MASS_ON_ERROR(*context->result) goto err;
+    if (then_operand->descriptor == &descriptor_number_literal) {
+      then_operand = token_value_force_immediate_integer(
+        context, &then_branch.source_range, then_operand, select_descriptor
+      );
+    }
+    if (else_operand->descriptor == &descriptor_number_literal) {
+      else_operand = token_value_force_immediate_integer(
+        context, &else_branch.source_range, else_operand, select_descriptor
+      );
+    }
+    MASS_ON_ERROR(*context->result) goto err;
+
+    Value *if_value = reserve_stack(context->allocator, context->builder, select_descriptor);
+    make_select(
+      context, &keyword->source_range, if_value, condition_value, then_operand, else_operand
+    );
+    MASS_ON_ERROR(*context->result) goto err;
+    *matched_length = peek_index + else_branch.length;
+    return token_value_make(context, if_value, view.source_range);
+  }
+
   Value *condition_value = value_any(context);
   token_parse_expression(context, condition, condition_value, Expression_Parse_Mode_Default);
   MASS_ON_ERROR(*context->result) goto err;
@@ -4355,8 +4740,28 @@ token_parse_explicit_return(
   Value *fn_return = scope_entry_force(context, scope_value_entry);
   assert(fn_return);
 
+  Scope_Entry *scope_label_entry = scope_lookup(context->scope, MASS_RETURN_LABEL_NAME);
+  assert(scope_label_entry);
+  Value *return_label = scope_entry_force(context, scope_label_entry);
+  assert(return_label);
+  assert(return_label->descriptor == &descriptor_void);
+  assert(storage_is_label(&return_label->storage));
+
+  // :TailCall
+  // `return foo(...)` from the function itself (and not from an inline or a macro
+  // which have their own return labels) allows the call to reuse the current frame.
+  Execution_Context return_context = *context;
+  Label_Index return_label_index =
+    return_label->storage.Memory.location.Instruction_Pointer_Relative.label_index;
+  if (
+    return_label_index.value == context->builder->code_block.end_label.value &&
+    token_view_is_single_call(rest)
+  ) {
+    return_context.tail_call_args_token = token_view_get(rest, 1);
+  }
+
   bool is_any_return = fn_return->descriptor->tag == Descriptor_Tag_Any;
-  token_parse_expression(context, rest, fn_return, Expression_Parse_Mode_Default);
+  token_parse_expression(&return_context, rest, fn_return, Expression_Parse_Mode_Default);
 
   // FIXME with inline functions and explicit returns we can end up with multiple immediate
   //       values that are trying to be moved in the same return value
@@ -4377,13 +4782,6 @@ token_parse_explicit_return(
     );
   }
 
-  Scope_Entry *scope_label_entry = scope_lookup(context->scope, MASS_RETURN_LABEL_NAME);
-  assert(scope_label_entry);
-  Value *return_label = scope_entry_force(context, scope_label_entry);
-  assert(return_label);
-  assert(return_label->descriptor == &descriptor_void);
-  assert(storage_is_label(&return_label->storage));
-
   push_instruction(
     &context->builder->code_block.instructions,
     keyword->source_range,
@@ -4673,6 +5071,22 @@ scope_define_builtins(
     .tag = Scope_Entry_Tag_Operator,
     .Operator = { .precedence = 19, .fixity = Operator_Fixity_Prefix, .argument_count = 1 }
   });
+  scope_define(scope, slice_literal("inline"), (Scope_Entry) {
+    .tag = Scope_Entry_Tag_Operator,
+    .Operator = { .precedence = 19, .fixity = Operator_Fixity_Prefix, .argument_count = 1 }
+  });
+  scope_define(scope, slice_literal("cold"), (Scope_Entry) {
+    .tag = Scope_Entry_Tag_Operator,
+    .Operator = { .precedence = 19, .fixity = Operator_Fixity_Prefix, .argument_count = 1 }
+  });
+  scope_define(scope, slice_literal("likely"), (Scope_Entry) {
+    .tag = Scope_Entry_Tag_Operator,
+    .Operator = { .precedence = 19, .fixity = Operator_Fixity_Prefix, .argument_count = 1 }
+  });
+  scope_define(scope, slice_literal("unlikely"), (Scope_Entry) {
+    .tag = Scope_Entry_Tag_Operator,
+    .Operator = { .precedence = 19, .fixity = Operator_Fixity_Prefix, .argument_count = 1 }
+  });
 
   scope_define(scope, slice_literal("-"), (Scope_Entry) {
     .tag = Scope_Entry_Tag_Operator,
@@ -127,6 +127,11 @@ token_parse_expression(
   Expression_Parse_Mode mode
 );
 
+const Token *
+token_view_last_statement_call_args(
+  Token_View view
+);
+
 void
 token_parse_block_no_scope(
   Execution_Context *context,
@@ -4,6 +4,7 @@
 #include "value.c"
 #include "instruction.c"
 #include "encoding.c"
+#include "optimization.c"
 #include "function.c"
 #include "source.c"
 
@@ -28,6 +29,7 @@ typedef s32 (*fn_type_s32_s32_to_s32)(s32, s32);
 typedef s64 (*fn_type_s64_to_s64)(s64);
 typedef s64 (*fn_type_s64_s64_to_s64)(s64, s64);
 typedef s64 (*fn_type_s64_s64_s64_to_s64)(s64, s64, s64);
+typedef s64 (*fn_type_s64_s64_s64_s64_to_s64)(s64, s64, s64, s64);
 typedef s64 (*fn_type_s64_s64_s64_s64_s64_to_s64)(s64, s64, s64, s64, s64);
 typedef s64 (*fn_type_s64_s64_s64_s64_s64_s64_to_s64)(s64, s64, s64, s64, s64, s64);
 typedef s32 (*fn_type__void_to_s32__to_s32)(fn_type_void_to_s32);
@@ -41,6 +43,17 @@ typedef struct {
 
 typedef Test_128bit (*fn_type_s64_to_test_128bit_struct)(s64);
 
+typedef struct {
+  s32 lanes[4];
+} Test_s32x4;
+
+typedef struct {
+  f32 lanes[4];
+} Test_f32x4;
+
+typedef Test_s32x4 (*fn_type_s32x4_s32x4_to_s32x4)(Test_s32x4, Test_s32x4);
+typedef Test_f32x4 (*fn_type_f32x4_to_f32x4)(Test_f32x4);
+
 bool
 spec_check_mass_result(
   const Mass_Result *result
@@ -429,6 +442,36 @@ spec("source") {
       check(checker(42) == 1);
       check(checker(-2) == 0);
     }
+    it("should select between side-effect free arms of an if expression without a jump") {
+      fn_type_s64_to_s64 checker = (fn_type_s64_to_s64)test_program_inline_source_function(
+        "at_least_one", &test_context,
+        "at_least_one :: (count : s64) -> (s64) {"
+          "if count then count else 1"
+        "}"
+      );
+      check(checker);
+      check(checker(0) == 1);
+      check(checker(42) == 42);
+      Function_Builder *builder = dyn_array_get(test_context.program->functions, 0);
+      for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+        Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+        if (instruction->type != Instruction_Type_Assembly) continue;
+        check(instruction->assembly.mnemonic != jmp);
+        check(instruction->assembly.mnemonic != je);
+      }
+    }
+    it("should select using the comparison from the condition of an if expression") {
+      fn_type_s32_s32_to_s32 checker = (fn_type_s32_s32_to_s32)test_program_inline_source_function(
+        "max", &test_context,
+        "max :: (x : s32, y : s32) -> (s32) {"
+          "if x < y then y else x"
+        "}"
+      );
+      check(checker);
+      check(checker(3, 7) == 7);
+      check(checker(7, 3) == 7);
+      check(checker(-5, -9) == -5);
+    }
     it("should report an error on missing `then` inside of an if expression") {
       test_program_inline_source_base(
         "main", &test_context,
@@ -473,6 +516,36 @@ spec("source") {
       check(checker(-2) == 0);
     }
 
+    it("should place the branch of an `unlikely` condition after the rest of the function") {
+      fn_type_s64_to_s64 checker = (fn_type_s64_to_s64)test_program_inline_source_function(
+        "test", &test_context,
+        "test :: (x : s64) -> (s64) { y := x * 2; if unlikely(y > 100) { y = y - 7 }; y + 1 }"
+      );
+      check(checker);
+      check(checker(5) == 11);
+      check(checker(60) == 114);
+      Function_Builder *builder = dyn_array_get(test_context.program->functions, 0);
+      check(builder->hot_instruction_count < dyn_array_length(builder->code_block.instructions));
+      for (u64 i = 0; i < builder->hot_instruction_count; ++i) {
+        Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+        if (instruction->type != Instruction_Type_Assembly) continue;
+        check(instruction->assembly.mnemonic != sub);
+      }
+    }
+
+    it("should not apply an `unlikely` hint to a branch on an unrelated condition") {
+      fn_type_s64_to_s64 checker = (fn_type_s64_to_s64)test_program_inline_source_function(
+        "test", &test_context,
+        "test :: (x : s64) -> (s64) { rare := unlikely(x > 100); y := x; if (x > 3) { y = y - 7 }; y }"
+      );
+      check(checker);
+      check(checker(2) == 2);
+      check(checker(5) == -2);
+      Function_Builder *builder = dyn_array_get(test_context.program->functions, 0);
+      check(!dyn_array_is_initialized(builder->cold_labels));
+      check(builder->hot_instruction_count == dyn_array_length(builder->code_block.instructions));
+    }
+
     it("should report an error for an `if` statement without a body or a condition") {
       test_program_inline_source_base(
         "main", &test_context,
@@ -514,6 +587,105 @@ spec("source") {
       check(checker(1, 2, 3, 4, 5) == 5);
     }
 
+    it("should pass more arguments in registers and return 16 bytes in RAX:RDX to internal functions") {
+      fn_type_s64_to_s64 checker = (fn_type_s64_to_s64)test_program_inline_source_function(
+        "test", &test_context,
+        "Pair :: c_struct({ a : s64; b : s32 });"
+        "mix :: (a : s64, b : s64, c : s64, d : s64, e : s64, f : s64) -> (Pair) {"
+          "p : Pair;"
+          "p.a = a * b + c * d;"
+          "p.b = cast(s32, e * f - a);"
+          "if (a > 3) { p.a = p.a + 1 };"
+          "p"
+        "};"
+        "test :: (x : s64) -> (s64) { p := mix(x, 2, 3, 4, 5, 6); p.a * 100 + cast(s64, p.b) }"
+      );
+      check(checker);
+      check(checker(5) == 2325);
+      check(checker(1) == 1429);
+      check(dyn_array_length(test_context.program->functions) == 2);
+      Function_Builder *mix = dyn_array_get(test_context.program->functions, 0);
+      Function_Builder *test = dyn_array_get(test_context.program->functions, 1);
+      check(mix->calling_convention == Calling_Convention_Private);
+      check(test->calling_convention == Calling_Convention_Win64);
+      // No home area and no stack arguments
+      check(test->max_call_parameters_stack_size == 0);
+    }
+
+    it("should not save registers around a call that the callee does not modify") {
+      fn_type_s64_s64_s64_s64_to_s64 checker =
+        (fn_type_s64_s64_s64_s64_to_s64)test_program_inline_source_function(
+          "test", &test_context,
+          "leaf :: (x : s64) -> (s64) { a := x * 3; if (a > 10) { a = a - 10 }; a };"
+          "test :: (x : s64, y : s64, z : s64, w : s64) -> (s64) { leaf(x) + w }"
+        );
+      check(checker);
+      check(checker(7, 0, 0, 100) == 111);
+      check(checker(2, 0, 0, 100) == 106);
+      Function_Builder *leaf = dyn_array_get(test_context.program->functions, 0);
+      Function_Builder *test = dyn_array_get(test_context.program->functions, 1);
+      check(!register_bitset_get(leaf->register_clobber_bitset, Register_R9));
+      // `w` stays in R9 across the call instead of being spilled and reloaded
+      for (u64 i = 0; i < dyn_array_length(test->code_block.instructions); ++i) {
+        Instruction *instruction = dyn_array_get(test->code_block.instructions, i);
+        if (instruction->type != Instruction_Type_Assembly) continue;
+        if (instruction->assembly.mnemonic != mov) continue;
+        Storage *source = &instruction->assembly.operands[1];
+        check(!(source->tag == Storage_Tag_Register && source->Register.index == Register_R9));
+      }
+    }
+
+    it("should place functions that call each other next to each other when ordering is enabled") {
+      test_context.program->order_functions_by_calls = true;
+      fn_type_s64_to_s64 checker = (fn_type_s64_to_s64)test_program_inline_source_function(
+        "test", &test_context,
+        "first :: (x : s64) -> (s64) { a := x * 3; if (a > 10) { a = a - 10 }; a + 1 };"
+        "third :: (x : s64) -> (s64) { a := x * 5; if (a > 20) { a = a - 20 }; a + 2 };"
+        "second :: (x : s64) -> (s64) { a := third(x) * 7; if (a > 30) { a = a - 30 }; a + 3 };"
+        "test :: (x : s64) -> (s64) { first(x) + second(x) + second(x + 1) }"
+      );
+      check(checker);
+      check(checker(1) == 4 + 22 + 57);
+      Program *program = test_context.program;
+      Array_u64 order = program_function_layout_order(program, 0);
+      check(dyn_array_length(order) == dyn_array_length(program->functions));
+      const char *names[] = {"first", "second", "third", "test"};
+      u64 positions[countof(names)] = {0};
+      for (u64 i = 0; i < dyn_array_length(order); ++i) {
+        Function_Builder *builder = dyn_array_get(program->functions, *dyn_array_get(order, i));
+        Slice name = program_get_label(program, builder->label_index)->name;
+        for (u64 k = 0; k < countof(names); ++k) {
+          if (slice_equal(name, slice_from_c_string(names[k]))) positions[k] = i;
+        }
+      }
+      // `test` has neighbors on both sides so the chain is first - test - second - third
+      check(positions[3] == positions[0] + 1);
+      check(positions[1] == positions[3] + 1);
+      check(positions[2] == positions[1] + 1);
+      dyn_array_destroy(order);
+    }
+
+    it("should not inline a `cold` function and move the call out of the hot path") {
+      fn_type_s64_to_s64 checker = (fn_type_s64_to_s64)test_program_inline_source_function(
+        "test", &test_context,
+        "report :: cold (x : s64) -> (s64) { x * 10 };"
+        "test :: (x : s64) -> (s64) { y := x + 1; if (y > 3) { y = report(y) }; y }"
+      );
+      check(checker);
+      check(checker(1) == 2);
+      check(checker(5) == 60);
+      Function_Builder *test = dyn_array_get(test_context.program->functions, 1);
+      bool has_call = false;
+      for (u64 i = 0; i < dyn_array_length(test->code_block.instructions); ++i) {
+        Instruction *instruction = dyn_array_get(test->code_block.instructions, i);
+        if (instruction->type != Instruction_Type_Assembly) continue;
+        if (instruction->assembly.mnemonic != call) continue;
+        has_call = true;
+        check(i >= test->hot_instruction_count);
+      }
+      check(has_call);
+    }
+
     it("should correctly save volatile registers when calling other functions") {
       fn_type_s64_to_s64 checker = (fn_type_s64_to_s64)test_program_inline_source_function(
         "outer", &test_context,
@@ -749,6 +921,36 @@ spec("source") {
       check(fibonnacci(10) == 55);
     }
 
+    it("should turn a call in a tail position into a jump that does not grow the stack") {
+      fn_type_s64_to_s64 checker = (fn_type_s64_to_s64)test_program_inline_source_function(
+        "count_down", &test_context,
+        "count_down :: (n : s64) -> (s64) {"
+          "if (n == 0) { return 42 };"
+          "count_down(n - 1)"
+        "}"
+      );
+      check(checker);
+      Function_Builder *builder = dyn_array_get(test_context.program->functions, 0);
+      for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+        Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+        check(instruction->type != Instruction_Type_Assembly || instruction->assembly.mnemonic != call);
+      }
+      // Deep enough to overflow the stack if every level had its own frame
+      check(checker(10000000) == 42);
+    }
+
+    it("should turn a call in an explicit return into a jump that does not grow the stack") {
+      fn_type_s64_to_s64 checker = (fn_type_s64_to_s64)test_program_inline_source_function(
+        "count_down", &test_context,
+        "count_down :: (n : s64) -> (s64) {"
+          "if (n != 0) { return count_down(n - 1) };"
+          "42"
+        "}"
+      );
+      check(checker);
+      check(checker(10000000) == 42);
+    }
+
     it("should report an error when encountering invalid pointer type") {
       test_program_inline_source_base(
         "main", &test_context,
@@ -1053,7 +1255,7 @@ spec("source") {
       check(checker() == 42);
     }
 
-    xit("should not allow changes to the passed arguments to inline function") {
+    it("should not allow changes to the passed arguments to inline function") {
       fn_type_void_to_s64 checker = (fn_type_void_to_s64)test_program_inline_source_function(
         "test", &test_context,
         "process :: inline (y : s64) -> () { y = 20; }\n"
@@ -1063,6 +1265,33 @@ spec("source") {
       check(checker() == 42);
     }
 
+    it("should inline calls to small functions instead of emitting a call") {
+      fn_type_void_to_s64 checker = (fn_type_void_to_s64)test_program_inline_source_function(
+        "test", &test_context,
+        "add :: (x : s64, y : s64) -> (s64) { x + y }\n"
+        "test :: () -> (s64) { add(20, 22) }"
+      );
+      check(checker);
+      check(checker() == 42);
+      check(dyn_array_length(test_context.program->functions) == 1);
+      Function_Builder *builder = dyn_array_get(test_context.program->functions, 0);
+      for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+        Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+        check(instruction->type != Instruction_Type_Assembly || instruction->assembly.mnemonic != call);
+      }
+    }
+
+    it("should be able to parse and run inline function with an explicit return") {
+      fn_type_s64_to_s64 checker = (fn_type_s64_to_s64)test_program_inline_source_function(
+        "test", &test_context,
+        "clamp :: inline (x : s64) -> (s64) { if (x > 10) { return 10 }; x }\n"
+        "test :: (x : s64) -> (s64) { clamp(x) + 1 }"
+      );
+      check(checker);
+      check(checker(42) == 11);
+      check(checker(3) == 4);
+    }
+
     it("should be able to define and use a syntax macro without a capture") {
       fn_type_void_to_s32 checker = (fn_type_void_to_s32)test_program_inline_source_function(
         "checker", &test_context,
@@ -1289,6 +1518,34 @@ spec("source") {
       u8 actual = checker();
       check(actual == 42);
     }
+
+    it("should address an array element by a runtime index with a scaled index operand") {
+      fn_type_s64_to_s64 checker = (fn_type_s64_to_s64)test_program_inline_source_function(
+        "test", &test_context,
+        "test :: (index : s64) -> (s64) {"
+          "foo : s64[8];"
+          "foo.(index) = 40;"
+          "foo.(index) + 2"
+        "}"
+      );
+      check(checker);
+      check(checker(3) == 42);
+      Function_Builder *builder = dyn_array_get(test_context.program->functions, 0);
+      bool has_scaled_operand = false;
+      for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+        Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+        if (instruction->type != Instruction_Type_Assembly) continue;
+        for (u64 operand_index = 0; operand_index < countof(instruction->assembly.operands); ++operand_index) {
+          Storage *operand = &instruction->assembly.operands[operand_index];
+          if (operand->tag != Storage_Tag_Memory) continue;
+          if (operand->Memory.location.tag != Memory_Location_Tag_Indirect) continue;
+          if (operand->Memory.location.Indirect.index_scale == Index_Scale_8) has_scaled_operand = true;
+        }
+        check(instruction->assembly.mnemonic != imul);
+        check(instruction->assembly.mnemonic != shl);
+      }
+      check(has_scaled_operand);
+    }
   }
 
   describe("User-defined Types") {
@@ -1378,9 +1635,70 @@ spec("source") {
       check(checker);
       check(checker(8) == 9);
     }
+
+    it("should do 8 and 16 bit arithmetic in 32 bit registers and truncate the result") {
+      fn_type_s16_to_s16 checker = (fn_type_s16_to_s16)test_program_inline_source_function(
+        "wrap", &test_context,
+        "wrap :: (x : s16) -> (s16) { y : s16 = x * 2; y + 1 }"
+      );
+      check(checker);
+      check(checker(3) == 7);
+      check(checker(32767) == -1);
+      Function_Builder *builder = dyn_array_get(test_context.program->functions, 0);
+      for (u64 i = 0; i < dyn_array_length(builder->code_block.instructions); ++i) {
+        Instruction *instruction = dyn_array_get(builder->code_block.instructions, i);
+        if (instruction->type != Instruction_Type_Assembly) continue;
+        const X64_Mnemonic *mnemonic = instruction->assembly.mnemonic;
+        if (mnemonic != add && mnemonic != imul) continue;
+        Storage *destination = &instruction->assembly.operands[0];
+        if (destination->tag != Storage_Tag_Register) continue;
+        check(destination->byte_size >= 4);
+      }
+    }
   }
 
 
+  describe("Vector Types") {
+    it("should be able to add s32x4 vectors lane-wise") {
+      fn_type_s32x4_s32x4_to_s32x4 checker = (fn_type_s32x4_s32x4_to_s32x4)test_program_inline_source_function(
+        "checker", &test_context,
+        "checker :: (a : s32x4, b : s32x4) -> (s32x4) { a + b }"
+      );
+      check(checker);
+      Test_s32x4 result = checker((Test_s32x4){{1, 2, 3, 4}}, (Test_s32x4){{10, 20, 30, -40}});
+      check(result.lanes[0] == 11);
+      check(result.lanes[1] == 22);
+      check(result.lanes[2] == 33);
+      check(result.lanes[3] == -36);
+    }
+
+    it("should be able to compare vectors with a lane-wise operator from the prelude") {
+      fn_type_s32x4_s32x4_to_s32x4 checker = (fn_type_s32x4_s32x4_to_s32x4)test_program_inline_source_function(
+        "checker", &test_context,
+        "checker :: (a : s32x4, b : s32x4) -> (s32x4) { a .== b }"
+      );
+      check(checker);
+      Test_s32x4 result = checker((Test_s32x4){{1, 2, 3, 4}}, (Test_s32x4){{1, 0, 3, 0}});
+      check(result.lanes[0] == -1);
+      check(result.lanes[1] == 0);
+      check(result.lanes[2] == -1);
+      check(result.lanes[3] == 0);
+    }
+
+    it("should be able to shuffle lanes of a f32x4 vector") {
+      fn_type_f32x4_to_f32x4 checker = (fn_type_f32x4_to_f32x4)test_program_inline_source_function(
+        "checker", &test_context,
+        "checker :: (a : f32x4) -> (f32x4) { vector_shuffle(a, 27) * a }"
+      );
+      check(checker);
+      Test_f32x4 result = checker((Test_f32x4){{1.0f, 2.0f, 3.0f, 4.0f}});
+      check(result.lanes[0] == 4.0f);
+      check(result.lanes[1] == 6.0f);
+      check(result.lanes[2] == 6.0f);
+      check(result.lanes[3] == 4.0f);
+    }
+  }
+
   describe("Modules") {
     it("should support importing modules") {
       fn_type_void_to_s32 checker = (fn_type_void_to_s32)test_program_inline_source_function(
@@ -80,10 +80,24 @@
   MASS_PROCESS_BUILT_IN_TYPE(u32, 32)\
   MASS_PROCESS_BUILT_IN_TYPE(u64, 64)
 
+// Packed SIMD vectors that fit into a single XMM register
+#define MASS_ENUMERATE_VECTOR_TYPES\
+  MASS_PROCESS_BUILT_IN_TYPE(s8x16, 128)\
+  MASS_PROCESS_BUILT_IN_TYPE(s16x8, 128)\
+  MASS_PROCESS_BUILT_IN_TYPE(s32x4, 128)\
+  MASS_PROCESS_BUILT_IN_TYPE(s64x2, 128)\
+  MASS_PROCESS_BUILT_IN_TYPE(u8x16, 128)\
+  MASS_PROCESS_BUILT_IN_TYPE(u16x8, 128)\
+  MASS_PROCESS_BUILT_IN_TYPE(u32x4, 128)\
+  MASS_PROCESS_BUILT_IN_TYPE(u64x2, 128)\
+  MASS_PROCESS_BUILT_IN_TYPE(f32x4, 128)\
+  MASS_PROCESS_BUILT_IN_TYPE(f64x2, 128)
+
 #define MASS_ENUMERATE_BUILT_IN_TYPES\
   MASS_ENUMERATE_INTEGER_TYPES \
   MASS_PROCESS_BUILT_IN_TYPE(f32, 32)\
-  MASS_PROCESS_BUILT_IN_TYPE(f64, 64)
+  MASS_PROCESS_BUILT_IN_TYPE(f64, 64)\
+  MASS_ENUMERATE_VECTOR_TYPES
 
 #include "generated_types.h"
 
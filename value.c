@@ -276,7 +276,7 @@ print_operand(
     }
     case Storage_Tag_Xmm: {
       u64 bits = operand->byte_size * 8;
-      printf("xmm%"PRIu64, bits);
+      printf("%s%"PRIu64, bits == 256 ? "ymm" : "xmm", bits);
       break;
     }
     case Storage_Tag_Static: {
@@ -305,9 +305,23 @@ print_operand(
       break;
     }
     case Storage_Tag_Memory: {
-      // TODO print better info
       u64 bits = operand->byte_size * 8;
       printf("m%"PRIu64, bits);
+      const Memory_Location *location = &operand->Memory.location;
+      if (location->tag == Memory_Location_Tag_Indirect) {
+        printf("[r%u", (u32)location->Indirect.base_register);
+        if (location->Indirect.maybe_index_register.has_value) {
+          printf(
+            "+r%u*%u",
+            (u32)location->Indirect.maybe_index_register.index,
+            1u << location->Indirect.index_scale
+          );
+        }
+        if (location->Indirect.offset) {
+          printf("%+"PRIi64, location->Indirect.offset);
+        }
+        printf("]");
+      }
       break;
     }
     default: {
@@ -372,6 +386,11 @@ const Storage reg_name##_64 = { \
   .tag = Storage_Tag_Xmm, \
   .byte_size = 8, \
   .Register = {.index = (reg_index)}, \
+};\
+const Storage reg_name##_128 = { \
+  .tag = Storage_Tag_Xmm, \
+  .byte_size = 16, \
+  .Register = {.index = (reg_index)}, \
 };
 define_xmm_register(xmm0, 0b000);
 define_xmm_register(xmm1, 0b001);
@@ -381,6 +400,14 @@ define_xmm_register(xmm4, 0b100);
 define_xmm_register(xmm5, 0b101);
 define_xmm_register(xmm6, 0b110);
 define_xmm_register(xmm7, 0b111);
+define_xmm_register(xmm8, 0b1000);
+define_xmm_register(xmm9, 0b1001);
+define_xmm_register(xmm10, 0b1010);
+define_xmm_register(xmm11, 0b1011);
+define_xmm_register(xmm12, 0b1100);
+define_xmm_register(xmm13, 0b1101);
+define_xmm_register(xmm14, 0b1110);
+define_xmm_register(xmm15, 0b1111);
 #undef define_xmm_register
 
 static inline Label_Index
@@ -643,6 +670,7 @@ storage_equal(
             a_location->Indirect.base_register == b_location->Indirect.base_register &&
             a_location->Indirect.maybe_index_register.has_value == b_location->Indirect.maybe_index_register.has_value &&
             a_location->Indirect.maybe_index_register.index == b_location->Indirect.maybe_index_register.index &&
+            a_location->Indirect.index_scale == b_location->Indirect.index_scale &&
             a_location->Indirect.offset == b_location->Indirect.offset
           );
           break;
@@ -673,6 +701,7 @@ instruction_equal(
 ) {
   if (a->type != b->type) return false;
   switch(a->type) {
+    case Instruction_Type_Tail_Call:
     case Instruction_Type_Assembly: {
       if (a->assembly.mnemonic != b->assembly.mnemonic) return false;
       for (u64 i = 0; i < countof(a->assembly.operands); ++i) {
@@ -922,7 +951,10 @@ storage_register_for_descriptor(
   Descriptor *descriptor
 ) {
   u64 byte_size = descriptor_byte_size(descriptor);
-  assert(byte_size == 1 || byte_size == 2 || byte_size == 4 || byte_size == 8);
+  assert(
+    byte_size == 1 || byte_size == 2 || byte_size == 4 || byte_size == 8 ||
+    (register_is_xmm(reg) && byte_size == 16)
+  );
 
   Storage result = {
     .tag = register_is_xmm(reg) ? Storage_Tag_Xmm : Storage_Tag_Register,
@@ -983,10 +1015,21 @@ value_global_c_string_from_slice_internal(
     },
   };
 
-  Value *string_value = value_global_internal(compiler_source_location, context, descriptor);
-  s8 *memory = rip_value_pointer(context->program, string_value);
-  memcpy(memory, slice.bytes, slice.length);
-  memory[length - 1] = 0;
+  // :ConstantPool The terminating zero is part of the bytes so only suffixes
+  // that are themselves NUL-terminated strings can be shared
+  char *bytes = allocator_allocate_bytes(context->allocator, length, sizeof(s8));
+  memcpy(bytes, slice.bytes, slice.length);
+  bytes[length - 1] = 0;
+  Slice c_string_bytes = {.bytes = bytes, .length = s32_to_u64(length)};
+  Label_Index label_index = program_constant_pool_add(context->program, c_string_bytes, sizeof(s8));
+
+  Value *string_value = allocator_allocate(context->allocator, Value);
+  *string_value = (Value) {
+    .epoch = context->epoch,
+    .descriptor = descriptor,
+    .storage = data_label32(label_index, c_string_bytes.length),
+    .compiler_source_location = compiler_source_location,
+  };
   return string_value;
 }
 #define value_global_c_string_from_slice(...)\
@@ -1037,45 +1080,145 @@ value_as_function(
   return (fn_type_opaque)target;
 }
 
+static inline Descriptor *
+function_argument_descriptor(
+  const Function_Argument *argument
+) {
+  switch(argument->tag) {
+    case Function_Argument_Tag_Any_Of_Type: return argument->Any_Of_Type.descriptor;
+    case Function_Argument_Tag_Exact: return argument->Exact.descriptor;
+  }
+  panic("Unexpected function argument tag");
+  return 0;
+}
+
+// :PrivateCallingConvention
+// Functions that are only ever called directly from Mass code do not need to
+// follow the Win64 ABI. General purpose and float arguments are assigned
+// registers independently and there are more of them, the caller does not
+// reserve the home area and values up to 16 bytes are returned in RAX:RDX.
+// Functions that would need arguments on the stack keep the Win64 convention.
+static const Register private_general_argument_registers[] = {
+  Register_C, Register_D, Register_R8, Register_R9, Register_R10, Register_R11,
+};
+static const Register private_float_argument_registers[] = {
+  Register_Xmm0, Register_Xmm1, Register_Xmm2, Register_Xmm3, Register_Xmm4, Register_Xmm5,
+};
+
+static inline bool
+calling_convention_returns_in_register_pair(
+  Calling_Convention convention,
+  Descriptor *descriptor
+) {
+  if (convention != Calling_Convention_Private) return false;
+  u64 byte_size = descriptor_byte_size(descriptor);
+  if (byte_size <= 8 || byte_size > 16) return false;
+  // The upper part has to be something a single `mov` can handle
+  u64 high_byte_size = byte_size - 8;
+  return high_byte_size == 1 || high_byte_size == 2 || high_byte_size == 4 || high_byte_size == 8;
+}
+
+// :ReturnTypeLargerThanRegister
+static inline bool
+calling_convention_has_return_pointer(
+  Calling_Convention convention,
+  Descriptor *descriptor
+) {
+  if (descriptor_byte_size(descriptor) <= 8) return false;
+  return !calling_convention_returns_in_register_pair(convention, descriptor);
+}
+
+static inline bool
+private_argument_is_float(
+  Descriptor *descriptor
+) {
+  return descriptor_is_float(descriptor) && descriptor_byte_size(descriptor) <= 8;
+}
+
+bool
+function_can_use_private_calling_convention(
+  const Descriptor_Function *function
+) {
+  if (function->flags & Descriptor_Function_Flags_External) return false;
+  if (function->flags & Descriptor_Function_Flags_Compile_Time) return false;
+  if (!function->body || function->body->tag != Token_Tag_Group) return false;
+  u64 general_count =
+    calling_convention_has_return_pointer(Calling_Convention_Private, function->returns.descriptor);
+  u64 float_count = 0;
+  for (u64 i = 0; i < dyn_array_length(function->arguments); ++i) {
+    Function_Argument *argument = dyn_array_get(function->arguments, i);
+    if (private_argument_is_float(function_argument_descriptor(argument))) {
+      float_count++;
+    } else {
+      general_count++;
+    }
+  }
+  return general_count <= countof(private_general_argument_registers) &&
+    float_count <= countof(private_float_argument_registers);
+}
+
 Value *
 function_argument_value_at_index_internal(
   Compiler_Source_Location source_location,
   Execution_Context *context,
   Descriptor_Function *function,
+  Calling_Convention convention,
   u64 argument_index,
   Function_Argument_Mode mode
 ) {
-  Descriptor *arg_descriptor = 0;
   Function_Argument *argument = dyn_array_get(function->arguments, argument_index);
-  switch(argument->tag) {
-    case Function_Argument_Tag_Any_Of_Type: {
-      arg_descriptor = argument->Any_Of_Type.descriptor;
-      break;
-    }
-    case Function_Argument_Tag_Exact: {
-      arg_descriptor = argument->Exact.descriptor;
-      break;
-    }
-  }
+  Descriptor *arg_descriptor = function_argument_descriptor(argument);
   u64 byte_size = descriptor_byte_size(arg_descriptor);
 
   // :ReturnTypeLargerThanRegister
   // If return type is larger than register, the pointer to stack location
   // where it needs to be written to is passed as the first argument
   // shifting registers for actual arguments by one
-  if (descriptor_byte_size(function->returns.descriptor) > 8) {
-    argument_index++;
+  u64 return_pointer_count =
+    calling_convention_has_return_pointer(convention, function->returns.descriptor);
+
+  Register reg = Register_A;
+  bool is_in_register = false;
+  switch(convention) {
+    case Calling_Convention_Win64: {
+      Register general_registers[] = {Register_C, Register_D, Register_R8, Register_R9};
+      Register float_registers[] = {Register_Xmm0, Register_Xmm1, Register_Xmm2, Register_Xmm3};
+
+      assert(countof(general_registers) == countof(float_registers));
+
+      argument_index += return_pointer_count;
+      if (argument_index < countof(general_registers)) {
+        Register *registers = descriptor_is_float(arg_descriptor) ? float_registers : general_registers;
+        reg = registers[argument_index];
+        is_in_register = true;
+      }
+      break;
+    }
+    case Calling_Convention_Private: {
+      u64 general_index = return_pointer_count;
+      u64 float_index = 0;
+      for (u64 i = 0; i < argument_index; ++i) {
+        Function_Argument *previous = dyn_array_get(function->arguments, i);
+        if (private_argument_is_float(function_argument_descriptor(previous))) {
+          float_index++;
+        } else {
+          general_index++;
+        }
+      }
+      if (private_argument_is_float(arg_descriptor)) {
+        assert(float_index < countof(private_float_argument_registers));
+        reg = private_float_argument_registers[float_index];
+      } else {
+        assert(general_index < countof(private_general_argument_registers));
+        reg = private_general_argument_registers[general_index];
+      }
+      is_in_register = true;
+      break;
+    }
   }
 
-  Register general_registers[] = {Register_C, Register_D, Register_R8, Register_R9};
-  Register float_registers[] = {Register_Xmm0, Register_Xmm1, Register_Xmm2, Register_Xmm3};
-
-  assert(countof(general_registers) == countof(float_registers));
-
   Allocator *allocator = context->allocator;
-  if (argument_index < countof(general_registers)) {
-    Register *registers = descriptor_is_float(arg_descriptor) ? float_registers : general_registers;
-    Register reg = registers[argument_index];
+  if (is_in_register) {
     if (byte_size <= 8) {
       return value_register_for_descriptor_internal(source_location, context, reg, arg_descriptor);
     } else {
@@ -1121,6 +1264,11 @@ program_init(
     .patch_info_array = dyn_array_make(Array_Label_Location_Diff_Patch_Info, .capacity = 128, .allocator = allocator),
     .import_libraries = dyn_array_make(Array_Import_Library, .capacity = 16, .allocator = allocator),
     .functions = dyn_array_make(Array_Function_Builder, .capacity = 16, .allocator = allocator),
+    .private_function_labels = dyn_array_make(Array_Private_Function_Label, .allocator = allocator),
+    .constant_pool = {
+      .entries = dyn_array_make(Array_Constant_Pool_Entry, .allocator = allocator),
+      .map = hash_map_make(Constant_Pool_Map),
+    },
   };
 
   #define MAX_CODE_SIZE (640llu * 1024llu * 1024llu) // 640Mb
@@ -1176,6 +1324,13 @@ program_deinit(
   dyn_array_destroy(program->patch_info_array);
   dyn_array_destroy(program->import_libraries);
   dyn_array_destroy(program->functions);
+  dyn_array_destroy(program->private_function_labels);
+  for (u64 i = 0; i < dyn_array_length(program->constant_pool.entries); ++i) {
+    Constant_Pool_Entry *entry = dyn_array_get(program->constant_pool.entries, i);
+    allocator_deallocate(allocator_default, (void *)entry->bytes.bytes, entry->bytes.length);
+  }
+  dyn_array_destroy(program->constant_pool.entries);
+  hash_map_destroy(program->constant_pool.map);
 }
 
 void
@@ -1268,6 +1423,97 @@ program_set_label_offset(
   label->offset_in_section = offset_in_section;
 }
 
+Label_Index
+program_constant_pool_add(
+  Program *program,
+  Slice bytes,
+  u64 alignment
+) {
+  Constant_Pool *pool = &program->constant_pool;
+  u64 *maybe_index = hash_map_get(pool->map, bytes);
+  if (maybe_index) {
+    Constant_Pool_Entry *existing = dyn_array_get(pool->entries, *maybe_index);
+    if (existing->alignment >= alignment) return existing->label_index;
+  }
+
+  s8 *copy = allocator_allocate_bytes(allocator_default, bytes.length, sizeof(s8));
+  memcpy(copy, bytes.bytes, bytes.length);
+  Constant_Pool_Entry entry = {
+    .label_index = make_label(program, &program->memory.sections.ro_data, slice_literal("constant")),
+    .bytes = {.bytes = (char *)copy, .length = bytes.length},
+    .alignment = alignment,
+  };
+  hash_map_set(pool->map, entry.bytes, dyn_array_length(pool->entries));
+  dyn_array_push(pool->entries, entry);
+  return entry.label_index;
+}
+
+static int
+constant_pool_entry_compare_reversed_bytes(
+  const void *a_raw,
+  const void *b_raw
+) {
+  const Constant_Pool_Entry *a = *(const Constant_Pool_Entry **)a_raw;
+  const Constant_Pool_Entry *b = *(const Constant_Pool_Entry **)b_raw;
+  u64 min_length = a->bytes.length < b->bytes.length ? a->bytes.length : b->bytes.length;
+  for (u64 i = 1; i <= min_length; ++i) {
+    u8 a_byte = (u8)a->bytes.bytes[a->bytes.length - i];
+    u8 b_byte = (u8)b->bytes.bytes[b->bytes.length - i];
+    if (a_byte != b_byte) return a_byte < b_byte ? 1 : -1;
+  }
+  if (a->bytes.length == b->bytes.length) return 0;
+  return a->bytes.length < b->bytes.length ? 1 : -1;
+}
+
+void
+program_constant_pool_flush(
+  Program *program,
+  const Program_Reachability *reachability
+) {
+  Constant_Pool *pool = &program->constant_pool;
+  Virtual_Memory_Buffer *buffer = &program->memory.sections.ro_data.buffer;
+  u64 entry_count = dyn_array_length(pool->entries);
+  Constant_Pool_Entry **pending =
+    allocator_allocate_array(allocator_default, Constant_Pool_Entry *, entry_count);
+  u64 pending_count = 0;
+  for (u64 i = 0; i < entry_count; ++i) {
+    Constant_Pool_Entry *entry = dyn_array_get(pool->entries, i);
+    if (entry->flushed) continue;
+    // :ReachabilityStripping
+    if (reachability && !reachability->labels[entry->label_index.value]) {
+      program->strip_report.data_byte_size += entry->bytes.length;
+      continue;
+    }
+    pending[pending_count++] = entry;
+  }
+
+  // Sorting by the reversed bytes puts every constant right after one it is a suffix of,
+  // if there is such a constant, so NUL-terminated strings like "bar\0" can share the
+  // memory of "foobar\0". Constants that need alignment are never placed this way.
+  qsort(pending, pending_count, sizeof(pending[0]), constant_pool_entry_compare_reversed_bytes);
+  const Constant_Pool_Entry *previous = 0;
+  for (u64 i = 0; i < pending_count; ++i) {
+    Constant_Pool_Entry *entry = pending[i];
+    u32 offset;
+    if (
+      entry->alignment == 1 && previous && previous->alignment == 1 &&
+      slice_ends_with(previous->bytes, entry->bytes)
+    ) {
+      Label *previous_label = program_get_label(program, previous->label_index);
+      offset = previous_label->offset_in_section +
+        u64_to_u32(previous->bytes.length - entry->bytes.length);
+    } else {
+      s8 *memory = virtual_memory_buffer_allocate_bytes(buffer, entry->bytes.length, entry->alignment);
+      memcpy(memory, entry->bytes.bytes, entry->bytes.length);
+      offset = u64_to_u32((u64)(memory - buffer->memory));
+    }
+    program_set_label_offset(program, entry->label_index, offset);
+    entry->flushed = true;
+    previous = entry;
+  }
+  allocator_deallocate(allocator_default, pending, sizeof(pending[0]) * entry_count);
+}
+
 static inline u32
 program_resolve_label_to_rva(
   const Program *program,
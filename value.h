@@ -137,6 +137,17 @@ descriptor_is_float(
   return descriptor == &descriptor_f32 || descriptor == &descriptor_f64;
 }
 
+static inline bool
+descriptor_is_vector(
+  Descriptor *descriptor
+) {
+  #define MASS_PROCESS_BUILT_IN_TYPE(_NAME_, _BIT_SIZE_)\
+    if (descriptor == &descriptor_##_NAME_) return true;
+  MASS_ENUMERATE_VECTOR_TYPES
+  #undef MASS_PROCESS_BUILT_IN_TYPE
+  return false;
+}
+
 static inline Descriptor *
 maybe_unwrap_pointer_descriptor(
   Descriptor *descriptor
@@ -178,11 +189,15 @@ typedef enum {
   Instruction_Type_Assembly,
   Instruction_Type_Label,
   Instruction_Type_Bytes,
+  // :TailCall Expanded by `fn_end` once the frame layout is known
+  Instruction_Type_Tail_Call,
 } Instruction_Type;
 
 typedef struct {
   const X64_Mnemonic *mnemonic;
   Storage operands[3];
+  // :ClobberSets Volatile registers that a `call` is known to leave intact
+  u64 call_preserved_bitset;
 } Instruction_Assembly;
 
 #define INSTRUCTION_BYTES_NO_LABEL 255
@@ -219,6 +234,12 @@ typedef enum {
   Function_Argument_Mode_Body,
 } Function_Argument_Mode;
 
+// :PrivateCallingConvention
+typedef enum {
+  Calling_Convention_Win64,
+  Calling_Convention_Private,
+} Calling_Convention;
+
 typedef struct {
   s32 stack_reserve;
   u8 size_of_prolog;
@@ -229,6 +250,35 @@ typedef struct {
 } Function_Layout;
 typedef dyn_array_type(Function_Layout) Array_Function_Layout;
 
+// :IdenticalCodeFolding
+typedef struct {
+  s32 hash;
+  Function_Layout layout;
+  // Range of the `patch_info_array` entries pointing into the body
+  u64 first_patch_index;
+  u64 patch_count;
+} Encoded_Function_Body;
+typedef dyn_array_type(Encoded_Function_Body) Array_Encoded_Function_Body;
+
+// :ReachabilityStripping
+typedef struct {
+  // Indexed by the builder index in `program->functions`
+  bool *functions;
+  u64 function_count;
+  // Indexed by the label index
+  bool *labels;
+  u64 label_count;
+} Program_Reachability;
+
+typedef struct {
+  u64 function_count;
+  // Estimated from the instructions as the functions are never encoded
+  u64 code_byte_size;
+  u64 import_symbol_count;
+  u64 import_library_count;
+  u64 data_byte_size;
+} Strip_Report;
+
 typedef struct Function_Builder {
   bool frozen;
   s32 stack_reserve;
@@ -239,6 +289,17 @@ typedef struct Function_Builder {
 
   Descriptor_Function *function;
   Label_Index label_index;
+  Calling_Convention calling_convention;
+  // :ClobberSets Volatile registers the function might modify, known once it is frozen
+  u64 register_clobber_bitset;
+  // :ColdCode Labels starting rarely executed code. Instructions starting at
+  // `hot_instruction_count` are encoded after the epilogue of the function.
+  Array_Label_Index cold_labels;
+  u64 hot_instruction_count;
+
+  // :CopyPropagation Number of `mov` instructions before and after `fn_end` optimizations
+  u64 move_count_before_optimization;
+  u64 move_count_after_optimization;
 } Function_Builder;
 typedef dyn_array_type(Function_Builder) Array_Function_Builder;
 
@@ -254,12 +315,50 @@ typedef struct {
   } sections;
 } Program_Memory;
 
+// :PrivateCallingConvention
+typedef struct {
+  const Descriptor_Function *function;
+  Label_Index label_index;
+} Private_Function_Label;
+typedef dyn_array_type(Private_Function_Label) Array_Private_Function_Label;
+
+// :ConstantPool Immutable static data, e.g. string literals, stored once per unique content.
+// The bytes are only copied to `ro_data` when the program is linked as the section
+// is not writable in between JIT runs.
+typedef struct {
+  Label_Index label_index;
+  Slice bytes;
+  u64 alignment;
+  bool flushed;
+} Constant_Pool_Entry;
+typedef dyn_array_type(Constant_Pool_Entry) Array_Constant_Pool_Entry;
+
+hash_map_slice_template(Constant_Pool_Map, u64)
+
+typedef struct {
+  Array_Constant_Pool_Entry entries;
+  // Maps the bytes of a constant to the index of its entry
+  Constant_Pool_Map *map;
+} Constant_Pool;
+
 typedef struct Program {
   Array_Import_Library import_libraries;
   Array_Label labels;
   Array_Label_Location_Diff_Patch_Info patch_info_array;
   Value *entry_point;
   Array_Function_Builder functions;
+  // Labels are known before the body is compiled so (mutually) recursive calls can use them
+  Array_Private_Function_Label private_function_labels;
+  // :FunctionOrdering Place functions calling each other next to each other in `.text`
+  bool order_functions_by_calls;
+  // :CodeAlignment Byte alignment of function entries and loop heads, 0 to pack them tightly
+  u32 function_alignment;
+  u32 loop_alignment;
+  // :IdenticalCodeFolding Share a single body between functions with identical machine code
+  bool fold_identical_functions;
+  // :ReachabilityStripping What was left out of the last written executable
+  Strip_Report strip_report;
+  Constant_Pool constant_pool;
   Program_Memory memory;
 } Program;
 
@@ -293,6 +392,9 @@ typedef struct Execution_Context {
   Function_Builder *builder;
   Module *module;
   Mass_Result *result;
+  u32 inline_depth;
+  // :TailCall Arguments of the call that is the last action of the function
+  const Token *tail_call_args_token;
 } Execution_Context;
 
 void *
@@ -324,6 +426,19 @@ program_set_label_offset(
   u32 offset_in_section
 );
 
+Label_Index
+program_constant_pool_add(
+  Program *program,
+  Slice bytes,
+  u64 alignment
+);
+
+void
+program_constant_pool_flush(
+  Program *program,
+  const Program_Reachability *reachability
+);
+
 MASS_DEFINE_OPAQUE_C_TYPE(execution_context, Execution_Context);
 
 #endif
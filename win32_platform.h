@@ -222,6 +222,7 @@ win32_init_runtime_info_for_function(
     }
   }
 
+  // :FrameElision Leaf functions without locals do not allocate any stack
   if (layout->stack_reserve) {
     assert(layout->stack_reserve >= 8);
     assert(layout->stack_reserve % 8 == 0);
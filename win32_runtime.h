@@ -284,6 +284,9 @@ win32_program_jit(
     }
   }
 
+  // :ConstantPool
+  program_constant_pool_flush(program, 0);
+
   u64 import_count = dyn_array_length(program->import_libraries);
   for (u64 i = info->previous_counts.imports; i < import_count; ++i) {
     Import_Library *lib = dyn_array_get(program->import_libraries, i);
@@ -317,12 +320,17 @@ win32_program_jit(
   dyn_array_reserve_uninitialized(info->function_table, function_count);
 
   // Encode newly added functions
-  for (u64 i = info->previous_counts.functions; i < function_count; ++i) {
+  // :FunctionOrdering Functions that were encoded before stay where they are so the table
+  // remains sorted by address as long as it is filled in the order of encoding
+  Array_u64 order = program_function_layout_order(program, info->previous_counts.functions);
+  for (u64 order_index = 0; order_index < dyn_array_length(order); ++order_index) {
+    u64 i = *dyn_array_get(order, order_index);
     Function_Builder *builder = dyn_array_get(program->functions, i);
     Function_Layout layout;
     fn_encode(program, code_buffer, builder, &layout);
 
-    RUNTIME_FUNCTION *function = dyn_array_get(info->function_table, i);
+    RUNTIME_FUNCTION *function =
+      dyn_array_get(info->function_table, info->previous_counts.functions + order_index);
     UNWIND_INFO *unwind_info = win32_init_runtime_info_for_function(
       builder, &layout, function, &memory->sections.ro_data
     );
@@ -349,6 +357,7 @@ win32_program_jit(
       };
     }
   }
+  dyn_array_destroy(order);
 
   // After all the functions are encoded we should know all the offsets
   // and can patch all the label locations